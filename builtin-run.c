@@ -17,6 +17,7 @@
 #include "kvm/barrier.h"
 #include "kvm/kvm-cpu.h"
 #include "kvm/ioport.h"
+#include "kvm/placement.h"
 #include "kvm/symbol.h"
 #include "kvm/i8042.h"
 #include "kvm/mutex.h"
@@ -209,7 +210,8 @@ static int loglevel_parser(const struct option *opt, const char *arg, int unset)
 	OPT_BOOLEAN('\0', "nodefaults", &(cfg)->nodefaults, "Disable"   \
 			" implicit configuration that cannot be"	\
 			" disabled otherwise"),				\
-	OPT_CALLBACK('\0', "9p", NULL, "dir_to_share,tag_name",		\
+	OPT_CALLBACK('\0', "9p", NULL,					\
+		     "dir_to_share,tag_name[,queue_size=<n>]",		\
 		     "Enable virtio 9p to share files between host and"	\
 		     " guest", virtio_9p_rootdir_parser, kvm),		\
 	OPT_STRING('\0', "console", &(cfg)->console, "serial, virtio or"\
@@ -226,6 +228,24 @@ static int loglevel_parser(const struct option *opt, const char *arg, int unset)
 			" rootfs"),					\
 	OPT_STRING('\0', "hugetlbfs", &(cfg)->hugetlbfs_path, "path",	\
 			"Hugetlbfs path"),				\
+	OPT_INTEGER('\0', "threadpool-size", &(cfg)->threadpool_size,	\
+			"Number of I/O threadpool workers (default: one"\
+			" per host CPU)"),				\
+	OPT_STRING('\0', "threadpool-affinity",			\
+			&(cfg)->threadpool_affinity, "cpulist",		\
+			"Pin threadpool workers to these host CPUs"),	\
+	OPT_STRING('\0', "vcpu-affinity", &(cfg)->vcpu_affinity,	\
+			"cpulist", "Pin each VCPU to one of these host"	\
+			" CPUs, in order"),				\
+	OPT_STRING('\0', "io-affinity", &(cfg)->io_affinity,		\
+			"cpulist", "Run device and I/O threads on these"\
+			" host CPUs"),					\
+	OPT_STRING('\0', "mem-nodes", &(cfg)->mem_nodes, "nodelist",	\
+			"Allocate guest RAM from these host NUMA nodes"),\
+	OPT_STRING('\0', "mem-policy", &(cfg)->mem_policy,		\
+			"bind|interleave|preferred",			\
+			"How guest RAM is spread over --mem-nodes"	\
+			" (default: bind)"),				\
 	OPT_CALLBACK_NOOPT('\0', "virtio-legacy",			\
 			   &(cfg)->virtio_transport, "",		\
 			   "Use legacy virtio transport (Deprecated:"	\
@@ -293,6 +313,7 @@ static void *kvm_cpu_thread(void *arg)
 
 	sprintf(name, "kvm-vcpu-%lu", current_kvm_cpu->cpu_id);
 	kvm__set_thread_name(name);
+	placement__pin_vcpu(current_kvm_cpu);
 
 	if (kvm_cpu__start(current_kvm_cpu))
 		goto panic_kvm;
@@ -798,9 +819,9 @@ static struct kvm *kvm_cmd_run_init(int argc, const char **argv)
 		kvm_setup_resolv(kvm->cfg.custom_rootfs_name);
 
 		snprintf(tmp, PATH_MAX, "%s%s", kvm__get_dir(), "default");
-		if (virtio_9p__register(kvm, tmp, "/dev/root") < 0)
+		if (virtio_9p__register(kvm, tmp, "/dev/root", 0) < 0)
 			die("Unable to initialize virtio 9p");
-		if (virtio_9p__register(kvm, "/", "hostfs") < 0)
+		if (virtio_9p__register(kvm, "/", "hostfs", 0) < 0)
 			die("Unable to initialize virtio 9p");
 		kvm->cfg.using_rootfs = kvm->cfg.custom_rootfs = 1;
 	}
@@ -828,6 +849,9 @@ static struct kvm *kvm_cmd_run_init(int argc, const char **argv)
 			kvm->cfg.nrcpus, kvm->cfg.guest_name);
 	}
 
+	if (placement__init(kvm) < 0)
+		die("Failed to apply host placement");
+
 	if (init_list__init(kvm) < 0)
 		die ("Initialisation failed");
 
@@ -4,6 +4,11 @@
 #include <kvm/kvm.h>
 #include <kvm/parse-options.h>
 #include <kvm/kvm-ipc.h>
+#include <kvm/read-write.h>
+#include <kvm/virtio.h>
+#include <kvm/devices.h>
+#include <kvm/exit-stats.h>
+#include <kvm/disk-image.h>
 
 #include <sys/select.h>
 #include <stdio.h>
@@ -13,17 +18,34 @@
 #include <linux/virtio_balloon.h>
 
 static bool mem;
+static bool virtio;
+static bool exits;
+static bool exits_start;
+static bool exits_stop;
+static bool placement;
+static bool disk;
 static bool all;
 static const char *instance_name;
 
 static const char * const stat_usage[] = {
 	"lkvm stat [command] [--all] [-n name]",
+	"lkvm stat --exits [--exits-start|--exits-stop] [--all] [-n name]",
 	NULL
 };
 
 static const struct option stat_options[] = {
 	OPT_GROUP("Commands options:"),
 	OPT_BOOLEAN('m', "memory", &mem, "Display memory statistics"),
+	OPT_BOOLEAN('v', "virtio", &virtio, "Display virtqueue statistics"),
+	OPT_BOOLEAN('e', "exits", &exits, "Display vCPU exit statistics"),
+	OPT_BOOLEAN('\0', "exits-start", &exits_start,
+		    "Reset and start profiling vCPU exits"),
+	OPT_BOOLEAN('\0', "exits-stop", &exits_stop,
+		    "Stop profiling vCPU exits"),
+	OPT_BOOLEAN('p', "placement", &placement,
+		    "Display host CPU and NUMA placement"),
+	OPT_BOOLEAN('d', "disk", &disk,
+		    "Display disk image metadata cache statistics"),
 	OPT_GROUP("Instance options:"),
 	OPT_BOOLEAN('a', "all", &all, "All instances"),
 	OPT_STRING('n', "name", &instance_name, "name", "Instance name"),
@@ -112,6 +134,371 @@ static int do_memstat(const char *name, int sock)
 	return 0;
 }
 
+static int do_virtiostat(const char *name, int sock)
+{
+	struct virtio_stat_entry *entries;
+	struct virt_queue_stats *s;
+	fd_set fdset;
+	struct timeval t = { .tv_sec = 1 };
+	u32 i, nr;
+	int r;
+
+	FD_ZERO(&fdset);
+	FD_SET(sock, &fdset);
+	r = kvm_ipc__send(sock, KVM_IPC_VIRTIO_STAT);
+	if (r < 0)
+		return r;
+
+	r = select(sock + 1, &fdset, NULL, NULL, &t);
+	if (r <= 0) {
+		pr_err("Could not retrieve virtio stats from %s", name);
+		return -1;
+	}
+
+	if (read_in_full(sock, &nr, sizeof(nr)) != sizeof(nr))
+		return -1;
+
+	entries = calloc(nr, sizeof(*entries));
+	if (nr && !entries)
+		return -ENOMEM;
+
+	r = read_in_full(sock, entries, nr * sizeof(*entries));
+	if (r != (int)(nr * sizeof(*entries))) {
+		free(entries);
+		return -1;
+	}
+
+	printf("\n\n\t*** Virtio queue statistics of %s ***\n\n", name);
+	printf("%-10s %3s %5s %10s %10s %10s %10s %10s %10s %10s %14s %14s %7s %10s %10s\n",
+	       "device", "vq", "size", "kicks", "irqs", "suppressed",
+	       "coalesced", "buffers", "used", "descs", "bytes in",
+	       "bytes out", "batch", "empty(ms)", "full(ms)");
+
+	for (i = 0; i < nr; i++) {
+		s = &entries[i].stats;
+		printf("%-10.*s %3u %5u %10llu %10llu %10llu %10llu %10llu %10llu %10llu %14llu %14llu %7.1f %10llu %10llu\n",
+		       (int)sizeof(entries[i].device), entries[i].device,
+		       entries[i].vq, entries[i].size,
+		       (unsigned long long)s->kicks,
+		       (unsigned long long)s->irqs,
+		       (unsigned long long)s->irqs_suppressed,
+		       (unsigned long long)s->irqs_coalesced,
+		       (unsigned long long)s->bufs,
+		       (unsigned long long)s->used,
+		       (unsigned long long)s->descs,
+		       (unsigned long long)s->bytes_in,
+		       (unsigned long long)s->bytes_out,
+		       s->drains ? (double)s->bufs / s->drains : 0.0,
+		       (unsigned long long)(s->empty_ns / 1000000),
+		       (unsigned long long)(s->full_ns / 1000000));
+	}
+	printf("\n");
+
+	free(entries);
+
+	return 0;
+}
+
+/* Upper bound of the bucket holding the given percentile, in ns */
+static u64 exit_stats_percentile(const u64 *hist, u64 count, unsigned int pct)
+{
+	u64 seen = 0, target = (count * pct + 99) / 100;
+	unsigned int b;
+
+	for (b = 0; b < EXIT_STATS_BUCKETS; b++) {
+		seen += hist[b];
+		if (seen >= target)
+			break;
+	}
+
+	return 2ULL << b;
+}
+
+static void print_exit_reasons(struct exit_stats_cpu *s, const char *cpu)
+{
+	u64 count;
+	u32 r;
+
+	for (r = 0; r < EXIT_STATS_REASONS; r++) {
+		count = s->count[r];
+		if (!count)
+			continue;
+
+		printf("%-5s %-16s %12llu %10.2f %10.2f %10.2f\n", cpu,
+		       exit_stats__reason_name(r), (unsigned long long)count,
+		       (double)s->ns[r] / count / 1000,
+		       exit_stats_percentile(s->hist[r], count, 50) / 1000.0,
+		       exit_stats_percentile(s->hist[r], count, 99) / 1000.0);
+	}
+}
+
+static void print_exit_hist(struct exit_stats_cpu *s)
+{
+	unsigned int b;
+	u32 r;
+
+	printf("\nLatency histogram, exits handled in less than:\n");
+	for (r = 0; r < EXIT_STATS_REASONS; r++) {
+		if (!s->count[r])
+			continue;
+
+		printf("%-16s", exit_stats__reason_name(r));
+		for (b = 0; b < EXIT_STATS_BUCKETS; b++) {
+			if (!s->hist[r][b])
+				continue;
+			if (b < 9)
+				printf(" %lluns:", 2ULL << b);
+			else if (b < 19)
+				printf(" %lluus:", (2ULL << b) / 1000);
+			else
+				printf(" %llums:", (2ULL << b) / 1000000);
+			printf("%llu", (unsigned long long)s->hist[r][b]);
+		}
+		printf("\n");
+	}
+}
+
+static void print_exit_handlers(struct exit_stats_cpu *s)
+{
+	struct exit_stats_handler *h;
+	u32 i;
+
+	for (i = 0; i < s->nr_handlers; i++) {
+		h = &s->handlers[i];
+		printf("%-5u %-4s %#14llx %#10llx  lkvm+%#-10llx %12llu %10.2f\n",
+		       s->cpu, h->bus == DEVICE_BUS_MMIO ? "mmio" : "pio",
+		       (unsigned long long)h->start,
+		       (unsigned long long)h->len,
+		       (unsigned long long)h->fn,
+		       (unsigned long long)h->count,
+		       h->count ? (double)h->ns / h->count / 1000 : 0.0);
+	}
+
+	if (s->dropped)
+		printf("%-5u (%llu accesses to other regions)\n", s->cpu,
+		       (unsigned long long)s->dropped);
+}
+
+static int do_exitstat(const char *name, int sock)
+{
+	struct exit_stats_cpu *entries, total = {};
+	fd_set fdset;
+	struct timeval t = { .tv_sec = 1 };
+	u32 cmd = EXIT_STATS_DUMP;
+	u32 enabled, i, r, b, nr;
+	char cpu[16];
+	int ret;
+
+	if (exits_start)
+		cmd = EXIT_STATS_START;
+	else if (exits_stop)
+		cmd = EXIT_STATS_STOP;
+
+	FD_ZERO(&fdset);
+	FD_SET(sock, &fdset);
+	ret = kvm_ipc__send_msg(sock, KVM_IPC_EXIT_STAT, sizeof(cmd), (u8 *)&cmd);
+	if (ret < 0)
+		return ret;
+
+	ret = select(sock + 1, &fdset, NULL, NULL, &t);
+	if (ret <= 0) {
+		pr_err("Could not retrieve exit stats from %s", name);
+		return -1;
+	}
+
+	if (read_in_full(sock, &enabled, sizeof(enabled)) != sizeof(enabled) ||
+	    read_in_full(sock, &nr, sizeof(nr)) != sizeof(nr))
+		return -1;
+
+	entries = calloc(nr, sizeof(*entries));
+	if (nr && !entries)
+		return -ENOMEM;
+
+	ret = read_in_full(sock, entries, nr * sizeof(*entries));
+	if (ret != (int)(nr * sizeof(*entries))) {
+		free(entries);
+		return -1;
+	}
+
+	if (!exits) {
+		printf("Exit profiling of %s %s\n", name,
+		       enabled ? "started" : "stopped");
+		free(entries);
+		return 0;
+	}
+
+	printf("\n\n\t*** vCPU exit statistics of %s (profiling %s) ***\n\n",
+	       name, enabled ? "enabled" : "disabled");
+	printf("%-5s %-16s %12s %10s %10s %10s\n", "vcpu", "reason", "exits",
+	       "avg(us)", "p50(us)", "p99(us)");
+
+	for (i = 0; i < nr; i++) {
+		snprintf(cpu, sizeof(cpu), "%u", entries[i].cpu);
+		print_exit_reasons(&entries[i], cpu);
+
+		for (r = 0; r < EXIT_STATS_REASONS; r++) {
+			total.count[r] += entries[i].count[r];
+			total.ns[r] += entries[i].ns[r];
+			for (b = 0; b < EXIT_STATS_BUCKETS; b++)
+				total.hist[r][b] += entries[i].hist[r][b];
+		}
+	}
+	print_exit_reasons(&total, "all");
+	print_exit_hist(&total);
+
+	printf("\n%-5s %-4s %14s %10s  %-15s %12s %10s\n", "vcpu", "bus",
+	       "region", "size", "handler", "accesses", "avg(us)");
+	for (i = 0; i < nr; i++)
+		print_exit_handlers(&entries[i]);
+	printf("\n");
+
+	free(entries);
+
+	return 0;
+}
+
+static int do_placement(const char *name, int sock)
+{
+	fd_set fdset;
+	struct timeval t = { .tv_sec = 1 };
+	char *buf;
+	u32 len;
+	int r;
+
+	FD_ZERO(&fdset);
+	FD_SET(sock, &fdset);
+	r = kvm_ipc__send(sock, KVM_IPC_PLACEMENT);
+	if (r < 0)
+		return r;
+
+	r = select(sock + 1, &fdset, NULL, NULL, &t);
+	if (r <= 0) {
+		pr_err("Could not retrieve placement from %s", name);
+		return -1;
+	}
+
+	if (read_in_full(sock, &len, sizeof(len)) != sizeof(len))
+		return -1;
+
+	buf = malloc(len + 1);
+	if (!buf)
+		return -ENOMEM;
+
+	if (read_in_full(sock, buf, len) != (ssize_t)len) {
+		free(buf);
+		return -1;
+	}
+	buf[len] = '\0';
+
+	printf("\n\n\t*** Placement of %s ***\n\n%s\n", name, buf);
+	free(buf);
+
+	return 0;
+}
+
+static int do_diskstat(const char *name, int sock)
+{
+	struct disk_stat_entry *entries, *e;
+	fd_set fdset;
+	struct timeval t = { .tv_sec = 1 };
+	u64 lookups;
+	u32 i, nr, bounce = 0;
+	int r;
+
+	FD_ZERO(&fdset);
+	FD_SET(sock, &fdset);
+	r = kvm_ipc__send(sock, KVM_IPC_DISK_STAT);
+	if (r < 0)
+		return r;
+
+	r = select(sock + 1, &fdset, NULL, NULL, &t);
+	if (r <= 0) {
+		pr_err("Could not retrieve disk stats from %s", name);
+		return -1;
+	}
+
+	if (read_in_full(sock, &nr, sizeof(nr)) != sizeof(nr))
+		return -1;
+
+	entries = calloc(nr, sizeof(*entries));
+	if (nr && !entries)
+		return -ENOMEM;
+
+	r = read_in_full(sock, entries, nr * sizeof(*entries));
+	if (r != (int)(nr * sizeof(*entries))) {
+		free(entries);
+		return -1;
+	}
+
+	printf("\n\n\t*** Disk cache statistics of %s ***\n\n", name);
+	printf("%-5s %-10s %10s %14s %14s %14s %7s\n", "disk", "cache",
+	       "size(KB)", "hits", "misses", "evictions", "hit%");
+
+	for (i = 0; i < nr; i++) {
+		e = &entries[i];
+		if (e->type != DISK_STAT_CACHE)
+			continue;
+
+		lookups = e->hits + e->misses;
+		printf("%-5u %-10.*s %10llu %14llu %14llu %14llu %7.1f\n",
+		       e->disk, (int)sizeof(e->cache), e->cache,
+		       (unsigned long long)(e->size >> 10),
+		       (unsigned long long)e->hits,
+		       (unsigned long long)e->misses,
+		       (unsigned long long)e->evictions,
+		       lookups ? 100.0 * e->hits / lookups : 0.0);
+	}
+	printf("\n");
+
+	/* Only disks opened with O_DIRECT have bounce buffers */
+	for (i = 0; i < nr; i++) {
+		e = &entries[i];
+		if (e->type != DISK_STAT_BOUNCE)
+			continue;
+
+		if (!bounce++) {
+			printf("\n\t*** Disk bounce buffer statistics of %s ***\n\n",
+			       name);
+			printf("%-5s %10s %14s %14s %14s\n", "disk", "pool(KB)",
+			       "pooled", "allocated", "rmw");
+		}
+
+		printf("%-5u %10llu %14llu %14llu %14llu\n", e->disk,
+		       (unsigned long long)(e->size >> 10),
+		       (unsigned long long)e->pooled,
+		       (unsigned long long)e->allocated,
+		       (unsigned long long)e->rmw);
+	}
+	if (bounce)
+		printf("\n");
+
+	free(entries);
+
+	return 0;
+}
+
+static int do_stat(const char *name, int sock)
+{
+	int r = 0;
+
+	if (mem)
+		r = do_memstat(name, sock);
+
+	if (r >= 0 && virtio)
+		r = do_virtiostat(name, sock);
+
+	if (r >= 0 && (exits || exits_start || exits_stop))
+		r = do_exitstat(name, sock);
+
+	if (r >= 0 && placement)
+		r = do_placement(name, sock);
+
+	if (r >= 0 && disk)
+		r = do_diskstat(name, sock);
+
+	return r;
+}
+
 int kvm_cmd_stat(int argc, const char **argv, const char *prefix)
 {
 	int instance;
@@ -119,11 +506,15 @@ int kvm_cmd_stat(int argc, const char **argv, const char *prefix)
 
 	parse_stat_options(argc, argv);
 
-	if (!mem)
+	if (exits_start && exits_stop)
+		usage_with_options(stat_usage, stat_options);
+
+	if (!mem && !virtio && !exits && !exits_start && !exits_stop &&
+	    !placement && !disk)
 		usage_with_options(stat_usage, stat_options);
 
-	if (mem && all)
-		return kvm__enumerate_instances(do_memstat);
+	if (all)
+		return kvm__enumerate_instances(do_stat);
 
 	if (instance_name == NULL)
 		kvm_stat_help();
@@ -133,8 +524,7 @@ int kvm_cmd_stat(int argc, const char **argv, const char *prefix)
 	if (instance <= 0)
 		die("Failed locating instance");
 
-	if (mem)
-		r = do_memstat(instance_name, instance);
+	r = do_stat(instance_name, instance);
 
 	close(instance);
 
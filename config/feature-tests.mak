@@ -167,6 +167,20 @@ int main(void)
 }
 endef
 
+define SOURCE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int main(void)
+{
+	struct io_uring_params p = { .flags = IORING_SETUP_SQPOLL };
+
+	syscall(__NR_io_uring_setup, 0, &p);
+	return IORING_OP_FSYNC + IORING_OP_READ_FIXED + IORING_REGISTER_EVENTFD;
+}
+endef
+
 define SOURCE_STATIC
 #include <stdlib.h>
 
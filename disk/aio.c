@@ -7,57 +7,106 @@
 #include "kvm/kvm.h"
 #include "linux/list.h"
 
-#define AIO_MAX 256
-
-static int aio_submit(struct disk_image *disk, int nr, struct iocb **ios)
+/* Sends the requests held back on the queue */
+static int aio_submit(struct disk_aio *aio)
 {
+	struct iocb **ios = aio->pending;
+	int nr = aio->nr_pending;
 	int ret;
 
-	__sync_fetch_and_add(&disk->aio_inflight, nr);
+	aio->nr_pending = 0;
+
+	__sync_fetch_and_add(&aio->inflight, nr);
 	/*
 	 * A wmb() is needed here, to ensure disk_aio_thread() sees this
 	 * increase after receiving the events. It is included in the
 	 * __sync_fetch_and_add (as a full barrier).
 	 */
-restart:
-	ret = io_submit(disk->ctx, nr, ios);
-	if (ret == -EAGAIN)
-		goto restart;
-	else if (ret <= 0)
-		/* disk_aio_thread() is never going to see those */
-		__sync_fetch_and_sub(&disk->aio_inflight, nr);
-
-	return ret;
+	while (nr) {
+		ret = io_submit(aio->ctx, nr, ios);
+		if (ret == -EAGAIN || ret == -EINTR)
+			continue;
+
+		if (ret <= 0) {
+			/*
+			 * The first request can't be submitted, and
+			 * disk_aio_thread() is never going to see it. Fail it
+			 * and carry on with the others.
+			 */
+			__sync_fetch_and_sub(&aio->inflight, 1);
+			disk_image__complete(aio->disk, ios[0]->data,
+					     ret ? ret : -EIO);
+			ret = 1;
+		}
+
+		/* Partial submission, the kernel stopped at ios[ret] */
+		ios += ret;
+		nr -= ret;
+	}
+
+	return 0;
+}
+
+static struct iocb *aio_get_iocb(struct disk_aio *aio)
+{
+	struct iocb *iocb = &aio->iocbs[aio->nr_pending];
+
+	aio->pending[aio->nr_pending] = iocb;
+	return iocb;
+}
+
+/* io_submit() copies the iocbs, so they can be reused once it returns */
+static ssize_t aio_queue(struct disk_aio *aio, struct iocb *iocb, void *param)
+{
+	io_set_eventfd(iocb, aio->evt);
+	iocb->data = param;
+
+	if (++aio->nr_pending < AIO_MAX && aio->plugged)
+		return 0;
+
+	return aio_submit(aio);
 }
 
-ssize_t raw_image__read_async(struct disk_image *disk, u64 sector,
-			      const struct iovec *iov, int iovcount,
+ssize_t raw_image__read_async(struct disk_image *disk, unsigned int queue,
+			      u64 sector, const struct iovec *iov, int iovcount,
 			      void *param)
 {
-	struct iocb iocb;
+	struct disk_aio *aio = &disk->aio[queue];
+	struct iocb *iocb = aio_get_iocb(aio);
 	u64 offset = sector << SECTOR_SHIFT;
-	struct iocb *ios[1] = { &iocb };
 
-	io_prep_preadv(&iocb, disk->fd, iov, iovcount, offset);
-	io_set_eventfd(&iocb, disk->evt);
-	iocb.data = param;
+	io_prep_preadv(iocb, disk->fd, iov, iovcount, offset);
 
-	return aio_submit(disk, 1, ios);
+	return aio_queue(aio, iocb, param);
 }
 
-ssize_t raw_image__write_async(struct disk_image *disk, u64 sector,
-			       const struct iovec *iov, int iovcount,
+ssize_t raw_image__write_async(struct disk_image *disk, unsigned int queue,
+			       u64 sector, const struct iovec *iov, int iovcount,
 			       void *param)
 {
-	struct iocb iocb;
+	struct disk_aio *aio = &disk->aio[queue];
+	struct iocb *iocb = aio_get_iocb(aio);
 	u64 offset = sector << SECTOR_SHIFT;
-	struct iocb *ios[1] = { &iocb };
 
-	io_prep_pwritev(&iocb, disk->fd, iov, iovcount, offset);
-	io_set_eventfd(&iocb, disk->evt);
-	iocb.data = param;
+	io_prep_pwritev(iocb, disk->fd, iov, iovcount, offset);
+
+	return aio_queue(aio, iocb, param);
+}
+
+void disk_aio_plug(struct disk_image *disk, unsigned int queue)
+{
+	disk->aio[queue].plugged = true;
+}
+
+int disk_aio_unplug(struct disk_image *disk, unsigned int queue)
+{
+	struct disk_aio *aio = &disk->aio[queue];
+
+	aio->plugged = false;
+	if (!aio->nr_pending)
+		return 0;
 
-	return aio_submit(disk, 1, ios);
+	return aio_submit(aio);
 }
 
 /*
@@ -67,32 +116,44 @@ ssize_t raw_image__write_async(struct disk_image *disk, u64 sector,
  * Returns an inaccurate number of I/O that was in-flight when the function was
  * called.
  */
-int raw_image__wait(struct disk_image *disk)
+int disk_aio_wait(struct disk_image *disk)
 {
-	u64 inflight = disk->aio_inflight;
+	u64 inflight = 0;
+	unsigned int i;
 
-	while (disk->aio_inflight) {
-		usleep(100);
-		barrier();
+	for (i = 0; i < disk->nr_queues; i++)
+		inflight += disk->aio[i].inflight;
+
+	for (i = 0; i < disk->nr_queues; i++) {
+		while (disk->aio[i].inflight) {
+			usleep(100);
+			barrier();
+		}
 	}
 
 	return inflight;
 }
 
-static int disk_aio_get_events(struct disk_image *disk)
+static int disk_aio_get_events(struct disk_aio *aio)
 {
+	struct disk_image *disk = aio->disk;
 	struct io_event event[AIO_MAX];
 	struct timespec notime = {0};
 	int nr, i;
 
 	do {
-		nr = io_getevents(disk->ctx, 1, ARRAY_SIZE(event), event, &notime);
+		nr = io_getevents(aio->ctx, 1, ARRAY_SIZE(event), event, &notime);
 		for (i = 0; i < nr; i++)
-			disk->disk_req_cb(event[i].data, event[i].res);
+			disk_image__complete(disk, event[i].data,
+					     event[i].res);
+
+		if (nr > 0 && disk->disk_req_batch_cb)
+			disk->disk_req_batch_cb(disk->disk_req_cb_param,
+						aio->queue);
 
 		/* Pairs with wmb() in aio_submit() */
 		rmb();
-		__sync_fetch_and_sub(&disk->aio_inflight, nr);
+		__sync_fetch_and_sub(&aio->inflight, nr);
 
 	} while (nr > 0);
 
@@ -101,50 +162,95 @@ static int disk_aio_get_events(struct disk_image *disk)
 
 static void *disk_aio_thread(void *param)
 {
-	struct disk_image *disk = param;
+	struct disk_aio *aio = param;
 	u64 dummy;
 
 	kvm__set_thread_name("disk-image-io");
 
-	while (read(disk->evt, &dummy, sizeof(dummy)) > 0) {
-		if (disk_aio_get_events(disk))
+	while (read(aio->evt, &dummy, sizeof(dummy)) > 0) {
+		if (disk_aio_get_events(aio))
 			break;
 	}
 
 	return NULL;
 }
 
-int disk_aio_setup(struct disk_image *disk)
+static void disk_aio_destroy_queue(struct disk_aio *aio)
+{
+	pthread_cancel(aio->thread);
+	pthread_join(aio->thread, NULL);
+	close(aio->evt);
+	io_destroy(aio->ctx);
+}
+
+static int disk_aio_setup_queue(struct disk_aio *aio)
 {
 	int r;
 
+	aio->evt = eventfd(0, 0);
+	if (aio->evt < 0)
+		return -errno;
+
+	r = io_setup(AIO_MAX, &aio->ctx);
+	if (r < 0) {
+		close(aio->evt);
+		return r;
+	}
+
+	r = pthread_create(&aio->thread, NULL, disk_aio_thread, aio);
+	if (r) {
+		io_destroy(aio->ctx);
+		close(aio->evt);
+		return -r;
+	}
+
+	return 0;
+}
+
+/* Each queue gets its own AIO context and completion thread */
+int disk_aio_setup(struct disk_image *disk, unsigned int nr_queues)
+{
+	struct disk_aio *aio;
+	unsigned int i;
+	int r;
+
 	/* No need to setup AIO if the disk ops won't make use of it */
 	if (!disk->ops->async)
 		return 0;
 
-	disk->evt = eventfd(0, 0);
-	if (disk->evt < 0)
-		return -errno;
+	aio = calloc(nr_queues, sizeof(*aio));
+	if (!aio)
+		return -ENOMEM;
 
-	io_setup(AIO_MAX, &disk->ctx);
-	r = pthread_create(&disk->thread, NULL, disk_aio_thread, disk);
-	if (r) {
-		r = -errno;
-		close(disk->evt);
-		return r;
+	for (i = 0; i < nr_queues; i++) {
+		aio[i].disk = disk;
+		aio[i].queue = i;
+
+		r = disk_aio_setup_queue(&aio[i]);
+		if (r) {
+			while (i--)
+				disk_aio_destroy_queue(&aio[i]);
+			free(aio);
+			return r;
+		}
 	}
 
+	disk->aio = aio;
 	disk->async = true;
 	return 0;
 }
 
 void disk_aio_destroy(struct disk_image *disk)
 {
+	unsigned int i;
+
 	if (!disk->async)
 		return;
 
-	pthread_cancel(disk->thread);
-	pthread_join(disk->thread, NULL);
-	close(disk->evt);
-	io_destroy(disk->ctx);
+	for (i = 0; i < disk->nr_queues; i++)
+		disk_aio_destroy_queue(&disk->aio[i]);
+
+	free(disk->aio);
+	disk->aio = NULL;
+	disk->async = false;
 }
@@ -3,13 +3,36 @@
 #include <linux/err.h>
 #include <mntent.h>
 
+static int blkdev__discard(struct disk_image *disk, u64 sector, u64 nr_sectors,
+			   u32 flags)
+{
+	u64 range[2] = { sector << SECTOR_SHIFT, nr_sectors << SECTOR_SHIFT };
+
+	/* BLKZEROOUT may unmap the range when the device zeroes it that way */
+	if (flags & DISK_DISCARD_ZERO) {
+		if (ioctl(disk->fd, BLKZEROOUT, range) < 0)
+			return -errno;
+		return 0;
+	}
+
+	/* Discarding is only a hint */
+	if (ioctl(disk->fd, BLKDISCARD, range) < 0 && errno != EOPNOTSUPP)
+		return -errno;
+
+	return 0;
+}
+
 /*
  * raw image and blk dev are similar, so reuse raw image ops.
  */
 static struct disk_image_operations blk_dev_ops = {
 	.read	= raw_image__read,
 	.write	= raw_image__write,
+	.discard = blkdev__discard,
+	.plug	= raw_image__plug,
+	.unplug	= raw_image__unplug,
 	.wait	= raw_image__wait,
+	.complete = raw_image__complete,
 	.async	= true,
 };
 
@@ -37,6 +60,7 @@ static bool is_mounted(struct stat *st)
 
 struct disk_image *blkdev__probe(const char *filename, int flags, struct stat *st)
 {
+	struct disk_image *disk;
 	int fd, r;
 	u64 size;
 
@@ -68,5 +92,9 @@ struct disk_image *blkdev__probe(const char *filename, int flags, struct stat *s
 	 * mmap large disk. There is not enough virtual address space
 	 * in 32-bit host. However, this works on 64-bit host.
 	 */
-	return disk_image__new(fd, size, &blk_dev_ops, DISK_IMAGE_REGULAR);
+	disk = disk_image__new(fd, size, &blk_dev_ops, DISK_IMAGE_REGULAR);
+	if (!IS_ERR_OR_NULL(disk))
+		disk_bounce_init(disk);
+
+	return disk;
 }
@@ -0,0 +1,368 @@
+#include "kvm/disk-image.h"
+#include "kvm/iovec.h"
+
+#include <linux/kernel.h>
+
+/*
+ * Disks opened with O_DIRECT. Requests whose offset, length or buffers aren't
+ * aligned to the logical block size of the host go through an aligned buffer,
+ * from a pool per queue when it fits. Writes that don't cover whole blocks
+ * read the blocks at their ends first, synchronously and one at a time per
+ * disk, so that writes to different sectors of a block don't undo each other.
+ */
+
+/* Regular files don't tell, this covers both 512 byte and 4K blocks */
+#define DISK_BOUNCE_ALIGN	4096
+
+#define disk_bounce_add(field, n)					\
+	__atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+/* Called by the formats that hand guest buffers to the kernel */
+void disk_bounce_init(struct disk_image *disk)
+{
+	struct stat st;
+	int flags, bs;
+
+	flags = fcntl(disk->fd, F_GETFL);
+	if (flags < 0 || !(flags & O_DIRECT))
+		return;
+
+	disk->block_size = DISK_BOUNCE_ALIGN;
+	if (!fstat(disk->fd, &st) && S_ISBLK(st.st_mode) &&
+	    !ioctl(disk->fd, BLKSSZGET, &bs) && bs >= (int)SECTOR_SIZE)
+		disk->block_size = bs;
+
+	mutex_init(&disk->bounce_lock);
+
+	if (disk_bounce_setup(disk, disk->nr_queues))
+		pr_warning("No bounce buffers for O_DIRECT requests");
+}
+
+/* Requests then allocate their own aligned buffer, if it fails */
+int disk_bounce_setup(struct disk_image *disk, unsigned int nr_queues)
+{
+	struct disk_bounce *bounce, *b;
+	unsigned int i, j;
+
+	if (disk->block_size > DISK_BOUNCE_SIZE)
+		return -EINVAL;
+
+	bounce = calloc(nr_queues, sizeof(*bounce));
+	if (!bounce)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_queues; i++) {
+		b = &bounce[i];
+		if (posix_memalign(&b->pool, disk->block_size,
+				   DISK_BOUNCE_SLOTS * DISK_BOUNCE_SIZE)) {
+			while (i--)
+				free(bounce[i].pool);
+			free(bounce);
+			return -ENOMEM;
+		}
+
+		for (j = 0; j < DISK_BOUNCE_SLOTS; j++)
+			b->reqs[j].pool = b->pool + j * DISK_BOUNCE_SIZE;
+	}
+
+	disk->bounce = bounce;
+	return 0;
+}
+
+void disk_bounce_destroy(struct disk_image *disk)
+{
+	unsigned int i;
+
+	if (!disk->bounce)
+		return;
+
+	for (i = 0; i < disk->nr_queues; i++)
+		free(disk->bounce[i].pool);
+
+	free(disk->bounce);
+	disk->bounce = NULL;
+}
+
+bool disk_bounce_needed(struct disk_image *disk, u64 sector,
+			const struct iovec *iov, int iovcount)
+{
+	unsigned long mask = disk->block_size - 1;
+	unsigned long bits = sector << SECTOR_SHIFT;
+	size_t total = 0;
+
+	for (; iovcount--; iov++) {
+		if (!iov->iov_len)
+			continue;
+
+		bits |= (unsigned long)iov->iov_base | iov->iov_len;
+		total += iov->iov_len;
+	}
+
+	return total && (bits & mask);
+}
+
+static struct disk_bounce_req *disk_bounce_get(struct disk_image *disk,
+					       unsigned int queue)
+{
+	struct disk_bounce *b = disk->bounce;
+	int i;
+
+	if (!b)
+		return NULL;
+
+	for (i = 0; i < DISK_BOUNCE_SLOTS; i++) {
+		if (!__atomic_exchange_n(&b[queue].reqs[i].busy, true,
+					 __ATOMIC_ACQUIRE))
+			return &b[queue].reqs[i];
+	}
+
+	return NULL;
+}
+
+static void disk_bounce_put(struct disk_bounce_req *req)
+{
+	if (req->buf != req->pool)
+		free(req->buf);
+	free(req->guest);
+	req->buf = NULL;
+	req->guest = NULL;
+
+	if (req->busy)
+		__atomic_store_n(&req->busy, false, __ATOMIC_RELEASE);
+}
+
+/*
+ * Set up a request for the blocks from start, with a slot of the queue unless
+ * they are all in flight.
+ */
+static struct disk_bounce_req *disk_bounce_start(struct disk_image *disk,
+						 unsigned int queue,
+						 struct disk_bounce_req *tmp,
+						 u64 start, u64 len, u64 offset,
+						 u64 total, void *param)
+{
+	struct disk_bounce *b = disk->bounce;
+	struct disk_bounce_req *req;
+
+	req = disk_bounce_get(disk, queue);
+	if (!req) {
+		req = tmp;
+		*req = (struct disk_bounce_req) {};
+	}
+
+	req->param	= param;
+	req->head	= offset - start;
+	req->total	= total;
+
+	if (req->pool && len <= DISK_BOUNCE_SIZE) {
+		req->buf = req->pool;
+		disk_bounce_add(b[queue].pooled, 1);
+	} else if (!posix_memalign(&req->buf, disk->block_size, len)) {
+		if (b)
+			disk_bounce_add(b[queue].allocated, 1);
+	} else {
+		req->buf = NULL;
+		disk_bounce_put(req);
+		return NULL;
+	}
+
+	req->iov = (struct iovec) {
+		.iov_base	= req->buf,
+		.iov_len	= len,
+	};
+
+	return req;
+}
+
+/* The result of a bounced request, as seen by the guest */
+static long disk_bounce_end(struct disk_bounce_req *req, long len)
+{
+	if (len < 0)
+		return len;
+
+	if (!req->guest)
+		return len == (long)req->iov.iov_len ? (long)req->total : -EIO;
+
+	/* The file may end in the middle of the last block */
+	if ((u64)len < req->head + req->total)
+		return -EIO;
+
+	memcpy_toiovecend(req->guest, req->buf + req->head, 0, req->total);
+	return req->total;
+}
+
+/* Requests that can't be completed by the backend complete here */
+static ssize_t disk_bounce_done(struct disk_image *disk, void *param,
+				ssize_t ret)
+{
+	if (!disk->async)
+		return ret;
+
+	disk->disk_req_cb(param, ret);
+	return 0;
+}
+
+ssize_t disk_bounce_read(struct disk_image *disk, unsigned int queue,
+			 u64 sector, const struct iovec *iov, int iovcount,
+			 void *param)
+{
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 total = iov_size(iov, iovcount);
+	u64 start = round_down(offset, disk->block_size);
+	u64 end = ALIGN(offset + total, disk->block_size);
+	struct disk_bounce_req *req, tmp;
+	ssize_t ret;
+
+	req = disk_bounce_start(disk, queue, &tmp, start, end - start, offset,
+				total, param);
+	if (!req)
+		return disk_bounce_done(disk, param, -ENOMEM);
+
+	req->guest = malloc(iovcount * sizeof(*iov));
+	if (!req->guest) {
+		disk_bounce_put(req);
+		return disk_bounce_done(disk, param, -ENOMEM);
+	}
+	memcpy(req->guest, iov, iovcount * sizeof(*iov));
+
+	if (req != &tmp && disk->uring)
+		return raw_image__read_uring(disk, queue, start >> SECTOR_SHIFT,
+					     &req->iov, 1, req);
+	if (req != &tmp && disk->async)
+		return raw_image__read_async(disk, queue, start >> SECTOR_SHIFT,
+					     &req->iov, 1, req);
+
+	ret = pread_in_full(disk->fd, req->buf, end - start, start);
+	ret = disk_bounce_end(req, ret < 0 ? -errno : ret);
+	disk_bounce_put(req);
+
+	return disk_bounce_done(disk, param, ret);
+}
+
+/* Fill a block of the buffer with what is on disk, zeroes past the end */
+static int disk_bounce_read_block(struct disk_image *disk, void *buf, u64 pos)
+{
+	ssize_t ret;
+
+	ret = pread_in_full(disk->fd, buf, disk->block_size, pos);
+	if (ret < 0)
+		return -errno;
+
+	memset(buf + ret, 0, disk->block_size - ret);
+	return 0;
+}
+
+static ssize_t disk_bounce_rmw(struct disk_image *disk,
+			       struct disk_bounce_req *req, u64 start,
+			       const struct iovec *iov)
+{
+	u64 len = req->iov.iov_len, last = len - disk->block_size;
+	ssize_t ret = 0;
+
+	mutex_lock(&disk->bounce_lock);
+
+	if (req->head)
+		ret = disk_bounce_read_block(disk, req->buf, start);
+	if (!ret && req->head + req->total < len && (last || !req->head))
+		ret = disk_bounce_read_block(disk, req->buf + last,
+					     start + last);
+
+	if (!ret) {
+		memcpy_fromiovecend(req->buf + req->head, iov, 0, req->total);
+		ret = pwrite_in_full(disk->fd, req->buf, len, start);
+		if (ret < 0)
+			ret = -errno;
+	}
+
+	/* Don't grow a file that ends in the middle of a block */
+	if (start + len > disk->size && ftruncate(disk->fd, disk->size) < 0)
+		ret = -errno;
+
+	mutex_unlock(&disk->bounce_lock);
+
+	return ret;
+}
+
+ssize_t disk_bounce_write(struct disk_image *disk, unsigned int queue,
+			  u64 sector, const struct iovec *iov, int iovcount,
+			  void *param)
+{
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 total = iov_size(iov, iovcount);
+	u64 start = round_down(offset, disk->block_size);
+	u64 end = ALIGN(offset + total, disk->block_size);
+	struct disk_bounce_req *req, tmp;
+	ssize_t ret;
+
+	req = disk_bounce_start(disk, queue, &tmp, start, end - start, offset,
+				total, param);
+	if (!req)
+		return disk_bounce_done(disk, param, -ENOMEM);
+
+	if (start != offset || end != offset + total) {
+		if (disk->bounce)
+			disk_bounce_add(disk->bounce[queue].rmw, 1);
+
+		ret = disk_bounce_rmw(disk, req, start, iov);
+		ret = disk_bounce_end(req, ret);
+		disk_bounce_put(req);
+
+		return disk_bounce_done(disk, param, ret);
+	}
+
+	memcpy_fromiovecend(req->buf, iov, 0, total);
+
+	if (req != &tmp && disk->uring)
+		return raw_image__write_uring(disk, queue, sector, &req->iov, 1,
+					      req);
+	if (req != &tmp && disk->async)
+		return raw_image__write_async(disk, queue, sector, &req->iov, 1,
+					      req);
+
+	ret = pwrite_in_full(disk->fd, req->buf, total, offset);
+	ret = disk_bounce_end(req, ret < 0 ? -errno : ret);
+	disk_bounce_put(req);
+
+	return disk_bounce_done(disk, param, ret);
+}
+
+/* Completions of bounced requests, reported as the guest's request */
+bool disk_bounce_complete(struct disk_image *disk, void **param, long *len)
+{
+	struct disk_bounce_req *req = *param;
+
+	if (!disk->bounce || (void *)req < (void *)disk->bounce ||
+	    (void *)req >= (void *)(disk->bounce + disk->nr_queues))
+		return false;
+
+	*len = disk_bounce_end(req, *len);
+	*param = req->param;
+	disk_bounce_put(req);
+
+	return true;
+}
+
+int disk_bounce_stats(struct disk_image *disk, struct disk_stat_entry *entry)
+{
+	unsigned int i;
+
+	if (!disk->block_size)
+		return 0;
+
+	*entry = (struct disk_stat_entry) {
+		.type		= DISK_STAT_BOUNCE,
+	};
+	strncpy(entry->cache, "bounce", sizeof(entry->cache) - 1);
+
+	for (i = 0; disk->bounce && i < disk->nr_queues; i++) {
+		entry->size	 += DISK_BOUNCE_SLOTS * DISK_BOUNCE_SIZE;
+		entry->pooled	 += __atomic_load_n(&disk->bounce[i].pooled,
+						    __ATOMIC_RELAXED);
+		entry->allocated += __atomic_load_n(&disk->bounce[i].allocated,
+						    __ATOMIC_RELAXED);
+		entry->rmw	 += __atomic_load_n(&disk->bounce[i].rmw,
+						    __ATOMIC_RELAXED);
+	}
+
+	return 1;
+}
@@ -1,16 +1,69 @@
 #include "kvm/disk-image.h"
 #include "kvm/qcow.h"
 #include "kvm/virtio-blk.h"
+#include "kvm/virtio.h"
 #include "kvm/kvm.h"
 #include "kvm/iovec.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/read-write.h"
 
 #include <linux/err.h>
+#include <linux/list.h>
 #include <poll.h>
 
 int debug_iodelay;
 
 static int disk_image__close(struct disk_image *disk);
 
+/* Falls back to libaio when io_uring can't be used */
+static int disk_image__setup_io(struct disk_image *disk, unsigned int nr)
+{
+	int r;
+
+	if (disk->use_io_uring) {
+		r = disk_uring_setup(disk, nr);
+		if (!r)
+			goto out;
+
+		pr_warning("io_uring unavailable (%d), using libaio instead", r);
+		disk->use_io_uring = false;
+	}
+
+	r = disk_aio_setup(disk, nr);
+	if (r)
+		return r;
+
+out:
+	/* Without them, bounced requests allocate their own buffers */
+	if (disk->block_size && disk_bounce_setup(disk, nr))
+		pr_warning("No bounce buffers for O_DIRECT requests");
+
+	return 0;
+}
+
+static void disk_image__destroy_io(struct disk_image *disk)
+{
+	disk_uring_destroy(disk);
+	disk_aio_destroy(disk);
+	disk_bounce_destroy(disk);
+}
+
+/* Accepts a K, M or G suffix */
+static u64 disk_img_parse_size(const char *arg)
+{
+	char *end;
+	u64 size;
+
+	size = strtoull(arg, &end, 0);
+	switch (*end) {
+	case 'K': case 'k': return size << 10;
+	case 'M': case 'm': return size << 20;
+	case 'G': case 'g': return size << 30;
+	}
+
+	return size;
+}
+
 int disk_img_name_parser(const struct option *opt, const char *arg, int unset)
 {
 	const char *cur;
@@ -42,6 +95,28 @@ int disk_img_name_parser(const struct option *opt, const char *arg, int unset)
 				kvm->cfg.disk_image[kvm->nr_disks].readonly = true;
 			else if (strncmp(sep + 1, "direct", 6) == 0)
 				kvm->cfg.disk_image[kvm->nr_disks].direct = true;
+			else if (strncmp(sep + 1, "poll=", 5) == 0)
+				kvm->cfg.disk_image[kvm->nr_disks].poll_us =
+					strtoul(sep + 6, NULL, 0);
+			else if (strncmp(sep + 1, "queue_size=", 11) == 0)
+				kvm->cfg.disk_image[kvm->nr_disks].queue_size =
+					virtio_parse_queue_size(sep + 12);
+			else if (strncmp(sep + 1, "mq=", 3) == 0)
+				kvm->cfg.disk_image[kvm->nr_disks].num_queues =
+					strtoul(sep + 4, NULL, 0);
+			else if (strncmp(sep + 1, "aio=io_uring", 12) == 0)
+				kvm->cfg.disk_image[kvm->nr_disks].io_uring = true;
+			else if (strncmp(sep + 1, "aio=native", 10) == 0)
+				kvm->cfg.disk_image[kvm->nr_disks].io_uring = false;
+			else if (strncmp(sep + 1, "sqpoll", 6) == 0)
+				kvm->cfg.disk_image[kvm->nr_disks].sqpoll = true;
+			else if (strncmp(sep + 1, "fixedbufs", 9) == 0)
+				kvm->cfg.disk_image[kvm->nr_disks].fixed_bufs = true;
+			else if (strncmp(sep + 1, "cache_size=", 11) == 0)
+				kvm->cfg.disk_image[kvm->nr_disks].cache_size =
+					disk_img_parse_size(sep + 12);
+			else if (strncmp(sep + 1, "copy_on_read", 12) == 0)
+				kvm->cfg.disk_image[kvm->nr_disks].copy_on_read = true;
 			*sep = 0;
 			cur = sep + 1;
 		}
@@ -64,9 +139,10 @@ struct disk_image *disk_image__new(int fd, u64 size,
 		return ERR_PTR(-ENOMEM);
 
 	*disk = (struct disk_image) {
-		.fd	= fd,
-		.size	= size,
-		.ops	= ops,
+		.fd		= fd,
+		.size		= size,
+		.ops		= ops,
+		.nr_queues	= 1,
 	};
 
 	if (use_mmap == DISK_IMAGE_MMAP) {
@@ -80,7 +156,7 @@ struct disk_image *disk_image__new(int fd, u64 size,
 		}
 	}
 
-	r = disk_aio_setup(disk);
+	r = disk_image__setup_io(disk, disk->nr_queues);
 	if (r)
 		goto err_unmap_disk;
 
@@ -94,7 +170,8 @@ err_free_disk:
 	return ERR_PTR(r);
 }
 
-static struct disk_image *disk_image__open(const char *filename, bool readonly, bool direct)
+static struct disk_image *disk_image__open(const char *filename, bool readonly,
+					   bool direct, u64 cache_size)
 {
 	struct disk_image *disk;
 	struct stat st;
@@ -122,10 +199,13 @@ static struct disk_image *disk_image__open(const char *filename, bool readonly,
 		return ERR_PTR(fd);
 
 	/* qcow image ?*/
-	disk = qcow_probe(fd, true);
+	disk = qcow_probe(fd, filename, readonly, cache_size);
 	if (!IS_ERR_OR_NULL(disk)) {
-		pr_warning("Forcing read-only support for QCOW");
-		disk->readonly = true;
+		if (!readonly && !disk->ops->write) {
+			pr_warning("Forcing read-only support for QCOW version 1");
+			readonly = true;
+		}
+		disk->readonly = readonly;
 		return disk;
 	}
 
@@ -142,6 +222,87 @@ static struct disk_image *disk_image__open(const char *filename, bool readonly,
 	return ERR_PTR(-ENOSYS);
 }
 
+/*
+ * A backing file is opened once, read-only, however many images use it, so
+ * that the images on top of it share its metadata cache. Chains are opened
+ * and closed along with the disks, from the main thread.
+ */
+struct disk_backing {
+	struct list_head		list;
+	dev_t				dev;
+	ino_t				ino;
+	/* NULL while the chain below it is being opened */
+	struct disk_image		*disk;
+	int				users;
+};
+
+static LIST_HEAD(disk_backings);
+
+/* Format drivers read the returned image synchronously, with queue 0 */
+struct disk_image *disk_image__open_backing(const char *filename,
+					    u64 cache_size)
+{
+	struct disk_backing *b;
+	struct disk_image *disk;
+	struct stat st;
+
+	if (stat(filename, &st) < 0)
+		return ERR_PTR(-errno);
+
+	list_for_each_entry(b, &disk_backings, list) {
+		if (b->dev != st.st_dev || b->ino != st.st_ino)
+			continue;
+
+		/* The file is its own backing file, at some depth */
+		if (!b->disk)
+			return ERR_PTR(-ELOOP);
+
+		b->users++;
+		return b->disk;
+	}
+
+	b = malloc(sizeof(*b));
+	if (!b)
+		return ERR_PTR(-ENOMEM);
+
+	*b = (struct disk_backing) {
+		.dev	= st.st_dev,
+		.ino	= st.st_ino,
+		.users	= 1,
+	};
+	list_add(&b->list, &disk_backings);
+
+	disk = disk_image__open(filename, true, false, cache_size);
+	if (IS_ERR_OR_NULL(disk)) {
+		list_del(&b->list);
+		free(b);
+		return disk;
+	}
+
+	disk_image__destroy_io(disk);
+	b->disk = disk;
+
+	return disk;
+}
+
+void disk_image__put_backing(struct disk_image *disk)
+{
+	struct disk_backing *b;
+
+	list_for_each_entry(b, &disk_backings, list) {
+		if (b->disk != disk)
+			continue;
+
+		if (--b->users)
+			return;
+
+		list_del(&b->list);
+		free(b);
+		disk_image__close(disk);
+		return;
+	}
+}
+
 static struct disk_image **disk_image__open_all(struct kvm *kvm)
 {
 	struct disk_image **disks;
@@ -170,7 +331,7 @@ static struct disk_image **disk_image__open_all(struct kvm *kvm)
 		wwpn = params[i].wwpn;
 
 		if (wwpn) {
-			disks[i] = malloc(sizeof(struct disk_image));
+			disks[i] = calloc(1, sizeof(struct disk_image));
 			if (!disks[i])
 				return ERR_PTR(-ENOMEM);
 			disks[i]->wwpn = wwpn;
@@ -180,13 +341,22 @@ static struct disk_image **disk_image__open_all(struct kvm *kvm)
 		if (!filename)
 			continue;
 
-		disks[i] = disk_image__open(filename, readonly, direct);
+		disks[i] = disk_image__open(filename, readonly, direct,
+					    params[i].cache_size);
 		if (IS_ERR_OR_NULL(disks[i])) {
 			pr_err("Loading disk image '%s' failed", filename);
 			err = disks[i];
 			goto error;
 		}
 		disks[i]->debug_iodelay = kvm->cfg.debug_iodelay;
+		disks[i]->poll_us = params[i].poll_us;
+		disks[i]->queue_size = params[i].queue_size;
+		disks[i]->num_queues = params[i].num_queues;
+		disks[i]->use_io_uring = params[i].io_uring;
+		disks[i]->sqpoll = params[i].sqpoll;
+		disks[i]->fixed_bufs = params[i].fixed_bufs;
+		disks[i]->copy_on_read = params[i].copy_on_read;
+		disks[i]->kvm = kvm;
 	}
 
 	return disks;
@@ -207,6 +377,109 @@ int disk_image__wait(struct disk_image *disk)
 	return 0;
 }
 
+/*
+ * Set the number of queues that requests are submitted on, before any request
+ * is submitted. This also sets up the I/O backend chosen for the disk.
+ */
+int disk_image__set_queues(struct disk_image *disk, unsigned int nr)
+{
+	int r;
+
+	if (!nr)
+		return -EINVAL;
+
+	disk_image__destroy_io(disk);
+
+	r = disk_image__setup_io(disk, nr);
+	if (r) {
+		/* Keep the disk usable with the queues it had */
+		if (disk_image__setup_io(disk, disk->nr_queues))
+			pr_warning("Lost asynchronous I/O on disk");
+		return r;
+	}
+
+	disk->nr_queues = nr;
+	return 0;
+}
+
+/*
+ * Have completions of @queue signalled on @fd, or stop it if @fd is negative.
+ * Returns 1 when the thread reading @fd must then call disk_image__reap(), 0
+ * when the backend reports completions by itself.
+ */
+int disk_image__set_queue_eventfd(struct disk_image *disk, unsigned int queue,
+				  int fd)
+{
+	if (disk->uring)
+		return disk_uring_set_eventfd(disk, queue, fd);
+
+	return 0;
+}
+
+/*
+ * Run the callback of the completed requests of @queue. As for synchronous
+ * completions, the caller ends the batch.
+ */
+void disk_image__reap(struct disk_image *disk, unsigned int queue)
+{
+	if (disk->uring)
+		disk_uring_reap(disk, queue);
+}
+
+/*
+ * Requests submitted on @queue until disk_image__unplug() may be sent to the
+ * backend together.
+ */
+void disk_image__plug(struct disk_image *disk, unsigned int queue)
+{
+	if (disk->ops->plug)
+		disk->ops->plug(disk, queue);
+}
+
+int disk_image__unplug(struct disk_image *disk, unsigned int queue)
+{
+	if (disk->ops->unplug)
+		return disk->ops->unplug(disk, queue);
+
+	return 0;
+}
+
+/* Flush on behalf of a request of @queue, which completes like a write */
+ssize_t disk_image__flush_queue(struct disk_image *disk, unsigned int queue,
+				void *param)
+{
+	ssize_t ret;
+
+	if (disk->uring && !disk->ops->flush)
+		return disk_uring_flush(disk, queue, param);
+
+	ret = disk_image__flush(disk);
+	if (disk->disk_req_cb)
+		disk->disk_req_cb(param, ret);
+
+	return ret;
+}
+
+/*
+ * Deallocate or zero a range of sectors. This is synchronous, whether or not
+ * the disk is, and the caller completes the request itself.
+ */
+int disk_image__discard(struct disk_image *disk, u64 sector, u64 nr_sectors,
+			u32 flags)
+{
+	if (!disk->ops->discard || disk->readonly)
+		return -EOPNOTSUPP;
+
+	if (sector + nr_sectors < sector ||
+	    sector + nr_sectors > disk->size >> SECTOR_SHIFT)
+		return -EINVAL;
+
+	if (!nr_sectors)
+		return 0;
+
+	return disk->ops->discard(disk, sector, nr_sectors, flags);
+}
+
 int disk_image__flush(struct disk_image *disk)
 {
 	if (disk->ops->flush)
@@ -221,7 +494,8 @@ static int disk_image__close(struct disk_image *disk)
 	if (!disk)
 		return 0;
 
-	disk_aio_destroy(disk);
+	disk_image__destroy_io(disk);
+	raw_image__free_extents(disk);
 
 	if (disk->ops && disk->ops->close)
 		return disk->ops->close(disk);
@@ -248,7 +522,7 @@ static int disk_image__close_all(struct disk_image **disks, int count)
  * Fill iov with disk data, starting from sector 'sector'.
  * Return amount of bytes read.
  */
-ssize_t disk_image__read(struct disk_image *disk, u64 sector,
+ssize_t disk_image__read(struct disk_image *disk, unsigned int queue, u64 sector,
 			 const struct iovec *iov, int iovcount, void *param)
 {
 	ssize_t total = 0;
@@ -257,7 +531,8 @@ ssize_t disk_image__read(struct disk_image *disk, u64 sector,
 		msleep(debug_iodelay);
 
 	if (disk->ops->read) {
-		total = disk->ops->read(disk, sector, iov, iovcount, param);
+		total = disk->ops->read(disk, queue, sector, iov, iovcount,
+					param);
 		if (total < 0) {
 			pr_info("disk_image__read error: total=%ld\n", (long)total);
 			return total;
@@ -274,7 +549,7 @@ ssize_t disk_image__read(struct disk_image *disk, u64 sector,
  * Write iov to disk, starting from sector 'sector'.
  * Return amount of bytes written.
  */
-ssize_t disk_image__write(struct disk_image *disk, u64 sector,
+ssize_t disk_image__write(struct disk_image *disk, unsigned int queue, u64 sector,
 			  const struct iovec *iov, int iovcount, void *param)
 {
 	ssize_t total = 0;
@@ -287,7 +562,8 @@ ssize_t disk_image__write(struct disk_image *disk, u64 sector,
 		 * Try writev based operation first
 		 */
 
-		total = disk->ops->write(disk, sector, iov, iovcount, param);
+		total = disk->ops->write(disk, queue, sector, iov, iovcount,
+					 param);
 		if (total < 0) {
 			pr_info("disk_image__write error: total=%ld\n", (long)total);
 			return total;
@@ -337,6 +613,50 @@ void disk_image__set_callback(struct disk_image *disk,
 	disk->disk_req_cb = disk_req_cb;
 }
 
+void disk_image__set_batch_callback(struct disk_image *disk,
+				    void (*disk_req_batch_cb)(void *param,
+							      unsigned int queue),
+				    void *param)
+{
+	disk->disk_req_batch_cb = disk_req_batch_cb;
+	disk->disk_req_cb_param = param;
+}
+
+static void disk_image__stat_handle(struct kvm *kvm, int fd, u32 type,
+				    u32 len, u8 *msg)
+{
+	struct disk_stat_entry *entries = NULL;
+	struct disk_image *disk;
+	u32 i, n, nr = 0;
+
+	if (WARN_ON(type != KVM_IPC_DISK_STAT || len))
+		return;
+
+	if (kvm->nr_disks)
+		entries = calloc(kvm->nr_disks * DISK_STAT_MAX_CACHES,
+				 sizeof(*entries));
+
+	for (i = 0; entries && i < (u32)kvm->nr_disks; i++) {
+		disk = kvm->disks[i];
+		/* SCSI targets don't have any */
+		if (!disk || !disk->ops)
+			continue;
+
+		n = 0;
+		if (disk->ops->stats)
+			n = disk->ops->stats(disk, entries + nr);
+		n += disk_bounce_stats(disk, entries + nr + n);
+		while (n--)
+			entries[nr++].disk = i;
+	}
+
+	if (write_in_full(fd, &nr, sizeof(nr)) < 0 ||
+	    write_in_full(fd, entries, nr * sizeof(*entries)) < 0)
+		pr_warning("Failed sending disk stats");
+
+	free(entries);
+}
+
 int disk_image__init(struct kvm *kvm)
 {
 	if (kvm->nr_disks) {
@@ -345,7 +665,8 @@ int disk_image__init(struct kvm *kvm)
 			return PTR_ERR(kvm->disks);
 	}
 
-	return 0;
+	return kvm_ipc__register_handler(KVM_IPC_DISK_STAT,
+					 disk_image__stat_handle);
 }
 dev_base_init(disk_image__init);
 
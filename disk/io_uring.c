@@ -0,0 +1,635 @@
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "kvm/brlock.h"
+#include "kvm/disk-image.h"
+#include "kvm/kvm.h"
+#include "kvm/mutex.h"
+#include "linux/list.h"
+
+/*
+ * io_uring backend. Each queue has its own ring, whose completions are
+ * signalled on the eventfd the queue worker already waits on, and reaped by
+ * that worker. There is no completion thread.
+ */
+
+#define URING_ENTRIES		256
+/* Registered buffers can't be larger than this */
+#define URING_MAX_BUF		(1ULL << 30)
+/* How long the SQPOLL thread spins before sleeping */
+#define URING_SQ_IDLE_MS	10
+/* Index of the disk in the registered files */
+#define URING_FILE		0
+
+struct disk_uring {
+	struct disk_image	*disk;
+	unsigned int		queue;
+	int			fd;
+
+	u32			*sq_head;
+	u32			*sq_tail;
+	u32			*sq_flags;
+	u32			sq_mask;
+	u32			sq_entries;
+	struct io_uring_sqe	*sqes;
+	/* Entries up to this one are filled, those past *sq_tail are pending */
+	u32			tail;
+	u32			nr_pending;
+	/* Pending entries are only submitted on unplug, or when the ring is full */
+	bool			plugged;
+
+	u32			*cq_head;
+	u32			*cq_tail;
+	u32			cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	void			*sq_ring;
+	size_t			sq_ring_size;
+	void			*cq_ring;
+	size_t			cq_ring_size;
+	size_t			sqes_size;
+
+	bool			sqpoll;
+	bool			fixed_file;
+	/* Guest RAM registered with the ring, sorted by address */
+	struct iovec		*bufs;
+	unsigned int		nr_bufs;
+
+	/* Eventfd of the thread that reaps completions, or -1 */
+	int			notify_fd;
+	/* Serializes reaping when there is no such thread */
+	struct mutex		lock;
+	u64			inflight;
+};
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	int r = syscall(__NR_io_uring_setup, entries, p);
+
+	return r < 0 ? -errno : r;
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+			  unsigned int min_complete, unsigned int flags)
+{
+	int r = syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			flags, NULL, 0);
+
+	return r < 0 ? -errno : r;
+}
+
+static int io_uring_register(int fd, unsigned int opcode, const void *arg,
+			     unsigned int nr_args)
+{
+	int r = syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+
+	return r < 0 ? -errno : r;
+}
+
+static unsigned int disk_uring_reap_ring(struct disk_uring *ring)
+{
+	struct disk_image *disk = ring->disk;
+	struct io_uring_cqe *cqe;
+	unsigned int nr = 0;
+	u32 head, tail;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++, nr++) {
+		cqe = &ring->cqes[head & ring->cq_mask];
+		disk_image__complete(disk, (void *)(unsigned long)cqe->user_data,
+				     cqe->res);
+	}
+
+	if (nr) {
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+		__sync_fetch_and_sub(&ring->inflight, nr);
+	}
+
+	/* Completions that didn't fit in the ring are moved by the kernel */
+	if (__atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED) &
+	    IORING_SQ_CQ_OVERFLOW) {
+		io_uring_enter(ring->fd, 0, 0, IORING_ENTER_GETEVENTS);
+		nr += disk_uring_reap_ring(ring);
+	}
+
+	return nr;
+}
+
+/* Reap on behalf of a queue that has no thread doing it */
+static void disk_uring_wait_ring(struct disk_uring *ring)
+{
+	struct disk_image *disk = ring->disk;
+
+	mutex_lock(&ring->lock);
+	while (ring->inflight) {
+		io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+		if (disk_uring_reap_ring(ring) && disk->disk_req_batch_cb)
+			disk->disk_req_batch_cb(disk->disk_req_cb_param,
+						ring->queue);
+	}
+	mutex_unlock(&ring->lock);
+}
+
+/* The kernel didn't consume the entries from its head, complete them here */
+static void disk_uring_fail_pending(struct disk_uring *ring, int err)
+{
+	struct disk_image *disk = ring->disk;
+	struct io_uring_sqe *sqe;
+	u32 head, tail = ring->tail;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	__atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+	ring->tail = head;
+	ring->nr_pending = 0;
+
+	for (; head != tail; head++) {
+		sqe = &ring->sqes[head & ring->sq_mask];
+		__sync_fetch_and_sub(&ring->inflight, 1);
+		disk_image__complete(disk, (void *)(unsigned long)sqe->user_data,
+				     err);
+	}
+}
+
+/* Publish the pending entries and have the kernel consume them */
+static void disk_uring_flush_sq(struct disk_uring *ring)
+{
+	unsigned int flags = 0;
+	int r;
+
+	if (!ring->nr_pending)
+		return;
+
+	__atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+
+	if (ring->sqpoll) {
+		ring->nr_pending = 0;
+
+		/* Pairs with the barrier of the SQ thread before it sleeps */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (!(__atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED) &
+		      IORING_SQ_NEED_WAKEUP))
+			goto out;
+
+		flags |= IORING_ENTER_SQ_WAKEUP;
+		do {
+			r = io_uring_enter(ring->fd, 0, 0, flags);
+		} while (r == -EINTR);
+
+		goto out;
+	}
+
+	/* The kernel may stop early, submit the remaining ones again */
+	while (ring->nr_pending) {
+		r = io_uring_enter(ring->fd, ring->nr_pending, 0, flags);
+		if (r == -EINTR)
+			continue;
+
+		if (r == -EBUSY || r == -EAGAIN) {
+			/* The completion ring is full, make room */
+			if (ring->notify_fd >= 0)
+				disk_uring_reap_ring(ring);
+			continue;
+		}
+
+		if (r <= 0) {
+			disk_uring_fail_pending(ring, r ? r : -EIO);
+			break;
+		}
+
+		ring->nr_pending -= min_t(u32, r, ring->nr_pending);
+	}
+
+out:
+	/* Nobody else is going to reap the completions */
+	if (ring->notify_fd < 0)
+		disk_uring_wait_ring(ring);
+}
+
+static struct io_uring_sqe *disk_uring_get_sqe(struct disk_uring *ring)
+{
+	struct io_uring_sqe *sqe;
+
+	if (ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) ==
+	    ring->sq_entries)
+		disk_uring_flush_sq(ring);
+
+	/* Without SQPOLL, the kernel consumes the whole ring on each submit */
+	while (ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) ==
+	       ring->sq_entries)
+		io_uring_enter(ring->fd, 0, 0, IORING_ENTER_SQ_WAIT);
+
+	sqe = &ring->sqes[ring->tail & ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+
+	return sqe;
+}
+
+static int disk_uring_submit(struct disk_uring *ring,
+			     struct io_uring_sqe *sqe, void *param)
+{
+	if (ring->fixed_file) {
+		sqe->fd = URING_FILE;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	} else {
+		sqe->fd = ring->disk->fd;
+	}
+	sqe->user_data = (unsigned long)param;
+
+	__sync_fetch_and_add(&ring->inflight, 1);
+	ring->tail++;
+	ring->nr_pending++;
+
+	if (!ring->plugged)
+		disk_uring_flush_sq(ring);
+
+	return 1;
+}
+
+static int disk_uring_find_buf(struct disk_uring *ring, const struct iovec *iov)
+{
+	unsigned int lo = 0, hi = ring->nr_bufs, mid;
+	struct iovec *buf;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		buf = &ring->bufs[mid];
+
+		if (iov->iov_base < buf->iov_base) {
+			hi = mid;
+		} else if (iov->iov_base >= buf->iov_base + buf->iov_len) {
+			lo = mid + 1;
+		} else {
+			if (iov->iov_base + iov->iov_len >
+			    buf->iov_base + buf->iov_len)
+				return -1;
+			return mid;
+		}
+	}
+
+	return -1;
+}
+
+static ssize_t disk_uring_rw(struct disk_image *disk, unsigned int queue,
+			     u8 op, u8 op_fixed, u64 sector,
+			     const struct iovec *iov, int iovcount, void *param)
+{
+	struct disk_uring *ring = &disk->uring[queue];
+	struct io_uring_sqe *sqe;
+	int buf = -1;
+
+	sqe = disk_uring_get_sqe(ring);
+	sqe->off = sector << SECTOR_SHIFT;
+
+	/* Registered buffers only take a single segment */
+	if (iovcount == 1)
+		buf = disk_uring_find_buf(ring, iov);
+
+	if (buf >= 0) {
+		sqe->opcode	= op_fixed;
+		sqe->addr	= (unsigned long)iov->iov_base;
+		sqe->len	= iov->iov_len;
+		sqe->buf_index	= buf;
+	} else {
+		sqe->opcode	= op;
+		sqe->addr	= (unsigned long)iov;
+		sqe->len	= iovcount;
+	}
+
+	return disk_uring_submit(ring, sqe, param);
+}
+
+ssize_t raw_image__read_uring(struct disk_image *disk, unsigned int queue,
+			      u64 sector, const struct iovec *iov, int iovcount,
+			      void *param)
+{
+	return disk_uring_rw(disk, queue, IORING_OP_READV,
+			     IORING_OP_READ_FIXED, sector, iov, iovcount, param);
+}
+
+ssize_t raw_image__write_uring(struct disk_image *disk, unsigned int queue,
+			       u64 sector, const struct iovec *iov, int iovcount,
+			       void *param)
+{
+	return disk_uring_rw(disk, queue, IORING_OP_WRITEV,
+			     IORING_OP_WRITE_FIXED, sector, iov, iovcount, param);
+}
+
+ssize_t disk_uring_flush(struct disk_image *disk, unsigned int queue,
+			 void *param)
+{
+	struct disk_uring *ring = &disk->uring[queue];
+	struct io_uring_sqe *sqe;
+
+	sqe = disk_uring_get_sqe(ring);
+	sqe->opcode = IORING_OP_FSYNC;
+
+	return disk_uring_submit(ring, sqe, param);
+}
+
+void disk_uring_plug(struct disk_image *disk, unsigned int queue)
+{
+	disk->uring[queue].plugged = true;
+}
+
+int disk_uring_unplug(struct disk_image *disk, unsigned int queue)
+{
+	struct disk_uring *ring = &disk->uring[queue];
+
+	ring->plugged = false;
+	disk_uring_flush_sq(ring);
+
+	return 0;
+}
+
+int disk_uring_set_eventfd(struct disk_image *disk, unsigned int queue, int fd)
+{
+	struct disk_uring *ring = &disk->uring[queue];
+	int r;
+
+	if (ring->notify_fd >= 0) {
+		io_uring_register(ring->fd, IORING_UNREGISTER_EVENTFD, NULL, 0);
+		ring->notify_fd = -1;
+	}
+
+	if (fd < 0)
+		return 0;
+
+	r = io_uring_register(ring->fd, IORING_REGISTER_EVENTFD, &fd, 1);
+	if (r < 0)
+		return r;
+
+	ring->notify_fd = fd;
+	return 1;
+}
+
+void disk_uring_reap(struct disk_image *disk, unsigned int queue)
+{
+	disk_uring_reap_ring(&disk->uring[queue]);
+}
+
+/* When this function returns there are no in-flight I/O */
+int disk_uring_wait(struct disk_image *disk)
+{
+	struct disk_uring *ring;
+	u64 inflight = 0;
+	unsigned int i;
+
+	for (i = 0; i < disk->nr_queues; i++)
+		inflight += disk->uring[i].inflight;
+
+	for (i = 0; i < disk->nr_queues; i++) {
+		ring = &disk->uring[i];
+
+		if (ring->notify_fd < 0) {
+			disk_uring_wait_ring(ring);
+			continue;
+		}
+
+		/* The queue worker reaps them */
+		while (ring->inflight) {
+			usleep(100);
+			barrier();
+		}
+	}
+
+	return inflight;
+}
+
+static int disk_uring_cmp_buf(const void *a, const void *b)
+{
+	const struct iovec *x = a, *y = b;
+
+	if (x->iov_base < y->iov_base)
+		return -1;
+
+	return x->iov_base > y->iov_base;
+}
+
+/* Guest RAM in chunks that can be registered, sorted by address */
+static unsigned int disk_uring_ram_bufs(struct kvm *kvm, struct iovec **bufs)
+{
+	struct kvm_mem_bank *bank;
+	unsigned int nr = 0;
+	struct iovec *iov;
+	u64 off;
+
+	*bufs = NULL;
+	if (!kvm)
+		return 0;
+
+	mutex_lock(&kvm->mem_banks_lock);
+	list_for_each_entry(bank, &kvm->mem_banks, list) {
+		if (bank->type != KVM_MEM_TYPE_RAM)
+			continue;
+
+		for (off = 0; off < bank->size; off += URING_MAX_BUF) {
+			iov = realloc(*bufs, (nr + 1) * sizeof(*iov));
+			if (!iov)
+				break;
+
+			iov[nr++] = (struct iovec) {
+				.iov_base	= bank->host_addr + off,
+				.iov_len	= min_t(u64, bank->size - off,
+							   URING_MAX_BUF),
+			};
+			*bufs = iov;
+		}
+	}
+	mutex_unlock(&kvm->mem_banks_lock);
+
+	qsort(*bufs, nr, sizeof(**bufs), disk_uring_cmp_buf);
+
+	return nr;
+}
+
+static void disk_uring_destroy_ring(struct disk_uring *ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+}
+
+static int disk_uring_setup_ring(struct disk_uring *ring, bool sqpoll)
+{
+	struct disk_image *disk = ring->disk;
+	struct io_uring_params p;
+	int r;
+
+	p = (struct io_uring_params) {};
+	if (sqpoll) {
+		p.flags		= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = URING_SQ_IDLE_MS;
+	}
+
+	ring->fd = io_uring_setup(URING_ENTRIES, &p);
+	if (ring->fd < 0)
+		return ring->fd;
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(u32);
+	ring->cq_ring_size = p.cq_off.cqes +
+			     p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->sq_ring_size = max(ring->sq_ring_size, ring->cq_ring_size);
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_RW,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		r = -errno;
+		goto err_close;
+	}
+
+	ring->cq_ring = ring->sq_ring;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_RW,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			r = -errno;
+			goto err_unmap_sq;
+		}
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_RW,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		r = -errno;
+		goto err_unmap_cq;
+	}
+
+	ring->sq_head	= ring->sq_ring + p.sq_off.head;
+	ring->sq_tail	= ring->sq_ring + p.sq_off.tail;
+	ring->sq_flags	= ring->sq_ring + p.sq_off.flags;
+	ring->sq_mask	= *(u32 *)(ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+	ring->tail	= *ring->sq_tail;
+	ring->cq_head	= ring->cq_ring + p.cq_off.head;
+	ring->cq_tail	= ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask	= *(u32 *)(ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes	= ring->cq_ring + p.cq_off.cqes;
+	ring->sqpoll	= sqpoll;
+	ring->notify_fd	= -1;
+	mutex_init(&ring->lock);
+
+	/* Entries are always submitted in order */
+	for (r = 0; r < (int)p.sq_entries; r++)
+		((u32 *)(ring->sq_ring + p.sq_off.array))[r] = r;
+
+	ring->fixed_file = io_uring_register(ring->fd, IORING_REGISTER_FILES,
+					     &disk->fd, 1) == 0;
+
+	return 0;
+
+err_unmap_cq:
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+err_unmap_sq:
+	munmap(ring->sq_ring, ring->sq_ring_size);
+err_close:
+	close(ring->fd);
+	return r;
+}
+
+/*
+ * Each queue gets its own ring, with the disk registered. With the fixedbufs
+ * option guest RAM is registered as well, which pins it and charges it to
+ * RLIMIT_MEMLOCK once per ring.
+ */
+int disk_uring_setup(struct disk_image *disk, unsigned int nr_queues)
+{
+	struct disk_uring *uring, *ring;
+	unsigned int i, nr_bufs;
+	struct iovec *bufs;
+	bool sqpoll = disk->sqpoll;
+	int r;
+
+	/* No need to setup io_uring if the disk ops won't make use of it */
+	if (!disk->ops->async)
+		return 0;
+
+	uring = calloc(nr_queues, sizeof(*uring));
+	if (!uring)
+		return -ENOMEM;
+
+	nr_bufs = 0;
+	bufs = NULL;
+	if (disk->fixed_bufs)
+		nr_bufs = disk_uring_ram_bufs(disk->kvm, &bufs);
+
+	for (i = 0; i < nr_queues; i++) {
+		ring = &uring[i];
+		ring->disk = disk;
+		ring->queue = i;
+
+		r = disk_uring_setup_ring(ring, sqpoll);
+		if (r && sqpoll) {
+			pr_warning("io_uring SQPOLL unavailable (%d)", r);
+			sqpoll = false;
+			r = disk_uring_setup_ring(ring, sqpoll);
+		}
+		if (r) {
+			while (i--)
+				disk_uring_destroy_ring(&uring[i]);
+			free(uring);
+			free(bufs);
+			return r;
+		}
+
+		if (!nr_bufs)
+			continue;
+
+		/* Pinning guest RAM may exceed RLIMIT_MEMLOCK */
+		r = io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, bufs,
+				      nr_bufs);
+		if (r < 0) {
+			pr_warning("Not using fixed buffers: can't register guest RAM with io_uring queue %u (%d)%s",
+				   i, r, r == -ENOMEM ?
+				   ", RLIMIT_MEMLOCK too low for all queues?" : "");
+			nr_bufs = 0;
+			continue;
+		}
+
+		ring->bufs = bufs;
+		ring->nr_bufs = nr_bufs;
+	}
+
+	if (!nr_bufs) {
+		for (i = 0; i < nr_queues; i++) {
+			if (uring[i].nr_bufs)
+				io_uring_register(uring[i].fd,
+						  IORING_UNREGISTER_BUFFERS,
+						  NULL, 0);
+			uring[i].bufs = NULL;
+			uring[i].nr_bufs = 0;
+		}
+		free(bufs);
+	}
+
+	disk->uring = uring;
+	disk->async = true;
+	return 0;
+}
+
+void disk_uring_destroy(struct disk_image *disk)
+{
+	unsigned int i;
+
+	if (!disk->uring)
+		return;
+
+	for (i = 0; i < disk->nr_queues; i++)
+		disk_uring_destroy_ring(&disk->uring[i]);
+
+	free(disk->uring[0].bufs);
+	free(disk->uring);
+	disk->uring = NULL;
+	disk->async = false;
+}
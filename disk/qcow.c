@@ -1,6 +1,7 @@
 #include "kvm/qcow.h"
 
 #include "kvm/disk-image.h"
+#include "kvm/iovec.h"
 #include "kvm/read-write.h"
 #include "kvm/mutex.h"
 #include "kvm/util.h"
@@ -24,177 +25,234 @@
 
 static int update_cluster_refcount(struct qcow *q, u64 clust_idx, u16 append);
 static int qcow_write_refcount_table(struct qcow *q);
+static int qcow_write_refcounts(struct qcow *q);
 static u64 qcow_alloc_clusters(struct qcow *q, u64 size, int update_ref);
 static void  qcow_free_clusters(struct qcow *q, u64 clust_start, u64 size);
 
-static inline int qcow_pwrite_sync(int fd,
-	void *buf, size_t count, off_t offset)
-{
-	if (pwrite_in_full(fd, buf, count, offset) < 0)
-		return -1;
-
-	return fdatasync(fd);
-}
-
-static int l2_table_insert(struct rb_root *root, struct qcow_l2_table *new)
+/*
+ * Metadata caches hold fixed size slices of L2 tables or refcount blocks, so
+ * that a given amount of memory covers as much of the image as possible.
+ * Slices are found through a hash of their offset, and replaced with CLOCK:
+ * a hit only sets the referenced bit of the slice.
+ */
+static int qcow_cache_init(struct qcow_cache *c, u64 size, u32 slice_size,
+			   int (*writeback)(struct qcow *q))
 {
-	struct rb_node **link = &(root->rb_node), *parent = NULL;
-	u64 offset = new->offset;
+	u32 i;
 
-	/* search the tree */
-	while (*link) {
-		struct qcow_l2_table *t;
+	*c = (struct qcow_cache) {
+		.slice_size	= slice_size,
+		.nr_slices	= max_t(u64, size / slice_size,
+					QCOW_CACHE_MIN_SLICES),
+		.writeback	= writeback,
+	};
 
-		t = rb_entry(*link, struct qcow_l2_table, node);
-		if (!t)
-			goto error;
+	while ((1U << c->hash_bits) < c->nr_slices)
+		c->hash_bits++;
 
-		parent = *link;
+	c->slices = calloc(c->nr_slices, sizeof(*c->slices));
+	c->hash = calloc(1U << c->hash_bits, sizeof(*c->hash));
+	c->data = malloc((u64)c->nr_slices * slice_size);
+	if (!c->slices || !c->hash || !c->data)
+		return -1;
 
-		if (t->offset > offset)
-			link = &(*link)->rb_left;
-		else if (t->offset < offset)
-			link = &(*link)->rb_right;
-		else
-			goto out;
+	for (i = 0; i < c->nr_slices; i++) {
+		INIT_HLIST_NODE(&c->slices[i].node);
+		c->slices[i].data = c->data + (u64)i * slice_size;
 	}
 
-	/* add new node */
-	rb_link_node(&new->node, parent, link);
-	rb_insert_color(&new->node, root);
-out:
 	return 0;
-error:
-	return -1;
 }
 
-static struct qcow_l2_table *l2_table_lookup(struct rb_root *root, u64 offset)
+static void qcow_cache_free(struct qcow_cache *c)
+{
+	free(c->slices);
+	free(c->hash);
+	free(c->data);
+}
+
+static struct hlist_head *qcow_cache_bucket(struct qcow_cache *c, u64 offset)
 {
-	struct rb_node *link = root->rb_node;
+	u64 key = offset / c->slice_size;
 
-	while (link) {
-		struct qcow_l2_table *t;
+	/* Multiplicative hashing, as hash_64() does */
+	return &c->hash[(key * 0x61C8864680B583EBULL) >> (64 - c->hash_bits)];
+}
 
-		t = rb_entry(link, struct qcow_l2_table, node);
-		if (!t)
-			goto out;
+static struct qcow_cache_slice *qcow_cache_lookup(struct qcow_cache *c,
+						  u64 offset)
+{
+	struct qcow_cache_slice *s;
 
-		if (t->offset > offset)
-			link = link->rb_left;
-		else if (t->offset < offset)
-			link = link->rb_right;
-		else
-			return t;
+	if (!c->hash_bits)
+		return NULL;
+
+	hlist_for_each_entry(s, qcow_cache_bucket(c, offset), node) {
+		if (s->offset == offset)
+			return s;
 	}
-out:
+
 	return NULL;
 }
 
-static void l1_table_free_cache(struct qcow_l1_table *l1t)
+static int qcow_cache_write_slice(struct qcow *q, struct qcow_cache *c,
+				  struct qcow_cache_slice *s)
 {
-	struct rb_root *r = &l1t->root;
-	struct list_head *pos, *n;
-	struct qcow_l2_table *t;
+	if (!s->dirty)
+		return 0;
+
+	if (pwrite_in_full(q->fd, s->data, c->slice_size, s->offset) < 0)
+		return -1;
+
+	s->dirty = 0;
 
-	list_for_each_safe(pos, n, &l1t->lru_list) {
-		/* Remove cache table from the list and RB tree */
-		list_del(pos);
-		t = list_entry(pos, struct qcow_l2_table, list);
-		rb_erase(&t->node, r);
+	return 1;
+}
 
-		/* Free the cached node */
-		free(t);
+/* Write back the dirty slices. Returns 1 if anything was written. */
+static int qcow_cache_write(struct qcow *q, struct qcow_cache *c)
+{
+	int r, ret = 0;
+	u32 i;
+
+	for (i = 0; i < c->nr_slices; i++) {
+		r = qcow_cache_write_slice(q, c, &c->slices[i]);
+		if (r < 0)
+			return r;
+		ret |= r;
 	}
+
+	return ret;
 }
 
-static int qcow_l2_cache_write(struct qcow *q, struct qcow_l2_table *c)
+/* Find a slot for a new slice, writing back the slice it held */
+static struct qcow_cache_slice *qcow_cache_evict(struct qcow *q,
+						 struct qcow_cache *c)
 {
-	struct qcow_header *header = q->header;
-	u64 size;
+	struct qcow_cache_slice *s;
+	int r;
 
-	if (!c->dirty)
-		return 0;
+	for (;;) {
+		s = &c->slices[c->hand];
+		c->hand = (c->hand + 1) % c->nr_slices;
 
-	size = 1 << header->l2_bits;
+		if (!s->offset)
+			return s;
 
-	if (qcow_pwrite_sync(q->fd, c->table,
-		size * sizeof(u64), c->offset) < 0)
-		return -1;
+		if (s->referenced) {
+			s->referenced = 0;
+			continue;
+		}
 
-	c->dirty = 0;
+		if (s->dirty && c->writeback) {
+			r = c->writeback(q);
+			if (r > 0)
+				r = fdatasync(q->fd);
+			if (r < 0)
+				return NULL;
+		}
 
-	return 0;
-}
+		if (qcow_cache_write_slice(q, c, s) < 0)
+			return NULL;
 
-static int cache_table(struct qcow *q, struct qcow_l2_table *c)
-{
-	struct qcow_l1_table *l1t = &q->table;
-	struct rb_root *r = &l1t->root;
-	struct qcow_l2_table *lru;
+		hlist_del_init(&s->node);
+		s->offset = 0;
+		c->evictions++;
 
-	if (l1t->nr_cached == MAX_CACHE_NODES) {
-		/*
-		 * The node at the head of the list is least recently used
-		 * node. Remove it from the list and replaced with a new node.
-		 */
-		lru = list_first_entry(&l1t->lru_list, struct qcow_l2_table, list);
+		return s;
+	}
+}
 
-		/* Remove the node from the cache */
-		rb_erase(&lru->node, r);
-		list_del_init(&lru->list);
-		l1t->nr_cached--;
 
-		/* Free the LRUed node */
-		free(lru);
+/* Forget the slices of a table that is freed, its cluster may be reused */
+static void qcow_cache_drop(struct qcow_cache *c, u64 offset, u64 size)
+{
+	struct qcow_cache_slice *s;
+	u64 end = offset + size;
+
+	for (; offset < end; offset += c->slice_size) {
+		s = qcow_cache_lookup(c, offset);
+		if (!s)
+			continue;
+
+		hlist_del_init(&s->node);
+		s->offset = 0;
+		s->dirty = 0;
+		s->referenced = 0;
 	}
+}
 
-	/* Add new node in RB Tree: Helps in searching faster */
-	if (l2_table_insert(r, c) < 0)
-		goto error;
+/* Look up a slice, which counts as a hit if it is cached */
+static struct qcow_cache_slice *qcow_cache_hit(struct qcow_cache *c, u64 offset)
+{
+	struct qcow_cache_slice *s;
 
-	/* Add in LRU replacement list */
-	list_add_tail(&c->list, &l1t->lru_list);
-	l1t->nr_cached++;
+	s = qcow_cache_lookup(c, offset);
+	if (s) {
+		c->hits++;
+		s->referenced = 1;
+	}
 
-	return 0;
-error:
-	return -1;
+	return s;
 }
 
-static struct qcow_l2_table *l2_table_search(struct qcow *q, u64 offset)
+/* Add a slice for offset, with data for the caller to fill in */
+static struct qcow_cache_slice *qcow_cache_add(struct qcow *q,
+					       struct qcow_cache *c, u64 offset)
 {
-	struct qcow_l1_table *l1t = &q->table;
-	struct qcow_l2_table *l2t;
+	struct qcow_cache_slice *s;
 
-	l2t = l2_table_lookup(&l1t->root, offset);
-	if (!l2t)
+	s = qcow_cache_evict(q, c);
+	if (!s)
 		return NULL;
 
-	/* Update the LRU state, by moving the searched node to list tail */
-	list_move_tail(&l2t->list, &l1t->lru_list);
+	s->offset = offset;
+	s->referenced = 1;
+	hlist_add_head(&s->node, qcow_cache_bucket(c, offset));
 
-	return l2t;
+	return s;
 }
 
-/* Allocates a new node for caching L2 table */
-static struct qcow_l2_table *new_cache_table(struct qcow *q, u64 offset)
+/*
+ * Get the slice at offset, read from the image, or zeroed if @read is false.
+ * The slice stays valid until the next call on the same cache.
+ */
+static struct qcow_cache_slice *qcow_cache_get(struct qcow *q,
+					       struct qcow_cache *c,
+					       u64 offset, bool read)
 {
-	struct qcow_header *header = q->header;
-	struct qcow_l2_table *c;
-	u64 l2t_sz;
-	u64 size;
-
-	l2t_sz = 1 << header->l2_bits;
-	size   = sizeof(*c) + l2t_sz * sizeof(u64);
-	c      = calloc(1, size);
-	if (!c)
-		goto out;
+	struct qcow_cache_slice *s;
 
-	c->offset = offset;
-	RB_CLEAR_NODE(&c->node);
-	INIT_LIST_HEAD(&c->list);
-out:
-	return c;
+	s = qcow_cache_hit(c, offset);
+	if (s) {
+		if (!read)
+			memset(s->data, 0, c->slice_size);
+		return s;
+	}
+
+	c->misses++;
+
+	s = qcow_cache_add(q, c, offset);
+	if (!s)
+		return NULL;
+
+	if (!read) {
+		memset(s->data, 0, c->slice_size);
+	} else if (pread_in_full(q->fd, s->data, c->slice_size, offset) < 0) {
+		qcow_cache_drop(c, offset, c->slice_size);
+		return NULL;
+	}
+
+	return s;
+}
+
+/*
+ * Clusters that an L2 table uses are only allocated in the cached refcount
+ * blocks, which must reach the disk first.
+ */
+static int qcow_l2_cache_writeback(struct qcow *q)
+{
+	return qcow_write_refcounts(q);
 }
 
 static inline u64 get_l1_index(struct qcow *q, u64 offset)
@@ -218,36 +276,21 @@ static inline u64 get_cluster_offset(struct qcow *q, u64 offset)
 	return offset & ((1 << header->cluster_bits)-1);
 }
 
-static struct qcow_l2_table *qcow_read_l2_table(struct qcow *q, u64 offset)
+/*
+ * Get the slice of the L2 table at offset that holds entry *l2_idx, which is
+ * then made relative to the slice.
+ */
+static struct qcow_cache_slice *qcow_read_l2_slice(struct qcow *q, u64 offset,
+						   u64 *l2_idx)
 {
-	struct qcow_header *header = q->header;
-	struct qcow_l2_table *l2t;
-	u64 size;
-
-	size = 1 << header->l2_bits;
-
-	/* search an entry for offset in cache */
-	l2t = l2_table_search(q, offset);
-	if (l2t)
-		return l2t;
-
-	/* allocate new node for caching l2 table */
-	l2t = new_cache_table(q, offset);
-	if (!l2t)
-		goto error;
-
-	/* table not cached: read from the disk */
-	if (pread_in_full(q->fd, l2t->table, size * sizeof(u64), offset) < 0)
-		goto error;
+	struct qcow_cache *c = &q->table.cache;
+	u64 per_slice = c->slice_size / sizeof(u64);
+	u64 slice_offset;
 
-	/* cache the table */
-	if (cache_table(q, l2t) < 0)
-		goto error;
+	slice_offset = offset + (*l2_idx / per_slice) * c->slice_size;
+	*l2_idx %= per_slice;
 
-	return l2t;
-error:
-	free(l2t);
-	return NULL;
+	return qcow_cache_get(q, c, slice_offset, true);
 }
 
 static int qcow_decompress_buffer(u8 *out_buf, int out_buf_size,
@@ -288,7 +331,7 @@ static ssize_t qcow1_read_cluster(struct qcow *q, u64 offset,
 {
 	struct qcow_header *header = q->header;
 	struct qcow_l1_table *l1t = &q->table;
-	struct qcow_l2_table *l2t;
+	struct qcow_cache_slice *l2s;
 	u64 clust_offset;
 	u64 clust_start;
 	u64 l2t_offset;
@@ -319,16 +362,16 @@ static ssize_t qcow1_read_cluster(struct qcow *q, u64 offset,
 
 	l2t_size = 1 << header->l2_bits;
 
-	/* read and cache level 2 table */
-	l2t = qcow_read_l2_table(q, l2t_offset);
-	if (!l2t)
-		goto out_error;
-
 	l2_idx = get_l2_index(q, offset);
 	if (l2_idx >= l2t_size)
 		goto out_error;
 
-	clust_start = be64_to_cpu(l2t->table[l2_idx]);
+	/* read and cache level 2 table */
+	l2s = qcow_read_l2_slice(q, l2t_offset, &l2_idx);
+	if (!l2s)
+		goto out_error;
+
+	clust_start = be64_to_cpu(((u64 *)l2s->data)[l2_idx]);
 	if (clust_start & QCOW1_OFLAG_COMPRESSED) {
 		coffset	= clust_start & q->cluster_offset_mask;
 		csize	= clust_start >> (63 - q->header->cluster_bits);
@@ -368,100 +411,64 @@ out_error:
 	return -1;
 }
 
-static ssize_t qcow2_read_cluster(struct qcow *q, u64 offset,
-	void *dst, u32 dst_len)
+/*
+ * Inflate the compressed cluster of an L2 entry into dst, reading its
+ * compressed data into buf, of twice the cluster size.
+ */
+static int qcow2_inflate(struct qcow *q, u64 entry, void *buf, void *dst)
 {
-	struct qcow_header *header = q->header;
-	struct qcow_l1_table *l1t = &q->table;
-	struct qcow_l2_table *l2t;
-	u64 clust_offset;
-	u64 clust_start;
-	u64 l2t_offset;
-	size_t length;
-	u64 l2t_size;
-	u64 l1_idx;
-	u64 l2_idx;
-	int coffset;
+	u64 coffset;
 	int sector_offset;
 	int nb_csectors;
 	int csize;
 
-	l1_idx = get_l1_index(q, offset);
-	if (l1_idx >= l1t->table_size)
-		return -1;
+	coffset = entry & q->cluster_offset_mask;
+	nb_csectors = ((entry >> q->csize_shift) & q->csize_mask) + 1;
+	sector_offset = coffset & (SECTOR_SIZE - 1);
+	csize = nb_csectors * SECTOR_SIZE - sector_offset;
 
-	clust_offset = get_cluster_offset(q, offset);
-	if (clust_offset >= q->cluster_size)
+	if (pread_in_full(q->fd, buf, nb_csectors * SECTOR_SIZE,
+			  coffset & ~(SECTOR_SIZE - 1)) < 0)
 		return -1;
 
-	length = q->cluster_size - clust_offset;
-	if (length > dst_len)
-		length = dst_len;
-
-	mutex_lock(&q->mutex);
-
-	l2t_offset = be64_to_cpu(l1t->l1_table[l1_idx]);
-
-	l2t_offset &= ~QCOW2_OFLAG_COPIED;
-	if (!l2t_offset)
-		goto zero_cluster;
-
-	l2t_size = 1 << header->l2_bits;
-
-	/* read and cache level 2 table */
-	l2t = qcow_read_l2_table(q, l2t_offset);
-	if (!l2t)
-		goto out_error;
-
-	l2_idx = get_l2_index(q, offset);
-	if (l2_idx >= l2t_size)
-		goto out_error;
+	return qcow_decompress_buffer(dst, q->cluster_size,
+				      buf + sector_offset, csize);
+}
 
-	clust_start = be64_to_cpu(l2t->table[l2_idx]);
-	if (clust_start & QCOW2_OFLAG_COMPRESSED) {
-		coffset = clust_start & q->cluster_offset_mask;
-		nb_csectors = ((clust_start >> q->csize_shift)
-			& q->csize_mask) + 1;
-		sector_offset = coffset & (SECTOR_SIZE - 1);
-		csize = nb_csectors * SECTOR_SIZE - sector_offset;
-
-		if (pread_in_full(q->fd, q->cluster_data,
-				  nb_csectors * SECTOR_SIZE,
-				  coffset & ~(SECTOR_SIZE - 1)) < 0) {
-			goto out_error;
-		}
+/* Keep a decompressed cluster, called with the mutex held */
+static void qcow2_cache_inflated(struct qcow *q, u64 entry, void *data)
+{
+	u64 coffset = entry & q->cluster_offset_mask;
+	struct qcow_cache_slice *s;
 
-		if (qcow_decompress_buffer(q->cluster_cache, q->cluster_size,
-					q->cluster_data + sector_offset,
-					csize) < 0) {
-			goto out_error;
-		}
+	if (qcow_cache_lookup(&q->inflated, coffset))
+		return;
 
-		memcpy(dst, q->cluster_cache + clust_offset, length);
-		mutex_unlock(&q->mutex);
-	} else {
-		clust_start &= QCOW2_OFFSET_MASK;
-		if (!clust_start)
-			goto zero_cluster;
+	/* Clean slices are dropped without I/O */
+	s = qcow_cache_add(q, &q->inflated, coffset);
+	if (s)
+		memcpy(s->data, data, q->cluster_size);
+}
 
-		mutex_unlock(&q->mutex);
+/* Inflate the compressed cluster of an L2 entry, called with the mutex held */
+static int qcow2_read_compressed(struct qcow *q, u64 entry, void *dst)
+{
+	struct qcow_cache_slice *s;
 
-		if (pread_in_full(q->fd, dst, length,
-				  clust_start + clust_offset) < 0)
-			return -1;
+	s = qcow_cache_hit(&q->inflated, entry & q->cluster_offset_mask);
+	if (s) {
+		memcpy(dst, s->data, q->cluster_size);
+		return 0;
 	}
 
-	return length;
+	q->inflated.misses++;
 
-zero_cluster:
-	mutex_unlock(&q->mutex);
-	memset(dst, 0, length);
-	return length;
+	if (qcow2_inflate(q, entry, q->cluster_data, dst) < 0)
+		return -1;
 
-out_error:
-	mutex_unlock(&q->mutex);
-	length = -1;
-	return -1;
+	qcow2_cache_inflated(q, entry, dst);
+
+	return 0;
 }
 
 static ssize_t qcow_read_sector_single(struct disk_image *disk, u64 sector,
@@ -482,12 +489,7 @@ static ssize_t qcow_read_sector_single(struct disk_image *disk, u64 sector,
 		if (offset >= header->size)
 			return -1;
 
-		if (q->version == QCOW1_VERSION)
-			nr = qcow1_read_cluster(q, offset, buf,
-				dst_len - nr_read);
-		else
-			nr = qcow2_read_cluster(q, offset, buf,
-				dst_len - nr_read);
+		nr = qcow1_read_cluster(q, offset, buf, dst_len - nr_read);
 
 		if (nr <= 0)
 			return -1;
@@ -500,8 +502,9 @@ static ssize_t qcow_read_sector_single(struct disk_image *disk, u64 sector,
 	return dst_len;
 }
 
-static ssize_t qcow_read_sector(struct disk_image *disk, u64 sector,
-				const struct iovec *iov, int iovcount, void *param)
+static ssize_t qcow_read_sector(struct disk_image *disk, unsigned int queue,
+				u64 sector, const struct iovec *iov,
+				int iovcount, void *param)
 {
 	ssize_t nr, total = 0;
 
@@ -520,153 +523,14 @@ static ssize_t qcow_read_sector(struct disk_image *disk, u64 sector,
 	return total;
 }
 
-static void refcount_table_free_cache(struct qcow_refcount_table *rft)
-{
-	struct rb_root *r = &rft->root;
-	struct list_head *pos, *n;
-	struct qcow_refcount_block *t;
-
-	list_for_each_safe(pos, n, &rft->lru_list) {
-		list_del(pos);
-		t = list_entry(pos, struct qcow_refcount_block, list);
-		rb_erase(&t->node, r);
-
-		free(t);
-	}
-}
-
-static int refcount_block_insert(struct rb_root *root, struct qcow_refcount_block *new)
-{
-	struct rb_node **link = &(root->rb_node), *parent = NULL;
-	u64 offset = new->offset;
-
-	/* search the tree */
-	while (*link) {
-		struct qcow_refcount_block *t;
-
-		t = rb_entry(*link, struct qcow_refcount_block, node);
-		if (!t)
-			goto error;
-
-		parent = *link;
-
-		if (t->offset > offset)
-			link = &(*link)->rb_left;
-		else if (t->offset < offset)
-			link = &(*link)->rb_right;
-		else
-			goto out;
-	}
-
-	/* add new node */
-	rb_link_node(&new->node, parent, link);
-	rb_insert_color(&new->node, root);
-out:
-	return 0;
-error:
-	return -1;
-}
-
-static int write_refcount_block(struct qcow *q, struct qcow_refcount_block *rfb)
-{
-	if (!rfb->dirty)
-		return 0;
-
-	if (qcow_pwrite_sync(q->fd, rfb->entries,
-		rfb->size * sizeof(u16), rfb->offset) < 0)
-		return -1;
-
-	rfb->dirty = 0;
-
-	return 0;
-}
-
-static int cache_refcount_block(struct qcow *q, struct qcow_refcount_block *c)
-{
-	struct qcow_refcount_table *rft = &q->refcount_table;
-	struct rb_root *r = &rft->root;
-	struct qcow_refcount_block *lru;
-
-	if (rft->nr_cached == MAX_CACHE_NODES) {
-		lru = list_first_entry(&rft->lru_list, struct qcow_refcount_block, list);
-
-		rb_erase(&lru->node, r);
-		list_del_init(&lru->list);
-		rft->nr_cached--;
-
-		free(lru);
-	}
-
-	if (refcount_block_insert(r, c) < 0)
-		goto error;
-
-	list_add_tail(&c->list, &rft->lru_list);
-	rft->nr_cached++;
-
-	return 0;
-error:
-	return -1;
-}
-
-static struct qcow_refcount_block *new_refcount_block(struct qcow *q, u64 rfb_offset)
-{
-	struct qcow_refcount_block *rfb;
-
-	rfb = malloc(sizeof *rfb + q->cluster_size);
-	if (!rfb)
-		return NULL;
-
-	rfb->offset = rfb_offset;
-	rfb->size = q->cluster_size / sizeof(u16);
-	RB_CLEAR_NODE(&rfb->node);
-	INIT_LIST_HEAD(&rfb->list);
-
-	return rfb;
-}
-
-static struct qcow_refcount_block *refcount_block_lookup(struct rb_root *root, u64 offset)
-{
-	struct rb_node *link = root->rb_node;
-
-	while (link) {
-		struct qcow_refcount_block *t;
-
-		t = rb_entry(link, struct qcow_refcount_block, node);
-		if (!t)
-			goto out;
-
-		if (t->offset > offset)
-			link = link->rb_left;
-		else if (t->offset < offset)
-			link = link->rb_right;
-		else
-			return t;
-	}
-out:
-	return NULL;
-}
-
-static struct qcow_refcount_block *refcount_block_search(struct qcow *q, u64 offset)
-{
-	struct qcow_refcount_table *rft = &q->refcount_table;
-	struct qcow_refcount_block *rfb;
-
-	rfb = refcount_block_lookup(&rft->root, offset);
-	if (!rfb)
-		return NULL;
-
-	/* Update the LRU state, by moving the searched node to list tail */
-	list_move_tail(&rfb->list, &rft->lru_list);
-
-	return rfb;
-}
-
-static struct qcow_refcount_block *qcow_grow_refcount_block(struct qcow *q,
-	u64 clust_idx)
+/*
+ * A new refcount block is zeroed on disk right away: the table only points
+ * to it once it is written back, after the block.
+ */
+static int qcow_grow_refcount_block(struct qcow *q, u64 clust_idx)
 {
 	struct qcow_header *header = q->header;
 	struct qcow_refcount_table *rft = &q->refcount_table;
-	struct qcow_refcount_block *rfb;
 	u64 new_block_offset;
 	u64 rft_idx;
 
@@ -675,51 +539,43 @@ static struct qcow_refcount_block *qcow_grow_refcount_block(struct qcow *q,
 
 	if (rft_idx >= rft->rf_size) {
 		pr_warning("Don't support grow refcount block table");
-		return NULL;
+		return -1;
 	}
 
 	new_block_offset = qcow_alloc_clusters(q, q->cluster_size, 0);
 	if (new_block_offset == (u64)-1)
-		return NULL;
-
-	rfb = new_refcount_block(q, new_block_offset);
-	if (!rfb)
-		return NULL;
-
-	memset(rfb->entries, 0x00, q->cluster_size);
-	rfb->dirty = 1;
+		return -1;
 
-	/* write refcount block */
-	if (write_refcount_block(q, rfb) < 0)
-		goto free_rfb;
+	/* Stale slices of a reused cluster */
+	qcow_cache_drop(&rft->cache, new_block_offset, q->cluster_size);
 
-	if (cache_refcount_block(q, rfb) < 0)
-		goto free_rfb;
+	if (raw_image__write_zeroes(q->fd, new_block_offset,
+				    q->cluster_size, 0) < 0)
+		return -1;
 
+	/* Written back after the block, see qcow_write_refcounts() */
 	rft->rf_table[rft_idx] = cpu_to_be64(new_block_offset);
-	if (update_cluster_refcount(q, new_block_offset >>
-		    header->cluster_bits, 1) < 0)
-		goto recover_rft;
-
-	if (qcow_write_refcount_table(q) < 0)
-		goto recover_rft;
-
-	return rfb;
+	rft->dirty = true;
 
-recover_rft:
-	rft->rf_table[rft_idx] = 0;
-free_rfb:
-	free(rfb);
-	return NULL;
+	return update_cluster_refcount(q, new_block_offset >>
+				       header->cluster_bits, 1);
 }
 
-static struct qcow_refcount_block *qcow_read_refcount_block(struct qcow *q, u64 clust_idx)
+/*
+ * Get the slice of the refcount block holding the refcount of a cluster, and
+ * its index in the slice. Returns ERR_PTR(-ENOSPC) if there is no such block.
+ */
+static struct qcow_cache_slice *qcow_read_refcount_slice(struct qcow *q,
+							 u64 clust_idx,
+							 u64 *rfb_idx)
 {
 	struct qcow_header *header = q->header;
 	struct qcow_refcount_table *rft = &q->refcount_table;
-	struct qcow_refcount_block *rfb;
+	struct qcow_cache *c = &rft->cache;
+	u64 per_slice = c->slice_size / sizeof(u16);
 	u64 rfb_offset;
 	u64 rft_idx;
+	u64 idx;
 
 	rft_idx = clust_idx >> (header->cluster_bits - QCOW_REFCOUNT_BLOCK_SHIFT);
 	if (rft_idx >= rft->rf_size)
@@ -729,88 +585,55 @@ static struct qcow_refcount_block *qcow_read_refcount_block(struct qcow *q, u64
 	if (!rfb_offset)
 		return ERR_PTR(-ENOSPC);
 
-	rfb = refcount_block_search(q, rfb_offset);
-	if (rfb)
-		return rfb;
-
-	rfb = new_refcount_block(q, rfb_offset);
-	if (!rfb)
-		return NULL;
-
-	if (pread_in_full(q->fd, rfb->entries, rfb->size * sizeof(u16), rfb_offset) < 0)
-		goto error_free_rfb;
-
-	if (cache_refcount_block(q, rfb) < 0)
-		goto error_free_rfb;
-
-	return rfb;
-
-error_free_rfb:
-	free(rfb);
+	idx = clust_idx & (((1ULL <<
+		(header->cluster_bits - QCOW_REFCOUNT_BLOCK_SHIFT)) - 1));
+	*rfb_idx = idx % per_slice;
 
-	return NULL;
+	return qcow_cache_get(q, c, rfb_offset + (idx / per_slice) *
+			      c->slice_size, true);
 }
 
 static u16 qcow_get_refcount(struct qcow *q, u64 clust_idx)
 {
-	struct qcow_refcount_block *rfb = NULL;
-	struct qcow_header *header = q->header;
+	struct qcow_cache_slice *rfs;
 	u64 rfb_idx;
 
-	rfb = qcow_read_refcount_block(q, clust_idx);
-	if (PTR_ERR(rfb) == -ENOSPC)
+	rfs = qcow_read_refcount_slice(q, clust_idx, &rfb_idx);
+	if (PTR_ERR(rfs) == -ENOSPC)
 		return 0;
-	else if (IS_ERR_OR_NULL(rfb)) {
+	else if (IS_ERR_OR_NULL(rfs)) {
 		pr_warning("Error while reading refcount table");
 		return -1;
 	}
 
-	rfb_idx = clust_idx & (((1ULL <<
-		(header->cluster_bits - QCOW_REFCOUNT_BLOCK_SHIFT)) - 1));
-
-	if (rfb_idx >= rfb->size) {
-		pr_warning("L1: refcount block index out of bounds");
-		return -1;
-	}
-
-	return be16_to_cpu(rfb->entries[rfb_idx]);
+	return be16_to_cpu(((u16 *)rfs->data)[rfb_idx]);
 }
 
 static int update_cluster_refcount(struct qcow *q, u64 clust_idx, u16 append)
 {
-	struct qcow_refcount_block *rfb = NULL;
-	struct qcow_header *header = q->header;
-	u16 refcount;
+	struct qcow_cache_slice *rfs;
+	u16 refcount, *entry;
 	u64 rfb_idx;
 
-	rfb = qcow_read_refcount_block(q, clust_idx);
-	if (PTR_ERR(rfb) == -ENOSPC) {
-		rfb = qcow_grow_refcount_block(q, clust_idx);
-		if (!rfb) {
+	rfs = qcow_read_refcount_slice(q, clust_idx, &rfb_idx);
+	if (PTR_ERR(rfs) == -ENOSPC) {
+		if (qcow_grow_refcount_block(q, clust_idx) < 0) {
 			pr_warning("error while growing refcount table");
 			return -1;
 		}
-	} else if (IS_ERR_OR_NULL(rfb)) {
-		pr_warning("error while reading refcount table");
-		return -1;
+		rfs = qcow_read_refcount_slice(q, clust_idx, &rfb_idx);
 	}
 
-	rfb_idx = clust_idx & (((1ULL <<
-		(header->cluster_bits - QCOW_REFCOUNT_BLOCK_SHIFT)) - 1));
-	if (rfb_idx >= rfb->size) {
-		pr_warning("refcount block index out of bounds");
+	if (IS_ERR_OR_NULL(rfs)) {
+		pr_warning("error while reading refcount table");
 		return -1;
 	}
 
-	refcount = be16_to_cpu(rfb->entries[rfb_idx]) + append;
-	rfb->entries[rfb_idx] = cpu_to_be16(refcount);
-	rfb->dirty = 1;
-
-	/* write refcount block */
-	if (write_refcount_block(q, rfb) < 0) {
-		pr_warning("refcount block index out of bounds");
-		return -1;
-	}
+	entry = (u16 *)rfs->data + rfb_idx;
+	refcount = be16_to_cpu(*entry) + append;
+	*entry = cpu_to_be16(refcount);
+	/* Written back by qcow_write_refcounts() */
+	rfs->dirty = 1;
 
 	/* update free_clust_idx since refcount becomes zero */
 	if (!refcount && clust_idx < q->free_clust_idx)
@@ -839,7 +662,7 @@ static u64 qcow_alloc_clusters(struct qcow *q, u64 size, int update_ref)
 {
 	struct qcow_header *header = q->header;
 	u16 clust_refcount;
-	u32 clust_idx = 0, i;
+	u64 clust_idx = 0, i;
 	u64 clust_num;
 
 	clust_num = (size + (q->cluster_size - 1)) >> header->cluster_bits;
@@ -867,200 +690,765 @@ again:
 
 static int qcow_write_l1_table(struct qcow *q)
 {
-	struct qcow_l1_table *l1t = &q->table;
-	struct qcow_header *header = q->header;
+	struct qcow_l1_table *l1t = &q->table;
+	struct qcow_header *header = q->header;
+
+	if (pwrite_in_full(q->fd, l1t->l1_table,
+		l1t->table_size * sizeof(u64),
+		header->l1_table_offset) < 0)
+		return -1;
+
+	l1t->dirty = false;
+
+	return 0;
+}
+
+/* Write back the dirty refcount blocks. Returns 1 if anything was written. */
+static int qcow_write_refcounts(struct qcow *q)
+{
+	struct qcow_refcount_table *rft = &q->refcount_table;
+	int ret;
+
+	ret = qcow_cache_write(q, &rft->cache);
+	if (ret < 0)
+		return ret;
+
+	/* New blocks must be on disk before the table points to them */
+	if (rft->dirty) {
+		if (fdatasync(q->fd) < 0 || qcow_write_refcount_table(q) < 0)
+			return -1;
+		ret = 1;
+	}
+
+	return ret;
+}
+
+/* Write back the dirty L2 tables, then the L1 table */
+static int qcow_write_l2_tables(struct qcow *q)
+{
+	struct qcow_l1_table *l1t = &q->table;
+	int ret;
+
+	ret = qcow_cache_write(q, &l1t->cache);
+	if (ret < 0)
+		return ret;
+
+	if (l1t->dirty) {
+		if (fdatasync(q->fd) < 0 || qcow_write_l1_table(q) < 0)
+			return -1;
+		ret = 1;
+	}
+
+	return ret;
+}
+
+/*
+ * Write back the cached metadata, so that the image on disk never uses a
+ * cluster it doesn't hold a reference on. Refcount increments go first, then
+ * the tables, and the clusters the tables stopped using are only freed then.
+ */
+static int qcow_write_metadata(struct qcow *q)
+{
+	u32 i;
+	int r;
+
+	r = qcow_write_refcounts(q);
+	if (r > 0)
+		r = fdatasync(q->fd);
+	if (r < 0)
+		return -1;
+
+	r = qcow_write_l2_tables(q);
+	if (r > 0)
+		r = fdatasync(q->fd);
+	if (r < 0)
+		return -1;
+
+	/* The refcount blocks are written back with the next batch */
+	for (i = 0; i < q->nr_frees; i++)
+		qcow_free_clusters(q, q->frees[i].offset, q->frees[i].size);
+	q->nr_frees = 0;
+
+	return 0;
+}
+
+/* Free clusters that the cached tables stopped using */
+static void qcow_defer_free(struct qcow *q, u64 offset, u64 size)
+{
+	if (q->nr_frees == QCOW_MAX_FREES && qcow_write_metadata(q) < 0) {
+		/* Leaking the clusters is safe */
+		pr_warning("Can't write back qcow metadata");
+		return;
+	}
+
+	q->frees[q->nr_frees++] = (struct qcow_free) {
+		.offset	= offset,
+		.size	= size,
+	};
+}
+
+/* Drop the reference that an L2 entry holds on its cluster */
+static void qcow_free_l2_entry(struct qcow *q, u64 entry)
+{
+	u64 clust_start = entry & QCOW2_OFFSET_MASK;
+	int size;
+
+	if (entry & QCOW2_OFLAG_COMPRESSED) {
+		qcow_cache_drop(&q->inflated, clust_start & q->cluster_offset_mask,
+				1);
+
+		size = ((clust_start >> q->csize_shift) & q->csize_mask) + 1;
+		size *= 512;
+		clust_start &= q->cluster_offset_mask;
+		clust_start &= ~511;
+
+		qcow_defer_free(q, clust_start, size);
+	} else if (clust_start) {
+		qcow_defer_free(q, clust_start, q->cluster_size);
+	}
+}
+
+/*
+ * Allocate a single cluster out of a run of QCOW_PREALLOC_CLUSTERS, so that
+ * refcounts are updated and the file is extended once per run. Clusters past
+ * the end of the file read back as zeroes.
+ */
+static u64 qcow_alloc_cluster(struct qcow *q, bool *zeroed)
+{
+	u64 size = QCOW_PREALLOC_CLUSTERS * q->cluster_size;
+	struct stat st;
+	u64 clust;
+
+	if (q->prealloc_start == q->prealloc_end) {
+		clust = qcow_alloc_clusters(q, size, 1);
+		if (clust == (u64)-1)
+			return -1;
+
+		/*
+		 * Extending the file keeps the run contiguous on the host, and
+		 * has partial writes to its clusters read back zeroes around
+		 * them rather than end short.
+		 */
+		q->prealloc_zeroed = !fstat(q->fd, &st) &&
+				     clust >= (u64)st.st_size &&
+				     (!fallocate(q->fd, 0, clust, size) ||
+				      !ftruncate(q->fd, clust + size));
+
+		q->prealloc_start = clust;
+		q->prealloc_end = clust + size;
+	}
+
+	if (zeroed)
+		*zeroed = q->prealloc_zeroed;
+
+	clust = q->prealloc_start;
+	q->prealloc_start += q->cluster_size;
+
+	return clust;
+}
+
+/*
+ * Get l2 table. If the table has been copied, read table directly.
+ * If the table exists, allocate a new cluster and copy the table
+ * to the new cluster.
+ */
+static int get_cluster_table(struct qcow *q, u64 offset,
+	struct qcow_cache_slice **result_l2s, u64 *result_l2_index)
+{
+	struct qcow_header *header = q->header;
+	struct qcow_l1_table *l1t = &q->table;
+	struct qcow_cache *c = &l1t->cache;
+	struct qcow_cache_slice *l2s;
+	u64 l1t_idx;
+	u64 l2t_offset;
+	u64 l2t_idx;
+	u64 l2t_size;
+	u64 l2t_new_offset;
+	u64 i;
+
+	l2t_size = 1 << header->l2_bits;
+
+	l1t_idx = get_l1_index(q, offset);
+	if (l1t_idx >= l1t->table_size)
+		return -1;
+
+	l2t_idx = get_l2_index(q, offset);
+	if (l2t_idx >= l2t_size)
+		return -1;
+
+	l2t_offset = be64_to_cpu(l1t->l1_table[l1t_idx]);
+	if (l2t_offset & QCOW2_OFLAG_COPIED) {
+		l2t_offset &= ~QCOW2_OFLAG_COPIED;
+	} else {
+		l2t_new_offset = qcow_alloc_cluster(q, NULL);
+		if (l2t_new_offset == (u64)-1)
+			goto error;
+
+		/* The shared table is only read, it can't be dirty */
+		if (!l2t_offset)
+			memset(q->copy_buff, 0x00, q->cluster_size);
+		else if (pread_in_full(q->fd, q->copy_buff, q->cluster_size,
+				       l2t_offset) < 0)
+			goto free_cluster;
+
+		for (i = 0; i < q->cluster_size; i += c->slice_size) {
+			l2s = qcow_cache_get(q, c, l2t_new_offset + i, false);
+			if (!l2s)
+				goto free_cache;
+
+			memcpy(l2s->data, q->copy_buff + i, c->slice_size);
+			/* Written back by qcow_write_metadata() */
+			l2s->dirty = 1;
+		}
+
+		l1t->l1_table[l1t_idx] = cpu_to_be64(l2t_new_offset
+			| QCOW2_OFLAG_COPIED);
+		l1t->dirty = true;
+
+		/* free old cluster */
+		if (l2t_offset) {
+			qcow_cache_drop(c, l2t_offset, q->cluster_size);
+			qcow_defer_free(q, l2t_offset, q->cluster_size);
+		}
+
+		l2t_offset = l2t_new_offset;
+	}
+
+	l2s = qcow_read_l2_slice(q, l2t_offset, &l2t_idx);
+	if (!l2s)
+		goto error;
+
+	*result_l2s = l2s;
+	*result_l2_index = l2t_idx;
+
+	return 0;
+
+free_cache:
+	qcow_cache_drop(c, l2t_new_offset, q->cluster_size);
+
+free_cluster:
+	qcow_free_clusters(q, l2t_new_offset, q->cluster_size);
+
+error:
+	return -1;
+}
+
+/* Position in the guest buffers of a request */
+struct qcow_iter {
+	const struct iovec		*iov;
+	size_t				off;
+};
+
+/* Copy the next len bytes of the guest buffers to buf */
+static void qcow_iter_read(struct qcow_iter *it, void *buf, u64 len)
+{
+	size_t copy;
+
+	while (len) {
+		copy = min_t(u64, len, it->iov->iov_len - it->off);
+		memcpy(buf, it->iov->iov_base + it->off, copy);
+
+		buf	+= copy;
+		len	-= copy;
+		it->off	+= copy;
+		if (it->off == it->iov->iov_len) {
+			it->iov++;
+			it->off = 0;
+		}
+	}
+}
+
+/* Fill the next len bytes of the guest buffers from buf, or with zeroes */
+static void qcow_iter_fill(struct qcow_iter *it, const void *buf, u64 len)
+{
+	size_t copy;
+
+	while (len) {
+		copy = min_t(u64, len, it->iov->iov_len - it->off);
+		if (buf) {
+			memcpy(it->iov->iov_base + it->off, buf, copy);
+			buf += copy;
+		} else {
+			memset(it->iov->iov_base + it->off, 0, copy);
+		}
+
+		len	-= copy;
+		it->off	+= copy;
+		if (it->off == it->iov->iov_len) {
+			it->iov++;
+			it->off = 0;
+		}
+	}
+}
+
+/* Append the next len bytes of the guest buffers to iov */
+static int qcow_iter_slice(struct qcow_iter *it, u64 len, struct iovec *iov,
+			   int iovcount)
+{
+	size_t copy;
+
+	while (len) {
+		copy = min_t(u64, len, it->iov->iov_len - it->off);
+		if (copy) {
+			iov[iovcount++] = (struct iovec) {
+				.iov_base	= it->iov->iov_base + it->off,
+				.iov_len	= copy,
+			};
+		}
+
+		len	-= copy;
+		it->off	+= copy;
+		if (it->off == it->iov->iov_len) {
+			it->iov++;
+			it->off = 0;
+		}
+	}
+
+	return iovcount;
+}
+
+/* Number of guest buffers that the next len bytes span */
+static int qcow_iter_count(struct qcow_iter *it, u64 len)
+{
+	const struct iovec *iov = it->iov;
+	size_t avail = iov->iov_len - it->off;
+	int nr = 1;
+
+	while (len > avail) {
+		len -= avail;
+		avail = (++iov)->iov_len;
+		nr++;
+	}
+
+	return nr;
+}
+
+/*
+ * Read len bytes at offset from the backing file to the next guest buffers.
+ * Past the end of the backing file, and without one, they read as zeroes.
+ */
+static int qcow_read_backing(struct qcow *q, u64 offset, struct qcow_iter *it,
+			     u64 len)
+{
+	struct disk_image *backing = q->backing;
+	struct iovec *iov;
+	int iovcount;
+	ssize_t ret;
+	u64 n = 0;
+
+	if (backing && offset < backing->size)
+		n = min(len, backing->size - offset);
+
+	if (n) {
+		iov = malloc(qcow_iter_count(it, n) * sizeof(*iov));
+		if (!iov)
+			return -1;
+
+		iovcount = qcow_iter_slice(it, n, iov, 0);
+		ret = backing->ops->read(backing, 0, offset >> SECTOR_SHIFT,
+					 iov, iovcount, NULL);
+		free(iov);
+		if (ret != (ssize_t)n)
+			return -1;
+	}
+
+	qcow_iter_fill(it, NULL, len - n);
+	return 0;
+}
+
+/* Whether clusters at offset that aren't allocated read as zeroes */
+static bool qcow_backed(struct qcow *q, u64 offset)
+{
+	return q->backing && offset < q->backing->size;
+}
+
+/* A guest request, completed once all of its chunks are */
+struct qcow_req {
+	struct disk_image		*disk;
+	unsigned int			queue;
+	void				*param;
+	int				pending;
+	long				ret;
+};
+
+/* Returns true when this completed the request */
+static bool qcow_req_put(struct qcow_req *req, long ret)
+{
+	struct disk_image *disk = req->disk;
+
+	if (ret < 0)
+		__atomic_store_n(&req->ret, ret, __ATOMIC_RELAXED);
+
+	if (__atomic_sub_fetch(&req->pending, 1, __ATOMIC_ACQ_REL))
+		return false;
+
+	if (disk->disk_req_cb)
+		disk->disk_req_cb(req->param, req->ret);
+	free(req);
+
+	return true;
+}
+
+/* A chunk of a guest read, waiting for its cluster to be inflated */
+struct qcow_inflate_wait {
+	struct list_head		list;
+	struct qcow_req			*req;
+	u64				clust_off;
+	u64				len;
+	int				iovcount;
+	struct iovec			iov[];
+};
+
+/*
+ * Runs in the thread pool, so that clusters are inflated in parallel and
+ * outside of the mutex. The slot stops taking waiters when they are taken
+ * off it, reads that come later find the cluster in the cache, and it is only
+ * reused once they got the data. Slots are reused, relying on the thread pool
+ * running a job again if it is queued while it runs.
+ */
+static void qcow_inflate_work(struct kvm *kvm, void *data)
+{
+	struct qcow_inflate *inf = data;
+	struct qcow *q = inf->q;
+	struct qcow_inflate_wait *w, *n;
+	struct disk_image *disk;
+	struct qcow_iter it;
+	unsigned int queue;
+	LIST_HEAD(waiters);
+	int r;
+
+	r = qcow2_inflate(q, inf->entry, inf->cdata, inf->data);
+
+	mutex_lock(&q->mutex);
+	if (!r)
+		qcow2_cache_inflated(q, inf->entry, inf->data);
+	list_splice_init(&inf->waiters, &waiters);
+	inf->entry = 0;
+	mutex_unlock(&q->mutex);
+
+	list_for_each_entry_safe(w, n, &waiters, list) {
+		if (!r) {
+			it = (struct qcow_iter) { .iov = w->iov };
+			qcow_iter_fill(&it, inf->data + w->clust_off, w->len);
+		}
+
+		/*
+		 * Nobody else ends the batch of a request completed here, once
+		 * its queue is done submitting.
+		 */
+		disk = w->req->disk;
+		queue = w->req->queue;
+		if (qcow_req_put(w->req, r ? -EIO : 0) &&
+		    disk->disk_req_batch_cb)
+			disk->disk_req_batch_cb(disk->disk_req_cb_param, queue);
+		free(w);
+	}
+
+	mutex_lock(&q->mutex);
+	inf->busy = false;
+	mutex_unlock(&q->mutex);
+}
+
+/*
+ * Get the slot inflating the compressed cluster of an L2 entry, or start it
+ * in a free one. Called with the mutex held, returns NULL if none is free.
+ */
+static struct qcow_inflate *qcow2_inflate_start(struct qcow *q, u64 entry)
+{
+	struct qcow_inflate *inf, *free_inf = NULL;
+	int i;
+
+	for (i = 0; i < QCOW_MAX_INFLATE; i++) {
+		inf = &q->inflate[i];
+		if (inf->entry == entry)
+			return inf;
+		if (!inf->busy && !free_inf)
+			free_inf = inf;
+	}
+
+	inf = free_inf;
+	if (!inf)
+		return NULL;
+
+	if (!inf->data) {
+		inf->cdata = malloc(2 * q->cluster_size);
+		inf->data = malloc(q->cluster_size);
+		if (!inf->cdata || !inf->data) {
+			free(inf->cdata);
+			free(inf->data);
+			inf->cdata = inf->data = NULL;
+			return NULL;
+		}
+	}
+
+	inf->entry = entry;
+	inf->busy = true;
+	thread_pool__do_job(&inf->job);
+
+	return inf;
+}
+
+/*
+ * Have the chunk of a guest read filled in once its cluster is inflated.
+ * Called with the mutex held.
+ */
+static int qcow2_inflate_async(struct qcow *q, u64 entry, struct qcow_req *req,
+			       u64 clust_off, struct qcow_iter *it, u64 len)
+{
+	struct qcow_inflate_wait *w;
+	struct qcow_inflate *inf;
+	int iovcount;
+
+	iovcount = qcow_iter_count(it, len);
+	w = malloc(sizeof(*w) + iovcount * sizeof(*w->iov));
+	if (!w)
+		return -ENOMEM;
+
+	inf = qcow2_inflate_start(q, entry);
+	if (!inf) {
+		free(w);
+		return -EBUSY;
+	}
+
+	*w = (struct qcow_inflate_wait) {
+		.req		= req,
+		.clust_off	= clust_off,
+		.len		= len,
+	};
+	w->iovcount = qcow_iter_slice(it, len, w->iov, 0);
+
+	__atomic_add_fetch(&req->pending, 1, __ATOMIC_RELAXED);
+	list_add_tail(&w->list, &inf->waiters);
+
+	return 0;
+}
+
+/*
+ * Start inflating the compressed clusters that follow entry l2_idx of an L2
+ * slice, which are likely read next. Called with the mutex held.
+ */
+static void qcow2_readahead(struct qcow *q, struct qcow_cache_slice *l2s,
+			    u64 l2_idx)
+{
+	u64 nr = q->table.cache.slice_size / sizeof(u64);
+	u64 end = min(nr, l2_idx + 1 + QCOW_INFLATE_READAHEAD);
+	u64 entry;
+
+	for (l2_idx++; l2_idx < end; l2_idx++) {
+		entry = be64_to_cpu(((u64 *)l2s->data)[l2_idx]);
+		if (!(entry & QCOW2_OFLAG_COMPRESSED) ||
+		    qcow_cache_lookup(&q->inflated,
+				      entry & q->cluster_offset_mask))
+			continue;
+
+		if (!qcow2_inflate_start(q, entry))
+			break;
+	}
+}
+
+/*
+ * Serve a read of an unallocated cluster from the backing file, and copy the
+ * whole cluster to the image, so that it is read locally from then on. Called
+ * with the mutex held, which keeps guest writes from allocating it meanwhile.
+ */
+static int qcow2_copy_on_read(struct qcow *q, u64 offset, struct qcow_iter *it,
+			      u64 len)
+{
+	u64 clust_off = get_cluster_offset(q, offset);
+	struct iovec iov = {
+		.iov_base	= q->copy_buff,
+		.iov_len	= q->cluster_size,
+	};
+	struct qcow_iter copy = { .iov = &iov };
+	struct qcow_cache_slice *l2s;
+	u64 clust_new_start, l2t_idx;
+	bool zeroed;
 
-	if (qcow_pwrite_sync(q->fd, l1t->l1_table,
-		l1t->table_size * sizeof(u64),
-		header->l1_table_offset) < 0)
+	offset -= clust_off;
+	if (qcow_read_backing(q, offset, &copy, q->cluster_size) < 0)
 		return -1;
 
+	qcow_iter_fill(it, q->copy_buff + clust_off, len);
+
+	/* Failing to copy only leaves the cluster in the backing file */
+	if (get_cluster_table(q, offset, &l2s, &l2t_idx))
+		return 0;
+
+	clust_new_start = qcow_alloc_cluster(q, &zeroed);
+	if (clust_new_start == (u64)-1)
+		return 0;
+
+	if (pwrite_in_full(q->fd, q->copy_buff, q->cluster_size,
+			   clust_new_start) < 0) {
+		qcow_free_clusters(q, clust_new_start, q->cluster_size);
+		return 0;
+	}
+
+	((u64 *)l2s->data)[l2t_idx] = cpu_to_be64(clust_new_start |
+						  QCOW2_OFLAG_COPIED);
+	l2s->dirty = 1;
+
 	return 0;
 }
 
 /*
- * Get l2 table. If the table has been copied, read table directly.
- * If the table exists, allocate a new cluster and copy the table
- * to the new cluster.
+ * Find where len bytes at offset, within a cluster, are on the host. Chunks
+ * that aren't, or are compressed, are filled in here, or once inflated for
+ * asynchronous requests, and 0 is returned. Unallocated chunks come from the
+ * backing file, and are copied to the image if cor.
  */
-static int get_cluster_table(struct qcow *q, u64 offset,
-	struct qcow_l2_table **result_l2t, u64 *result_l2_index)
+static u64 qcow2_map_read(struct qcow *q, u64 offset, struct qcow_iter *it,
+			  u64 len, struct qcow_req *req, bool cor)
 {
-	struct qcow_header *header = q->header;
 	struct qcow_l1_table *l1t = &q->table;
-	struct qcow_l2_table *l2t;
-	u64 l1t_idx;
-	u64 l2t_offset;
-	u64 l2t_idx;
-	u64 l2t_size;
-	u64 l2t_new_offset;
+	struct qcow_cache_slice *l2s, *s;
+	u64 clust_off, l2t_offset, entry;
+	u64 l1_idx, l2_idx;
 
-	l2t_size = 1 << header->l2_bits;
-
-	l1t_idx = get_l1_index(q, offset);
-	if (l1t_idx >= l1t->table_size)
+	l1_idx = get_l1_index(q, offset);
+	if (l1_idx >= l1t->table_size)
 		return -1;
 
-	l2t_idx = get_l2_index(q, offset);
-	if (l2t_idx >= l2t_size)
-		return -1;
+	clust_off = get_cluster_offset(q, offset);
 
-	l2t_offset = be64_to_cpu(l1t->l1_table[l1t_idx]);
-	if (l2t_offset & QCOW2_OFLAG_COPIED) {
-		l2t_offset &= ~QCOW2_OFLAG_COPIED;
-		l2t = qcow_read_l2_table(q, l2t_offset);
-		if (!l2t)
-			goto error;
-	} else {
-		l2t_new_offset = qcow_alloc_clusters(q,
-			l2t_size*sizeof(u64), 1);
+	mutex_lock(&q->mutex);
 
-		if (l2t_new_offset != (u64)-1)
-			goto error;
+	l2t_offset = be64_to_cpu(l1t->l1_table[l1_idx]) & ~QCOW2_OFLAG_COPIED;
+	if (!l2t_offset)
+		goto zero_cluster;
 
-		l2t = new_cache_table(q, l2t_new_offset);
-		if (!l2t)
-			goto free_cluster;
+	/* read and cache level 2 table */
+	l2_idx = get_l2_index(q, offset);
+	l2s = qcow_read_l2_slice(q, l2t_offset, &l2_idx);
+	if (!l2s)
+		goto out_error;
 
-		if (l2t_offset) {
-			l2t = qcow_read_l2_table(q, l2t_offset);
-			if (!l2t)
-				goto free_cache;
-		} else
-			memset(l2t->table, 0x00, l2t_size * sizeof(u64));
+	entry = be64_to_cpu(((u64 *)l2s->data)[l2_idx]);
+	if (entry & QCOW2_OFLAG_COMPRESSED) {
+		s = qcow_cache_hit(&q->inflated, entry & q->cluster_offset_mask);
+		if (s) {
+			qcow_iter_fill(it, s->data + clust_off, len);
+		} else if (!req || qcow2_inflate_async(q, entry, req, clust_off,
+						       it, len) < 0) {
+			if (qcow2_read_compressed(q, entry, q->cluster_cache) < 0)
+				goto out_error;
+
+			qcow_iter_fill(it, q->cluster_cache + clust_off, len);
+		} else {
+			q->inflated.misses++;
+		}
 
-		/* write l2 table */
-		l2t->dirty = 1;
-		if (qcow_l2_cache_write(q, l2t) < 0)
-			goto free_cache;
+		if (req)
+			qcow2_readahead(q, l2s, l2_idx);
 
-		/* cache l2 table */
-		if (cache_table(q, l2t))
-			goto free_cache;
+		mutex_unlock(&q->mutex);
+		return 0;
+	}
 
-		/* update the l1 talble */
-		l1t->l1_table[l1t_idx] = cpu_to_be64(l2t_new_offset
-			| QCOW2_OFLAG_COPIED);
-		if (qcow_write_l1_table(q)) {
-			pr_warning("Update l1 table error");
-			goto free_cache;
-		}
+	entry &= QCOW2_OFFSET_MASK;
+	if (!entry)
+		goto zero_cluster;
 
-		/* free old cluster */
-		qcow_free_clusters(q, l2t_offset, q->cluster_size);
-	}
+	mutex_unlock(&q->mutex);
+	return entry + clust_off;
 
-	*result_l2t = l2t;
-	*result_l2_index = l2t_idx;
+zero_cluster:
+	if (cor && qcow_backed(q, offset)) {
+		if (qcow2_copy_on_read(q, offset, it, len) < 0)
+			goto out_error;
 
-	return 0;
+		mutex_unlock(&q->mutex);
+		return 0;
+	}
 
-free_cache:
-	free(l2t);
+	mutex_unlock(&q->mutex);
+	if (qcow_read_backing(q, offset, it, len) < 0)
+		return -1;
 
-free_cluster:
-	qcow_free_clusters(q, l2t_new_offset, q->cluster_size);
+	return 0;
 
-error:
+out_error:
+	mutex_unlock(&q->mutex);
 	return -1;
 }
 
 /*
- * If the cluster has been copied, write data directly. If not,
- * read the original data and write it to the new cluster with
- * modification.
+ * Find where len bytes at offset, within a cluster, can be written on the
+ * host. A cluster that isn't allocated, or is shared or compressed, is
+ * replaced with a new one. Only the chunk is left to write when the new
+ * cluster otherwise reads back the same as the old one. When it doesn't, the
+ * old data is copied and the chunk is written here, and 0 is returned.
  */
-static ssize_t qcow_write_cluster(struct qcow *q, u64 offset,
-		void *buf, u32 src_len)
+static u64 qcow2_map_write(struct qcow *q, u64 offset, struct qcow_iter *it,
+			   u64 len)
 {
-	struct qcow_l2_table *l2t;
-	u64 clust_new_start;
-	u64 clust_start;
-	u64 clust_flags;
-	u64 clust_off;
-	u64 l2t_idx;
-	u64 len;
-
-	l2t = NULL;
+	struct iovec iov = {
+		.iov_base	= q->copy_buff,
+		.iov_len	= q->cluster_size,
+	};
+	struct qcow_iter copy = { .iov = &iov };
+	struct qcow_cache_slice *l2s;
+	u64 clust_off, clust_new_start;
+	u64 l2t_idx, entry;
+	bool zeroed;
+	int r = 0;
 
 	clust_off = get_cluster_offset(q, offset);
-	if (clust_off >= q->cluster_size)
-		return -1;
-
-	len = q->cluster_size - clust_off;
-	if (len > src_len)
-		len = src_len;
 
 	mutex_lock(&q->mutex);
 
-	if (get_cluster_table(q, offset, &l2t, &l2t_idx)) {
+	if (get_cluster_table(q, offset, &l2s, &l2t_idx)) {
 		pr_warning("Get l2 table error");
 		goto error;
 	}
 
-	clust_start = be64_to_cpu(l2t->table[l2t_idx]);
-	clust_flags = clust_start & QCOW2_OFLAGS_MASK;
-
-	clust_start &= QCOW2_OFFSET_MASK;
-	if (!(clust_flags & QCOW2_OFLAG_COPIED)) {
-		clust_new_start	= qcow_alloc_clusters(q, q->cluster_size, 1);
-		if (clust_new_start != (u64)-1) {
-			pr_warning("Cluster alloc error");
-			goto error;
-		}
+	entry = be64_to_cpu(((u64 *)l2s->data)[l2t_idx]);
+	if (entry & QCOW2_OFLAG_COPIED) {
+		mutex_unlock(&q->mutex);
+		return (entry & QCOW2_OFFSET_MASK) + clust_off;
+	}
 
-		offset &= ~(q->cluster_size - 1);
+	clust_new_start = qcow_alloc_cluster(q, &zeroed);
+	if (clust_new_start == (u64)-1) {
+		pr_warning("Cluster alloc error");
+		goto error;
+	}
 
-		/* if clust_start is not zero, read the original data*/
-		if (clust_start) {
-			mutex_unlock(&q->mutex);
-			if (qcow2_read_cluster(q, offset, q->copy_buff,
-				q->cluster_size) < 0) {
-				pr_warning("Read copy cluster error");
-				qcow_free_clusters(q, clust_new_start,
-					q->cluster_size);
-				return -1;
-			}
-			mutex_lock(&q->mutex);
-		} else
-			memset(q->copy_buff, 0x00, q->cluster_size);
+	if (!entry && zeroed && !qcow_backed(q, offset - clust_off)) {
+		((u64 *)l2s->data)[l2t_idx] = cpu_to_be64(clust_new_start |
+						  QCOW2_OFLAG_COPIED);
+		l2s->dirty = 1;
+		mutex_unlock(&q->mutex);
+		return clust_new_start + clust_off;
+	}
 
-		memcpy(q->copy_buff + clust_off, buf, len);
+	if (entry & QCOW2_OFLAG_COMPRESSED)
+		r = qcow2_read_compressed(q, entry, q->copy_buff);
+	else if (entry)
+		r = pread_in_full(q->fd, q->copy_buff, q->cluster_size,
+				  entry & QCOW2_OFFSET_MASK);
+	else
+		r = qcow_read_backing(q, offset - clust_off, &copy,
+				      q->cluster_size);
 
-		 /* Write actual data */
-		if (pwrite_in_full(q->fd, q->copy_buff, q->cluster_size,
-			clust_new_start) < 0)
-			goto free_cluster;
+	if (r < 0) {
+		pr_warning("Read copy cluster error");
+		goto free_cluster;
+	}
 
-		/* update l2 table*/
-		l2t->table[l2t_idx] = cpu_to_be64(clust_new_start
-			| QCOW2_OFLAG_COPIED);
-		l2t->dirty = 1;
+	qcow_iter_read(it, q->copy_buff + clust_off, len);
 
-		if (qcow_l2_cache_write(q, l2t))
-			goto free_cluster;
+	if (pwrite_in_full(q->fd, q->copy_buff, q->cluster_size,
+			   clust_new_start) < 0)
+		goto free_cluster;
 
-		/* free old cluster*/
-		if (clust_flags & QCOW2_OFLAG_COMPRESSED) {
-			int size;
-			size = ((clust_start >> q->csize_shift) &
-				q->csize_mask) + 1;
-			size *= 512;
-			clust_start &= q->cluster_offset_mask;
-			clust_start &= ~511;
+	((u64 *)l2s->data)[l2t_idx] = cpu_to_be64(clust_new_start | QCOW2_OFLAG_COPIED);
+	l2s->dirty = 1;
 
-			qcow_free_clusters(q, clust_start, size);
-		} else if (clust_start)
-			qcow_free_clusters(q, clust_start, q->cluster_size);
+	qcow_free_l2_entry(q, entry);
 
-	} else {
-		/* Write actual data */
-		if (pwrite_in_full(q->fd, buf, len,
-			clust_start + clust_off) < 0)
-			goto error;
-	}
 	mutex_unlock(&q->mutex);
-	return len;
+	return 0;
 
 free_cluster:
 	qcow_free_clusters(q, clust_new_start, q->cluster_size);
@@ -1070,104 +1458,346 @@ error:
 	return -1;
 }
 
-static ssize_t qcow_write_sector_single(struct disk_image *disk, u64 sector, void *src, u32 src_len)
+/* Chunks of a request that are contiguous on the host, read or written at once */
+struct qcow_aio {
+	struct qcow_req			*req;
+	u64				offset;
+	u64				len;
+	int				iovcount;
+	struct iovec			iov[];
+};
+
+static void qcow_aio_complete(struct disk_image *disk, void *param, long len)
 {
-	struct qcow *q = disk->priv;
-	struct qcow_header *header = q->header;
-	u32 nr_written;
-	char *buf;
-	u64 offset;
-	ssize_t nr;
+	struct qcow_aio *aio = param;
 
-	buf		= src;
-	nr_written	= 0;
-	offset		= sector << SECTOR_SHIFT;
+	if (len >= 0 && len != (long)aio->len)
+		len = -EIO;
 
-	while (nr_written < src_len) {
-		if (offset >= header->size)
-			return -1;
+	qcow_req_put(aio->req, len);
+	free(aio);
+}
 
-		nr = qcow_write_cluster(q, offset, buf, src_len - nr_written);
-		if (nr < 0)
-			return -1;
+/* Returns the length for synchronous requests */
+static ssize_t qcow_aio_submit(struct disk_image *disk, unsigned int queue,
+			       struct qcow_aio *aio, bool write)
+{
+	struct qcow *q = disk->priv;
+	ssize_t ret = aio->len;
 
-		nr_written	+= nr;
-		buf		+= nr;
-		offset		+= nr;
+	if (!aio->req) {
+		if (write)
+			ret = pwritev_in_full(q->fd, aio->iov, aio->iovcount,
+					      aio->offset);
+		else
+			ret = preadv_in_full(q->fd, aio->iov, aio->iovcount,
+					     aio->offset);
+		/* Like qcow_aio_complete(), as the guest buffer isn't filled */
+		if (ret >= 0 && ret != (ssize_t)aio->len)
+			ret = -EIO;
+		free(aio);
+		return ret;
 	}
 
-	return nr_written;
+	__atomic_add_fetch(&aio->req->pending, 1, __ATOMIC_RELAXED);
+
+	/*
+	 * The backend completes it through qcow_aio_complete(), which may run
+	 * before the submission returns.
+	 */
+	if (write)
+		raw_image__write(disk, queue, aio->offset >> SECTOR_SHIFT,
+				 aio->iov, aio->iovcount, aio);
+	else
+		raw_image__read(disk, queue, aio->offset >> SECTOR_SHIFT,
+				aio->iov, aio->iovcount, aio);
+
+	return ret;
 }
 
-static ssize_t qcow_write_sector(struct disk_image *disk, u64 sector,
-				const struct iovec *iov, int iovcount, void *param)
+/*
+ * Metadata is looked up and updated synchronously, and the data is then read
+ * or written in host contiguous chunks, through the disk backend if @async.
+ * Asynchronous requests are completed with disk_req_cb().
+ */
+static ssize_t qcow2_rw(struct disk_image *disk, unsigned int queue,
+			u64 sector, const struct iovec *iov, int iovcount,
+			void *param, bool write, bool async)
 {
-	ssize_t nr, total = 0;
+	struct qcow_iter it = { .iov = iov };
+	struct qcow *q = disk->priv;
+	struct qcow_aio *aio = NULL;
+	struct qcow_req *req = NULL;
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 total = iov_size(iov, iovcount);
+	u64 done, len, host;
+	ssize_t ret = total;
+	int max_iov;
+	bool cor = disk->copy_on_read && !disk->readonly;
+
+	if (offset + total > q->header->size || offset + total < offset)
+		return -1;
 
-	while (iovcount--) {
-		nr = qcow_write_sector_single(disk, sector, iov->iov_base, iov->iov_len);
-		if (nr != (ssize_t)iov->iov_len) {
-			pr_info("qcow_write_sector error: nr=%ld iov_len=%ld\n", (long)nr, (long)iov->iov_len);
-			return -1;
+	/* Bounds the chunks of guest buffers that a request is split into */
+	max_iov = iovcount + total / q->cluster_size + 2;
+
+	if (async) {
+		req = malloc(sizeof(*req));
+		if (!req)
+			return -ENOMEM;
+
+		*req = (struct qcow_req) {
+			.disk	= disk,
+			.queue	= queue,
+			.param	= param,
+			.pending = 1,
+			.ret	= total,
+		};
+	}
+
+	for (done = 0; done < total; done += len) {
+		len = min(total - done,
+			  q->cluster_size - get_cluster_offset(q, offset + done));
+
+		if (write)
+			host = qcow2_map_write(q, offset + done, &it, len);
+		else
+			host = qcow2_map_read(q, offset + done, &it, len, req,
+					      cor);
+
+		if (host == (u64)-1) {
+			ret = -EIO;
+			break;
+		}
+		if (!host)
+			continue;
+
+		if (aio && (host != aio->offset + aio->len ||
+			    aio->iovcount + max_iov - iovcount > IOV_MAX)) {
+			if (qcow_aio_submit(disk, queue, aio, write) < 0)
+				ret = -EIO;
+			aio = NULL;
 		}
 
-		sector	+= iov->iov_len >> SECTOR_SHIFT;
-		iov++;
-		total	+= nr;
+		if (!aio) {
+			aio = malloc(sizeof(*aio) + max_iov * sizeof(*aio->iov));
+			if (!aio) {
+				ret = -ENOMEM;
+				break;
+			}
+
+			*aio = (struct qcow_aio) {
+				.req	= req,
+				.offset	= host,
+			};
+		}
+
+		aio->iovcount = qcow_iter_slice(&it, len, aio->iov,
+						aio->iovcount);
+		aio->len += len;
 	}
 
-	return total;
+	if (aio && ret >= 0 && qcow_aio_submit(disk, queue, aio, write) < 0)
+		ret = -EIO;
+	else if (aio && ret < 0)
+		free(aio);
+
+	if (!async)
+		return ret;
+
+	/* Chunks still in flight complete the request */
+	qcow_req_put(req, ret);
+	return 0;
 }
 
-static int qcow_disk_flush(struct disk_image *disk)
+static ssize_t qcow2_read_sector(struct disk_image *disk, unsigned int queue,
+				 u64 sector, const struct iovec *iov,
+				 int iovcount, void *param)
 {
-	struct qcow *q = disk->priv;
-	struct qcow_refcount_table *rft;
-	struct list_head *pos, *n;
-	struct qcow_l1_table *l1t;
+	return qcow2_rw(disk, queue, sector, iov, iovcount, param, false,
+			disk->async);
+}
 
-	l1t = &q->table;
-	rft = &q->refcount_table;
+static ssize_t qcow2_write_sector(struct disk_image *disk, unsigned int queue,
+				  u64 sector, const struct iovec *iov,
+				  int iovcount, void *param)
+{
+	return qcow2_rw(disk, queue, sector, iov, iovcount, param, true,
+			disk->async);
+}
+
+/*
+ * Deallocate the cluster at offset. Unallocated clusters read back as zeroes,
+ * or from the backing file.
+ */
+static int qcow_discard_cluster(struct qcow *q, u64 offset)
+{
+	struct qcow_l1_table *l1t = &q->table;
+	struct qcow_cache_slice *l2s;
+	u64 l1t_idx, l2t_idx;
+	u64 entry;
+	int ret = 0;
+
+	l1t_idx = get_l1_index(q, offset);
+	if (l1t_idx >= l1t->table_size)
+		return -EINVAL;
 
 	mutex_lock(&q->mutex);
 
-	list_for_each_safe(pos, n, &rft->lru_list) {
-		struct qcow_refcount_block *c = list_entry(pos, struct qcow_refcount_block, list);
+	/* Nothing to release without an L2 table */
+	if (!l1t->l1_table[l1t_idx])
+		goto out;
 
-		if (write_refcount_block(q, c) < 0)
-			goto error_unlock;
+	if (get_cluster_table(q, offset, &l2s, &l2t_idx)) {
+		ret = -EIO;
+		goto out;
 	}
 
-	list_for_each_safe(pos, n, &l1t->lru_list) {
-		struct qcow_l2_table *c = list_entry(pos, struct qcow_l2_table, list);
+	entry = be64_to_cpu(((u64 *)l2s->data)[l2t_idx]);
+	if (!entry)
+		goto out;
 
-		if (qcow_l2_cache_write(q, c) < 0)
-			goto error_unlock;
-	}
+	((u64 *)l2s->data)[l2t_idx] = 0;
+	l2s->dirty = 1;
 
-	if (qcow_write_l1_table < 0)
-		goto error_unlock;
+	qcow_free_l2_entry(q, entry);
 
+out:
 	mutex_unlock(&q->mutex);
+	return ret;
+}
+
+static int qcow_write_zeroes(struct disk_image *disk, u64 offset, u64 end)
+{
+	struct qcow *q = disk->priv;
+	struct iovec iov;
+	u64 len;
+	int ret = 0;
+
+	iov.iov_base = calloc(1, q->cluster_size);
+	if (!iov.iov_base)
+		return -ENOMEM;
+
+	for (; offset < end; offset += len) {
+		len = min_t(u64, end - offset, q->cluster_size);
+		iov.iov_len = len;
+		if (qcow2_rw(disk, 0, offset >> SECTOR_SHIFT, &iov, 1, NULL,
+			     true, false) != (ssize_t)len) {
+			ret = -EIO;
+			break;
+		}
+	}
+
+	free(iov.iov_base);
+	return ret;
+}
+
+/*
+ * Only whole clusters can be released. The edges of a range that must read
+ * back as zeroes are written, and so is all of it when it may not be released.
+ */
+static int qcow_disk_discard(struct disk_image *disk, u64 sector,
+			     u64 nr_sectors, u32 flags)
+{
+	struct qcow *q = disk->priv;
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 end = offset + (nr_sectors << SECTOR_SHIFT);
+	u64 start = offset, stop = offset;
+	u64 clust;
+	int ret;
+
+	if (q->version != QCOW2_VERSION)
+		return -EOPNOTSUPP;
+
+	/* Released clusters would read from the backing file */
+	if (q->backing && (flags & DISK_DISCARD_ZERO))
+		flags &= ~DISK_DISCARD_UNMAP;
+
+	if (flags & DISK_DISCARD_UNMAP) {
+		start = ALIGN(offset, q->cluster_size);
+		stop = max(start, round_down(end, q->cluster_size));
+	}
+
+	for (clust = start; clust < stop; clust += q->cluster_size) {
+		ret = qcow_discard_cluster(q, clust);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (!(flags & DISK_DISCARD_ZERO))
+		return 0;
 
-	return fsync(disk->fd);
+	ret = qcow_write_zeroes(disk, offset, min(start, end));
+	if (!ret && stop < end)
+		ret = qcow_write_zeroes(disk, stop, end);
 
-error_unlock:
+	return ret;
+}
+
+static int qcow_disk_flush(struct disk_image *disk)
+{
+	struct qcow *q = disk->priv;
+	int ret;
+
+	mutex_lock(&q->mutex);
+	ret = qcow_write_metadata(q);
 	mutex_unlock(&q->mutex);
-	return -1;
+
+	if (ret < 0)
+		return ret;
+
+	return fdatasync(disk->fd);
 }
 
 static int qcow_disk_close(struct disk_image *disk)
 {
 	struct qcow *q;
+	int i;
 
 	if (!disk)
 		return 0;
 
 	q = disk->priv;
 
-	refcount_table_free_cache(&q->refcount_table);
-	l1_table_free_cache(&q->table);
+	if (disk->ops->write) {
+		mutex_lock(&q->mutex);
+		if (qcow_write_metadata(q) < 0)
+			pr_warning("Can't write back qcow metadata");
+
+		/* Return what's left of the preallocated run */
+		if (q->prealloc_start != q->prealloc_end) {
+			qcow_free_clusters(q, q->prealloc_start,
+					   q->prealloc_end - q->prealloc_start);
+			q->prealloc_start = q->prealloc_end;
+		}
+
+		if (qcow_write_metadata(q) < 0 || fdatasync(disk->fd) < 0)
+			pr_warning("Can't write back qcow metadata");
+		mutex_unlock(&q->mutex);
+	}
+
+	/*
+	 * Inflations hold references to guest requests. The thread pool may
+	 * already be gone, so finish those that didn't get to run here.
+	 */
+	for (i = 0; i < QCOW_MAX_INFLATE; i++) {
+		if (!q->inflate[i].data)
+			continue;
+
+		thread_pool__cancel_job(&q->inflate[i].job);
+		if (q->inflate[i].busy)
+			qcow_inflate_work(NULL, &q->inflate[i]);
+
+		free(q->inflate[i].cdata);
+		free(q->inflate[i].data);
+	}
+
+	if (q->backing)
+		disk_image__put_backing(q->backing);
+
+	qcow_cache_free(&q->inflated);
+	qcow_cache_free(&q->refcount_table.cache);
+	qcow_cache_free(&q->table.cache);
 	free(q->copy_buff);
 	free(q->cluster_data);
 	free(q->cluster_cache);
@@ -1179,16 +1809,66 @@ static int qcow_disk_close(struct disk_image *disk)
 	return 0;
 }
 
-static struct disk_image_operations qcow_disk_readonly_ops = {
+static void qcow_cache_stats(struct qcow_cache *c, const char *name,
+			     struct disk_stat_entry *entry)
+{
+	*entry = (struct disk_stat_entry) {
+		.type		= DISK_STAT_CACHE,
+		.size		= (u64)c->nr_slices * c->slice_size,
+		.hits		= c->hits,
+		.misses		= c->misses,
+		.evictions	= c->evictions,
+	};
+	strncpy(entry->cache, name, sizeof(entry->cache) - 1);
+}
+
+static int qcow_disk_stats(struct disk_image *disk,
+			   struct disk_stat_entry *entries)
+{
+	struct qcow *q = disk->priv;
+	int nr = 0;
+
+	mutex_lock(&q->mutex);
+	qcow_cache_stats(&q->table.cache, "l2", &entries[nr++]);
+	if (q->version == QCOW2_VERSION) {
+		qcow_cache_stats(&q->refcount_table.cache, "refcount",
+				 &entries[nr++]);
+		qcow_cache_stats(&q->inflated, "inflated", &entries[nr++]);
+	}
+	mutex_unlock(&q->mutex);
+
+	return nr;
+}
+
+static struct disk_image_operations qcow1_disk_ops = {
 	.read	= qcow_read_sector,
 	.close	= qcow_disk_close,
+	.stats	= qcow_disk_stats,
+};
+
+static struct disk_image_operations qcow_disk_readonly_ops = {
+	.read	= qcow2_read_sector,
+	.plug	= raw_image__plug,
+	.unplug	= raw_image__unplug,
+	.wait	= raw_image__wait,
+	.close	= qcow_disk_close,
+	.complete = qcow_aio_complete,
+	.stats	= qcow_disk_stats,
+	.async	= true,
 };
 
 static struct disk_image_operations qcow_disk_ops = {
-	.read	= qcow_read_sector,
-	.write	= qcow_write_sector,
+	.read	= qcow2_read_sector,
+	.write	= qcow2_write_sector,
 	.flush	= qcow_disk_flush,
+	.discard = qcow_disk_discard,
+	.plug	= raw_image__plug,
+	.unplug	= raw_image__unplug,
+	.wait	= raw_image__wait,
 	.close	= qcow_disk_close,
+	.complete = qcow_aio_complete,
+	.stats	= qcow_disk_stats,
+	.async	= true,
 };
 
 static int qcow_read_refcount_table(struct qcow *q)
@@ -1203,9 +1883,6 @@ static int qcow_read_refcount_table(struct qcow *q)
 	if (!rft->rf_table)
 		return -1;
 
-	rft->root = (struct rb_root) RB_ROOT;
-	INIT_LIST_HEAD(&rft->lru_list);
-
 	return pread_in_full(q->fd, rft->rf_table, sizeof(u64) * rft->rf_size, header->refcount_table_offset);
 }
 
@@ -1214,8 +1891,12 @@ static int qcow_write_refcount_table(struct qcow *q)
 	struct qcow_header *header = q->header;
 	struct qcow_refcount_table *rft = &q->refcount_table;
 
-	return qcow_pwrite_sync(q->fd, rft->rf_table,
-		rft->rf_size * sizeof(u64), header->refcount_table_offset);
+	if (pwrite_in_full(q->fd, rft->rf_table, rft->rf_size * sizeof(u64),
+			   header->refcount_table_offset) < 0)
+		return -1;
+
+	rft->dirty = false;
+	return 0;
 }
 
 static int qcow_read_l1_table(struct qcow *q)
@@ -1268,17 +1949,58 @@ static void *qcow2_read_header(int fd)
 		.l2_bits		= f_header.cluster_bits - 3,
 		.refcount_table_offset	= f_header.refcount_table_offset,
 		.refcount_table_size	= f_header.refcount_table_clusters,
+		.backing_file_offset	= f_header.backing_file_offset,
+		.backing_file_size	= f_header.backing_file_size,
 	};
 
 	return header;
 }
 
-static struct disk_image *qcow2_probe(int fd, bool readonly)
+/* A relative name of the backing file is relative to the image */
+static int qcow2_open_backing(struct qcow *q, const char *filename,
+			      u64 cache_size)
+{
+	struct qcow_header *h = q->header;
+	char name[PATH_MAX], path[PATH_MAX];
+	const char *sep;
+	int len;
+
+	if (h->backing_file_size >= sizeof(name))
+		return -ENAMETOOLONG;
+
+	if (pread_in_full(q->fd, name, h->backing_file_size,
+			  h->backing_file_offset) < 0)
+		return -errno;
+	name[h->backing_file_size] = '\0';
+
+	sep = strrchr(filename, '/');
+	if (name[0] != '/' && sep)
+		len = snprintf(path, sizeof(path), "%.*s/%s",
+			       (int)(sep - filename), filename, name);
+	else
+		len = snprintf(path, sizeof(path), "%s", name);
+	if (len >= (int)sizeof(path))
+		return -ENAMETOOLONG;
+
+	q->backing = disk_image__open_backing(path, cache_size);
+	if (IS_ERR_OR_NULL(q->backing)) {
+		pr_warning("Can't open backing file %s", path);
+		q->backing = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct disk_image *qcow2_probe(int fd, const char *filename,
+				      bool readonly, u64 cache_size)
 {
 	struct disk_image *disk_image;
 	struct qcow_l1_table *l1t;
 	struct qcow_header *h;
 	struct qcow *q;
+	u32 slice_size;
+	int i;
 
 	q = calloc(1, sizeof(struct qcow));
 	if (!q)
@@ -1287,10 +2009,14 @@ static struct disk_image *qcow2_probe(int fd, bool readonly)
 	mutex_init(&q->mutex);
 	q->fd = fd;
 
-	l1t = &q->table;
+	for (i = 0; i < QCOW_MAX_INFLATE; i++) {
+		q->inflate[i].q = q;
+		INIT_LIST_HEAD(&q->inflate[i].waiters);
+		thread_pool__init_job(&q->inflate[i].job, NULL,
+				      qcow_inflate_work, &q->inflate[i]);
+	}
 
-	l1t->root = (struct rb_root) RB_ROOT;
-	INIT_LIST_HEAD(&l1t->lru_list);
+	l1t = &q->table;
 
 	h = q->header = qcow2_read_header(fd);
 	if (!h)
@@ -1308,7 +2034,8 @@ static struct disk_image *qcow2_probe(int fd, bool readonly)
 		goto free_header;
 	}
 
-	q->cluster_data = malloc(q->cluster_size);
+	/* Compressed data may span one more cluster than it inflates to */
+	q->cluster_data = malloc(2 * q->cluster_size);
 	if (!q->cluster_data) {
 		pr_warning("cluster data malloc error");
 		goto free_copy_buff;
@@ -1320,12 +2047,27 @@ static struct disk_image *qcow2_probe(int fd, bool readonly)
 		goto free_cluster_data;
 	}
 
+	slice_size = min_t(u64, QCOW_CACHE_SLICE_SIZE, q->cluster_size);
+	if (qcow_cache_init(&l1t->cache, cache_size, slice_size,
+			    qcow_l2_cache_writeback) < 0 ||
+	    qcow_cache_init(&q->refcount_table.cache, cache_size / 4,
+			    slice_size, NULL) < 0 ||
+	    qcow_cache_init(&q->inflated, QCOW_INFLATED_CACHE_SIZE,
+			    q->cluster_size, NULL) < 0) {
+		pr_warning("metadata cache malloc error");
+		goto free_metadata_cache;
+	}
+
 	if (qcow_read_l1_table(q) < 0)
-		goto free_cluster_cache;
+		goto free_metadata_cache;
 
 	if (qcow_read_refcount_table(q) < 0)
 		goto free_l1_table;
 
+	if (h->backing_file_offset &&
+	    qcow2_open_backing(q, filename, cache_size) < 0)
+		goto free_refcount_table;
+
 	/*
 	 * Do not use mmap use read/write instead
 	 */
@@ -1335,19 +2077,25 @@ static struct disk_image *qcow2_probe(int fd, bool readonly)
 		disk_image = disk_image__new(fd, h->size, &qcow_disk_ops, DISK_IMAGE_REGULAR);
 
 	if (IS_ERR_OR_NULL(disk_image))
-		goto free_refcount_table;
+		goto put_backing;
 
 	disk_image->priv = q;
 
 	return disk_image;
 
+put_backing:
+	if (q->backing)
+		disk_image__put_backing(q->backing);
 free_refcount_table:
 	if (q->refcount_table.rf_table)
 		free(q->refcount_table.rf_table);
 free_l1_table:
 	if (q->table.l1_table)
 		free(q->table.l1_table);
-free_cluster_cache:
+free_metadata_cache:
+	qcow_cache_free(&q->inflated);
+	qcow_cache_free(&q->refcount_table.cache);
+	qcow_cache_free(&q->table.cache);
 	if (q->cluster_cache)
 		free(q->cluster_cache);
 free_cluster_data:
@@ -1418,12 +2166,13 @@ static void *qcow1_read_header(int fd)
 	return header;
 }
 
-static struct disk_image *qcow1_probe(int fd, bool readonly)
+static struct disk_image *qcow1_probe(int fd, bool readonly, u64 cache_size)
 {
 	struct disk_image *disk_image;
 	struct qcow_l1_table *l1t;
 	struct qcow_header *h;
 	struct qcow *q;
+	u32 slice_size;
 
 	q = calloc(1, sizeof(struct qcow));
 	if (!q)
@@ -1434,10 +2183,6 @@ static struct disk_image *qcow1_probe(int fd, bool readonly)
 
 	l1t = &q->table;
 
-	l1t->root = (struct rb_root)RB_ROOT;
-	INIT_LIST_HEAD(&l1t->lru_list);
-	INIT_LIST_HEAD(&q->refcount_table.lru_list);
-
 	h = q->header = qcow1_read_header(fd);
 	if (!h)
 		goto free_qcow;
@@ -1459,16 +2204,21 @@ static struct disk_image *qcow1_probe(int fd, bool readonly)
 		goto free_cluster_data;
 	}
 
+	/* L2 tables aren't a cluster in size */
+	slice_size = min_t(u64, QCOW_CACHE_SLICE_SIZE,
+			   (1ULL << h->l2_bits) * sizeof(u64));
+	if (qcow_cache_init(&l1t->cache, cache_size, slice_size, NULL) < 0) {
+		pr_warning("metadata cache malloc error");
+		goto free_metadata_cache;
+	}
+
 	if (qcow_read_l1_table(q) < 0)
-		goto free_cluster_cache;
+		goto free_metadata_cache;
 
 	/*
-	 * Do not use mmap use read/write instead
+	 * Do not use mmap use read/write instead. Only reading is supported.
 	 */
-	if (readonly)
-		disk_image = disk_image__new(fd, h->size, &qcow_disk_readonly_ops, DISK_IMAGE_REGULAR);
-	else
-		disk_image = disk_image__new(fd, h->size, &qcow_disk_ops, DISK_IMAGE_REGULAR);
+	disk_image = disk_image__new(fd, h->size, &qcow1_disk_ops, DISK_IMAGE_REGULAR);
 
 	if (!disk_image)
 		goto free_l1_table;
@@ -1480,7 +2230,8 @@ static struct disk_image *qcow1_probe(int fd, bool readonly)
 free_l1_table:
 	if (q->table.l1_table)
 		free(q->table.l1_table);
-free_cluster_cache:
+free_metadata_cache:
+	qcow_cache_free(&q->table.cache);
 	if (q->cluster_cache)
 		free(q->cluster_cache);
 free_cluster_data:
@@ -1514,13 +2265,18 @@ static bool qcow1_check_image(int fd)
 	return true;
 }
 
-struct disk_image *qcow_probe(int fd, bool readonly)
+/* cache_size is the size of the L2 cache in bytes, or 0 for the default */
+struct disk_image *qcow_probe(int fd, const char *filename, bool readonly,
+			      u64 cache_size)
 {
+	if (!cache_size)
+		cache_size = QCOW_CACHE_SIZE;
+
 	if (qcow1_check_image(fd))
-		return qcow1_probe(fd, readonly);
+		return qcow1_probe(fd, readonly, cache_size);
 
 	if (qcow2_check_image(fd))
-		return qcow2_probe(fd, readonly);
+		return qcow2_probe(fd, filename, readonly, cache_size);
 
 	return NULL;
 }
@@ -1,22 +1,27 @@
 #include "kvm/disk-image.h"
+#include "kvm/iovec.h"
 
 #include <linux/err.h>
+#include <linux/falloc.h>
+#include <linux/kernel.h>
 
-ssize_t raw_image__read_sync(struct disk_image *disk, u64 sector, const struct iovec *iov,
-				int iovcount, void *param)
+ssize_t raw_image__read_sync(struct disk_image *disk, unsigned int queue,
+			     u64 sector, const struct iovec *iov, int iovcount,
+			     void *param)
 {
 	return preadv_in_full(disk->fd, iov, iovcount, sector << SECTOR_SHIFT);
 }
 
-ssize_t raw_image__write_sync(struct disk_image *disk, u64 sector,
-			      const struct iovec *iov, int iovcount,
+ssize_t raw_image__write_sync(struct disk_image *disk, unsigned int queue,
+			      u64 sector, const struct iovec *iov, int iovcount,
 			      void *param)
 {
 	return pwritev_in_full(disk->fd, iov, iovcount, sector << SECTOR_SHIFT);
 }
 
-ssize_t raw_image__read_mmap(struct disk_image *disk, u64 sector, const struct iovec *iov,
-				int iovcount, void *param)
+ssize_t raw_image__read_mmap(struct disk_image *disk, unsigned int queue,
+			     u64 sector, const struct iovec *iov, int iovcount,
+			     void *param)
 {
 	u64 offset = sector << SECTOR_SHIFT;
 	ssize_t total = 0;
@@ -33,8 +38,9 @@ ssize_t raw_image__read_mmap(struct disk_image *disk, u64 sector, const struct i
 	return total;
 }
 
-ssize_t raw_image__write_mmap(struct disk_image *disk, u64 sector, const struct iovec *iov,
-				int iovcount, void *param)
+ssize_t raw_image__write_mmap(struct disk_image *disk, unsigned int queue,
+			      u64 sector, const struct iovec *iov, int iovcount,
+			      void *param)
 {
 	u64 offset = sector << SECTOR_SHIFT;
 	ssize_t total = 0;
@@ -51,6 +57,413 @@ ssize_t raw_image__write_mmap(struct disk_image *disk, u64 sector, const struct
 	return total;
 }
 
+/*
+ * For filesystems that can't zero a range without writing it. @align is the
+ * block size of disks opened with O_DIRECT, 0 otherwise.
+ */
+int raw_image__write_zeroes(int fd, u64 offset, u64 len, u32 align)
+{
+	size_t size = max_t(size_t, 64 * 1024, align);
+	void *zeroes;
+	ssize_t nr;
+	int ret = 0;
+
+	if (posix_memalign(&zeroes, max_t(size_t, align, sizeof(void *)), size))
+		return -ENOMEM;
+	memset(zeroes, 0, size);
+
+	while (len) {
+		nr = pwrite_in_full(fd, zeroes, min_t(u64, len, size), offset);
+		if (nr < 0) {
+			ret = -errno;
+			break;
+		}
+
+		offset	+= nr;
+		len	-= nr;
+	}
+
+	free(zeroes);
+	return ret;
+}
+
+int raw_image__discard(struct disk_image *disk, u64 sector, u64 nr_sectors,
+		       u32 flags)
+{
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 len = nr_sectors << SECTOR_SHIFT;
+	int mode = FALLOC_FL_KEEP_SIZE;
+
+	/* Holes read back as zeroes */
+	if (flags & DISK_DISCARD_UNMAP)
+		mode |= FALLOC_FL_PUNCH_HOLE;
+	else
+		mode |= FALLOC_FL_ZERO_RANGE;
+
+	if (!fallocate(disk->fd, mode, offset, len))
+		return 0;
+
+	if (errno != EOPNOTSUPP)
+		return -errno;
+
+	/* Discarding is only a hint */
+	if (!(flags & DISK_DISCARD_ZERO))
+		return 0;
+
+	return raw_image__write_zeroes(disk->fd, offset, len, disk->block_size);
+}
+
+/*
+ * Sparse raw images. Reads that only cover holes are zero-filled, and reads
+ * partly in holes only read the part from the first chunk with data to the
+ * last one.
+ */
+static void raw_extents_set(struct raw_extents *ext, u64 first, u64 end,
+			    u8 state)
+{
+	u8 unknown;
+
+	for (; first < end && first < ext->nr_chunks; first++) {
+		unknown = RAW_EXTENT_UNKNOWN;
+		__atomic_compare_exchange_n(&ext->map[first], &unknown, state,
+					    false, __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED);
+	}
+}
+
+/* Chunks that a write is about to fill, before it is submitted */
+static void raw_extents_write(struct disk_image *disk, u64 offset, u64 len)
+{
+	struct raw_extents *ext = disk->extents;
+	u64 chunk, end;
+
+	if (!ext || !len)
+		return;
+
+	end = min((offset + len - 1) >> RAW_EXTENT_SHIFT, ext->nr_chunks - 1);
+	for (chunk = offset >> RAW_EXTENT_SHIFT; chunk <= end; chunk++) {
+		if (__atomic_load_n(&ext->map[chunk], __ATOMIC_RELAXED) !=
+		    RAW_EXTENT_DATA)
+			__atomic_store_n(&ext->map[chunk], RAW_EXTENT_DATA,
+					 __ATOMIC_RELAXED);
+	}
+}
+
+/* Find out whether a chunk is a hole, along with the chunks around it */
+static u8 raw_extents_get(struct disk_image *disk, u64 chunk)
+{
+	struct raw_extents *ext = disk->extents;
+	u64 start = chunk << RAW_EXTENT_SHIFT;
+	off_t data, hole;
+	u8 state;
+
+	state = __atomic_load_n(&ext->map[chunk], __ATOMIC_RELAXED);
+	if (state != RAW_EXTENT_UNKNOWN)
+		return state;
+
+	data = lseek(disk->fd, start, SEEK_DATA);
+	if (data < 0 && errno == ENXIO)
+		data = disk->size;
+
+	/* Without SEEK_DATA, everything is data */
+	if (data < 0) {
+		raw_extents_set(ext, 0, ext->nr_chunks, RAW_EXTENT_DATA);
+	} else if ((u64)data >= min(start + (1 << RAW_EXTENT_SHIFT),
+				    disk->size)) {
+		/* A partial chunk at the end of the hole has data */
+		raw_extents_set(ext, chunk, (u64)data >> RAW_EXTENT_SHIFT,
+				RAW_EXTENT_HOLE);
+		if ((u64)data >= disk->size)
+			raw_extents_set(ext, chunk, ext->nr_chunks,
+					RAW_EXTENT_HOLE);
+	} else {
+		hole = lseek(disk->fd, data, SEEK_HOLE);
+		if (hole < data)
+			hole = data + 1;
+		raw_extents_set(ext, chunk, DIV_ROUND_UP((u64)hole,
+							 1 << RAW_EXTENT_SHIFT),
+				RAW_EXTENT_DATA);
+	}
+
+	return __atomic_load_n(&ext->map[chunk], __ATOMIC_RELAXED);
+}
+
+/* Zero len bytes of the guest buffers, from offset into them */
+static void raw_iov_zero(const struct iovec *iov, u64 offset, u64 len)
+{
+	u64 n;
+
+	for (; len; iov++) {
+		if (offset >= iov->iov_len) {
+			offset -= iov->iov_len;
+			continue;
+		}
+
+		n = min(len, iov->iov_len - offset);
+		memset(iov->iov_base + offset, 0, n);
+		len -= n;
+		offset = 0;
+	}
+}
+
+/* The guest buffers for len bytes, from offset into them */
+static int raw_iov_slice(const struct iovec *iov, u64 offset, u64 len,
+			 struct iovec *slice)
+{
+	int nr = 0;
+	u64 n;
+
+	for (; len; iov++) {
+		if (offset >= iov->iov_len) {
+			offset -= iov->iov_len;
+			continue;
+		}
+
+		n = min(len, iov->iov_len - offset);
+		slice[nr++] = (struct iovec) {
+			.iov_base	= iov->iov_base + offset,
+			.iov_len	= n,
+		};
+		len -= n;
+		offset = 0;
+	}
+
+	return nr;
+}
+
+static struct raw_split_read *raw_split_get(struct raw_extents *ext)
+{
+	int i;
+
+	for (i = 0; i < RAW_SPLIT_READS; i++) {
+		if (!__atomic_exchange_n(&ext->splits[i].busy, true,
+					 __ATOMIC_ACQUIRE))
+			return &ext->splits[i];
+	}
+
+	return NULL;
+}
+
+static void raw_split_put(struct raw_split_read *split)
+{
+	free(split->iov);
+	split->iov = NULL;
+	__atomic_store_n(&split->busy, false, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns false when the read must be submitted as it is. Otherwise, ret is
+ * what the read returns.
+ */
+static bool raw_image__read_sparse(struct disk_image *disk, unsigned int queue,
+				   u64 sector, const struct iovec *iov,
+				   int iovcount, void *param, ssize_t *ret)
+{
+	struct raw_extents *ext = disk->extents;
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 total = iov_size(iov, iovcount);
+	struct raw_split_read *split = NULL;
+	u64 first, last, start, end;
+	struct iovec *slice;
+	int nr;
+
+	if (!total || offset + total > disk->size)
+		return false;
+
+	first = offset >> RAW_EXTENT_SHIFT;
+	last = (offset + total - 1) >> RAW_EXTENT_SHIFT;
+
+	while (first <= last && raw_extents_get(disk, first) == RAW_EXTENT_HOLE)
+		first++;
+	while (last > first && raw_extents_get(disk, last) == RAW_EXTENT_HOLE)
+		last--;
+
+	if (first > last) {
+		raw_iov_zero(iov, 0, total);
+		*ret = total;
+		if (disk->async) {
+			disk_image__complete(disk, param, total);
+			*ret = 0;
+		}
+		return true;
+	}
+
+	start = max(offset, first << RAW_EXTENT_SHIFT);
+	end = min(offset + total, (last + 1) << RAW_EXTENT_SHIFT);
+	if (start == offset && end == offset + total)
+		return false;
+
+	slice = malloc(iovcount * sizeof(*slice));
+	if (!slice)
+		return false;
+
+	if (disk->async) {
+		split = raw_split_get(ext);
+		if (!split) {
+			free(slice);
+			return false;
+		}
+	}
+
+	raw_iov_zero(iov, 0, start - offset);
+	raw_iov_zero(iov, end - offset, offset + total - end);
+	nr = raw_iov_slice(iov, start - offset, end - start, slice);
+
+	if (!split) {
+		*ret = preadv_in_full(disk->fd, slice, nr, start);
+		free(slice);
+		if (*ret >= 0)
+			*ret = *ret == (ssize_t)(end - start) ? (ssize_t)total :
+								-EIO;
+		return true;
+	}
+
+	*split = (struct raw_split_read) {
+		.busy	= true,
+		.param	= param,
+		.len	= end - start,
+		.total	= total,
+		.iov	= slice,
+	};
+
+	sector = start >> SECTOR_SHIFT;
+	if (disk->uring)
+		*ret = raw_image__read_uring(disk, queue, sector, slice, nr,
+					     split);
+	else
+		*ret = raw_image__read_async(disk, queue, sector, slice, nr,
+					     split);
+	return true;
+}
+
+/* Reads partly in holes and bounced requests complete as the guest's */
+void raw_image__complete(struct disk_image *disk, void *param, long len)
+{
+	struct raw_extents *ext = disk->extents;
+	struct raw_split_read *split = param;
+
+	if (disk_bounce_complete(disk, &param, &len)) {
+		disk->disk_req_cb(param, len);
+		return;
+	}
+
+	if (ext && split >= ext->splits &&
+	    split < ext->splits + RAW_SPLIT_READS) {
+		param = split->param;
+		if (len >= 0)
+			len = len == (long)split->len ? (long)split->total : -EIO;
+		raw_split_put(split);
+	}
+
+	disk->disk_req_cb(param, len);
+}
+
+static void raw_image__init_extents(struct disk_image *disk, struct stat *st)
+{
+	struct raw_extents *ext;
+
+	if (!S_ISREG(st->st_mode) || !disk->size)
+		return;
+
+	ext = calloc(1, sizeof(*ext));
+	if (!ext)
+		return;
+
+	ext->nr_chunks = DIV_ROUND_UP(disk->size, 1 << RAW_EXTENT_SHIFT);
+	ext->map = calloc(ext->nr_chunks, 1);
+	if (!ext->map) {
+		free(ext);
+		return;
+	}
+
+	disk->extents = ext;
+}
+
+void raw_image__free_extents(struct disk_image *disk)
+{
+	if (!disk->extents)
+		return;
+
+	free(disk->extents->map);
+	free(disk->extents);
+	disk->extents = NULL;
+}
+
+/* Requests go through io_uring or libaio when the disk was set up for it */
+ssize_t raw_image__read(struct disk_image *disk, unsigned int queue,
+			u64 sector, const struct iovec *iov, int iovcount,
+			void *param)
+{
+	ssize_t ret;
+
+	if (disk->block_size &&
+	    disk_bounce_needed(disk, sector, iov, iovcount))
+		return disk_bounce_read(disk, queue, sector, iov, iovcount,
+					param);
+
+	if (disk->extents &&
+	    raw_image__read_sparse(disk, queue, sector, iov, iovcount, param,
+				   &ret))
+		return ret;
+
+	if (disk->uring)
+		return raw_image__read_uring(disk, queue, sector, iov, iovcount,
+					     param);
+	if (disk->async)
+		return raw_image__read_async(disk, queue, sector, iov, iovcount,
+					     param);
+
+	return raw_image__read_sync(disk, queue, sector, iov, iovcount, param);
+}
+
+ssize_t raw_image__write(struct disk_image *disk, unsigned int queue,
+			 u64 sector, const struct iovec *iov, int iovcount,
+			 void *param)
+{
+	raw_extents_write(disk, sector << SECTOR_SHIFT,
+			  iov_size(iov, iovcount));
+
+	if (disk->block_size &&
+	    disk_bounce_needed(disk, sector, iov, iovcount))
+		return disk_bounce_write(disk, queue, sector, iov, iovcount,
+					 param);
+
+	if (disk->uring)
+		return raw_image__write_uring(disk, queue, sector, iov,
+					      iovcount, param);
+	if (disk->async)
+		return raw_image__write_async(disk, queue, sector, iov,
+					      iovcount, param);
+
+	return raw_image__write_sync(disk, queue, sector, iov, iovcount, param);
+}
+
+void raw_image__plug(struct disk_image *disk, unsigned int queue)
+{
+	if (disk->uring)
+		disk_uring_plug(disk, queue);
+	else if (disk->async)
+		disk_aio_plug(disk, queue);
+}
+
+int raw_image__unplug(struct disk_image *disk, unsigned int queue)
+{
+	if (disk->uring)
+		return disk_uring_unplug(disk, queue);
+	if (disk->async)
+		return disk_aio_unplug(disk, queue);
+
+	return 0;
+}
+
+int raw_image__wait(struct disk_image *disk)
+{
+	if (disk->uring)
+		return disk_uring_wait(disk);
+
+	return disk_aio_wait(disk);
+}
+
 int raw_image__close(struct disk_image *disk)
 {
 	int ret = 0;
@@ -67,7 +480,11 @@ int raw_image__close(struct disk_image *disk)
 static struct disk_image_operations raw_image_regular_ops = {
 	.read	= raw_image__read,
 	.write	= raw_image__write,
+	.discard = raw_image__discard,
+	.plug	= raw_image__plug,
+	.unplug	= raw_image__unplug,
 	.wait	= raw_image__wait,
+	.complete = raw_image__complete,
 	.async	= true,
 };
 
@@ -79,7 +496,10 @@ struct disk_image_operations ro_ops = {
 
 struct disk_image_operations ro_ops_nowrite = {
 	.read	= raw_image__read,
+	.plug	= raw_image__plug,
+	.unplug	= raw_image__unplug,
 	.wait	= raw_image__wait,
+	.complete = raw_image__complete,
 	.async	= true,
 };
 
@@ -95,6 +515,10 @@ struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly)
 		disk = disk_image__new(fd, st->st_size, &ro_ops, DISK_IMAGE_MMAP);
 		if (IS_ERR_OR_NULL(disk)) {
 			disk = disk_image__new(fd, st->st_size, &ro_ops_nowrite, DISK_IMAGE_REGULAR);
+			if (!IS_ERR_OR_NULL(disk)) {
+				raw_image__init_extents(disk, st);
+				disk_bounce_init(disk);
+			}
 		}
 
 		return disk;
@@ -102,6 +526,14 @@ struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly)
 		/*
 		 * Use read/write instead of mmap
 		 */
-		return disk_image__new(fd, st->st_size, &raw_image_regular_ops, DISK_IMAGE_REGULAR);
+		struct disk_image *disk;
+
+		disk = disk_image__new(fd, st->st_size, &raw_image_regular_ops, DISK_IMAGE_REGULAR);
+		if (!IS_ERR_OR_NULL(disk)) {
+			raw_image__init_extents(disk, st);
+			disk_bounce_init(disk);
+		}
+
+		return disk;
 	}
 }
@@ -1,7 +1,9 @@
 #include "kvm/8250-serial.h"
 
 #include "kvm/read-write.h"
+#include "kvm/kvm-cpu.h"
 #include "kvm/ioport.h"
+#include "kvm/epoll.h"
 #include "kvm/mutex.h"
 #include "kvm/util.h"
 #include "kvm/term.h"
@@ -12,6 +14,7 @@
 #include <linux/serial_reg.h>
 
 #include <pthread.h>
+#include <sys/timerfd.h>
 
 #if defined(CONFIG_ARM) || defined(CONFIG_ARM64)
 #define serial_iobase(nr)	(ARM_UART_MMIO_BASE + (nr) * 0x1000)
@@ -44,6 +47,13 @@
 
 #define UART_IIR_TYPE_BITS	0xc0
 
+/*
+ * Transmitted bytes are buffered, and written to the terminal by a background
+ * thread at this interval or when the buffer fills up. Writes to THR are
+ * coalesced by KVM when possible, and replayed by the same thread.
+ */
+#define SERIAL8250_TX_FLUSH_NS	(10 * 1000 * 1000)
+
 struct serial8250_device {
 	struct device_header	dev_hdr;
 	struct mutex		mutex;
@@ -142,6 +152,9 @@ static struct serial8250_device devices[] = {
 	},
 };
 
+static struct kvm__epoll serial8250_epoll;
+static int serial8250_timer_fd = -1;
+
 static void serial8250_flush_tx(struct kvm *kvm, struct serial8250_device *dev)
 {
 	dev->lsr |= UART_LSR_TEMT | UART_LSR_THRE;
@@ -163,11 +176,10 @@ static void serial8250_update_irq(struct kvm *kvm, struct serial8250_device *dev
 		dev->lsr &= ~UART_LSR_DR;
 	}
 
-	/* Handle clear tx */
+	/* Handle clear tx, the guest already saw buffered bytes go out */
 	if (dev->lcr & UART_FCR_CLEAR_XMIT) {
 		dev->lcr &= ~UART_FCR_CLEAR_XMIT;
-		dev->txcnt = 0;
-		dev->lsr |= UART_LSR_TEMT | UART_LSR_THRE;
+		serial8250_flush_tx(kvm, dev);
 	}
 
 	/* Data ready and rcv interrupt enabled ? */
@@ -189,14 +201,6 @@ static void serial8250_update_irq(struct kvm *kvm, struct serial8250_device *dev
 			kvm__irq_line(kvm, dev->irq, 1);
 	}
 	dev->irq_state = iir;
-
-	/*
-	 * If the kernel disabled the tx interrupt, we know that there
-	 * is nothing more to transmit, so we can reset our tx logic
-	 * here.
-	 */
-	if (!(dev->ier & UART_IER_THRI))
-		serial8250_flush_tx(kvm, dev);
 }
 
 #define SYSRQ_PENDING_NONE		0
@@ -288,16 +292,13 @@ static bool serial8250_out(struct serial8250_device *dev, struct kvm_cpu *vcpu,
 			break;
 		}
 
-		if (dev->txcnt < FIFO_LEN) {
-			dev->txbuf[dev->txcnt++] = *addr;
-			dev->lsr &= ~UART_LSR_TEMT;
-			if (dev->txcnt == FIFO_LEN / 2)
-				dev->lsr &= ~UART_LSR_THRE;
+		/*
+		 * The transmitter always looks empty to the guest, so that it
+		 * never has to wait for us to write to the terminal.
+		 */
+		dev->txbuf[dev->txcnt++] = *addr;
+		if (dev->txcnt == FIFO_LEN)
 			serial8250_flush_tx(vcpu->kvm, dev);
-		} else {
-			/* Should never happpen */
-			dev->lsr &= ~(UART_LSR_TEMT | UART_LSR_THRE);
-		}
 		break;
 	case UART_IER:
 		if (!(dev->lcr & UART_LCR_DLAB))
@@ -452,9 +453,91 @@ void serial8250_generate_fdt_node(void *fdt, struct device_header *dev_hdr,
 }
 #endif
 
+static void serial8250__flush(struct kvm *kvm, struct epoll_event *ev)
+{
+	unsigned int i;
+	u64 expirations;
+
+	if (read(serial8250_timer_fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	/* Replay the THR writes that KVM coalesced since the last exit */
+	kvm_cpu__flush_coalesced_io(kvm);
+
+	for (i = 0; i < ARRAY_SIZE(devices); i++) {
+		struct serial8250_device *dev = &devices[i];
+
+		if (!__atomic_load_n(&dev->txcnt, __ATOMIC_RELAXED))
+			continue;
+
+		mutex_lock(&dev->mutex);
+		serial8250_flush_tx(kvm, dev);
+		mutex_unlock(&dev->mutex);
+	}
+}
+
+static int serial8250__flush_init(struct kvm *kvm)
+{
+	struct itimerspec its = {
+		.it_value.tv_nsec	= SERIAL8250_TX_FLUSH_NS,
+		.it_interval.tv_nsec	= SERIAL8250_TX_FLUSH_NS,
+	};
+	struct epoll_event ev = {
+		.events		= EPOLLIN,
+	};
+	int r;
+
+	serial8250_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					     TFD_NONBLOCK | TFD_CLOEXEC);
+	if (serial8250_timer_fd < 0)
+		return -errno;
+
+	r = epoll__init(kvm, &serial8250_epoll, "serial8250-tx",
+			serial8250__flush);
+	if (r < 0)
+		goto err_close_timer;
+
+	if (epoll_ctl(serial8250_epoll.fd, EPOLL_CTL_ADD, serial8250_timer_fd,
+		      &ev) < 0 ||
+	    timerfd_settime(serial8250_timer_fd, 0, &its, NULL) < 0) {
+		r = -errno;
+		epoll__exit(&serial8250_epoll);
+		goto err_close_timer;
+	}
+
+	return 0;
+
+err_close_timer:
+	close(serial8250_timer_fd);
+	serial8250_timer_fd = -1;
+	return r;
+}
+
+static void serial8250__flush_exit(struct kvm *kvm)
+{
+	unsigned int i;
+
+	if (serial8250_timer_fd < 0)
+		return;
+
+	epoll__exit(&serial8250_epoll);
+	close(serial8250_timer_fd);
+	serial8250_timer_fd = -1;
+
+	kvm_cpu__flush_coalesced_io(kvm);
+
+	for (i = 0; i < ARRAY_SIZE(devices); i++) {
+		mutex_lock(&devices[i].mutex);
+		serial8250_flush_tx(kvm, &devices[i]);
+		mutex_unlock(&devices[i].mutex);
+	}
+}
+
 static int serial8250__device_init(struct kvm *kvm,
 				   struct serial8250_device *dev)
 {
+	unsigned int thr_flags = SERIAL8250_BUS_TYPE;
+	unsigned int cap = KVM_CAP_COALESCED_PIO;
 	int r;
 
 	r = device__register(&dev->dev_hdr);
@@ -462,8 +545,27 @@ static int serial8250__device_init(struct kvm *kvm,
 		return r;
 
 	ioport__map_irq(&dev->irq);
-	r = kvm__register_iotrap(kvm, dev->iobase, 8, serial8250_mmio, dev,
+
+	/*
+	 * Guests writing to the console would otherwise exit for every
+	 * character. Let KVM queue writes to THR, they are replayed before
+	 * the next access to the UART is emulated so that registers such as
+	 * LSR always reflect them.
+	 */
+	if (SERIAL8250_BUS_TYPE == DEVICE_BUS_MMIO)
+		cap = KVM_CAP_COALESCED_MMIO;
+	if (kvm__supports_extension(kvm, cap))
+		thr_flags |= IOTRAP_COALESCE;
+
+	r = kvm__register_iotrap(kvm, dev->iobase, 1, serial8250_mmio, dev,
+				 thr_flags);
+	if (r < 0)
+		return r;
+
+	r = kvm__register_iotrap(kvm, dev->iobase + 1, 7, serial8250_mmio, dev,
 				 SERIAL8250_BUS_TYPE);
+	if (r < 0)
+		kvm__deregister_iotrap(kvm, dev->iobase, SERIAL8250_BUS_TYPE);
 
 	return r;
 }
@@ -481,12 +583,18 @@ int serial8250__init(struct kvm *kvm)
 			goto cleanup;
 	}
 
+	r = serial8250__flush_init(kvm);
+	if (r < 0)
+		goto cleanup;
+
 	return r;
 cleanup:
-	for (j = 0; j <= i; j++) {
+	for (j = 0; j <= i && j < ARRAY_SIZE(devices); j++) {
 		struct serial8250_device *dev = &devices[j];
 
 		kvm__deregister_iotrap(kvm, dev->iobase, SERIAL8250_BUS_TYPE);
+		kvm__deregister_iotrap(kvm, dev->iobase + 1,
+				       SERIAL8250_BUS_TYPE);
 		device__unregister(&dev->dev_hdr);
 	}
 
@@ -497,15 +605,15 @@ dev_init(serial8250__init);
 int serial8250__exit(struct kvm *kvm)
 {
 	unsigned int i;
-	int r;
+
+	serial8250__flush_exit(kvm);
 
 	for (i = 0; i < ARRAY_SIZE(devices); i++) {
 		struct serial8250_device *dev = &devices[i];
 
-		r = kvm__deregister_iotrap(kvm, dev->iobase,
-					   SERIAL8250_BUS_TYPE);
-		if (r < 0)
-			return r;
+		kvm__deregister_iotrap(kvm, dev->iobase, SERIAL8250_BUS_TYPE);
+		kvm__deregister_iotrap(kvm, dev->iobase + 1,
+				       SERIAL8250_BUS_TYPE);
 		device__unregister(&dev->dev_hdr);
 	}
 
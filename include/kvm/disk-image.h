@@ -1,6 +1,7 @@
 #ifndef KVM__DISK_IMAGE_H
 #define KVM__DISK_IMAGE_H
 
+#include "kvm/mutex.h"
 #include "kvm/read-write.h"
 #include "kvm/util.h"
 #include "kvm/parse-options.h"
@@ -13,7 +14,7 @@
 #include <sys/stat.h>
 #include <stdbool.h>
 #include <sys/uio.h>
-#include <stdbool.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -33,16 +34,138 @@ enum {
 
 #define MAX_DISK_IMAGES         4
 
+/* Flags of disk_image_operations::discard() */
+#define DISK_DISCARD_ZERO	(1 << 0)	/* The range must read back as zeroes */
+#define DISK_DISCARD_UNMAP	(1 << 1)	/* Its storage may be released */
+
+/* Holes of sparse raw images are tracked in chunks of this size */
+#define RAW_EXTENT_SHIFT	16
+/* Reads partly in holes that can be in flight at once, per disk */
+#define RAW_SPLIT_READS		32
+
+enum {
+	RAW_EXTENT_UNKNOWN,
+	RAW_EXTENT_HOLE,
+	RAW_EXTENT_DATA,
+};
+
+/* The data part of a read partly in holes, completed as the whole read */
+struct raw_split_read {
+	bool				busy;
+	void				*param;
+	u64				len;
+	u64				total;
+	struct iovec			*iov;
+};
+
+/*
+ * A RAW_EXTENT_* per chunk, built as reads find out with SEEK_DATA. Chunks
+ * only change from unknown, or to data when written, so that a hole found
+ * while a write is in flight can't hide it.
+ */
+struct raw_extents {
+	u8				*map;
+	u64				nr_chunks;
+	struct raw_split_read		splits[RAW_SPLIT_READS];
+};
+
+/* Aligned buffers per queue of a disk opened with O_DIRECT */
+#define DISK_BOUNCE_SLOTS	16
+/* Larger requests get a buffer of their own */
+#define DISK_BOUNCE_SIZE	(64 * 1024)
+
+/* A request that goes through an aligned buffer */
+struct disk_bounce_req {
+	bool				busy;
+	void				*param;
+	/* Buffer of the slot in the pool, NULL without a pool */
+	void				*pool;
+	/* That buffer, or one allocated for the request */
+	void				*buf;
+	struct iovec			iov;
+	/* Guest buffers that a read is copied to when it completes */
+	struct iovec			*guest;
+	u64				head;
+	u64				total;
+};
+
+struct disk_bounce {
+	void				*pool;
+	struct disk_bounce_req		reqs[DISK_BOUNCE_SLOTS];
+	/* Updated by the submitter of the queue only */
+	u64				pooled;
+	u64				allocated;
+	u64				rmw;
+};
+
+/* Metadata caches and bounce buffers reported per disk */
+#define DISK_STAT_MAX_CACHES	4
+
+enum disk_stat_type {
+	DISK_STAT_CACHE,
+	DISK_STAT_BOUNCE,
+};
+
+/* Reply to KVM_IPC_DISK_STAT is a u32 count followed by the entries */
+struct disk_stat_entry {
+	u32				disk;
+	u32				type;
+	char				cache[12];
+	u64				size;
+	union {
+		/* Metadata caches of image formats */
+		struct {
+			u64		hits;
+			u64		misses;
+			u64		evictions;
+		};
+		/* Bounce buffers of O_DIRECT disks */
+		struct {
+			/* Requests that used a buffer of the pool */
+			u64		pooled;
+			/* Requests that allocated their own */
+			u64		allocated;
+			/* Writes that read the blocks at their ends */
+			u64		rmw;
+		};
+	};
+};
+
 struct disk_image;
+struct disk_uring;
+struct kvm;
 
+/*
+ * Requests are submitted on a queue, from a single thread per queue.
+ * Asynchronous completions of a queue are reported by the thread of its
+ * backend, except for QCOW reads of compressed clusters, completed by the
+ * thread pool. Each of those ends its own batch, so the batch callback must
+ * serialize with the one of the backend.
+ */
 struct disk_image_operations {
-	ssize_t (*read)(struct disk_image *disk, u64 sector, const struct iovec *iov,
-			int iovcount, void *param);
-	ssize_t (*write)(struct disk_image *disk, u64 sector, const struct iovec *iov,
-			int iovcount, void *param);
+	ssize_t (*read)(struct disk_image *disk, unsigned int queue, u64 sector,
+			const struct iovec *iov, int iovcount, void *param);
+	ssize_t (*write)(struct disk_image *disk, unsigned int queue, u64 sector,
+			 const struct iovec *iov, int iovcount, void *param);
 	int (*flush)(struct disk_image *disk);
+	/* Synchronous, with DISK_DISCARD_* flags */
+	int (*discard)(struct disk_image *disk, u64 sector, u64 nr_sectors,
+		       u32 flags);
+	/*
+	 * Requests submitted on a plugged queue may be held back, until it
+	 * is unplugged or the backend can't hold more.
+	 */
+	void (*plug)(struct disk_image *disk, unsigned int queue);
+	int (*unplug)(struct disk_image *disk, unsigned int queue);
 	int (*wait)(struct disk_image *disk);
 	int (*close)(struct disk_image *disk);
+	/*
+	 * Completion of a request that the image format split off and handed
+	 * to the backend itself, instead of disk_req_cb().
+	 */
+	void (*complete)(struct disk_image *disk, void *param, long len);
+	/* Fills up to DISK_STAT_MAX_CACHES entries, returns how many */
+	int (*stats)(struct disk_image *disk, struct disk_stat_entry *entries);
 	bool async;
 };
 
@@ -52,7 +175,42 @@ struct disk_image_params {
 	const char *wwpn;
 	bool readonly;
 	bool direct;
+	/* virtio-blk busy-polling budget in microseconds */
+	u32 poll_us;
+	/* Largest virtio-blk queue offered to the driver */
+	u16 queue_size;
+	/* Number of virtio-blk queues, 0 for one per VCPU */
+	u16 num_queues;
+	/* Submit through io_uring rather than libaio */
+	bool io_uring;
+	/* Let a kernel thread poll the io_uring submission queues */
+	bool sqpoll;
+	/* Register guest RAM with each io_uring queue, pinning it */
+	bool fixed_bufs;
+	/* Size of the metadata cache of image formats, 0 for the default */
+	u64 cache_size;
+	/* Copy clusters read from a backing file to the image */
+	bool copy_on_read;
+};
+
+#ifdef CONFIG_HAS_AIO
+#define AIO_MAX 256
+
+/* Submission and completion context of a queue */
+struct disk_aio {
+	struct disk_image		*disk;
+	unsigned int			queue;
+	io_context_t			ctx;
+	int				evt;
+	pthread_t			thread;
+	u64				inflight;
+	/* Requests held back until the queue is unplugged */
+	bool				plugged;
+	int				nr_pending;
+	struct iocb			*pending[AIO_MAX];
+	struct iocb			iocbs[AIO_MAX];
 };
+#endif /* CONFIG_HAS_AIO */
 
 struct disk_image {
 	int				fd;
@@ -61,59 +219,146 @@ struct disk_image {
 	void				*priv;
 	void				*disk_req_cb_param;
 	void				(*disk_req_cb)(void *param, long len);
+	/*
+	 * Called with disk_req_cb_param after a batch of asynchronous
+	 * completions of a queue. Synchronous completions run in the
+	 * submitter's context, which ends the batch itself.
+	 */
+	void				(*disk_req_batch_cb)(void *param,
+							     unsigned int queue);
 	bool				readonly;
 	bool				async;
+	/* Queues that requests can be submitted on */
+	unsigned int			nr_queues;
 #ifdef CONFIG_HAS_AIO
-	io_context_t			ctx;
-	int				evt;
-	pthread_t			thread;
-	u64				aio_inflight;
+	/* nr_queues entries */
+	struct disk_aio			*aio;
 #endif /* CONFIG_HAS_AIO */
+	/* nr_queues entries, when requests go through io_uring instead */
+	struct disk_uring		*uring;
+	bool				use_io_uring;
+	bool				sqpoll;
+	bool				fixed_bufs;
+	/* For registering guest RAM with io_uring */
+	struct kvm			*kvm;
 	const char			*wwpn;
 	int				debug_iodelay;
+	u32				poll_us;
+	u16				queue_size;
+	u16				num_queues;
+	bool				copy_on_read;
+	/* Holes of a sparse raw image, read without I/O */
+	struct raw_extents		*extents;
+	/* Alignment of O_DIRECT requests, 0 when opened without it */
+	u32				block_size;
+	/* nr_queues entries, NULL when they couldn't be allocated */
+	struct disk_bounce		*bounce;
+	/* Serializes writes that don't cover whole blocks */
+	struct mutex			bounce_lock;
 };
 
+/* Called by the backends for each request they complete */
+static inline void disk_image__complete(struct disk_image *disk, void *param,
+					long len)
+{
+	if (disk->ops->complete)
+		disk->ops->complete(disk, param, len);
+	else
+		disk->disk_req_cb(param, len);
+}
+
 int disk_img_name_parser(const struct option *opt, const char *arg, int unset);
 int disk_image__init(struct kvm *kvm);
 int disk_image__exit(struct kvm *kvm);
 struct disk_image *disk_image__new(int fd, u64 size, struct disk_image_operations *ops, int mmap);
 int disk_image__flush(struct disk_image *disk);
 int disk_image__wait(struct disk_image *disk);
-ssize_t disk_image__read(struct disk_image *disk, u64 sector, const struct iovec *iov,
-				int iovcount, void *param);
-ssize_t disk_image__write(struct disk_image *disk, u64 sector, const struct iovec *iov,
-				int iovcount, void *param);
+int disk_image__set_queues(struct disk_image *disk, unsigned int nr);
+int disk_image__set_queue_eventfd(struct disk_image *disk, unsigned int queue,
+				  int fd);
+void disk_image__reap(struct disk_image *disk, unsigned int queue);
+ssize_t disk_image__flush_queue(struct disk_image *disk, unsigned int queue,
+				void *param);
+int disk_image__discard(struct disk_image *disk, u64 sector, u64 nr_sectors,
+			u32 flags);
+void disk_image__plug(struct disk_image *disk, unsigned int queue);
+int disk_image__unplug(struct disk_image *disk, unsigned int queue);
+ssize_t disk_image__read(struct disk_image *disk, unsigned int queue, u64 sector,
+			 const struct iovec *iov, int iovcount, void *param);
+ssize_t disk_image__write(struct disk_image *disk, unsigned int queue, u64 sector,
+			  const struct iovec *iov, int iovcount, void *param);
 ssize_t disk_image__get_serial(struct disk_image *disk, struct iovec *iov,
 			       int iovcount, ssize_t len);
+struct disk_image *disk_image__open_backing(const char *filename,
+					    u64 cache_size);
+void disk_image__put_backing(struct disk_image *disk);
 
 struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly);
 struct disk_image *blkdev__probe(const char *filename, int flags, struct stat *st);
 
-ssize_t raw_image__read_sync(struct disk_image *disk, u64 sector,
-			     const struct iovec *iov, int iovcount, void *param);
-ssize_t raw_image__write_sync(struct disk_image *disk, u64 sector,
-			      const struct iovec *iov, int iovcount, void *param);
-ssize_t raw_image__read_mmap(struct disk_image *disk, u64 sector,
-				const struct iovec *iov, int iovcount, void *param);
-ssize_t raw_image__write_mmap(struct disk_image *disk, u64 sector,
-				const struct iovec *iov, int iovcount, void *param);
+ssize_t raw_image__read_sync(struct disk_image *disk, unsigned int queue,
+			     u64 sector, const struct iovec *iov, int iovcount,
+			     void *param);
+ssize_t raw_image__write_sync(struct disk_image *disk, unsigned int queue,
+			      u64 sector, const struct iovec *iov, int iovcount,
+			      void *param);
+ssize_t raw_image__read_mmap(struct disk_image *disk, unsigned int queue,
+			     u64 sector, const struct iovec *iov, int iovcount,
+			     void *param);
+ssize_t raw_image__write_mmap(struct disk_image *disk, unsigned int queue,
+			      u64 sector, const struct iovec *iov, int iovcount,
+			      void *param);
+ssize_t raw_image__read(struct disk_image *disk, unsigned int queue,
+			u64 sector, const struct iovec *iov, int iovcount,
+			void *param);
+ssize_t raw_image__write(struct disk_image *disk, unsigned int queue,
+			 u64 sector, const struct iovec *iov, int iovcount,
+			 void *param);
+int raw_image__discard(struct disk_image *disk, u64 sector, u64 nr_sectors,
+		       u32 flags);
+int raw_image__write_zeroes(int fd, u64 offset, u64 len, u32 align);
+void raw_image__plug(struct disk_image *disk, unsigned int queue);
+int raw_image__unplug(struct disk_image *disk, unsigned int queue);
+int raw_image__wait(struct disk_image *disk);
 int raw_image__close(struct disk_image *disk);
+void raw_image__complete(struct disk_image *disk, void *param, long len);
+void raw_image__free_extents(struct disk_image *disk);
 void disk_image__set_callback(struct disk_image *disk, void (*disk_req_cb)(void *param, long len));
+void disk_image__set_batch_callback(struct disk_image *disk,
+				    void (*disk_req_batch_cb)(void *param,
+							      unsigned int queue),
+				    void *param);
+
+void disk_bounce_init(struct disk_image *disk);
+int disk_bounce_setup(struct disk_image *disk, unsigned int nr_queues);
+void disk_bounce_destroy(struct disk_image *disk);
+bool disk_bounce_needed(struct disk_image *disk, u64 sector,
+			const struct iovec *iov, int iovcount);
+ssize_t disk_bounce_read(struct disk_image *disk, unsigned int queue,
+			 u64 sector, const struct iovec *iov, int iovcount,
+			 void *param);
+ssize_t disk_bounce_write(struct disk_image *disk, unsigned int queue,
+			  u64 sector, const struct iovec *iov, int iovcount,
+			  void *param);
+bool disk_bounce_complete(struct disk_image *disk, void **param, long *len);
+int disk_bounce_stats(struct disk_image *disk, struct disk_stat_entry *entry);
 
 #ifdef CONFIG_HAS_AIO
-int disk_aio_setup(struct disk_image *disk);
+int disk_aio_setup(struct disk_image *disk, unsigned int nr_queues);
 void disk_aio_destroy(struct disk_image *disk);
-ssize_t raw_image__read_async(struct disk_image *disk, u64 sector,
-			      const struct iovec *iov, int iovcount, void *param);
-ssize_t raw_image__write_async(struct disk_image *disk, u64 sector,
-			       const struct iovec *iov, int iovcount, void *param);
-int raw_image__wait(struct disk_image *disk);
-
-#define raw_image__read		raw_image__read_async
-#define raw_image__write	raw_image__write_async
+ssize_t raw_image__read_async(struct disk_image *disk, unsigned int queue,
+			      u64 sector, const struct iovec *iov, int iovcount,
+			      void *param);
+ssize_t raw_image__write_async(struct disk_image *disk, unsigned int queue,
+			       u64 sector, const struct iovec *iov, int iovcount,
+			       void *param);
+void disk_aio_plug(struct disk_image *disk, unsigned int queue);
+int disk_aio_unplug(struct disk_image *disk, unsigned int queue);
+int disk_aio_wait(struct disk_image *disk);
 
 #else /* !CONFIG_HAS_AIO */
-static inline int disk_aio_setup(struct disk_image *disk)
+static inline int disk_aio_setup(struct disk_image *disk,
+				 unsigned int nr_queues)
 {
 	/* No-op */
 	return 0;
@@ -122,12 +367,101 @@ static inline void disk_aio_destroy(struct disk_image *disk)
 {
 }
 
-static inline int raw_image__wait(struct disk_image *disk)
+static inline ssize_t raw_image__read_async(struct disk_image *disk,
+					    unsigned int queue, u64 sector,
+					    const struct iovec *iov,
+					    int iovcount, void *param)
+{
+	return -ENOSYS;
+}
+static inline ssize_t raw_image__write_async(struct disk_image *disk,
+					     unsigned int queue, u64 sector,
+					     const struct iovec *iov,
+					     int iovcount, void *param)
+{
+	return -ENOSYS;
+}
+
+static inline void disk_aio_plug(struct disk_image *disk, unsigned int queue)
+{
+}
+static inline int disk_aio_unplug(struct disk_image *disk, unsigned int queue)
+{
+	return 0;
+}
+
+static inline int disk_aio_wait(struct disk_image *disk)
 {
 	return 0;
 }
-#define raw_image__read		raw_image__read_sync
-#define raw_image__write	raw_image__write_sync
 #endif /* CONFIG_HAS_AIO */
 
+#ifdef CONFIG_HAS_IO_URING
+int disk_uring_setup(struct disk_image *disk, unsigned int nr_queues);
+void disk_uring_destroy(struct disk_image *disk);
+ssize_t raw_image__read_uring(struct disk_image *disk, unsigned int queue,
+			      u64 sector, const struct iovec *iov, int iovcount,
+			      void *param);
+ssize_t raw_image__write_uring(struct disk_image *disk, unsigned int queue,
+			       u64 sector, const struct iovec *iov, int iovcount,
+			       void *param);
+ssize_t disk_uring_flush(struct disk_image *disk, unsigned int queue,
+			 void *param);
+int disk_uring_set_eventfd(struct disk_image *disk, unsigned int queue, int fd);
+void disk_uring_reap(struct disk_image *disk, unsigned int queue);
+void disk_uring_plug(struct disk_image *disk, unsigned int queue);
+int disk_uring_unplug(struct disk_image *disk, unsigned int queue);
+int disk_uring_wait(struct disk_image *disk);
+
+#else /* !CONFIG_HAS_IO_URING */
+static inline int disk_uring_setup(struct disk_image *disk,
+				   unsigned int nr_queues)
+{
+	return -ENOSYS;
+}
+static inline void disk_uring_destroy(struct disk_image *disk)
+{
+}
+
+static inline ssize_t raw_image__read_uring(struct disk_image *disk,
+					    unsigned int queue, u64 sector,
+					    const struct iovec *iov,
+					    int iovcount, void *param)
+{
+	return -ENOSYS;
+}
+static inline ssize_t raw_image__write_uring(struct disk_image *disk,
+					     unsigned int queue, u64 sector,
+					     const struct iovec *iov,
+					     int iovcount, void *param)
+{
+	return -ENOSYS;
+}
+static inline ssize_t disk_uring_flush(struct disk_image *disk,
+				       unsigned int queue, void *param)
+{
+	return -ENOSYS;
+}
+static inline int disk_uring_set_eventfd(struct disk_image *disk,
+					 unsigned int queue, int fd)
+{
+	return 0;
+}
+static inline void disk_uring_reap(struct disk_image *disk, unsigned int queue)
+{
+}
+static inline void disk_uring_plug(struct disk_image *disk, unsigned int queue)
+{
+}
+static inline int disk_uring_unplug(struct disk_image *disk,
+				    unsigned int queue)
+{
+	return 0;
+}
+static inline int disk_uring_wait(struct disk_image *disk)
+{
+	return 0;
+}
+#endif /* CONFIG_HAS_IO_URING */
+
 #endif /* KVM__DISK_IMAGE_H */
@@ -0,0 +1,68 @@
+#ifndef KVM__EXIT_STATS_H
+#define KVM__EXIT_STATS_H
+
+#include "kvm/util.h"
+
+#include <linux/types.h>
+#include <stdbool.h>
+
+struct kvm_cpu;
+
+/* Exit reasons past the last slot are counted in it */
+#define EXIT_STATS_REASONS	48
+/* Bucket n counts exits handled in [2^n, 2^(n+1)) ns */
+#define EXIT_STATS_BUCKETS	32
+/* Handlers tracked per vCPU, the others are only counted in dropped */
+#define EXIT_STATS_HANDLERS	32
+
+/* Command sent with KVM_IPC_EXIT_STAT */
+enum {
+	EXIT_STATS_DUMP,
+	EXIT_STATS_START,
+	EXIT_STATS_STOP,
+};
+
+struct exit_stats_handler {
+	/* DEVICE_BUS_MMIO or DEVICE_BUS_IOPORT, and the trapped region */
+	u32	bus;
+	u32	pad;
+	u64	start;
+	u64	len;
+	/* Offset of the handler function in the lkvm binary */
+	u64	fn;
+	u64	count;
+	u64	ns;
+};
+
+struct exit_stats_cpu {
+	u32	cpu;
+	u32	nr_handlers;
+	u64	count[EXIT_STATS_REASONS];
+	u64	ns[EXIT_STATS_REASONS];
+	u64	hist[EXIT_STATS_REASONS][EXIT_STATS_BUCKETS];
+	struct exit_stats_handler handlers[EXIT_STATS_HANDLERS];
+	u64	dropped;
+};
+
+/*
+ * Reply to KVM_IPC_EXIT_STAT is a u32 telling whether profiling is enabled,
+ * a u32 count and the entries of the vCPUs that exited since it started.
+ */
+
+extern bool exit_stats__enabled;
+
+/* Returns the start of the exit, or 0 if profiling is disabled */
+static inline u64 exit_stats__begin(void)
+{
+	if (!__atomic_load_n(&exit_stats__enabled, __ATOMIC_RELAXED))
+		return 0;
+
+	return monotonic_ns();
+}
+
+void exit_stats__end(struct kvm_cpu *vcpu, u32 reason, u64 start);
+void exit_stats__handler(struct kvm_cpu *vcpu, u32 bus, u64 addr, u64 len,
+			 unsigned long fn, u64 start);
+const char *exit_stats__reason_name(u32 reason);
+
+#endif /* KVM__EXIT_STATS_H */
@@ -33,6 +33,12 @@ struct kvm_config {
 	int active_console;
 	int debug_iodelay;
 	int nrcpus;
+	int threadpool_size;
+	const char *threadpool_affinity;
+	const char *vcpu_affinity;
+	const char *io_affinity;
+	const char *mem_nodes;
+	const char *mem_policy;
 	const char *kernel_cmdline;
 	const char *kernel_filename;
 	const char *vmlinux_filename;
@@ -13,6 +13,10 @@ enum {
 	KVM_IPC_STOP	= 6,
 	KVM_IPC_PID	= 7,
 	KVM_IPC_VMSTATE	= 8,
+	KVM_IPC_VIRTIO_STAT = 9,
+	KVM_IPC_EXIT_STAT = 10,
+	KVM_IPC_PLACEMENT = 11,
+	KVM_IPC_DISK_STAT = 12,
 };
 
 int kvm_ipc__register_handler(u32 type, void (*cb)(struct kvm *kvm,
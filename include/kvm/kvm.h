@@ -80,6 +80,24 @@ struct kvm_mem_bank {
 	u64			memfd_offset;
 };
 
+struct kvm_mem_map_entry {
+	u64			guest_phys_addr;
+	u64			size;
+	void			*host_addr;
+};
+
+/*
+ * Immutable copy of the memory banks sorted by guest address, which lets
+ * guest_flat_to_host() run without taking mem_banks_lock. A map that has been
+ * replaced is freed once no lookup can still be using it.
+ */
+struct kvm_mem_map {
+	/* Unique for every published map, used to validate lookup caches */
+	u64			gen;
+	unsigned int		nr;
+	struct kvm_mem_map_entry entries[];
+};
+
 struct kvm {
 	struct kvm_arch		arch;
 	struct kvm_config	cfg;
@@ -97,6 +115,9 @@ struct kvm {
 	u64			ram_pagesize;
 	struct mutex		mem_banks_lock;
 	struct list_head	mem_banks;
+	struct kvm_mem_map	*mem_map;
+	/* Generation of mem_map, stored after it */
+	u64			mem_map_gen;
 
 	bool			nmi_disabled;
 	bool			msix_needs_devid;
@@ -0,0 +1,20 @@
+#ifndef KVM__PLACEMENT_H
+#define KVM__PLACEMENT_H
+
+#include <linux/types.h>
+
+struct kvm;
+struct kvm_cpu;
+
+/*
+ * Reply to KVM_IPC_PLACEMENT is a u32 length followed by a text report of the
+ * host CPUs each thread may run on, and of the NUMA nodes backing guest RAM.
+ */
+
+int placement__init(struct kvm *kvm);
+void placement__pin_vcpu(struct kvm_cpu *vcpu);
+void placement__set_mem_policy(struct kvm *kvm);
+void placement__reset_mem_policy(struct kvm *kvm);
+void placement__bind_mem(struct kvm *kvm, void *addr, u64 size);
+
+#endif /* KVM__PLACEMENT_H */
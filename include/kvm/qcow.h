@@ -2,10 +2,10 @@
 #define KVM__QCOW_H
 
 #include "kvm/mutex.h"
+#include "kvm/threadpool.h"
 
 #include <linux/types.h>
 #include <stdbool.h>
-#include <linux/rbtree.h>
 #include <linux/list.h>
 
 #define QCOW_MAGIC		(('Q' << 24) | ('F' << 16) | ('I' << 8) | 0xfb)
@@ -22,45 +22,90 @@
 
 #define QCOW2_OFFSET_MASK	(~QCOW2_OFLAGS_MASK)
 
-#define MAX_CACHE_NODES         32
+/* Metadata is cached in slices of L2 tables and refcount blocks */
+#define QCOW_CACHE_SLICE_SIZE	4096
+/* Default size of the L2 cache, the refcount cache gets a quarter of it */
+#define QCOW_CACHE_SIZE		(2 << 20)
+#define QCOW_CACHE_MIN_SLICES	8
 
-struct qcow_l2_table {
+/* Size of the cache of decompressed clusters */
+#define QCOW_INFLATED_CACHE_SIZE	(8 << 20)
+/* Compressed clusters inflated at once by the thread pool */
+#define QCOW_MAX_INFLATE		16
+/* Compressed clusters after the one read that are inflated ahead */
+#define QCOW_INFLATE_READAHEAD		4
+
+/* Clusters allocated at once, and handed out as they are needed */
+#define QCOW_PREALLOC_CLUSTERS	32
+/* Clusters freed before the tables that used them are written back */
+#define QCOW_MAX_FREES		1024
+
+struct qcow;
+
+struct qcow_cache_slice {
+	/* Of the slice in the image, 0 while the slot is unused */
 	u64				offset;
-	struct rb_node			node;
-	struct list_head		list;
+	struct hlist_node		node;
 	u8				dirty;
-	u64				table[];
+	/* Set on use, cleared as the CLOCK hand passes */
+	u8				referenced;
+	void				*data;
+};
+
+struct qcow_cache {
+	u32				slice_size;
+	u32				nr_slices;
+	struct qcow_cache_slice		*slices;
+	void				*data;
+	/* Next slot that the CLOCK hand looks at */
+	u32				hand;
+	u32				hash_bits;
+	struct hlist_head		*hash;
+	/* Called before a dirty slice is written back on eviction */
+	int				(*writeback)(struct qcow *q);
+	u64				hits;
+	u64				misses;
+	u64				evictions;
 };
 
 struct qcow_l1_table {
 	u32				table_size;
 	u64				*l1_table;
 
-	/* Level2 caching data structures */
-	struct rb_root			root;
-	struct list_head		lru_list;
-	int				nr_cached;
+	/* Slices of L2 tables */
+	struct qcow_cache		cache;
+	/* An entry points to a new L2 table */
+	bool				dirty;
 };
 
 #define QCOW_REFCOUNT_BLOCK_SHIFT	1
 
-struct qcow_refcount_block {
-	u64				offset;
-	struct rb_node			node;
-	struct list_head		list;
-	u64				size;
-	u8				dirty;
-	u16				entries[];
-};
-
 struct qcow_refcount_table {
 	u32				rf_size;
 	u64				*rf_table;
 
-	/* Refcount block caching data structures */
-	struct rb_root			root;
-	struct list_head		lru_list;
-	int				nr_cached;
+	/* Slices of refcount blocks */
+	struct qcow_cache		cache;
+	/* An entry points to a new refcount block */
+	bool				dirty;
+};
+
+struct qcow_inflate {
+	struct thread_pool__job		job;
+	struct qcow			*q;
+	/* L2 entry of the cluster, 0 once it no longer takes waiters */
+	u64				entry;
+	/* Guest reads waiting for the cluster */
+	struct list_head		waiters;
+	/* Until the waiters are filled in from data */
+	bool				busy;
+	void				*cdata;
+	void				*data;
+};
+
+struct qcow_free {
+	u64				offset;
+	u64				size;
 };
 
 struct qcow_header {
@@ -71,6 +116,8 @@ struct qcow_header {
 	u8				l2_bits;
 	u64				refcount_table_offset;
 	u32				refcount_table_size;
+	u64				backing_file_offset;
+	u32				backing_file_size;
 };
 
 struct qcow {
@@ -88,6 +135,24 @@ struct qcow {
 	void				*cluster_cache;
 	void				*cluster_data;
 	void				*copy_buff;
+	/* Where unallocated clusters are read from, shared with other images */
+	struct disk_image		*backing;
+
+	/* Decompressed clusters, by offset of their compressed data */
+	struct qcow_cache		inflated;
+	/* Inflations in flight in the thread pool */
+	struct qcow_inflate		inflate[QCOW_MAX_INFLATE];
+
+	/* Allocated clusters not used yet, and whether they read as zeroes */
+	u64				prealloc_start;
+	u64				prealloc_end;
+	bool				prealloc_zeroed;
+	/*
+	 * Clusters that the cached tables no longer use, but the tables on
+	 * disk may. They are only freed once the cached tables are written.
+	 */
+	struct qcow_free		frees[QCOW_MAX_FREES];
+	u32				nr_frees;
 };
 
 struct qcow1_header_disk {
@@ -128,6 +193,7 @@ struct qcow2_header_disk {
 	u64				snapshots_offset;
 };
 
-struct disk_image *qcow_probe(int fd, bool readonly);
+struct disk_image *qcow_probe(int fd, const char *filename, bool readonly,
+			      u64 cache_size);
 
 #endif /* KVM__QCOW_H */
@@ -1,8 +1,6 @@
 #ifndef KVM__THREADPOOL_H
 #define KVM__THREADPOOL_H
 
-#include "kvm/mutex.h"
-
 #include <linux/list.h>
 
 struct kvm;
@@ -14,10 +12,14 @@ struct thread_pool__job {
 	struct kvm			*kvm;
 	void				*data;
 
+	/* Runs still owed, a job is only queued once at a time */
 	int				signalcount;
-	struct mutex			mutex;
+	/* Worker queue the job was last pushed to, or -1 */
+	int				worker;
 
 	struct list_head		queue;
+	/* Link in the lock-free inbox of a worker */
+	struct thread_pool__job		*next;
 };
 
 static inline void thread_pool__init_job(struct thread_pool__job *job, struct kvm *kvm, kvm_thread_callback_fn_t callback, void *data)
@@ -26,7 +28,7 @@ static inline void thread_pool__init_job(struct thread_pool__job *job, struct kv
 		.kvm		= kvm,
 		.callback	= callback,
 		.data		= data,
-		.mutex		= MUTEX_INITIALIZER,
+		.worker		= -1,
 	};
 	INIT_LIST_HEAD(&job->queue);
 }
@@ -21,6 +21,7 @@
 #include <limits.h>
 #include <sys/param.h>
 #include <sys/types.h>
+#include <time.h>
 #include <linux/types.h>
 
 #ifdef __GNUC__
@@ -105,6 +106,18 @@ static inline void msleep(unsigned int msecs)
 	usleep(MSECS_TO_USECS(msecs));
 }
 
+#define USECS_TO_NSECS(s) ((s) * 1000ULL)
+#define NSECS_PER_SEC	1000000000ULL
+
+/* Monotonic clock in nanoseconds, for measuring short intervals */
+static inline u64 monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * NSECS_PER_SEC + ts.tv_nsec;
+}
+
 /*
  * Find last (most significant) bit set. Same implementation as Linux:
  * fls(0) = 0, fls(1) = 1, fls(1UL << 63) = 64
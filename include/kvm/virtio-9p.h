@@ -10,6 +10,7 @@
 #include <linux/rbtree.h>
 
 #define NUM_VIRT_QUEUES		1
+/* Default maximum queue size, overridden with --9p dir,tag,queue_size=<n> */
 #define VIRTQUEUE_NUM		128
 #define	VIRTIO_9P_DEFAULT_TAG	"kvm_9p"
 #define VIRTIO_9P_HDR_LEN	(sizeof(u32)+sizeof(u8)+sizeof(u16))
@@ -49,6 +50,7 @@ struct p9_dev {
 	u16			tag_len;
 
 	/* virtio queue */
+	u16			queue_size;
 	struct virt_queue	vqs[NUM_VIRT_QUEUES];
 	struct p9_dev_job	jobs[NUM_VIRT_QUEUES];
 	char			root_dir[PATH_MAX];
@@ -60,15 +62,17 @@ struct p9_pdu {
 	size_t			write_offset;
 	u16			out_iov_cnt;
 	u16			in_iov_cnt;
-	struct iovec		in_iov[VIRTQUEUE_NUM];
-	struct iovec		out_iov[VIRTQUEUE_NUM];
+	/* Both sized to the queue, allocated along with the pdu */
+	struct iovec		*in_iov;
+	struct iovec		*out_iov;
 };
 
 struct kvm;
 
 int virtio_9p_rootdir_parser(const struct option *opt, const char *arg, int unset);
 int virtio_9p_img_name_parser(const struct option *opt, const char *arg, int unset);
-int virtio_9p__register(struct kvm *kvm, const char *root, const char *tag_name);
+int virtio_9p__register(struct kvm *kvm, const char *root, const char *tag_name,
+			u16 queue_size);
 int virtio_9p__init(struct kvm *kvm);
 int virtio_9p__exit(struct kvm *kvm);
 int virtio_p9_pdu_readf(struct p9_pdu *pdu, const char *fmt, ...);
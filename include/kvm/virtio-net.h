@@ -19,6 +19,10 @@ struct virtio_net_params {
 	int vhost;
 	int fd;
 	int mq;
+	int poll;
+	int queue_size;
+	int coalesce_frames;
+	int coalesce_usecs;
 };
 
 int virtio_net__init(struct kvm *kvm);
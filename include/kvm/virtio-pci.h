@@ -53,6 +53,8 @@ struct virtio_pci {
 	u32			config_gsi;
 	u16			vq_vector[VIRTIO_PCI_MAX_VQ];
 	u32			gsis[VIRTIO_PCI_MAX_VQ];
+	/* Eventfds bound to gsis[], used to signal the queues */
+	int			irqfds[VIRTIO_PCI_MAX_VQ];
 	u64			msix_pba;
 	struct msix_table	msix_table[VIRTIO_PCI_MAX_VQ + VIRTIO_PCI_MAX_CONFIG];
 
@@ -90,6 +92,7 @@ static inline u32 virtio_pci__msix_io_addr(struct virtio_pci *vpci)
 }
 
 int virtio_pci__add_msix_route(struct virtio_pci *vpci, u32 vec);
+void virtio_pci__set_vq_gsi(struct virtio_device *vdev, u32 vq, u32 gsi);
 int virtio_pci__init_ioeventfd(struct kvm *kvm, struct virtio_device *vdev,
 			       u32 vq);
 int virtio_pci_init_vq(struct kvm *kvm, struct virtio_device *vdev, int vq);
@@ -8,6 +8,7 @@
 
 #include <linux/types.h>
 #include <linux/compiler.h>
+#include <linux/list.h>
 #include <linux/virtio_config.h>
 #include <sys/uio.h>
 
@@ -67,22 +68,113 @@ struct vring_addr {
 	};
 };
 
+/* Ring position and length of a buffer popped from a packed virtqueue */
+struct virt_queue_packed_buf {
+	u16		pos;
+	u16		ndescs;
+};
+
+/* Device state of a packed virtqueue (VIRTIO_F_RING_PACKED) */
+struct virt_queue_packed {
+	struct vring_packed_desc	*desc;
+	struct vring_packed_desc_event	*driver;
+	struct vring_packed_desc_event	*device;
+	/* Indexed by buffer ID */
+	struct virt_queue_packed_buf	*bufs;
+	u16				used_idx;
+	/* Descriptors written but not yet published with used_idx_advance */
+	u16				used_pending;
+	/* Flags of the first pending used descriptor, written on publication */
+	u16				used_flags;
+	bool				avail_wrap;
+	bool				used_wrap;
+	bool				signalled_valid;
+};
+
+/* Per-queue counters, reported by lkvm stat --virtio */
+struct virt_queue_stats {
+	u64		kicks;
+	u64		irqs;
+	/* Interrupts that the driver asked us to skip */
+	u64		irqs_suppressed;
+	/* Interrupts deferred by coalescing */
+	u64		irqs_coalesced;
+	/* Buffers popped, and the descriptors they were made of */
+	u64		bufs;
+	u64		descs;
+	/* Buffers returned to the driver */
+	u64		used;
+	/* Written to and read from guest buffers */
+	u64		bytes_in;
+	u64		bytes_out;
+	/* Times a worker emptied the queue, for the average batch size */
+	u64		drains;
+	/* Time the worker found the ring empty, or completely filled */
+	u64		empty_ns;
+	u64		full_ns;
+};
+
+struct virtio_device;
+typedef int (*virtio_inject_fn)(struct kvm *kvm, struct virtio_device *vdev,
+				u32 vq);
+
+/* Interrupt coalescing, see virtio/coalesce.c */
+struct virt_queue_coalesce {
+	struct mutex	lock;
+	/* Zero max_usecs disables coalescing */
+	u32		max_frames;
+	u32		max_usecs;
+	/* -1 without a timer */
+	int		timer_fd;
+	bool		initialised;
+	/* A deferred interrupt waits for the timer or for more frames */
+	bool		pending;
+	/* stats.used when we last sent an interrupt */
+	u64		used_irq;
+	/* Recorded by the transport when deferring an interrupt */
+	u32		idx;
+	virtio_inject_fn inject;
+};
+
+enum virt_queue_state {
+	VIRT_QUEUE_BUSY,
+	VIRT_QUEUE_EMPTY,
+	VIRT_QUEUE_FULL,
+};
+
 struct virt_queue {
 	struct vring	vring;
+	struct virt_queue_packed packed;
 	struct vring_addr vring_addr;
 	/* The last_avail_idx field is an index to ->ring of struct vring_avail.
-	   It's where we assume the next request index is at.  */
+	   It's where we assume the next request index is at. With a packed
+	   ring, it is the position of the next descriptor in ->packed.desc. */
 	u16		last_avail_idx;
 	u16		last_used_signalled;
+	/* Used elements written by stage_used_elem but not yet published */
+	u16		used_staged;
 	u16		endian;
+	/* Queue size set by the driver, or zero for the device maximum */
+	u16		size;
 	bool		use_event_idx;
+	bool		use_packed;
+	/* Guest notifications suppressed with virt_queue__disable_notify */
+	bool		notify_disabled;
 	bool		enabled;
 	struct virtio_device *vdev;
 
+	struct virt_queue_stats stats;
+	/* Current state and when we entered it, for stats.empty/full_ns */
+	enum virt_queue_state state;
+	u64		state_ns;
+
 	/* vhost IRQ handling */
 	int		gsi;
 	int		irqfd;
 	int		index;
+
+	/* Outlives virtio_exit_vq, which the flush thread may race with */
+	struct virt_queue_coalesce coalesce;
 };
 
 /*
@@ -155,9 +247,32 @@ static inline u64 virtio_host_to_guest_u64(u16 endian, u64 value)
 
 #endif
 
+/*
+ * Counters are only read by the IPC thread, so relaxed accesses are enough.
+ * Most of them are only updated by the queue worker, or under the lock that
+ * serializes used ring updates. Kicks and interrupts can come from any
+ * thread and need an atomic increment.
+ */
+#define virt_queue__stat_add(vq, field, n)				\
+	__atomic_store_n(&(vq)->stats.field, (vq)->stats.field + (n),	\
+			 __ATOMIC_RELAXED)
+#define virt_queue__stat_add_atomic(vq, field, n)			\
+	__atomic_fetch_add(&(vq)->stats.field, (n), __ATOMIC_RELAXED)
+
+void virt_queue__set_state(struct virt_queue *vq, enum virt_queue_state state);
+
+u16 virt_queue__pop_packed(struct virt_queue *queue);
+
 static inline u16 virt_queue__pop(struct virt_queue *queue)
 {
+	enum virt_queue_state state;
 	__u16 guest_idx;
+	u16 pending;
+
+	virt_queue__stat_add(queue, bufs, 1);
+
+	if (queue->use_packed)
+		return virt_queue__pop_packed(queue);
 
 	/*
 	 * The guest updates the avail index after writing the ring entry.
@@ -166,6 +281,13 @@ static inline u16 virt_queue__pop(struct virt_queue *queue)
 	 */
 	rmb();
 
+	/* The driver can't add anything until we catch up */
+	pending = virtio_guest_to_host_u16(queue->endian, queue->vring.avail->idx) -
+		  queue->last_avail_idx;
+	state = pending >= queue->vring.num ? VIRT_QUEUE_FULL : VIRT_QUEUE_BUSY;
+	if (queue->state != state)
+		virt_queue__set_state(queue, state);
+
 	guest_idx = queue->vring.avail->ring[queue->last_avail_idx++ % queue->vring.num];
 	return virtio_guest_to_host_u16(queue->endian, guest_idx);
 }
@@ -175,14 +297,58 @@ static inline struct vring_desc *virt_queue__get_desc(struct virt_queue *queue,
 	return &queue->vring.desc[desc_ndx];
 }
 
+static inline bool virt_packed_desc__is_avail(u16 flags, bool wrap)
+{
+	bool avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+	bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+
+	return avail != used && avail == wrap;
+}
+
+static inline bool virt_queue__available_packed(struct virt_queue *vq)
+{
+	struct vring_packed_desc *desc;
+	u16 off_wrap;
+
+	if (!vq->packed.desc)
+		return 0;
+
+	if (vq->use_event_idx && !vq->notify_disabled) {
+		off_wrap = vq->last_avail_idx |
+			   vq->packed.avail_wrap << VRING_PACKED_EVENT_F_WRAP_CTR;
+		vq->packed.device->off_wrap = virtio_host_to_guest_u16(vq->endian,
+								       off_wrap);
+		/* Same as the split ring, see below */
+		mb();
+	}
+
+	desc = &vq->packed.desc[vq->last_avail_idx];
+	if (virt_packed_desc__is_avail(virtio_guest_to_host_u16(vq->endian,
+								desc->flags),
+				       vq->packed.avail_wrap))
+		return true;
+
+	if (vq->state != VIRT_QUEUE_EMPTY)
+		virt_queue__set_state(vq, VIRT_QUEUE_EMPTY);
+
+	return false;
+}
+
 static inline bool virt_queue__available(struct virt_queue *vq)
 {
 	u16 last_avail_idx = virtio_host_to_guest_u16(vq->endian, vq->last_avail_idx);
 
+	if (vq->use_packed)
+		return virt_queue__available_packed(vq);
+
 	if (!vq->vring.avail)
 		return 0;
 
-	if (vq->use_event_idx) {
+	/*
+	 * While notifications are disabled, leave the event index behind so
+	 * that the driver doesn't kick us for new buffers.
+	 */
+	if (vq->use_event_idx && !vq->notify_disabled) {
 		vring_avail_event(&vq->vring) = last_avail_idx;
 		/*
 		 * After the driver writes a new avail index, it reads the event
@@ -192,18 +358,62 @@ static inline bool virt_queue__available(struct virt_queue *vq)
 		mb();
 	}
 
-	return vq->vring.avail->idx != last_avail_idx;
+	if (vq->vring.avail->idx != last_avail_idx)
+		return true;
+
+	if (vq->state != VIRT_QUEUE_EMPTY)
+		virt_queue__set_state(vq, VIRT_QUEUE_EMPTY);
+
+	return false;
 }
 
 void virt_queue__used_idx_advance(struct virt_queue *queue, u16 jump);
 struct vring_used_elem * virt_queue__set_used_elem_no_update(struct virt_queue *queue, u32 head, u32 len, u16 offset);
 struct vring_used_elem *virt_queue__set_used_elem(struct virt_queue *queue, u32 head, u32 len);
+void virt_queue__stage_used_elem(struct virt_queue *queue, u32 head, u32 len);
+bool virt_queue__publish_used(struct virt_queue *queue);
 
 bool virtio_queue__should_signal(struct virt_queue *vq);
+/* Largest queue size that a device may offer */
+#define VIRTIO_QUEUE_SIZE_MAX		32768
+
+static inline u16 virt_queue__get_size(struct virt_queue *vq, u16 max)
+{
+	return vq->size ? vq->size : max;
+}
+
+u16 virt_queue__set_size(struct virtio_device *vdev, struct virt_queue *vq,
+			 u32 size, u16 max);
+u16 virtio_parse_queue_size(const char *arg);
+
+void virt_queue__disable_notify(struct virt_queue *vq);
+bool virt_queue__enable_notify(struct virt_queue *vq);
+
+/* Adaptive busy-polling state of a virtqueue worker */
+struct virt_queue_poll {
+	/* Configured budget, zero when polling is disabled */
+	u64		max_ns;
+	/* Current budget, adjusted by virt_queue__poll() */
+	u64		budget_ns;
+};
+
+void virt_queue__poll_init(struct virt_queue_poll *poll, u32 max_us);
+bool virt_queue__poll(struct virt_queue *vq, struct virt_queue_poll *poll);
+void virt_queue__init_coalesce(struct virt_queue *vq);
+int virt_queue__set_coalesce(struct virt_queue *vq, u32 max_frames,
+			     u32 max_usecs);
+void virt_queue__exit_coalesce(struct virt_queue *vq);
+bool virt_queue__coalesce_irq(struct virt_queue *vq, u32 idx,
+			      virtio_inject_fn inject);
+
+void *virt_queue__get_last_in(struct virt_queue *vq, u16 head, struct kvm *kvm);
 u16 virt_queue__get_iov(struct virt_queue *vq, struct iovec iov[],
 			u16 *out, u16 *in, struct kvm *kvm);
 u16 virt_queue__get_head_iov(struct virt_queue *vq, struct iovec iov[],
 			     u16 *out, u16 *in, u16 head, struct kvm *kvm);
+int virt_queue__get_head_iov_max(struct virt_queue *vq, struct iovec iov[],
+				 u16 max_iov, u16 *out, u16 *in, u16 head,
+				 struct kvm *kvm);
 u16 virt_queue__get_inout_iov(struct kvm *kvm, struct virt_queue *queue,
 			      struct iovec in_iov[], struct iovec out_iov[],
 			      u16 *in, u16 *out);
@@ -224,6 +434,19 @@ struct virtio_device {
 	u16			endian;
 	u64			features;
 	u32			status;
+
+	/* Device private data and VIRTIO_ID_*, for lkvm stat */
+	void			*dev;
+	u32			id;
+	struct list_head	list;
+};
+
+/* Reply to KVM_IPC_VIRTIO_STAT is a u32 count followed by the entries */
+struct virtio_stat_entry {
+	char			device[16];
+	u32			vq;
+	u32			size;
+	struct virt_queue_stats	stats;
 };
 
 struct virtio_ops {
@@ -239,6 +462,12 @@ struct virtio_ops {
 	int (*set_size_vq)(struct kvm *kvm, void *dev, u32 vq, int size);
 	void (*notify_vq_gsi)(struct kvm *kvm, void *dev, u32 vq, u32 gsi);
 	void (*notify_vq_eventfd)(struct kvm *kvm, void *dev, u32 vq, u32 efd);
+	/*
+	 * Return true if the device thread waits on the eventfd passed to
+	 * notify_vq_eventfd() itself, rather than getting notify_vq() calls
+	 * from the ioeventfd worker.
+	 */
+	bool (*owns_vq_eventfd)(struct kvm *kvm, void *dev, u32 vq);
 	int (*signal_vq)(struct kvm *kvm, struct virtio_device *vdev, u32 queueid);
 	int (*signal_config)(struct kvm *kvm, struct virtio_device *vdev);
 	void (*notify_status)(struct kvm *kvm, void *dev, u32 status);
@@ -258,6 +487,8 @@ void virtio_init_device_vq(struct kvm *kvm, struct virtio_device *vdev,
 			   struct virt_queue *vq, size_t nr_descs);
 void virtio_exit_vq(struct kvm *kvm, struct virtio_device *vdev, void *dev,
 		    int num);
+void virtio_notify_vq(struct kvm *kvm, struct virtio_device *vdev, u32 vq);
+bool virtio_owns_vq_eventfd(struct kvm *kvm, struct virtio_device *vdev, u32 vq);
 bool virtio_access_config(struct kvm *kvm, struct virtio_device *vdev, void *dev,
 			  unsigned long offset, void *data, size_t size,
 			  bool is_write);
@@ -265,6 +496,7 @@ void virtio_set_guest_features(struct kvm *kvm, struct virtio_device *vdev,
 			       void *dev, u64 features);
 void virtio_notify_status(struct kvm *kvm, struct virtio_device *vdev,
 			  void *dev, u8 status);
+void virtio_set_needs_reset(struct kvm *kvm, struct virtio_device *vdev);
 void virtio_vhost_init(struct kvm *kvm, int vhost_fd);
 void virtio_vhost_set_vring(struct kvm *kvm, int vhost_fd, u32 index,
 			    struct virt_queue *queue);
@@ -4,6 +4,7 @@
 #include <kvm/compiler.h>
 #define __SANE_USERSPACE_TYPES__	/* For PPC64, to get LL64 types */
 #include <asm/types.h>
+#include <linux/posix_types.h>
 
 typedef __u64 u64;
 typedef __s64 s64;
@@ -36,6 +37,8 @@ typedef __u32 __bitwise __be32;
 typedef __u64 __bitwise __le64;
 typedef __u64 __bitwise __be64;
 
+#define __aligned_u64 __u64 __attribute__((aligned(8)))
+
 struct list_head {
 	struct list_head *next, *prev;
 };
@@ -1,5 +1,6 @@
 #include "kvm/kvm-cpu.h"
 
+#include "kvm/exit-stats.h"
 #include "kvm/symbol.h"
 #include "kvm/util.h"
 #include "kvm/kvm.h"
@@ -69,20 +70,48 @@ static void kvm_cpu_signal_handler(int signum)
 	/* For SIGKVMTASK cpu->task is already set */
 }
 
+/*
+ * The coalesced ring is shared by all VCPUs. Whoever drains it must replay the
+ * writes in order, and before handling any access that could observe them.
+ */
+static DEFINE_MUTEX(coalesced_lock);
+
 static void kvm_cpu__handle_coalesced_mmio(struct kvm_cpu *cpu)
 {
-	if (cpu->ring) {
-		while (cpu->ring->first != cpu->ring->last) {
-			struct kvm_coalesced_mmio *m;
-			m = &cpu->ring->coalesced_mmio[cpu->ring->first];
-			kvm_cpu__emulate_mmio(cpu,
-					      m->phys_addr,
-					      m->data,
-					      m->len,
-					      1);
-			cpu->ring->first = (cpu->ring->first + 1) % KVM_COALESCED_MMIO_MAX;
-		}
+	struct kvm_coalesced_mmio_ring *ring = cpu->ring;
+	struct kvm_coalesced_mmio *m;
+	u32 first;
+
+	if (!ring || ring->first == __atomic_load_n(&ring->last,
+						    __ATOMIC_ACQUIRE))
+		return;
+
+	mutex_lock(&coalesced_lock);
+	first = ring->first;
+	while (first != __atomic_load_n(&ring->last, __ATOMIC_ACQUIRE)) {
+		m = &ring->coalesced_mmio[first];
+		if (m->pio)
+			kvm_cpu__emulate_io(cpu, m->phys_addr, m->data,
+					    KVM_EXIT_IO_OUT, m->len, 1);
+		else
+			kvm_cpu__emulate_mmio(cpu, m->phys_addr, m->data,
+					      m->len, 1);
+
+		first = (first + 1) % KVM_COALESCED_MMIO_MAX;
+		/* Let KVM reuse the entry */
+		__atomic_store_n(&ring->first, first, __ATOMIC_RELEASE);
 	}
+	mutex_unlock(&coalesced_lock);
+}
+
+/*
+ * Replay the writes that KVM coalesced, for devices that need them to make
+ * progress while the VCPUs don't exit.
+ */
+void kvm_cpu__flush_coalesced_io(struct kvm *kvm)
+{
+	if (kvm->nrcpus && kvm->cpus[0])
+		kvm_cpu__handle_coalesced_mmio(kvm->cpus[0]);
 }
 
 static DEFINE_MUTEX(task_lock);
@@ -160,6 +189,8 @@ int kvm_cpu__start(struct kvm_cpu *cpu)
 		kvm_cpu__enable_singlestep(cpu);
 
 	while (cpu->is_running) {
+		u64 exit_start;
+
 		if (cpu->needs_nmi) {
 			kvm_cpu__arch_nmi(cpu);
 			cpu->needs_nmi = 0;
@@ -170,6 +201,8 @@ int kvm_cpu__start(struct kvm_cpu *cpu)
 
 		kvm_cpu__run(cpu);
 
+		exit_start = exit_stats__begin();
+
 		switch (cpu->kvm_run->exit_reason) {
 		case KVM_EXIT_UNKNOWN:
 			break;
@@ -180,6 +213,9 @@ int kvm_cpu__start(struct kvm_cpu *cpu)
 		case KVM_EXIT_IO: {
 			bool ret;
 
+			/* Coalesced writes come first, as for MMIO */
+			kvm_cpu__handle_coalesced_mmio(cpu);
+
 			ret = kvm_cpu__emulate_io(cpu,
 						  cpu->kvm_run->io.port,
 						  (u8 *)cpu->kvm_run +
@@ -248,6 +284,10 @@ int kvm_cpu__start(struct kvm_cpu *cpu)
 		}
 		}
 		kvm_cpu__handle_coalesced_mmio(cpu);
+
+		if (exit_start)
+			exit_stats__end(cpu, cpu->kvm_run->exit_reason,
+					exit_start);
 	}
 
 exit_kvm:
@@ -0,0 +1,262 @@
+#include "kvm/exit-stats.h"
+#include "kvm/kvm-cpu.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/kvm.h"
+#include "kvm/read-write.h"
+#include "kvm/util.h"
+
+#include <linux/kvm.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * vCPU exit profiler. Each vCPU thread only writes its own counters, which the
+ * IPC thread copies with relaxed loads. Nothing but the check of
+ * exit_stats__enabled is done while profiling is disabled.
+ */
+bool exit_stats__enabled;
+
+struct exit_stats_vcpu {
+	/* Counters are reset by the vCPU when it notices a new generation */
+	u64			gen;
+	struct exit_stats_cpu	s;
+};
+
+static struct exit_stats_vcpu **exit_stats;
+static u32 nr_exit_stats;
+static u64 exit_stats_gen;
+
+extern __thread struct kvm_cpu *current_kvm_cpu;
+
+/* Start of the lkvm image, so that handlers can be found with addr2line */
+extern char __executable_start[];
+
+#define exit_stats__add(field, n)					\
+	__atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+#define EXIT_REASON(r)	[KVM_EXIT_##r] = #r
+
+static const char *exit_reason_names[EXIT_STATS_REASONS] = {
+	EXIT_REASON(UNKNOWN),
+	EXIT_REASON(EXCEPTION),
+	EXIT_REASON(IO),
+	EXIT_REASON(HYPERCALL),
+	EXIT_REASON(DEBUG),
+	EXIT_REASON(HLT),
+	EXIT_REASON(MMIO),
+	EXIT_REASON(IRQ_WINDOW_OPEN),
+	EXIT_REASON(SHUTDOWN),
+	EXIT_REASON(FAIL_ENTRY),
+	EXIT_REASON(INTR),
+	EXIT_REASON(SET_TPR),
+	EXIT_REASON(TPR_ACCESS),
+	EXIT_REASON(S390_SIEIC),
+	EXIT_REASON(S390_RESET),
+	EXIT_REASON(DCR),
+	EXIT_REASON(NMI),
+	EXIT_REASON(INTERNAL_ERROR),
+	EXIT_REASON(OSI),
+	EXIT_REASON(PAPR_HCALL),
+	EXIT_REASON(S390_UCONTROL),
+	EXIT_REASON(WATCHDOG),
+	EXIT_REASON(S390_TSCH),
+	EXIT_REASON(EPR),
+	EXIT_REASON(SYSTEM_EVENT),
+	EXIT_REASON(S390_STSI),
+	EXIT_REASON(IOAPIC_EOI),
+	EXIT_REASON(HYPERV),
+	EXIT_REASON(ARM_NISV),
+	EXIT_REASON(X86_RDMSR),
+	EXIT_REASON(X86_WRMSR),
+	EXIT_REASON(DIRTY_RING_FULL),
+	EXIT_REASON(AP_RESET_HOLD),
+	EXIT_REASON(X86_BUS_LOCK),
+	EXIT_REASON(XEN),
+	EXIT_REASON(RISCV_SBI),
+	EXIT_REASON(RISCV_CSR),
+	EXIT_REASON(NOTIFY),
+	EXIT_REASON(LOONGARCH_IOCSR),
+	EXIT_REASON(MEMORY_FAULT),
+	[EXIT_STATS_REASONS - 1] = "OTHER",
+};
+
+const char *exit_stats__reason_name(u32 reason)
+{
+	if (reason < EXIT_STATS_REASONS && exit_reason_names[reason])
+		return exit_reason_names[reason];
+
+	return "OTHER";
+}
+
+static unsigned int exit_stats__bucket(u64 ns)
+{
+	unsigned int bucket = 0;
+
+	while (ns > 1 && bucket < EXIT_STATS_BUCKETS - 1) {
+		ns >>= 1;
+		bucket++;
+	}
+
+	return bucket;
+}
+
+/* Called by the vCPU thread, to get its counters for the current run */
+static struct exit_stats_cpu *exit_stats__get(struct kvm_cpu *vcpu)
+{
+	u64 gen = __atomic_load_n(&exit_stats_gen, __ATOMIC_ACQUIRE);
+	struct exit_stats_vcpu *stats;
+
+	/* Coalesced writes can be replayed by other threads on its behalf */
+	if (vcpu != current_kvm_cpu || vcpu->cpu_id >= nr_exit_stats)
+		return NULL;
+
+	stats = exit_stats[vcpu->cpu_id];
+	if (!stats) {
+		stats = calloc(1, sizeof(*stats));
+		if (!stats)
+			return NULL;
+
+		stats->gen = gen;
+		stats->s.cpu = vcpu->cpu_id;
+		__atomic_store_n(&exit_stats[vcpu->cpu_id], stats,
+				 __ATOMIC_RELEASE);
+	}
+
+	if (stats->gen != gen) {
+		memset(&stats->s, 0, sizeof(stats->s));
+		stats->s.cpu = vcpu->cpu_id;
+		__atomic_store_n(&stats->gen, gen, __ATOMIC_RELEASE);
+	}
+
+	return &stats->s;
+}
+
+void exit_stats__end(struct kvm_cpu *vcpu, u32 reason, u64 start)
+{
+	u64 ns = monotonic_ns() - start;
+	struct exit_stats_cpu *s;
+
+	s = exit_stats__get(vcpu);
+	if (!s)
+		return;
+
+	if (reason >= EXIT_STATS_REASONS)
+		reason = EXIT_STATS_REASONS - 1;
+
+	exit_stats__add(s->count[reason], 1);
+	exit_stats__add(s->ns[reason], ns);
+	exit_stats__add(s->hist[reason][exit_stats__bucket(ns)], 1);
+}
+
+/* Account the time spent in the MMIO or PIO handler of a region */
+void exit_stats__handler(struct kvm_cpu *vcpu, u32 bus, u64 addr, u64 len,
+			 unsigned long fn, u64 start)
+{
+	u64 ns = monotonic_ns() - start;
+	struct exit_stats_handler *h;
+	struct exit_stats_cpu *s;
+	u32 i;
+
+	s = exit_stats__get(vcpu);
+	if (!s)
+		return;
+
+	fn -= (unsigned long)__executable_start;
+
+	for (i = 0; i < s->nr_handlers; i++) {
+		h = &s->handlers[i];
+		if (h->bus == bus && h->start == addr && h->fn == fn)
+			goto found;
+	}
+
+	if (s->nr_handlers == EXIT_STATS_HANDLERS) {
+		exit_stats__add(s->dropped, 1);
+		return;
+	}
+
+	h = &s->handlers[s->nr_handlers];
+	*h = (struct exit_stats_handler) {
+		.bus	= bus,
+		.start	= addr,
+		.len	= len,
+		.fn	= fn,
+	};
+	__atomic_store_n(&s->nr_handlers, s->nr_handlers + 1, __ATOMIC_RELEASE);
+
+found:
+	exit_stats__add(h->count, 1);
+	exit_stats__add(h->ns, ns);
+}
+
+static void exit_stats__handle(struct kvm *kvm, int fd, u32 type, u32 len,
+			       u8 *msg)
+{
+	struct exit_stats_cpu *entries = NULL;
+	struct exit_stats_vcpu *stats;
+	u32 cmd, enabled, i, nr = 0;
+	u64 gen;
+
+	if (WARN_ON(type != KVM_IPC_EXIT_STAT || len != sizeof(cmd)))
+		return;
+
+	memcpy(&cmd, msg, sizeof(cmd));
+
+	switch (cmd) {
+	case EXIT_STATS_START:
+		__atomic_add_fetch(&exit_stats_gen, 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&exit_stats__enabled, true, __ATOMIC_RELAXED);
+		break;
+	case EXIT_STATS_STOP:
+		__atomic_store_n(&exit_stats__enabled, false, __ATOMIC_RELAXED);
+		break;
+	}
+
+	gen = __atomic_load_n(&exit_stats_gen, __ATOMIC_ACQUIRE);
+	enabled = __atomic_load_n(&exit_stats__enabled, __ATOMIC_RELAXED);
+
+	if (nr_exit_stats)
+		entries = calloc(nr_exit_stats, sizeof(*entries));
+
+	for (i = 0; entries && i < nr_exit_stats; i++) {
+		stats = __atomic_load_n(&exit_stats[i], __ATOMIC_ACQUIRE);
+		/* Skip vCPUs that didn't exit since profiling was restarted */
+		if (!stats || __atomic_load_n(&stats->gen, __ATOMIC_ACQUIRE) != gen)
+			continue;
+
+		memcpy(&entries[nr++], &stats->s, sizeof(*entries));
+	}
+
+	if (write_in_full(fd, &enabled, sizeof(enabled)) < 0 ||
+	    write_in_full(fd, &nr, sizeof(nr)) < 0 ||
+	    write_in_full(fd, entries, nr * sizeof(*entries)) < 0)
+		pr_warning("Failed sending exit stats");
+
+	free(entries);
+}
+
+static int exit_stats__init(struct kvm *kvm)
+{
+	exit_stats = calloc(kvm->nrcpus, sizeof(*exit_stats));
+	if (!exit_stats)
+		return -ENOMEM;
+
+	nr_exit_stats = kvm->nrcpus;
+
+	return kvm_ipc__register_handler(KVM_IPC_EXIT_STAT, exit_stats__handle);
+}
+dev_base_init(exit_stats__init);
+
+/* Once the vCPUs and the IPC server are gone */
+static int exit_stats__exit(struct kvm *kvm)
+{
+	u32 i;
+
+	for (i = 0; i < nr_exit_stats; i++)
+		free(exit_stats[i]);
+	free(exit_stats);
+	exit_stats = NULL;
+	nr_exit_stats = 0;
+
+	return 0;
+}
+core_exit(exit_stats__exit);
@@ -64,6 +64,37 @@ extern struct kvm_ext kvm_req_ext[];
 
 static char kvm_dir[PATH_MAX];
 
+/*
+ * Threads looking up a map make their sequence number odd while they may hold
+ * a reference to it. A replaced map is freed once every thread that was
+ * looking up when it was replaced has moved on.
+ */
+struct kvm_mem_reader {
+	struct kvm_mem_reader	*next;
+	struct kvm		*kvm;
+	u64			seq;
+};
+
+struct kvm_mem_retired {
+	struct kvm_mem_retired	*next;
+	struct kvm_mem_map	*map;
+	unsigned int		nr;
+	struct {
+		struct kvm_mem_reader *reader;
+		u64		seq;
+	} snap[];
+};
+
+/* Protected by mem_banks_lock */
+static struct kvm_mem_reader *kvm_mem_readers;
+static unsigned int nr_kvm_mem_readers;
+static struct kvm_mem_retired *kvm_mem_retired;
+
+static __thread struct kvm_mem_reader *kvm_mem_current_reader;
+/* Unregisters the reader of a thread when it exits */
+static pthread_key_t kvm_mem_reader_key;
+static pthread_once_t kvm_mem_reader_once = PTHREAD_ONCE_INIT;
+
 extern __thread struct kvm_cpu *current_kvm_cpu;
 
 static int set_dir(const char *fmt, va_list args)
@@ -195,9 +226,28 @@ static void kvm__delete_ram(struct kvm *kvm)
 int kvm__exit(struct kvm *kvm)
 {
 	struct kvm_mem_bank *bank, *tmp;
+	struct kvm_mem_retired *retired;
+	struct kvm_mem_reader *reader;
 
 	kvm__delete_ram(kvm);
 
+	/* No lookup is left by now */
+	while ((retired = kvm_mem_retired)) {
+		kvm_mem_retired = retired->next;
+		free(retired->map);
+		free(retired);
+	}
+
+	/* Threads that exit later only free their reader */
+	mutex_lock(&kvm->mem_banks_lock);
+	for (reader = kvm_mem_readers; reader; reader = reader->next)
+		reader->kvm = NULL;
+	kvm_mem_readers = NULL;
+	nr_kvm_mem_readers = 0;
+	mutex_unlock(&kvm->mem_banks_lock);
+	free(kvm->mem_map);
+	kvm->mem_map = NULL;
+
 	list_for_each_entry_safe(bank, tmp, &kvm->mem_banks, list) {
 		if (bank->host_addr)
 			_munmap(bank->host_addr, bank->size);
@@ -263,13 +313,212 @@ static int set_user_memory_guestfd(struct kvm *kvm, u32 slot, u32 flags,
 	return ret;
 }
 
+static int mem_map_entry_cmp(const void *a, const void *b)
+{
+	const struct kvm_mem_map_entry *ea = a, *eb = b;
+
+	if (ea->guest_phys_addr < eb->guest_phys_addr)
+		return -1;
+
+	return ea->guest_phys_addr > eb->guest_phys_addr;
+}
+
+/*
+ * Allocate a translation map large enough for the current banks plus @extra.
+ * Must be called with mem_banks_lock held, before changing the bank list.
+ */
+static struct kvm_mem_map *kvm__alloc_mem_map(struct kvm *kvm,
+					      unsigned int extra)
+{
+	struct kvm_mem_bank *bank;
+	unsigned int nr = extra;
+
+	list_for_each_entry(bank, &kvm->mem_banks, list)
+		nr++;
+
+	return malloc(sizeof(struct kvm_mem_map) +
+		      nr * sizeof(struct kvm_mem_map_entry));
+}
+
+static void kvm__reclaim_mem_maps(void);
+
+static void kvm__mem_reader_unregister(void *data)
+{
+	struct kvm_mem_reader *reader = data, **prev;
+	struct kvm_mem_retired *retired;
+	struct kvm *kvm;
+	unsigned int i;
+
+	/* Readers are detached from the VM when it is destroyed */
+	kvm = __atomic_load_n(&reader->kvm, __ATOMIC_RELAXED);
+	if (!kvm) {
+		free(reader);
+		return;
+	}
+
+	mutex_lock(&kvm->mem_banks_lock);
+	for (prev = &kvm_mem_readers; *prev != reader; prev = &(*prev)->next)
+		;
+	*prev = reader->next;
+	nr_kvm_mem_readers--;
+
+	/* The thread is gone, it doesn't hold back any map */
+	for (retired = kvm_mem_retired; retired; retired = retired->next) {
+		for (i = 0; i < retired->nr; i++) {
+			if (retired->snap[i].reader == reader)
+				retired->snap[i].reader = NULL;
+		}
+	}
+	kvm__reclaim_mem_maps();
+	mutex_unlock(&kvm->mem_banks_lock);
+
+	free(reader);
+}
+
+static void kvm__mem_reader_key_init(void)
+{
+	if (pthread_key_create(&kvm_mem_reader_key, kvm__mem_reader_unregister))
+		die("Failed creating memory map reader key");
+}
+
+static struct kvm_mem_reader *kvm__mem_read_begin(struct kvm *kvm)
+{
+	struct kvm_mem_reader *reader = kvm_mem_current_reader;
+
+	if (!reader) {
+		pthread_once(&kvm_mem_reader_once, kvm__mem_reader_key_init);
+
+		reader = calloc(1, sizeof(*reader));
+		if (!reader)
+			die("Failed allocating memory map reader");
+		reader->kvm = kvm;
+
+		mutex_lock(&kvm->mem_banks_lock);
+		reader->next = kvm_mem_readers;
+		__atomic_store_n(&kvm_mem_readers, reader, __ATOMIC_RELEASE);
+		nr_kvm_mem_readers++;
+		mutex_unlock(&kvm->mem_banks_lock);
+
+		kvm_mem_current_reader = reader;
+		pthread_setspecific(kvm_mem_reader_key, reader);
+	}
+
+	__atomic_store_n(&reader->seq, reader->seq + 1, __ATOMIC_RELAXED);
+	/* Order the store above before loading the map */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	return reader;
+}
+
+static void kvm__mem_read_end(struct kvm_mem_reader *reader)
+{
+	__atomic_store_n(&reader->seq, reader->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Called with mem_banks_lock held. */
+static void kvm__reclaim_mem_maps(void)
+{
+	struct kvm_mem_retired **prev = &kvm_mem_retired, *retired;
+	unsigned int i;
+	u64 seq;
+
+	while ((retired = *prev)) {
+		for (i = 0; i < retired->nr; i++) {
+			if (!retired->snap[i].reader)
+				continue;
+
+			seq = __atomic_load_n(&retired->snap[i].reader->seq,
+					      __ATOMIC_ACQUIRE);
+			if ((seq & 1) && seq == retired->snap[i].seq)
+				break;
+		}
+
+		if (i < retired->nr) {
+			prev = &retired->next;
+			continue;
+		}
+
+		*prev = retired->next;
+		free(retired->map);
+		free(retired);
+	}
+}
+
+/* Called with mem_banks_lock held, after the map has been replaced. */
+static void kvm__retire_mem_map(struct kvm_mem_map *map)
+{
+	struct kvm_mem_retired *retired;
+	struct kvm_mem_reader *reader;
+	unsigned int i = 0;
+
+	if (!map)
+		return;
+
+	retired = malloc(sizeof(*retired) +
+			 nr_kvm_mem_readers * sizeof(retired->snap[0]));
+	if (!retired) {
+		/* Leak it rather than risk a use after free */
+		pr_warning("Failed to retire memory map");
+		return;
+	}
+
+	/* Pairs with the fence in kvm__mem_read_begin() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	for (reader = kvm_mem_readers; reader; reader = reader->next) {
+		retired->snap[i].reader = reader;
+		retired->snap[i].seq = __atomic_load_n(&reader->seq,
+							__ATOMIC_ACQUIRE);
+		i++;
+	}
+
+	retired->map = map;
+	retired->nr = i;
+	retired->next = kvm_mem_retired;
+	kvm_mem_retired = retired;
+}
+
+/*
+ * Fill @map from the bank list and make it visible to guest_flat_to_host().
+ * Must be called with mem_banks_lock held.
+ */
+static void kvm__publish_mem_map(struct kvm *kvm, struct kvm_mem_map *map)
+{
+	struct kvm_mem_map *old = kvm->mem_map;
+	struct kvm_mem_bank *bank;
+
+	map->gen = kvm->mem_map_gen + 1;
+	map->nr = 0;
+	list_for_each_entry(bank, &kvm->mem_banks, list) {
+		map->entries[map->nr++] = (struct kvm_mem_map_entry) {
+			.guest_phys_addr	= bank->guest_phys_addr,
+			.size			= bank->size,
+			.host_addr		= bank->host_addr,
+		};
+	}
+	qsort(map->entries, map->nr, sizeof(map->entries[0]), mem_map_entry_cmp);
+
+	__atomic_store_n(&kvm->mem_map, map, __ATOMIC_RELEASE);
+	__atomic_store_n(&kvm->mem_map_gen, map->gen, __ATOMIC_RELEASE);
+
+	kvm__retire_mem_map(old);
+	kvm__reclaim_mem_maps();
+}
+
 int kvm__destroy_mem(struct kvm *kvm, u64 guest_phys, u64 size,
 		     void *userspace_addr)
 {
+	struct kvm_mem_map *map;
 	struct kvm_mem_bank *bank;
 	int ret;
 
 	mutex_lock(&kvm->mem_banks_lock);
+	map = kvm__alloc_mem_map(kvm, 0);
+	if (!map) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	list_for_each_entry(bank, &kvm->mem_banks, list)
 		if (bank->guest_phys_addr == guest_phys &&
 		    bank->size == size && bank->host_addr == userspace_addr)
@@ -302,9 +551,12 @@ int kvm__destroy_mem(struct kvm *kvm, u64 guest_phys, u64 size,
 	list_del(&bank->list);
 	free(bank);
 	kvm->mem_slots--;
+	kvm__publish_mem_map(kvm, map);
+	map = NULL;
 	ret = 0;
 
 out:
+	free(map);
 	mutex_unlock(&kvm->mem_banks_lock);
 	return ret;
 }
@@ -316,11 +568,18 @@ int kvm__register_mem(struct kvm *kvm, u64 guest_phys, u64 size,
 	struct kvm_mem_bank *merged = NULL;
 	struct kvm_mem_bank *bank;
 	struct list_head *prev_entry;
+	struct kvm_mem_map *map;
 	u32 slot;
 	u32 flags = 0;
 	int ret;
 
 	mutex_lock(&kvm->mem_banks_lock);
+	map = kvm__alloc_mem_map(kvm, 1);
+	if (!map) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	/* Check for overlap and find first empty slot. */
 	slot = 0;
 	prev_entry = &kvm->mem_banks;
@@ -372,6 +631,8 @@ int kvm__register_mem(struct kvm *kvm, u64 guest_phys, u64 size,
 	}
 
 	if (merged) {
+		kvm__publish_mem_map(kvm, map);
+		map = NULL;
 		ret = 0;
 		goto out;
 	}
@@ -408,28 +669,75 @@ int kvm__register_mem(struct kvm *kvm, u64 guest_phys, u64 size,
 
 	list_add(&bank->list, prev_entry);
 	kvm->mem_slots++;
+	kvm__publish_mem_map(kvm, map);
+	map = NULL;
 	ret = 0;
 
 out:
+	free(map);
 	mutex_unlock(&kvm->mem_banks_lock);
 	return ret;
 }
 
-void *guest_flat_to_host(struct kvm *kvm, u64 offset)
+static const struct kvm_mem_map_entry *
+kvm__mem_map_search(const struct kvm_mem_map *map, u64 offset)
 {
-	struct kvm_mem_bank *bank;
+	const struct kvm_mem_map_entry *entry;
+	unsigned int lo = 0, hi = map->nr;
 
-	list_for_each_entry(bank, &kvm->mem_banks, list) {
-		u64 bank_start = bank->guest_phys_addr;
-		u64 bank_end = bank_start + bank->size;
+	/* Find the last entry starting at or below offset */
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (map->entries[mid].guest_phys_addr <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo)
+		return NULL;
+
+	entry = &map->entries[lo - 1];
+	if (offset - entry->guest_phys_addr >= entry->size)
+		return NULL;
+
+	return entry;
+}
+
+/*
+ * Most threads keep hitting the same bank, usually guest RAM. The entry is
+ * copied, so that hits don't touch a map that may be freed.
+ */
+static __thread struct kvm_mem_map_entry last_entry;
+static __thread u64 last_gen;
+
+void *guest_flat_to_host(struct kvm *kvm, u64 offset)
+{
+	const struct kvm_mem_map_entry *entry;
+	const struct kvm_mem_map *map;
+	struct kvm_mem_reader *reader;
+
+	if (__atomic_load_n(&kvm->mem_map_gen, __ATOMIC_ACQUIRE) == last_gen &&
+	    offset - last_entry.guest_phys_addr < last_entry.size)
+		return last_entry.host_addr + (offset - last_entry.guest_phys_addr);
+
+	reader = kvm__mem_read_begin(kvm);
+	map = __atomic_load_n(&kvm->mem_map, __ATOMIC_ACQUIRE);
+	entry = map ? kvm__mem_map_search(map, offset) : NULL;
+	if (entry) {
+		last_entry = *entry;
+		last_gen = map->gen;
+	}
+	kvm__mem_read_end(reader);
 
-		if (offset >= bank_start && offset < bank_end)
-			return bank->host_addr + (offset - bank_start);
+	if (!entry) {
+		pr_warning("unable to translate guest address 0x%llx to host",
+			   (unsigned long long)offset);
+		return NULL;
 	}
 
-	pr_warning("unable to translate guest address 0x%llx to host",
-			(unsigned long long)offset);
-	return NULL;
+	return last_entry.host_addr + (offset - last_entry.guest_phys_addr);
 }
 
 u64 host_to_guest_flat(struct kvm *kvm, void *ptr)
@@ -1,5 +1,7 @@
 #include "kvm/kvm.h"
 #include "kvm/kvm-cpu.h"
+#include "kvm/devices.h"
+#include "kvm/exit-stats.h"
 #include "kvm/rbtree-interval.h"
 #include "kvm/mutex.h"
 
@@ -15,32 +17,309 @@
 
 #define mmio_node(n) rb_entry(n, struct mmio_mapping, node)
 
+/*
+ * The trees are only used to register and deregister handlers, with mmio_lock
+ * held. Every change publishes an immutable, sorted copy of the tree that the
+ * vCPUs search without taking any lock.
+ */
 static DEFINE_MUTEX(mmio_lock);
 
 struct mmio_mapping {
 	struct rb_int_node	node;
 	mmio_handler_fn		mmio_fn;
 	void			*ptr;
-	u32			refcount;
-	bool			remove;
 };
 
 static struct rb_root mmio_tree = RB_ROOT;
 static struct rb_root pio_tree = RB_ROOT;
 
-static struct mmio_mapping *mmio_search(struct rb_root *root, u64 addr, u64 len)
+struct mmio_map_entry {
+	u64			start;
+	u64			end;
+	mmio_handler_fn		mmio_fn;
+	void			*ptr;
+};
+
+struct mmio_map {
+	/* Unique for every published map, used to validate lookup caches */
+	u64			gen;
+	unsigned int		nr;
+	struct mmio_map_entry	entries[];
+};
+
+static struct mmio_map *mmio_map;
+static struct mmio_map *pio_map;
+static u64 mmio_map_gen;
+
+/*
+ * Threads dispatching an access make their sequence number odd while they may
+ * hold a reference to a map. A replaced map is freed once every thread that
+ * was dispatching when it was replaced has moved on.
+ */
+struct mmio_reader {
+	struct mmio_reader	*next;
+	u64			seq;
+	unsigned int		depth;
+};
+
+struct mmio_retired {
+	struct mmio_retired	*next;
+	struct mmio_map		*map;
+	unsigned int		nr;
+	struct {
+		struct mmio_reader *reader;
+		u64		seq;
+	} snap[];
+};
+
+static struct mmio_reader *mmio_readers;
+static unsigned int nr_mmio_readers;
+static struct mmio_retired *mmio_retired;
+
+static __thread struct mmio_reader *mmio_current_reader;
+/* Unregisters the reader of a thread when it exits */
+static pthread_key_t mmio_reader_key;
+static pthread_once_t mmio_reader_once = PTHREAD_ONCE_INIT;
+
+/* The last entry each thread hit, on each bus */
+static __thread struct mmio_map_entry last_mmio, last_pio;
+static __thread u64 last_mmio_gen, last_pio_gen;
+
+static void mmio_reclaim(void);
+
+static void mmio_reader_unregister(void *data)
 {
-	struct rb_int_node *node;
+	struct mmio_reader *reader = data, **prev;
+	struct mmio_retired *retired;
+	unsigned int i;
 
-	/* If len is zero or if there's an overflow, the MMIO op is invalid. */
-	if (addr + len <= addr)
+	mutex_lock(&mmio_lock);
+	for (prev = &mmio_readers; *prev != reader; prev = &(*prev)->next)
+		;
+	*prev = reader->next;
+	nr_mmio_readers--;
+
+	/* The thread is gone, it doesn't hold back any map */
+	for (retired = mmio_retired; retired; retired = retired->next) {
+		for (i = 0; i < retired->nr; i++) {
+			if (retired->snap[i].reader == reader)
+				retired->snap[i].reader = NULL;
+		}
+	}
+	mmio_reclaim();
+	mutex_unlock(&mmio_lock);
+
+	free(reader);
+}
+
+static void mmio_reader_key_init(void)
+{
+	if (pthread_key_create(&mmio_reader_key, mmio_reader_unregister))
+		die("Failed creating MMIO reader key");
+}
+
+static struct mmio_reader *mmio_reader_register(void)
+{
+	struct mmio_reader *reader;
+
+	pthread_once(&mmio_reader_once, mmio_reader_key_init);
+
+	reader = calloc(1, sizeof(*reader));
+	if (!reader)
+		die("Failed allocating MMIO reader");
+
+	mutex_lock(&mmio_lock);
+	reader->next = mmio_readers;
+	__atomic_store_n(&mmio_readers, reader, __ATOMIC_RELEASE);
+	nr_mmio_readers++;
+	mutex_unlock(&mmio_lock);
+
+	mmio_current_reader = reader;
+	pthread_setspecific(mmio_reader_key, reader);
+	return reader;
+}
+
+static struct mmio_reader *mmio_read_begin(void)
+{
+	struct mmio_reader *reader = mmio_current_reader;
+
+	if (!reader)
+		reader = mmio_reader_register();
+
+	/* Handlers may emulate accesses themselves */
+	if (reader->depth++ == 0) {
+		__atomic_store_n(&reader->seq, reader->seq + 1, __ATOMIC_RELAXED);
+		/* Order the store above before loading the map */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+
+	return reader;
+}
+
+static void mmio_read_end(struct mmio_reader *reader)
+{
+	if (--reader->depth == 0)
+		__atomic_store_n(&reader->seq, reader->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Called with mmio_lock held. */
+static void mmio_reclaim(void)
+{
+	struct mmio_retired **prev = &mmio_retired, *retired;
+	unsigned int i;
+	u64 seq;
+
+	while ((retired = *prev)) {
+		for (i = 0; i < retired->nr; i++) {
+			if (!retired->snap[i].reader)
+				continue;
+
+			seq = __atomic_load_n(&retired->snap[i].reader->seq,
+					      __ATOMIC_ACQUIRE);
+			if ((seq & 1) && seq == retired->snap[i].seq)
+				break;
+		}
+
+		if (i < retired->nr) {
+			prev = &retired->next;
+			continue;
+		}
+
+		*prev = retired->next;
+		free(retired->map);
+		free(retired);
+	}
+}
+
+/* Called with mmio_lock held, after the map has been replaced. */
+static void mmio_retire(struct mmio_map *map)
+{
+	struct mmio_retired *retired;
+	struct mmio_reader *reader;
+	unsigned int i = 0;
+
+	if (!map)
+		return;
+
+	retired = malloc(sizeof(*retired) +
+			 nr_mmio_readers * sizeof(retired->snap[0]));
+	if (!retired) {
+		/* Leak it rather than risk a use after free */
+		pr_warning("Failed to retire MMIO map");
+		return;
+	}
+
+	/* Pairs with the fence in mmio_read_begin() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	for (reader = mmio_readers; reader; reader = reader->next) {
+		retired->snap[i].reader = reader;
+		retired->snap[i].seq = __atomic_load_n(&reader->seq,
+							__ATOMIC_ACQUIRE);
+		i++;
+	}
+
+	retired->map = map;
+	retired->nr = i;
+	retired->next = mmio_retired;
+	mmio_retired = retired;
+}
+
+/* Called with mmio_lock held. */
+static int mmio_publish(struct rb_root *root, struct mmio_map **mapp)
+{
+	struct mmio_mapping *mmio;
+	struct mmio_map *map, *old;
+	struct rb_node *node;
+	unsigned int nr = 0;
+
+	for (node = rb_first(root); node; node = rb_next(node))
+		nr++;
+
+	map = malloc(sizeof(*map) + nr * sizeof(map->entries[0]));
+	if (!map)
+		return -ENOMEM;
+
+	map->gen = ++mmio_map_gen;
+	map->nr = 0;
+	for (node = rb_first(root); node; node = rb_next(node)) {
+		mmio = mmio_node(rb_int(node));
+		map->entries[map->nr++] = (struct mmio_map_entry) {
+			.start		= rb_int_start(&mmio->node),
+			.end		= mmio->node.high,
+			.mmio_fn	= mmio->mmio_fn,
+			.ptr		= mmio->ptr,
+		};
+	}
+
+	old = *mapp;
+	__atomic_store_n(mapp, map, __ATOMIC_RELEASE);
+
+	mmio_retire(old);
+	mmio_reclaim();
+
+	return 0;
+}
+
+static const struct mmio_map_entry *mmio_map_search(const struct mmio_map *map,
+						    u64 addr, u64 len)
+{
+	const struct mmio_map_entry *entry;
+	unsigned int lo = 0, hi, mid;
+
+	if (!map)
 		return NULL;
 
-	node = rb_int_search_range(root, addr, addr + len);
-	if (node == NULL)
+	/* Find the last entry starting at or below addr */
+	hi = map->nr;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (map->entries[mid].start <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == 0)
 		return NULL;
 
-	return mmio_node(node);
+	entry = &map->entries[lo - 1];
+	if (addr + len > entry->end)
+		return NULL;
+
+	return entry;
+}
+
+/*
+ * Look up the handler of an access in the current map, copying it to @entry.
+ * Must be called between mmio_read_begin() and mmio_read_end().
+ */
+static bool mmio_lookup(struct mmio_map **mapp, struct mmio_map_entry *last,
+			u64 *last_gen, u64 addr, u64 len,
+			struct mmio_map_entry *entry)
+{
+	const struct mmio_map_entry *found;
+	const struct mmio_map *map;
+
+	/* If len is zero or if there's an overflow, the MMIO op is invalid. */
+	if (addr + len <= addr)
+		return false;
+
+	map = __atomic_load_n(mapp, __ATOMIC_ACQUIRE);
+	if (map && map->gen == *last_gen &&
+	    addr >= last->start && addr + len <= last->end) {
+		*entry = *last;
+		return true;
+	}
+
+	found = mmio_map_search(map, addr, len);
+	if (!found)
+		return false;
+
+	*entry = *last = *found;
+	*last_gen = map->gen;
+
+	return true;
 }
 
 /* Find lowest match, Check for overlap */
@@ -73,25 +352,13 @@ static const char *to_direction(u8 is_write)
 	return "read";
 }
 
-static struct mmio_mapping *mmio_get(struct rb_root *root, u64 phys_addr, u32 len)
-{
-	struct mmio_mapping *mmio;
-
-	mutex_lock(&mmio_lock);
-	mmio = mmio_search(root, phys_addr, len);
-	if (mmio)
-		mmio->refcount++;
-	mutex_unlock(&mmio_lock);
-
-	return mmio;
-}
-
 /* Called with mmio_lock held. */
 static void mmio_deregister(struct kvm *kvm, struct rb_root *root, struct mmio_mapping *mmio)
 {
 	struct kvm_coalesced_mmio_zone zone = (struct kvm_coalesced_mmio_zone) {
 		.addr	= rb_int_start(&mmio->node),
 		.size	= 1,
+		.pio	= root == &pio_tree,
 	};
 	ioctl(kvm->vm_fd, KVM_UNREGISTER_COALESCED_MMIO, &zone);
 
@@ -99,15 +366,6 @@ static void mmio_deregister(struct kvm *kvm, struct rb_root *root, struct mmio_m
 	free(mmio);
 }
 
-static void mmio_put(struct kvm *kvm, struct rb_root *root, struct mmio_mapping *mmio)
-{
-	mutex_lock(&mmio_lock);
-	mmio->refcount--;
-	if (mmio->remove && mmio->refcount == 0)
-		mmio_deregister(kvm, root, mmio);
-	mutex_unlock(&mmio_lock);
-}
-
 static bool trap_is_mmio(unsigned int flags)
 {
 	return (flags & IOTRAP_BUS_MASK) == DEVICE_BUS_MMIO;
@@ -119,6 +377,8 @@ int kvm__register_iotrap(struct kvm *kvm, u64 phys_addr, u64 phys_addr_len,
 {
 	struct mmio_mapping *mmio;
 	struct kvm_coalesced_mmio_zone zone;
+	struct mmio_map **map;
+	struct rb_root *tree;
 	int ret;
 
 	mmio = malloc(sizeof(*mmio));
@@ -129,18 +389,14 @@ int kvm__register_iotrap(struct kvm *kvm, u64 phys_addr, u64 phys_addr_len,
 		.node		= RB_INT_INIT(phys_addr, phys_addr + phys_addr_len),
 		.mmio_fn	= mmio_fn,
 		.ptr		= ptr,
-		/*
-		 * Start from 0 because kvm__deregister_mmio() doesn't decrement
-		 * the reference count.
-		 */
-		.refcount	= 0,
-		.remove		= false,
 	};
 
-	if (trap_is_mmio(flags) && (flags & IOTRAP_COALESCE)) {
+	/* Needs KVM_CAP_COALESCED_MMIO, or KVM_CAP_COALESCED_PIO for ports */
+	if (flags & IOTRAP_COALESCE) {
 		zone = (struct kvm_coalesced_mmio_zone) {
 			.addr	= phys_addr,
 			.size	= phys_addr_len,
+			.pio	= !trap_is_mmio(flags),
 		};
 		ret = ioctl(kvm->vm_fd, KVM_REGISTER_COALESCED_MMIO, &zone);
 		if (ret < 0) {
@@ -149,25 +405,45 @@ int kvm__register_iotrap(struct kvm *kvm, u64 phys_addr, u64 phys_addr_len,
 		}
 	}
 
+	if (trap_is_mmio(flags)) {
+		tree = &mmio_tree;
+		map = &mmio_map;
+	} else {
+		tree = &pio_tree;
+		map = &pio_map;
+	}
+
 	mutex_lock(&mmio_lock);
-	if (trap_is_mmio(flags))
-		ret = mmio_insert(&mmio_tree, mmio);
-	else
-		ret = mmio_insert(&pio_tree, mmio);
+	ret = mmio_insert(tree, mmio);
+	if (!ret) {
+		ret = mmio_publish(tree, map);
+		if (ret)
+			mmio_remove(tree, mmio);
+	}
 	mutex_unlock(&mmio_lock);
 
+	if (ret) {
+		if (flags & IOTRAP_COALESCE)
+			ioctl(kvm->vm_fd, KVM_UNREGISTER_COALESCED_MMIO, &zone);
+		free(mmio);
+	}
+
 	return ret;
 }
 
 bool kvm__deregister_iotrap(struct kvm *kvm, u64 phys_addr, unsigned int flags)
 {
 	struct mmio_mapping *mmio;
+	struct mmio_map **map;
 	struct rb_root *tree;
 
-	if (trap_is_mmio(flags))
+	if (trap_is_mmio(flags)) {
 		tree = &mmio_tree;
-	else
+		map = &mmio_map;
+	} else {
 		tree = &pio_tree;
+		map = &pio_map;
+	}
 
 	mutex_lock(&mmio_lock);
 	mmio = mmio_search_single(tree, phys_addr);
@@ -177,19 +453,14 @@ bool kvm__deregister_iotrap(struct kvm *kvm, u64 phys_addr, unsigned int flags)
 	}
 	/*
 	 * The PCI emulation code calls this function when memory access is
-	 * disabled for a device, or when a BAR has a new address assigned. PCI
-	 * emulation doesn't use any locks and as a result we can end up in a
-	 * situation where we have called mmio_get() to do emulation on one VCPU
-	 * thread (let's call it VCPU0), and several other VCPU threads have
-	 * called kvm__deregister_mmio(). In this case, if we decrement refcount
-	 * kvm__deregister_mmio() (either directly, or by calling mmio_put()),
-	 * refcount will reach 0 and we will free the mmio node before VCPU0 has
-	 * called mmio_put(). This will trigger use-after-free errors on VCPU0.
+	 * disabled for a device, or when a BAR has a new address assigned,
+	 * possibly while other VCPUs are still emulating accesses to it.
+	 * Those VCPUs work on their own copy of the handler, taken from a map
+	 * that is only freed once they're done with it, so the node can go.
 	 */
-	if (mmio->refcount == 0)
-		mmio_deregister(kvm, tree, mmio);
-	else
-		mmio->remove = true;
+	mmio_deregister(kvm, tree, mmio);
+	if (mmio_publish(tree, map))
+		die("Failed to update the MMIO map");
 	mutex_unlock(&mmio_lock);
 
 	return true;
@@ -198,10 +469,13 @@ bool kvm__deregister_iotrap(struct kvm *kvm, u64 phys_addr, unsigned int flags)
 bool kvm__emulate_mmio(struct kvm_cpu *vcpu, u64 phys_addr, u8 *data,
 		       u32 len, u8 is_write)
 {
-	struct mmio_mapping *mmio;
+	struct mmio_map_entry mmio;
+	struct mmio_reader *reader;
+	u64 start;
 
-	mmio = mmio_get(&mmio_tree, phys_addr, len);
-	if (!mmio) {
+	reader = mmio_read_begin();
+	if (!mmio_lookup(&mmio_map, &last_mmio, &last_mmio_gen, phys_addr, len,
+			 &mmio)) {
 		if (vcpu->kvm->cfg.mmio_debug)
 			fprintf(stderr,	"MMIO warning: Ignoring MMIO %s at %016llx (length %u)\n",
 				to_direction(is_write),
@@ -212,21 +486,30 @@ bool kvm__emulate_mmio(struct kvm_cpu *vcpu, u64 phys_addr, u8 *data,
 		goto out;
 	}
 
-	mmio->mmio_fn(vcpu, phys_addr, data, len, is_write, mmio->ptr);
-	mmio_put(vcpu->kvm, &mmio_tree, mmio);
+	start = exit_stats__begin();
+	mmio.mmio_fn(vcpu, phys_addr, data, len, is_write, mmio.ptr);
+	if (start)
+		exit_stats__handler(vcpu, DEVICE_BUS_MMIO, mmio.start,
+				    mmio.end - mmio.start,
+				    (unsigned long)mmio.mmio_fn, start);
 
 out:
+	mmio_read_end(reader);
 	return true;
 }
 
 bool kvm__emulate_io(struct kvm_cpu *vcpu, u16 port, void *data,
 		     int direction, int size, u32 count)
 {
-	struct mmio_mapping *mmio;
+	struct mmio_map_entry mmio;
+	struct mmio_reader *reader;
 	bool is_write = direction == KVM_EXIT_IO_OUT;
+	u64 start;
 
-	mmio = mmio_get(&pio_tree, port, size);
-	if (!mmio) {
+	reader = mmio_read_begin();
+	if (!mmio_lookup(&pio_map, &last_pio, &last_pio_gen, port, size,
+			 &mmio)) {
+		mmio_read_end(reader);
 		if (vcpu->kvm->cfg.ioport_debug) {
 			fprintf(stderr, "IO error: %s port=%x, size=%d, count=%u\n",
 				to_direction(direction), port, size, count);
@@ -236,13 +519,18 @@ bool kvm__emulate_io(struct kvm_cpu *vcpu, u16 port, void *data,
 		return true;
 	}
 
+	start = exit_stats__begin();
 	while (count--) {
-		mmio->mmio_fn(vcpu, port, data, size, is_write, mmio->ptr);
+		mmio.mmio_fn(vcpu, port, data, size, is_write, mmio.ptr);
 
 		data += size;
 	}
+	if (start)
+		exit_stats__handler(vcpu, DEVICE_BUS_IOPORT, mmio.start,
+				    mmio.end - mmio.start,
+				    (unsigned long)mmio.mmio_fn, start);
 
-	mmio_put(vcpu->kvm, &pio_tree, mmio);
+	mmio_read_end(reader);
 
 	return true;
 }
@@ -0,0 +1,371 @@
+#include "kvm/placement.h"
+#include "kvm/kvm-cpu.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/kvm.h"
+#include "kvm/mutex.h"
+#include "kvm/read-write.h"
+#include "kvm/strbuf.h"
+#include "kvm/util.h"
+
+#include <linux/bitmap.h>
+#include <linux/cpumask.h>
+#include <linux/find.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/mempolicy.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Host placement of the VM. Threads inherit the affinity of the thread that
+ * creates them, so pinning the main thread to the I/O CPUs before anything is
+ * initialized covers every device and I/O thread. VCPU threads then pin
+ * themselves. Guest RAM gets a NUMA policy before it is allocated.
+ */
+
+/* Number of host NUMA nodes that --mem-nodes accepts */
+#define PLACEMENT_MAX_NODES	1024
+
+static cpu_set_t vcpu_cpus;
+static cpu_set_t io_cpus;
+/* Affinity before --io-affinity was applied, for VCPUs without their own */
+static cpu_set_t orig_cpus;
+static bool has_io_cpus;
+
+static unsigned long mem_nodes[BITS_TO_LONGS(PLACEMENT_MAX_NODES)];
+static int mem_policy = MPOL_DEFAULT;
+
+static void placement__parse_cpus(const char *opt, const char *cpulist,
+				  cpu_set_t *set)
+{
+	cpumask_t *cpumask;
+	int cpu;
+
+	cpumask = calloc(1, cpumask_size());
+	if (!cpumask)
+		die_perror("calloc");
+
+	if (cpulist_parse(cpulist, cpumask))
+		die("Invalid %s %s", opt, cpulist);
+
+	CPU_ZERO(set);
+	for_each_cpu(cpu, cpumask) {
+		if (cpu >= CPU_SETSIZE)
+			die("Invalid %s %s", opt, cpulist);
+		CPU_SET(cpu, set);
+	}
+
+	free(cpumask);
+
+	if (!CPU_COUNT(set))
+		die("Invalid %s %s", opt, cpulist);
+}
+
+static int placement__parse_policy(const char *policy)
+{
+	if (!policy || !strcmp(policy, "bind"))
+		return MPOL_BIND;
+	if (!strcmp(policy, "interleave"))
+		return MPOL_INTERLEAVE;
+	if (!strcmp(policy, "preferred"))
+		return MPOL_PREFERRED;
+
+	die("Unknown memory policy %s", policy);
+}
+
+static unsigned int placement__nr_nodes(void)
+{
+	unsigned int nr = 0;
+	unsigned long node;
+
+	for (node = find_next_bit(mem_nodes, PLACEMENT_MAX_NODES, 0);
+	     node < PLACEMENT_MAX_NODES;
+	     node = find_next_bit(mem_nodes, PLACEMENT_MAX_NODES, node + 1))
+		nr++;
+
+	return nr;
+}
+
+/* VCPU n runs on the n-th CPU of --vcpu-affinity, wrapping around */
+void placement__pin_vcpu(struct kvm_cpu *vcpu)
+{
+	cpu_set_t cpuset;
+	int cpu, n;
+
+	if (CPU_COUNT(&vcpu_cpus)) {
+		n = vcpu->cpu_id % CPU_COUNT(&vcpu_cpus);
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &vcpu_cpus) && n-- == 0)
+				break;
+		}
+
+		CPU_ZERO(&cpuset);
+		CPU_SET(cpu, &cpuset);
+	} else if (has_io_cpus) {
+		cpuset = orig_cpus;
+	} else {
+		return;
+	}
+
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset))
+		pr_warning("Failed to set the affinity of VCPU %lu",
+			   vcpu->cpu_id);
+}
+
+/* Allocations made until placement__reset_mem_policy() follow --mem-nodes */
+void placement__set_mem_policy(struct kvm *kvm)
+{
+	if (mem_policy == MPOL_DEFAULT)
+		return;
+
+	if (syscall(__NR_set_mempolicy, mem_policy, mem_nodes,
+		    PLACEMENT_MAX_NODES + 1) < 0)
+		pr_warning("Failed to set the memory policy: %d", errno);
+}
+
+void placement__reset_mem_policy(struct kvm *kvm)
+{
+	if (mem_policy == MPOL_DEFAULT)
+		return;
+
+	if (syscall(__NR_set_mempolicy, MPOL_DEFAULT, NULL, 0) < 0)
+		pr_warning("Failed to reset the memory policy: %d", errno);
+}
+
+/* Pages of the mapping that are allocated later follow --mem-nodes too */
+void placement__bind_mem(struct kvm *kvm, void *addr, u64 size)
+{
+	if (mem_policy == MPOL_DEFAULT)
+		return;
+
+	if (syscall(__NR_mbind, addr, size, mem_policy, mem_nodes,
+		    PLACEMENT_MAX_NODES + 1, 0) < 0)
+		pr_warning("Failed to bind guest RAM at %p to NUMA nodes %s: %d",
+			   addr, kvm->cfg.mem_nodes, errno);
+}
+
+static void placement__print_cpus(FILE *f, cpu_set_t *cpuset)
+{
+	const char *sep = "";
+	int cpu, last;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, cpuset))
+			continue;
+
+		for (last = cpu; last + 1 < CPU_SETSIZE; last++) {
+			if (!CPU_ISSET(last + 1, cpuset))
+				break;
+		}
+
+		if (last == cpu)
+			fprintf(f, "%s%d", sep, cpu);
+		else
+			fprintf(f, "%s%d-%d", sep, cpu, last);
+
+		sep = ",";
+		cpu = last;
+	}
+}
+
+/* The CPU a thread last ran on is field 39 of its stat file */
+static int placement__thread_cpu(int tid)
+{
+	char path[64], buf[1024], *p;
+	int field, fd, n;
+
+	snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+	buf[n] = '\0';
+
+	/* The name may contain spaces, count from the end of it */
+	p = strrchr(buf, ')');
+	for (field = 2; p && field < 39; field++)
+		p = strchr(p + 1, ' ');
+
+	return p ? atoi(p + 1) : -1;
+}
+
+static void placement__report_threads(FILE *f)
+{
+	char path[64], name[32];
+	struct dirent *de;
+	cpu_set_t cpuset;
+	DIR *dir;
+	int fd, n, tid;
+
+	dir = opendir("/proc/self/task");
+	if (!dir)
+		return;
+
+	fprintf(f, "%-8s %-20s %4s  %s\n", "tid", "thread", "cpu",
+		"allowed cpus");
+
+	while ((de = readdir(dir))) {
+		if (!isdigit(de->d_name[0]))
+			continue;
+
+		tid = atoi(de->d_name);
+		snprintf(path, sizeof(path), "/proc/self/task/%d/comm", tid);
+
+		n = -1;
+		fd = open(path, O_RDONLY);
+		if (fd >= 0) {
+			n = read(fd, name, sizeof(name) - 1);
+			close(fd);
+		}
+		if (n <= 0)
+			continue;
+
+		name[n] = '\0';
+		name[strcspn(name, "\n")] = '\0';
+
+		fprintf(f, "%-8d %-20s %4d  ", tid, name,
+			placement__thread_cpu(tid));
+		if (sched_getaffinity(tid, sizeof(cpuset), &cpuset) == 0)
+			placement__print_cpus(f, &cpuset);
+		fprintf(f, "\n");
+	}
+
+	closedir(dir);
+}
+
+static bool placement__is_ram(struct kvm *kvm, u64 host_addr)
+{
+	struct kvm_mem_bank *bank;
+	bool ret = false;
+
+	mutex_lock(&kvm->mem_banks_lock);
+	list_for_each_entry(bank, &kvm->mem_banks, list) {
+		if (bank->type != KVM_MEM_TYPE_RAM)
+			continue;
+
+		if (host_addr >= (u64)bank->host_addr &&
+		    host_addr < (u64)bank->host_addr + bank->size) {
+			ret = true;
+			break;
+		}
+	}
+	mutex_unlock(&kvm->mem_banks_lock);
+
+	return ret;
+}
+
+/* Print the policy and per-node page counts of the guest RAM mappings */
+static void placement__report_mem(struct kvm *kvm, FILE *f)
+{
+	char line[4096], *tok, *save, *p;
+	bool found = false;
+	FILE *maps;
+	u64 start;
+
+	fprintf(f, "\n%-16s %-20s %s\n", "guest RAM", "policy", "pages");
+
+	maps = fopen("/proc/self/numa_maps", "r");
+	if (!maps) {
+		fprintf(f, "NUMA information not available\n");
+		return;
+	}
+
+	while (fgets(line, sizeof(line), maps)) {
+		start = strtoull(line, &p, 16);
+		if (!placement__is_ram(kvm, start))
+			continue;
+
+		tok = strtok_r(p, " \n", &save);
+		if (!tok)
+			continue;
+
+		fprintf(f, "%-16llx %-20s", (unsigned long long)start, tok);
+		while ((tok = strtok_r(NULL, " \n", &save))) {
+			if ((tok[0] == 'N' && isdigit(tok[1])) ||
+			    !prefixcmp(tok, "kernelpagesize_kB="))
+				fprintf(f, " %s", tok);
+		}
+		fprintf(f, "\n");
+		found = true;
+	}
+
+	if (!found)
+		fprintf(f, "No guest RAM mapping found\n");
+
+	fclose(maps);
+}
+
+static void placement__handle(struct kvm *kvm, int fd, u32 type, u32 len,
+			      u8 *msg)
+{
+	size_t size = 0;
+	char *buf = NULL;
+	FILE *f;
+	u32 n;
+
+	if (WARN_ON(type != KVM_IPC_PLACEMENT || len))
+		return;
+
+	f = open_memstream(&buf, &size);
+	if (!f)
+		return;
+
+	placement__report_threads(f);
+	placement__report_mem(kvm, f);
+	fclose(f);
+
+	n = size;
+	if (write_in_full(fd, &n, sizeof(n)) < 0 ||
+	    write_in_full(fd, buf, n) < 0)
+		pr_warning("Failed sending placement");
+
+	free(buf);
+}
+
+/* Called before any thread is created or guest RAM is allocated */
+int placement__init(struct kvm *kvm)
+{
+	struct kvm_config *cfg = &kvm->cfg;
+
+	if (cfg->vcpu_affinity)
+		placement__parse_cpus("VCPU affinity", cfg->vcpu_affinity,
+				      &vcpu_cpus);
+
+	if (cfg->io_affinity) {
+		placement__parse_cpus("I/O affinity", cfg->io_affinity,
+				      &io_cpus);
+
+		if (sched_getaffinity(0, sizeof(orig_cpus), &orig_cpus) ||
+		    sched_setaffinity(0, sizeof(io_cpus), &io_cpus))
+			return -errno;
+		has_io_cpus = true;
+	}
+
+	if (cfg->mem_nodes) {
+		if (bitmap_parselist(cfg->mem_nodes, mem_nodes,
+				     PLACEMENT_MAX_NODES) ||
+		    !placement__nr_nodes())
+			die("Invalid NUMA nodes %s", cfg->mem_nodes);
+
+		mem_policy = placement__parse_policy(cfg->mem_policy);
+		if (mem_policy == MPOL_PREFERRED && placement__nr_nodes() > 1)
+			die("The preferred memory policy takes a single node");
+	} else if (cfg->mem_policy) {
+		die("--mem-policy needs --mem-nodes");
+	}
+
+	return kvm_ipc__register_handler(KVM_IPC_PLACEMENT, placement__handle);
+}
@@ -2,156 +2,305 @@
 #include "kvm/mutex.h"
 #include "kvm/kvm.h"
 
+#include <linux/cpumask.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 
-static DEFINE_MUTEX(job_mutex);
-static DEFINE_MUTEX(thread_mutex);
-static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+/*
+ * Every worker has its own queue. Jobs are submitted without locking to the
+ * inbox of a worker, a stack that whoever holds the worker lock moves to the
+ * queue. A worker that runs out of jobs steals from the others before going
+ * to sleep, so the locks are only contended when stealing.
+ */
+struct thread_pool__worker {
+	struct mutex		lock;
+	pthread_cond_t		cond;
+	/* Protected by lock */
+	struct list_head	jobs;
+	bool			kicked;
+	/* Lock-free submissions, newest first */
+	struct thread_pool__job	*inbox;
+	/* Jobs in inbox and jobs, peeked at by thieves */
+	int			queued;
+	bool			sleeping;
+	int			cpu;
+	pthread_t		thread;
+};
+
+static struct thread_pool__worker	*workers;
+static unsigned int			nr_workers;
+static unsigned int			nr_sleeping;
+static unsigned int			next_worker;
+static bool				running;
+
+/* Jobs submitted before the workers exist, handed to the first one */
+static struct thread_pool__job		*backlog;
+
+static __thread struct thread_pool__worker *current_worker;
+
+static void thread_pool__inbox_push(struct thread_pool__job **inbox,
+				    struct thread_pool__job *job)
+{
+	struct thread_pool__job *next = __atomic_load_n(inbox, __ATOMIC_RELAXED);
+
+	do {
+		job->next = next;
+	} while (!__atomic_compare_exchange_n(inbox, &next, job, true,
+					      __ATOMIC_SEQ_CST,
+					      __ATOMIC_RELAXED));
+}
 
-static LIST_HEAD(head);
+/* Move submitted jobs to the queue, oldest first */
+static void thread_pool__drain_inbox_locked(struct thread_pool__worker *w)
+{
+	struct thread_pool__job *job, *next;
+	LIST_HEAD(batch);
+
+	job = __atomic_exchange_n(&w->inbox, NULL, __ATOMIC_ACQUIRE);
+	for (; job; job = next) {
+		next = job->next;
+		list_add(&job->queue, &batch);
+	}
 
-static pthread_t	*threads;
-static long		threadcount;
-static bool		running;
+	list_splice_tail(&batch, &w->jobs);
+}
 
-static struct thread_pool__job *thread_pool__job_pop_locked(void)
+static struct thread_pool__job *
+thread_pool__job_take_locked(struct thread_pool__worker *w, bool steal)
 {
 	struct thread_pool__job *job;
 
-	if (list_empty(&head))
+	thread_pool__drain_inbox_locked(w);
+	if (list_empty(&w->jobs))
 		return NULL;
 
-	job = list_first_entry(&head, struct thread_pool__job, queue);
+	/* The owner takes the oldest job, thieves take the newest */
+	if (steal)
+		job = list_last_entry(&w->jobs, struct thread_pool__job, queue);
+	else
+		job = list_first_entry(&w->jobs, struct thread_pool__job, queue);
 	list_del_init(&job->queue);
+	__atomic_sub_fetch(&w->queued, 1, __ATOMIC_RELAXED);
 
 	return job;
 }
 
-static void thread_pool__job_push_locked(struct thread_pool__job *job)
+static struct thread_pool__job *
+thread_pool__job_take(struct thread_pool__worker *w, bool steal)
 {
-	list_add_tail(&job->queue, &head);
+	struct thread_pool__job *job;
+
+	if (__atomic_load_n(&w->queued, __ATOMIC_RELAXED) <= 0)
+		return NULL;
+
+	mutex_lock(&w->lock);
+	job = thread_pool__job_take_locked(w, steal);
+	mutex_unlock(&w->lock);
+
+	return job;
 }
 
-static struct thread_pool__job *thread_pool__job_pop(void)
+static struct thread_pool__job *
+thread_pool__job_steal(struct thread_pool__worker *self)
 {
 	struct thread_pool__job *job;
+	unsigned int i, id = self - workers;
 
-	mutex_lock(&job_mutex);
-	job = thread_pool__job_pop_locked();
-	mutex_unlock(&job_mutex);
-	return job;
+	for (i = 1; i < nr_workers; i++) {
+		job = thread_pool__job_take(&workers[(id + i) % nr_workers], true);
+		if (job)
+			return job;
+	}
+
+	return NULL;
 }
 
-static void thread_pool__job_push(struct thread_pool__job *job)
+static void thread_pool__wake(struct thread_pool__worker *w)
 {
-	mutex_lock(&job_mutex);
-	thread_pool__job_push_locked(job);
-	mutex_unlock(&job_mutex);
+	mutex_lock(&w->lock);
+	w->kicked = true;
+	pthread_cond_signal(&w->cond);
+	mutex_unlock(&w->lock);
 }
 
-static void thread_pool__handle_job(struct thread_pool__job *job)
+/* Wake a sleeping worker other than @busy, so that it steals from @busy */
+static void thread_pool__wake_thief(struct thread_pool__worker *busy)
 {
-	while (job) {
-		job->callback(job->kvm, job->data);
-
-		mutex_lock(&job->mutex);
+	unsigned int i, id = busy - workers;
+	struct thread_pool__worker *w;
+
+	for (i = 1; i < nr_workers; i++) {
+		w = &workers[(id + i) % nr_workers];
+		if (__atomic_load_n(&w->sleeping, __ATOMIC_RELAXED)) {
+			thread_pool__wake(w);
+			return;
+		}
+	}
+}
 
-		if (--job->signalcount > 0)
-			/* If the job was signaled again while we were working */
-			thread_pool__job_push(job);
+static void thread_pool__job_push(struct thread_pool__worker *w,
+				  struct thread_pool__job *job)
+{
+	__atomic_store_n(&job->worker, w - workers, __ATOMIC_RELEASE);
+	thread_pool__inbox_push(&w->inbox, job);
 
-		mutex_unlock(&job->mutex);
+	/*
+	 * Pairs with thread_pool__wait(), which sets sleeping before looking
+	 * at queued: either it sees the job, or we see it sleeping.
+	 */
+	__atomic_add_fetch(&w->queued, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&w->sleeping, __ATOMIC_SEQ_CST))
+		thread_pool__wake(w);
+	else if (__atomic_load_n(&nr_sleeping, __ATOMIC_RELAXED))
+		thread_pool__wake_thief(w);
+}
 
-		job = thread_pool__job_pop();
-	}
+static void thread_pool__wait(struct thread_pool__worker *w)
+{
+	mutex_lock(&w->lock);
+	__atomic_store_n(&w->sleeping, true, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&nr_sleeping, 1, __ATOMIC_RELAXED);
+
+	while (__atomic_load_n(&running, __ATOMIC_RELAXED) && !w->kicked &&
+	       __atomic_load_n(&w->queued, __ATOMIC_SEQ_CST) <= 0)
+		pthread_cond_wait(&w->cond, &w->lock.mutex);
+
+	w->kicked = false;
+	__atomic_sub_fetch(&nr_sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&w->sleeping, false, __ATOMIC_RELAXED);
+	mutex_unlock(&w->lock);
 }
 
-static void thread_pool__threadfunc_cleanup(void *param)
+static void thread_pool__handle_job(struct thread_pool__worker *w,
+				    struct thread_pool__job *job)
 {
-	mutex_unlock(&job_mutex);
+	job->callback(job->kvm, job->data);
+
+	/* If the job was signaled again while we were working */
+	if (__atomic_sub_fetch(&job->signalcount, 1, __ATOMIC_ACQ_REL) > 0)
+		thread_pool__job_push(w, job);
 }
 
 static void *thread_pool__threadfunc(void *param)
 {
-	pthread_cleanup_push(thread_pool__threadfunc_cleanup, NULL);
+	struct thread_pool__worker *w = param;
+	struct thread_pool__job *job;
+	cpu_set_t cpuset;
 
 	kvm__set_thread_name("threadpool-worker");
+	current_worker = w;
+
+	if (w->cpu >= 0) {
+		CPU_ZERO(&cpuset);
+		CPU_SET(w->cpu, &cpuset);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset))
+			pr_warning("Failed to pin threadpool worker to CPU %d",
+				   w->cpu);
+	}
 
-	while (running) {
-		struct thread_pool__job *curjob = NULL;
-
-		mutex_lock(&job_mutex);
-		while (running && (curjob = thread_pool__job_pop_locked()) == NULL)
-			pthread_cond_wait(&job_cond, &job_mutex.mutex);
-		mutex_unlock(&job_mutex);
+	while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+		job = thread_pool__job_take(w, false);
+		if (!job)
+			job = thread_pool__job_steal(w);
 
-		if (running)
-			thread_pool__handle_job(curjob);
+		if (job)
+			thread_pool__handle_job(w, job);
+		else
+			thread_pool__wait(w);
 	}
 
-	pthread_cleanup_pop(0);
-
 	return NULL;
 }
 
-static int thread_pool__addthread(void)
+/* Assign the CPUs of --threadpool-affinity to workers, round-robin */
+static void thread_pool__assign_cpus(struct kvm *kvm)
 {
-	int res;
-	void *newthreads;
+	const char *cpulist = kvm->cfg.threadpool_affinity;
+	cpumask_t *cpumask;
+	unsigned int i;
+	int cpu = -1;
 
-	mutex_lock(&thread_mutex);
-	newthreads = realloc(threads, (threadcount + 1) * sizeof(pthread_t));
-	if (newthreads == NULL) {
-		mutex_unlock(&thread_mutex);
-		return -1;
-	}
+	if (!cpulist)
+		return;
 
-	threads = newthreads;
+	cpumask = calloc(1, cpumask_size());
+	if (!cpumask)
+		die_perror("calloc");
 
-	res = pthread_create(threads + threadcount, NULL,
-			     thread_pool__threadfunc, NULL);
+	if (cpulist_parse(cpulist, cpumask))
+		die("Invalid threadpool affinity %s", cpulist);
 
-	if (res == 0)
-		threadcount++;
-	mutex_unlock(&thread_mutex);
+	for (i = 0; i < nr_workers; i++) {
+		cpu = cpumask_next(cpu, cpumask);
+		if (cpu >= NR_CPUS)
+			cpu = cpumask_next(-1, cpumask);
+		if (cpu >= NR_CPUS || cpu >= CPU_SETSIZE)
+			die("Invalid threadpool affinity %s", cpulist);
+		workers[i].cpu = cpu;
+	}
 
-	return res;
+	free(cpumask);
 }
 
 int thread_pool__init(struct kvm *kvm)
 {
-	unsigned long i;
-	unsigned int thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+	struct thread_pool__worker *w;
+	struct thread_pool__job *job, *next;
+	unsigned int i, nr;
+
+	nr = kvm->cfg.threadpool_size;
+	if (kvm->cfg.threadpool_size <= 0)
+		nr = sysconf(_SC_NPROCESSORS_ONLN);
+
+	w = calloc(nr, sizeof(*w));
+	if (!w)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		w[i] = (struct thread_pool__worker) {
+			.lock	= MUTEX_INITIALIZER,
+			.cond	= PTHREAD_COND_INITIALIZER,
+			.cpu	= -1,
+		};
+		INIT_LIST_HEAD(&w[i].jobs);
+	}
+
+	nr_workers = nr;
+	__atomic_store_n(&workers, w, __ATOMIC_RELEASE);
+	thread_pool__assign_cpus(kvm);
+
+	job = __atomic_exchange_n(&backlog, NULL, __ATOMIC_ACQUIRE);
+	for (; job; job = next) {
+		next = job->next;
+		thread_pool__job_push(&workers[0], job);
+	}
 
 	running = true;
 
-	for (i = 0; i < thread_count; i++)
-		if (thread_pool__addthread() < 0)
-			return i;
+	for (i = 0; i < nr_workers; i++) {
+		if (pthread_create(&workers[i].thread, NULL,
+				   thread_pool__threadfunc, &workers[i]))
+			die_perror("Failed to create threadpool worker");
+	}
 
-	return i;
+	return 0;
 }
 late_init(thread_pool__init);
 
 int thread_pool__exit(struct kvm *kvm)
 {
-	int i;
-	void *NUL = NULL;
+	unsigned int i;
 
-	running = false;
+	__atomic_store_n(&running, false, __ATOMIC_RELAXED);
 
-	for (i = 0; i < threadcount; i++) {
-		mutex_lock(&job_mutex);
-		pthread_cond_signal(&job_cond);
-		mutex_unlock(&job_mutex);
-	}
+	for (i = 0; i < nr_workers; i++)
+		thread_pool__wake(&workers[i]);
 
-	for (i = 0; i < threadcount; i++) {
-		pthread_join(threads[i], NUL);
-	}
+	for (i = 0; i < nr_workers; i++)
+		pthread_join(workers[i].thread, NULL);
 
 	return 0;
 }
@@ -159,24 +308,42 @@ late_exit(thread_pool__exit);
 
 void thread_pool__do_job(struct thread_pool__job *job)
 {
-	struct thread_pool__job *jobinfo = job;
+	struct thread_pool__worker *w = current_worker;
+	int worker;
 
-	if (jobinfo == NULL || jobinfo->callback == NULL)
+	if (job == NULL || job->callback == NULL)
 		return;
 
-	mutex_lock(&jobinfo->mutex);
-	if (jobinfo->signalcount++ == 0)
-		thread_pool__job_push(job);
-	mutex_unlock(&jobinfo->mutex);
+	/* Coalesce with a pending run */
+	if (__atomic_fetch_add(&job->signalcount, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	if (!__atomic_load_n(&workers, __ATOMIC_ACQUIRE)) {
+		thread_pool__inbox_push(&backlog, job);
+		return;
+	}
 
-	mutex_lock(&job_mutex);
-	pthread_cond_signal(&job_cond);
-	mutex_unlock(&job_mutex);
+	/*
+	 * Jobs queued from a worker stay on it. Otherwise a job goes back to
+	 * the queue it last used, and idle workers steal it if that one is
+	 * busy.
+	 */
+	if (!w) {
+		worker = __atomic_load_n(&job->worker, __ATOMIC_RELAXED);
+		if (worker < 0)
+			worker = __atomic_fetch_add(&next_worker, 1,
+						    __ATOMIC_RELAXED) % nr_workers;
+		w = &workers[worker];
+	}
+
+	thread_pool__job_push(w, job);
 }
 
 void thread_pool__cancel_job(struct thread_pool__job *job)
 {
+	struct thread_pool__worker *w;
 	bool running;
+	int worker;
 
 	/*
 	 * If the job is queued but not running, remove it. Otherwise, wait for
@@ -185,14 +352,25 @@ void thread_pool__cancel_job(struct thread_pool__job *job)
 	 * thread_pool__do_job() isn't called - while this function is running.
 	 */
 	do {
-		mutex_lock(&job_mutex);
+		worker = __atomic_load_n(&job->worker, __ATOMIC_ACQUIRE);
+		if (worker < 0 || !workers) {
+			running = __atomic_load_n(&job->signalcount,
+						  __ATOMIC_ACQUIRE) > 0;
+			continue;
+		}
+
+		w = &workers[worker];
+		mutex_lock(&w->lock);
+		thread_pool__drain_inbox_locked(w);
 		if (list_empty(&job->queue)) {
-			running = job->signalcount > 0;
+			running = __atomic_load_n(&job->signalcount,
+						  __ATOMIC_ACQUIRE) > 0;
 		} else {
 			list_del_init(&job->queue);
-			job->signalcount = 0;
+			__atomic_sub_fetch(&w->queued, 1, __ATOMIC_RELAXED);
+			__atomic_store_n(&job->signalcount, 0, __ATOMIC_RELEASE);
 			running = false;
 		}
-		mutex_unlock(&job_mutex);
+		mutex_unlock(&w->lock);
 	} while (running);
 }
@@ -5,6 +5,7 @@
 #include "kvm/util.h"
 
 #include <kvm/kvm.h>
+#include <kvm/placement.h>
 #include <linux/magic.h>	/* For HUGETLBFS_MAGIC */
 #include <linux/memfd.h>
 #include <sys/mman.h>
@@ -193,10 +194,13 @@ void *mmap_anon_or_hugetlbfs_align(struct kvm *kvm, const char *hugetlbfs_path,
 	if (addr_map == MAP_FAILED)
 		return MAP_FAILED;
 
+	/* The memory is allocated right away, on the requested nodes */
+	placement__set_mem_policy(kvm);
 	if (kvm->cfg.restricted_mem)
 		fd = guest_memfd_alloc(kvm, size, hugetlbfs_path, blk_size);
 	else
 		fd = memfd_alloc(kvm, size, hugetlbfs_path, blk_size);
+	placement__reset_mem_policy(kvm);
 	if (fd < 0)
 		return MAP_FAILED;
 
@@ -227,6 +231,8 @@ void *mmap_anon_or_hugetlbfs_align(struct kvm *kvm, const char *hugetlbfs_path,
 	if (end_off)
 		munmap((void *)((u64)addr_align + size), end_off);
 
+	placement__bind_mem(kvm, addr_align, size);
+
 	kvm->ram_fd = fd;
 	return addr_align;
 }
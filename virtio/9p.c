@@ -1306,13 +1306,22 @@ static p9_handler *virtio_9p_dotl_handler [] = {
 
 static struct p9_pdu *virtio_p9_pdu_init(struct kvm *kvm, struct virt_queue *vq)
 {
-	struct p9_pdu *pdu = calloc(1, sizeof(*pdu));
+	size_t nr_iovs = vq->vring.num;
+	struct iovec *iovs;
+	struct p9_pdu *pdu;
+
+	pdu = malloc(sizeof(*pdu) + 2 * nr_iovs * sizeof(*iovs));
 	if (!pdu)
 		return NULL;
 
-	/* skip the pdu header p9_msg */
-	pdu->read_offset	= VIRTIO_9P_HDR_LEN;
-	pdu->write_offset	= VIRTIO_9P_HDR_LEN;
+	iovs = (void *)(pdu + 1);
+	*pdu = (struct p9_pdu) {
+		/* skip the pdu header p9_msg */
+		.read_offset	= VIRTIO_9P_HDR_LEN,
+		.write_offset	= VIRTIO_9P_HDR_LEN,
+		.in_iov		= iovs,
+		.out_iov	= iovs + nr_iovs,
+	};
 	pdu->queue_head		= virt_queue__get_inout_iov(kvm, vq, pdu->in_iov,
 					pdu->out_iov, &pdu->in_iov_cnt, &pdu->out_iov_cnt);
 	return pdu;
@@ -1351,7 +1360,7 @@ static bool virtio_p9_do_io_request(struct kvm *kvm, struct p9_dev_job *job)
 		handler = virtio_9p_dotl_handler[cmd];
 
 	handler(p9dev, p9pdu, &len);
-	virt_queue__set_used_elem(vq, p9pdu->queue_head, len);
+	virt_queue__stage_used_elem(vq, p9pdu->queue_head, len);
 	free(p9pdu);
 	return true;
 }
@@ -1362,10 +1371,15 @@ static void virtio_p9_do_io(struct kvm *kvm, void *param)
 	struct p9_dev *p9dev   = job->p9dev;
 	struct virt_queue *vq  = job->vq;
 
-	while (virt_queue__available(vq)) {
-		virtio_p9_do_io_request(kvm, job);
+	do {
+		virt_queue__disable_notify(vq);
+
+		while (virt_queue__available(vq))
+			virtio_p9_do_io_request(kvm, job);
+	} while (virt_queue__enable_notify(vq));
+
+	if (virt_queue__publish_used(vq) && virtio_queue__should_signal(vq))
 		p9dev->vdev.ops->signal_vq(kvm, &p9dev->vdev, vq - p9dev->vqs);
-	}
 }
 
 static u8 *get_config(struct kvm *kvm, void *dev)
@@ -1414,7 +1428,8 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 	queue		= &p9dev->vqs[vq];
 	job		= &p9dev->jobs[vq];
 
-	virtio_init_device_vq(kvm, &p9dev->vdev, queue, VIRTQUEUE_NUM);
+	virtio_init_device_vq(kvm, &p9dev->vdev, queue,
+			      virt_queue__get_size(queue, p9dev->queue_size));
 
 	*job		= (struct p9_dev_job) {
 		.vq		= queue,
@@ -1450,13 +1465,17 @@ static struct virt_queue *get_vq(struct kvm *kvm, void *dev, u32 vq)
 
 static int get_size_vq(struct kvm *kvm, void *dev, u32 vq)
 {
-	return VIRTQUEUE_NUM;
+	struct p9_dev *p9dev = dev;
+
+	return virt_queue__get_size(&p9dev->vqs[vq], p9dev->queue_size);
 }
 
 static int set_size_vq(struct kvm *kvm, void *dev, u32 vq, int size)
 {
-	/* FIXME: dynamic */
-	return size;
+	struct p9_dev *p9dev = dev;
+
+	return virt_queue__set_size(&p9dev->vdev, &p9dev->vqs[vq], size,
+				    p9dev->queue_size);
 }
 
 static unsigned int get_vq_count(struct kvm *kvm, void *dev)
@@ -1480,22 +1499,32 @@ struct virtio_ops p9_dev_virtio_ops = {
 
 int virtio_9p_rootdir_parser(const struct option *opt, const char *arg, int unset)
 {
-	char *tag_name;
+	char *tag_name, *sep;
 	char tmp[PATH_MAX];
 	struct kvm *kvm = opt->ptr;
+	u16 queue_size = 0;
 
 	/*
-	 * 9p dir can be of the form dirname,tag_name or
-	 * just dirname. In the later case we use the
+	 * 9p dir can be of the form dirname,tag_name[,queue_size=<n>]
+	 * or just dirname. In the later case we use the
 	 * default tag name
 	 */
 	tag_name = strstr(arg, ",");
 	if (tag_name) {
 		*tag_name = '\0';
 		tag_name++;
+
+		sep = strstr(tag_name, ",");
+		if (sep) {
+			*sep = '\0';
+			if (strncmp(sep + 1, "queue_size=", 11) == 0)
+				queue_size = virtio_parse_queue_size(sep + 12);
+			else
+				die("Unknown 9p option %s", sep + 1);
+		}
 	}
 	if (realpath(arg, tmp)) {
-		if (virtio_9p__register(kvm, tmp, tag_name) < 0)
+		if (virtio_9p__register(kvm, tmp, tag_name, queue_size) < 0)
 			die("Unable to initialize virtio 9p");
 	} else
 		die("Failed resolving 9p path");
@@ -1516,7 +1545,7 @@ int virtio_9p_img_name_parser(const struct option *opt, const char *arg, int uns
 			die("Please use only one rootfs directory atmost");
 
 		if (realpath(arg, tmp) == 0 ||
-		    virtio_9p__register(kvm, tmp, "/dev/root") < 0)
+		    virtio_9p__register(kvm, tmp, "/dev/root", 0) < 0)
 			die("Unable to initialize virtio 9p");
 		kvm->cfg.using_rootfs = 1;
 		return 0;
@@ -1532,9 +1561,9 @@ int virtio_9p_img_name_parser(const struct option *opt, const char *arg, int uns
 			die("Please use only one rootfs directory atmost");
 
 		if (realpath(path, tmp) == 0 ||
-		    virtio_9p__register(kvm, tmp, "/dev/root") < 0)
+		    virtio_9p__register(kvm, tmp, "/dev/root", 0) < 0)
 			die("Unable to initialize virtio 9p");
-		if (virtio_9p__register(kvm, "/", "hostfs") < 0)
+		if (virtio_9p__register(kvm, "/", "hostfs", 0) < 0)
 			die("Unable to initialize virtio 9p");
 		kvm_setup_resolv(arg);
 		kvm->cfg.using_rootfs = kvm->cfg.custom_rootfs = 1;
@@ -1576,7 +1605,8 @@ int virtio_9p__exit(struct kvm *kvm)
 }
 virtio_dev_exit(virtio_9p__exit);
 
-int virtio_9p__register(struct kvm *kvm, const char *root, const char *tag_name)
+int virtio_9p__register(struct kvm *kvm, const char *root, const char *tag_name,
+			u16 queue_size)
 {
 	struct p9_dev *p9dev;
 	size_t tag_length;
@@ -1604,6 +1634,8 @@ int virtio_9p__register(struct kvm *kvm, const char *root, const char *tag_name)
 	strncpy(p9dev->root_dir, root, sizeof(p9dev->root_dir));
 	p9dev->root_dir[sizeof(p9dev->root_dir)-1] = '\x00';
 
+	p9dev->queue_size = queue_size ? queue_size : VIRTQUEUE_NUM;
+
 	p9dev->tag_len = tag_length;
 	if (p9dev->tag_len > MAX_TAG_LEN) {
 		err = -EINVAL;
@@ -120,10 +120,14 @@ static void virtio_bln_do_io(struct kvm *kvm, void *param)
 		return;
 	}
 
-	while (virt_queue__available(vq)) {
-		virtio_bln_do_io_request(kvm, &bdev, vq);
-		bdev.vdev.ops->signal_vq(kvm, &bdev.vdev, vq - bdev.vqs);
-	}
+	do {
+		virt_queue__disable_notify(vq);
+
+		while (virt_queue__available(vq)) {
+			virtio_bln_do_io_request(kvm, &bdev, vq);
+			bdev.vdev.ops->signal_vq(kvm, &bdev.vdev, vq - bdev.vqs);
+		}
+	} while (virt_queue__enable_notify(vq));
 }
 
 static int virtio_bln__collect_stats(struct kvm *kvm)
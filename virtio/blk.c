@@ -15,32 +15,66 @@
 
 #include <linux/virtio_ring.h>
 #include <linux/virtio_blk.h>
+#include <linux/byteorder.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
 #include <linux/types.h>
+#include <limits.h>
 #include <pthread.h>
 
 #define VIRTIO_BLK_MAX_DEV		4
 
 /*
- * the header and status consume too entries
+ * the header and status consume too entries, and the rest must fit in a
+ * single preadv() or io_uring READV
  */
-#define DISK_SEG_MAX			(VIRTIO_BLK_QUEUE_SIZE - 2)
+#define DISK_SEG_MAX(queue_size)	(min_t(u32, queue_size, IOV_MAX) - 2)
+/* Buffers of a request, as advertised through seg_max */
+#define DISK_REQ_IOV(queue_size)	(DISK_SEG_MAX(queue_size) + 2)
+/* Default maximum queue size, overridden with -d <image>,queue_size=<n> */
 #define VIRTIO_BLK_QUEUE_SIZE		256
-#define NUM_VIRT_QUEUES			1
+/* Default number of queues is one per VCPU, up to this */
+#define VIRTIO_BLK_MAX_QUEUES		32
+/* Limits of discard and write zeroes requests */
+#define VIRTIO_BLK_MAX_DISCARD_SECTORS	(1U << 22)
+#define VIRTIO_BLK_MAX_DISCARD_SEG	256
 
 struct blk_dev_req {
 	struct virt_queue		*vq;
 	struct blk_dev			*bdev;
-	struct iovec			iov[VIRTIO_BLK_QUEUE_SIZE];
+	struct blk_dev_queue		*queue;
+	/* DISK_REQ_IOV(queue_size) entries */
+	struct iovec			*iov;
 	u16				out, in, head;
 	u8				*status;
 	struct kvm			*kvm;
 };
 
-struct blk_dev {
-	struct mutex			mutex;
+/*
+ * Each queue has its own I/O thread, and submits to its own disk queue whose
+ * completions are reported by a single thread. Nothing is shared between
+ * queues.
+ */
+struct blk_dev_queue {
+	unsigned int			id;
+	struct blk_dev			*bdev;
+	struct virt_queue		vq;
+	/* Serializes synchronous and asynchronous completions */
+	struct mutex			lock;
+	/* One per descriptor of the queue size set by the driver */
+	struct blk_dev_req		*reqs;
+	struct iovec			*iovs;
+
+	pthread_t			io_thread;
+	int				io_efd;
+	/* Kick eventfd of the queue, read by io_thread directly */
+	int				kick_fd;
+	/* The disk signals completions on io_efd too, for io_thread to reap */
+	bool				reap;
+	struct virt_queue_poll		poll;
+};
 
+struct blk_dev {
 	struct list_head		list;
 
 	struct virtio_device		vdev;
@@ -48,11 +82,10 @@ struct blk_dev {
 	u64				capacity;
 	struct disk_image		*disk;
 
-	struct virt_queue		vqs[NUM_VIRT_QUEUES];
-	struct blk_dev_req		reqs[VIRTIO_BLK_QUEUE_SIZE];
-
-	pthread_t			io_thread;
-	int				io_efd;
+	struct blk_dev_queue		queues[VIRTIO_BLK_MAX_QUEUES];
+	u16				num_queues;
+	/* Largest queue offered to the driver */
+	u16				queue_size;
 
 	struct kvm			*kvm;
 };
@@ -63,20 +96,86 @@ static int compat_id = -1;
 void virtio_blk_complete(void *param, long len)
 {
 	struct blk_dev_req *req = param;
-	struct blk_dev *bdev = req->bdev;
-	int queueid = req->vq - bdev->vqs;
+	struct blk_dev_queue *queue = req->queue;
 	u8 *status;
 
 	/* status */
 	status = req->status;
-	*status	= (len < 0) ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+	if (len == -EOPNOTSUPP)
+		*status = VIRTIO_BLK_S_UNSUPP;
+	else
+		*status	= (len < 0) ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+
+	/* Published by virtio_blk_complete_batch() */
+	mutex_lock(&queue->lock);
+	virt_queue__stage_used_elem(req->vq, req->head, len);
+	mutex_unlock(&queue->lock);
+}
+
+static void virtio_blk_complete_batch(void *param, unsigned int id)
+{
+	struct blk_dev *bdev = param;
+	struct blk_dev_queue *queue = &bdev->queues[id];
+	bool signal;
 
-	mutex_lock(&bdev->mutex);
-	virt_queue__set_used_elem(req->vq, req->head, len);
-	mutex_unlock(&bdev->mutex);
+	mutex_lock(&queue->lock);
+	signal = virt_queue__publish_used(&queue->vq) &&
+		 virtio_queue__should_signal(&queue->vq);
+	mutex_unlock(&queue->lock);
 
-	if (virtio_queue__should_signal(&bdev->vqs[queueid]))
-		bdev->vdev.ops->signal_vq(req->kvm, &bdev->vdev, queueid);
+	if (signal)
+		bdev->vdev.ops->signal_vq(bdev->kvm, &bdev->vdev, id);
+}
+
+static bool virtio_blk_can_discard(struct blk_dev *bdev)
+{
+	return bdev->disk->ops->discard && !bdev->disk->readonly;
+}
+
+/* Segments are processed in order, the request fails at the first error */
+static ssize_t virtio_blk_discard(struct blk_dev *bdev, u32 type,
+				  struct iovec *iov, size_t iovcount)
+{
+	struct virtio_blk_discard_write_zeroes seg;
+	u16 endian = bdev->vdev.endian;
+	u32 flags, seg_flags, nr_sectors;
+	unsigned int nr_segs = 0;
+	ssize_t ret = 0;
+
+	if (iov_size(iov, iovcount) % sizeof(seg))
+		return -EINVAL;
+
+	while (!ret && iov_size(iov, iovcount)) {
+		if (++nr_segs > VIRTIO_BLK_MAX_DISCARD_SEG)
+			return -EINVAL;
+
+		memcpy_fromiovec_safe(&seg, &iov, sizeof(seg), &iovcount);
+		nr_sectors = virtio_guest_to_host_u32(endian, seg.num_sectors);
+		seg_flags = virtio_guest_to_host_u32(endian, seg.flags);
+
+		if (type == VIRTIO_BLK_T_DISCARD) {
+			/* The unmap flag is only valid for write zeroes */
+			if (seg_flags)
+				return -EOPNOTSUPP;
+			flags = DISK_DISCARD_UNMAP;
+		} else {
+			if (seg_flags & ~VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP)
+				return -EOPNOTSUPP;
+			flags = DISK_DISCARD_ZERO;
+			if (seg_flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP)
+				flags |= DISK_DISCARD_UNMAP;
+		}
+
+		if (nr_sectors > VIRTIO_BLK_MAX_DISCARD_SECTORS)
+			return -EINVAL;
+
+		ret = disk_image__discard(bdev->disk,
+					  virtio_guest_to_host_u64(endian,
+								   seg.sector),
+					  nr_sectors, flags);
+	}
+
+	return ret;
 }
 
 static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, struct blk_dev_req *req)
@@ -119,13 +218,20 @@ static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, str
 
 	switch (type) {
 	case VIRTIO_BLK_T_IN:
-		disk_image__read(bdev->disk, sector, iov, iovcount, req);
+		disk_image__read(bdev->disk, req->queue->id, sector, iov,
+				 iovcount, req);
 		break;
 	case VIRTIO_BLK_T_OUT:
-		disk_image__write(bdev->disk, sector, iov, iovcount, req);
+		disk_image__write(bdev->disk, req->queue->id, sector, iov,
+				  iovcount, req);
 		break;
 	case VIRTIO_BLK_T_FLUSH:
-		len = disk_image__flush(bdev->disk);
+		disk_image__flush_queue(bdev->disk, req->queue->id, req);
+		break;
+	case VIRTIO_BLK_T_DISCARD:
+	case VIRTIO_BLK_T_WRITE_ZEROES:
+		/* The segments are device readable, only the status is written */
+		len = virtio_blk_discard(bdev, type, iov, iovcount);
 		virtio_blk_complete(req, len);
 		break;
 	case VIRTIO_BLK_T_GET_ID:
@@ -139,20 +245,63 @@ static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, str
 	}
 }
 
-static void virtio_blk_do_io(struct kvm *kvm, struct virt_queue *vq, struct blk_dev *bdev)
+static void virtio_blk_fail_request(struct blk_dev_queue *queue, u16 head)
 {
+	struct blk_dev *bdev = queue->bdev;
+	u8 *status;
+
+	pr_warning("Request with too many buffers");
+
+	status = virt_queue__get_last_in(&queue->vq, head, bdev->kvm);
+	if (!status) {
+		/* Not even a status byte, the driver is broken */
+		virtio_set_needs_reset(bdev->kvm, &bdev->vdev);
+		return;
+	}
+
+	*status = VIRTIO_BLK_S_IOERR;
+
+	mutex_lock(&queue->lock);
+	virt_queue__stage_used_elem(&queue->vq, head, 1);
+	mutex_unlock(&queue->lock);
+}
+
+static void virtio_blk_do_io(struct kvm *kvm, struct blk_dev_queue *queue)
+{
+	struct virt_queue *vq = &queue->vq;
 	struct blk_dev_req *req;
 	u16 head;
 
-	while (virt_queue__available(vq)) {
-		head		= virt_queue__pop(vq);
-		req		= &bdev->reqs[head];
-		req->head	= virt_queue__get_head_iov(vq, req->iov, &req->out,
-					&req->in, head, kvm);
-		req->vq		= vq;
+	/* Requests of the whole drain go to the disk together */
+	disk_image__plug(queue->bdev->disk, queue->id);
 
-		virtio_blk_do_io_request(kvm, vq, req);
-	}
+	/* Kicks are pointless while we're still walking the ring */
+	do {
+		virt_queue__disable_notify(vq);
+
+		while (virt_queue__available(vq)) {
+			head		= virt_queue__pop(vq);
+			req		= &queue->reqs[head];
+			req->head	= head;
+			req->vq		= vq;
+
+			/* More buffers than seg_max, only the status is set */
+			if (virt_queue__get_head_iov_max(vq, req->iov,
+					DISK_REQ_IOV(queue->bdev->queue_size),
+					&req->out, &req->in, head, kvm) < 0) {
+				virtio_blk_fail_request(queue, head);
+				continue;
+			}
+
+			virtio_blk_do_io_request(kvm, vq, req);
+		}
+	} while (virt_queue__enable_notify(vq));
+
+	disk_image__unplug(queue->bdev->disk, queue->id);
+
+	/* Requests that completed synchronously, or that the disk completed */
+	disk_image__reap(queue->bdev->disk, queue->id);
+	virtio_blk_complete_batch(queue->bdev, queue->id);
 }
 
 static u8 *get_config(struct kvm *kvm, void *dev)
@@ -178,6 +327,10 @@ static u64 get_host_features(struct kvm *kvm, void *dev)
 		| 1UL << VIRTIO_RING_F_EVENT_IDX
 		| 1UL << VIRTIO_RING_F_INDIRECT_DESC
 		| 1UL << VIRTIO_F_ANY_LAYOUT
+		| (bdev->num_queues > 1 ? 1UL << VIRTIO_BLK_F_MQ : 0)
+		| (virtio_blk_can_discard(bdev) ?
+		   1UL << VIRTIO_BLK_F_DISCARD |
+		   1UL << VIRTIO_BLK_F_WRITE_ZEROES : 0)
 		| (bdev->disk->readonly ? 1UL << VIRTIO_BLK_F_RO : 0);
 }
 
@@ -185,27 +338,49 @@ static void notify_status(struct kvm *kvm, void *dev, u32 status)
 {
 	struct blk_dev *bdev = dev;
 	struct virtio_blk_config *conf = &bdev->blk_config;
+	u16 endian = bdev->vdev.endian;
 
 	if (!(status & VIRTIO__STATUS_CONFIG))
 		return;
 
 	conf->capacity = virtio_host_to_guest_u64(bdev->vdev.endian, bdev->capacity);
-	conf->seg_max = virtio_host_to_guest_u32(bdev->vdev.endian, DISK_SEG_MAX);
+	conf->seg_max = virtio_host_to_guest_u32(bdev->vdev.endian,
+						 DISK_SEG_MAX(bdev->queue_size));
+	conf->num_queues = virtio_host_to_guest_u16(bdev->vdev.endian,
+						    bdev->num_queues);
+
+	if (virtio_blk_can_discard(bdev)) {
+		conf->max_discard_sectors = virtio_host_to_guest_u32(endian,
+					VIRTIO_BLK_MAX_DISCARD_SECTORS);
+		conf->max_discard_seg = virtio_host_to_guest_u32(endian,
+					VIRTIO_BLK_MAX_DISCARD_SEG);
+		conf->discard_sector_alignment = virtio_host_to_guest_u32(endian, 1);
+		conf->max_write_zeroes_sectors = virtio_host_to_guest_u32(endian,
+					VIRTIO_BLK_MAX_DISCARD_SECTORS);
+		conf->max_write_zeroes_seg = virtio_host_to_guest_u32(endian,
+					VIRTIO_BLK_MAX_DISCARD_SEG);
+		conf->write_zeroes_may_unmap = 1;
+	}
 }
 
-static void *virtio_blk_thread(void *dev)
+static void *virtio_blk_thread(void *p)
 {
-	struct blk_dev *bdev = dev;
+	struct blk_dev_queue *queue = p;
 	u64 data;
 	int r;
 
 	kvm__set_thread_name("virtio-blk-io");
 
 	while (1) {
-		r = read(bdev->io_efd, &data, sizeof(u64));
+		r = read(queue->io_efd, &data, sizeof(u64));
 		if (r < 0)
 			continue;
-		virtio_blk_do_io(bdev->kvm, &bdev->vqs[0], bdev);
+		/* Completions can't be told apart from kicks when reaping */
+		if (queue->io_efd == queue->kick_fd && !queue->reap)
+			virt_queue__stat_add(&queue->vq, kicks, data);
+		do {
+			virtio_blk_do_io(queue->bdev->kvm, queue);
+		} while (virt_queue__poll(&queue->vq, &queue->poll));
 	}
 
 	pthread_exit(NULL);
@@ -215,29 +390,54 @@ static void *virtio_blk_thread(void *dev)
 static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	unsigned int i;
+	int r;
 	struct blk_dev *bdev = dev;
+	struct blk_dev_queue *queue = &bdev->queues[vq];
+	u16 size = virt_queue__get_size(&queue->vq, bdev->queue_size);
 
 	compat__remove_message(compat_id);
 
-	virtio_init_device_vq(kvm, &bdev->vdev, &bdev->vqs[vq],
-			      VIRTIO_BLK_QUEUE_SIZE);
-
-	if (vq != 0)
-		return 0;
+	virtio_init_device_vq(kvm, &bdev->vdev, &queue->vq, size);
+
+	queue->id = vq;
+	queue->bdev = bdev;
+	queue->reqs = calloc(size, sizeof(*queue->reqs));
+	queue->iovs = calloc((size_t)size * DISK_REQ_IOV(bdev->queue_size),
+			     sizeof(*queue->iovs));
+	if (!queue->reqs || !queue->iovs) {
+		free(queue->reqs);
+		free(queue->iovs);
+		queue->reqs = NULL;
+		queue->iovs = NULL;
+		return -ENOMEM;
+	}
 
-	for (i = 0; i < ARRAY_SIZE(bdev->reqs); i++) {
-		bdev->reqs[i] = (struct blk_dev_req) {
+	for (i = 0; i < size; i++) {
+		queue->reqs[i] = (struct blk_dev_req) {
 			.bdev = bdev,
+			.queue = queue,
+			.iov = queue->iovs + i * DISK_REQ_IOV(bdev->queue_size),
 			.kvm = kvm,
 		};
 	}
 
-	mutex_init(&bdev->mutex);
-	bdev->io_efd = eventfd(0, 0);
-	if (bdev->io_efd < 0)
-		return -errno;
+	mutex_init(&queue->lock);
+	virt_queue__poll_init(&queue->poll, bdev->disk->poll_us);
+	if (queue->kick_fd > 0) {
+		/* Guest kicks wake the io thread without an extra hop */
+		queue->io_efd = queue->kick_fd;
+	} else {
+		queue->io_efd = eventfd(0, 0);
+		if (queue->io_efd < 0)
+			return -errno;
+	}
+
+	r = disk_image__set_queue_eventfd(bdev->disk, vq, queue->io_efd);
+	if (r < 0)
+		return r;
+	queue->reap = r;
 
-	if (pthread_create(&bdev->io_thread, NULL, virtio_blk_thread, bdev))
+	if (pthread_create(&queue->io_thread, NULL, virtio_blk_thread, queue))
 		return -errno;
 
 	return 0;
@@ -246,15 +446,24 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 static void exit_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct blk_dev *bdev = dev;
-
-	if (vq != 0)
-		return;
-
-	close(bdev->io_efd);
-	pthread_cancel(bdev->io_thread);
-	pthread_join(bdev->io_thread, NULL);
+	struct blk_dev_queue *queue = &bdev->queues[vq];
+
+	pthread_cancel(queue->io_thread);
+	pthread_join(queue->io_thread, NULL);
+	/* Left to disk_image__wait() from now on */
+	disk_image__set_queue_eventfd(bdev->disk, vq, -1);
+	queue->reap = false;
+	/* The transport closes the kick eventfd */
+	if (queue->io_efd != queue->kick_fd)
+		close(queue->io_efd);
+	queue->kick_fd = 0;
 
 	disk_image__wait(bdev->disk);
+
+	free(queue->reqs);
+	free(queue->iovs);
+	queue->reqs = NULL;
+	queue->iovs = NULL;
 }
 
 static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
@@ -263,35 +472,55 @@ static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
 	u64 data = 1;
 	int r;
 
-	r = write(bdev->io_efd, &data, sizeof(data));
+	if (vq >= bdev->num_queues)
+		return -EINVAL;
+
+	r = write(bdev->queues[vq].io_efd, &data, sizeof(data));
 	if (r < 0)
 		return r;
 
 	return 0;
 }
 
+static void notify_vq_eventfd(struct kvm *kvm, void *dev, u32 vq, u32 efd)
+{
+	struct blk_dev *bdev = dev;
+
+	bdev->queues[vq].kick_fd = efd;
+}
+
+static bool owns_vq_eventfd(struct kvm *kvm, void *dev, u32 vq)
+{
+	return true;
+}
+
 static struct virt_queue *get_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct blk_dev *bdev = dev;
 
-	return &bdev->vqs[vq];
+	return &bdev->queues[vq].vq;
 }
 
 static int get_size_vq(struct kvm *kvm, void *dev, u32 vq)
 {
-	/* FIXME: dynamic */
-	return VIRTIO_BLK_QUEUE_SIZE;
+	struct blk_dev *bdev = dev;
+
+	return virt_queue__get_size(&bdev->queues[vq].vq, bdev->queue_size);
 }
 
 static int set_size_vq(struct kvm *kvm, void *dev, u32 vq, int size)
 {
-	/* FIXME: dynamic */
-	return size;
+	struct blk_dev *bdev = dev;
+
+	return virt_queue__set_size(&bdev->vdev, &bdev->queues[vq].vq, size,
+				    bdev->queue_size);
 }
 
 static unsigned int get_vq_count(struct kvm *kvm, void *dev)
 {
-	return NUM_VIRT_QUEUES;
+	struct blk_dev *bdev = dev;
+
+	return bdev->num_queues;
 }
 
 static struct virtio_ops blk_dev_virtio_ops = {
@@ -303,6 +532,8 @@ static struct virtio_ops blk_dev_virtio_ops = {
 	.exit_vq		= exit_vq,
 	.notify_status		= notify_status,
 	.notify_vq		= notify_vq,
+	.notify_vq_eventfd	= notify_vq_eventfd,
+	.owns_vq_eventfd	= owns_vq_eventfd,
 	.get_vq			= get_vq,
 	.get_size_vq		= get_size_vq,
 	.set_size_vq		= set_size_vq,
@@ -323,9 +554,23 @@ static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk)
 	*bdev = (struct blk_dev) {
 		.disk			= disk,
 		.capacity		= disk->size / SECTOR_SIZE,
+		.queue_size		= disk->queue_size,
+		.num_queues		= disk->num_queues,
 		.kvm			= kvm,
 	};
 
+	if (!bdev->queue_size)
+		bdev->queue_size = VIRTIO_BLK_QUEUE_SIZE;
+	if (!bdev->num_queues)
+		bdev->num_queues = kvm->nrcpus;
+	bdev->num_queues = min_t(u16, bdev->num_queues, VIRTIO_BLK_MAX_QUEUES);
+
+	r = disk_image__set_queues(disk, bdev->num_queues);
+	if (r < 0) {
+		free(bdev);
+		return r;
+	}
+
 	list_add_tail(&bdev->list, &bdevs);
 
 	r = virtio_init(kvm, bdev, &bdev->vdev, &blk_dev_virtio_ops,
@@ -335,6 +580,8 @@ static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk)
 		return r;
 
 	disk_image__set_callback(bdev->disk, virtio_blk_complete);
+	disk_image__set_batch_callback(bdev->disk, virtio_blk_complete_batch,
+				       bdev);
 
 	if (compat_id == -1)
 		compat_id = virtio_compat_add_message("virtio-blk", "CONFIG_VIRTIO_BLK");
@@ -0,0 +1,171 @@
+#include "kvm/virtio.h"
+#include "kvm/epoll.h"
+#include "kvm/mutex.h"
+#include "kvm/util.h"
+
+#include <sys/timerfd.h>
+
+/*
+ * Interrupt coalescing. Instead of injecting an interrupt every time a device
+ * signals a queue, the transport defers it until either max_frames buffers
+ * have been used since the last interrupt, or max_usecs have elapsed since the
+ * first deferred signal. A single thread handles the timers of all queues.
+ */
+static struct kvm__epoll coalesce_epoll;
+
+static void virt_queue__arm_coalesce(struct virt_queue_coalesce *c, u32 usecs)
+{
+	struct itimerspec its = {
+		.it_value = {
+			.tv_sec		= usecs / 1000000,
+			.tv_nsec	= (usecs % 1000000) * 1000,
+		},
+	};
+
+	/* A zero value disarms the timer */
+	if (timerfd_settime(c->timer_fd, 0, &its, NULL) < 0)
+		pr_warning("Failed to arm coalescing timer: %d", errno);
+}
+
+/* The state is kept across resets of the queue, so this only runs once */
+void virt_queue__init_coalesce(struct virt_queue *vq)
+{
+	struct virt_queue_coalesce *c = &vq->coalesce;
+
+	if (c->initialised)
+		return;
+
+	mutex_init(&c->lock);
+	c->timer_fd = -1;
+	c->initialised = true;
+}
+
+int virt_queue__set_coalesce(struct virt_queue *vq, u32 max_frames,
+			     u32 max_usecs)
+{
+	struct virt_queue_coalesce *c = &vq->coalesce;
+	struct epoll_event ev = {
+		.events		= EPOLLIN,
+		.data.ptr	= vq,
+	};
+	int fd;
+
+	if (max_usecs && c->timer_fd < 0) {
+		fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (fd < 0)
+			return -errno;
+
+		if (epoll_ctl(coalesce_epoll.fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			close(fd);
+			return -errno;
+		}
+
+		c->timer_fd = fd;
+	}
+
+	/* A pending interrupt is still sent by the timer */
+	mutex_lock(&c->lock);
+	c->max_frames = max_frames;
+	c->max_usecs = max_usecs;
+	mutex_unlock(&c->lock);
+
+	return 0;
+}
+
+void virt_queue__exit_coalesce(struct virt_queue *vq)
+{
+	struct virt_queue_coalesce *c = &vq->coalesce;
+
+	if (!c->initialised || c->timer_fd < 0)
+		return;
+
+	/*
+	 * The flush thread may still handle an event of this timer. It finds
+	 * timer_fd < 0 under the lock, which virtio_exit_vq leaves alone.
+	 */
+	mutex_lock(&c->lock);
+	epoll_ctl(coalesce_epoll.fd, EPOLL_CTL_DEL, c->timer_fd, NULL);
+	close(c->timer_fd);
+	c->timer_fd = -1;
+	c->pending = false;
+	c->max_frames = 0;
+	c->max_usecs = 0;
+	mutex_unlock(&c->lock);
+}
+
+/*
+ * Called by the transport before injecting the interrupt of queue @idx.
+ * Returns false if the interrupt is deferred, in which case the flush thread
+ * calls @inject later.
+ */
+bool virt_queue__coalesce_irq(struct virt_queue *vq, u32 idx,
+			      virtio_inject_fn inject)
+{
+	struct virt_queue_coalesce *c = &vq->coalesce;
+	u64 used;
+	bool now;
+
+	if (!c->max_usecs && !c->pending)
+		return true;
+
+	mutex_lock(&c->lock);
+
+	used = vq->stats.used;
+	now = !c->max_usecs || c->max_frames == 1 ||
+	      (c->max_frames && used - c->used_irq >= c->max_frames);
+
+	if (now) {
+		if (c->pending)
+			virt_queue__arm_coalesce(c, 0);
+		c->pending = false;
+		c->used_irq = used;
+	} else if (!c->pending) {
+		c->pending = true;
+		c->idx = idx;
+		c->inject = inject;
+		virt_queue__arm_coalesce(c, c->max_usecs);
+	}
+
+	mutex_unlock(&c->lock);
+
+	if (!now)
+		virt_queue__stat_add_atomic(vq, irqs_coalesced, 1);
+
+	return now;
+}
+
+static void virt_queue__flush_coalesce(struct kvm *kvm, struct epoll_event *ev)
+{
+	struct virt_queue *vq = ev->data.ptr;
+	struct virt_queue_coalesce *c = &vq->coalesce;
+	u64 expirations;
+	bool flush = false;
+
+	mutex_lock(&c->lock);
+
+	/* The timer may have been disarmed or removed in the meantime */
+	if (c->timer_fd >= 0 &&
+	    read(c->timer_fd, &expirations, sizeof(expirations)) > 0) {
+		flush = c->pending;
+		c->pending = false;
+		c->used_irq = vq->stats.used;
+	}
+
+	mutex_unlock(&c->lock);
+
+	if (flush)
+		c->inject(kvm, vq->vdev, c->idx);
+}
+
+static int virtio_coalesce__init(struct kvm *kvm)
+{
+	return epoll__init(kvm, &coalesce_epoll, "virtio-irq",
+			   virt_queue__flush_coalesce);
+}
+dev_base_init(virtio_coalesce__init);
+
+static int virtio_coalesce__exit(struct kvm *kvm)
+{
+	return epoll__exit(&coalesce_epoll);
+}
+dev_base_exit(virtio_coalesce__exit);
@@ -68,6 +68,15 @@ static void virtio_console__inject_interrupt_callback(struct kvm *kvm, void *par
 		cdev.vdev.ops->signal_vq(kvm, &cdev.vdev, vq - cdev.vqs);
 	}
 
+	/*
+	 * Input is driven by the terminal, so we only need a kick when the
+	 * driver adds buffers after we ran out of them.
+	 */
+	if (virt_queue__available(vq))
+		virt_queue__disable_notify(vq);
+	else
+		virt_queue__enable_notify(vq);
+
 	mutex_unlock(&cdev.mutex);
 }
 
@@ -98,12 +107,15 @@ static void virtio_console_handle_callback(struct kvm *kvm, void *param)
 	 * So there is no need to inject an interrupt for the tx path.
 	 */
 
-	while (virt_queue__available(vq)) {
-		head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
-		len = term_putc_iov(iov, out, 0);
-		virt_queue__set_used_elem(vq, head, len);
-	}
+	do {
+		virt_queue__disable_notify(vq);
 
+		while (virt_queue__available(vq)) {
+			head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
+			len = term_putc_iov(iov, out, 0);
+			virt_queue__set_used_elem(vq, head, len);
+		}
+	} while (virt_queue__enable_notify(vq));
 }
 
 static u8 *get_config(struct kvm *kvm, void *dev)
@@ -1,6 +1,8 @@
 #include <linux/virtio_ring.h>
+#include <linux/virtio_ids.h>
 #include <linux/types.h>
 #include <sys/uio.h>
+#include <limits.h>
 #include <stdlib.h>
 
 #include "kvm/guest_compat.h"
@@ -10,6 +12,13 @@
 #include "kvm/virtio-mmio.h"
 #include "kvm/util.h"
 #include "kvm/kvm.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/mutex.h"
+#include "kvm/read-write.h"
+
+/* All initialized devices, for lkvm stat */
+static LIST_HEAD(virtio_devices);
+static DEFINE_MUTEX(virtio_devices_lock);
 
 
 const char* virtio_trans_name(enum virtio_trans trans)
@@ -51,10 +60,44 @@ int virtio_transport_parser(const struct option *opt, const char *arg, int unset
 	return 0;
 }
 
+static void virt_queue__used_idx_advance_packed(struct virt_queue *queue)
+{
+	struct virt_queue_packed *packed = &queue->packed;
+	u16 idx = packed->used_idx;
+
+	if (!packed->used_pending)
+		return;
+
+	/*
+	 * The driver consumes used descriptors in ring order, so the whole
+	 * batch becomes visible once the flags of the first one are set. Make
+	 * sure that all the other descriptors are written before that.
+	 */
+	wmb();
+	packed->desc[idx].flags = virtio_host_to_guest_u16(queue->endian,
+							   packed->used_flags);
+
+	idx += packed->used_pending;
+	if (idx >= queue->vring.num) {
+		idx -= queue->vring.num;
+		packed->used_wrap = !packed->used_wrap;
+		/* The last signalled index is meaningless after a wrap */
+		packed->signalled_valid = false;
+	}
+	packed->used_idx = idx;
+	packed->used_pending = 0;
+}
+
 void virt_queue__used_idx_advance(struct virt_queue *queue, u16 jump)
 {
-	u16 idx = virtio_guest_to_host_u16(queue->endian,
-					   queue->vring.used->idx);
+	u16 idx;
+
+	if (queue->use_packed) {
+		virt_queue__used_idx_advance_packed(queue);
+		return;
+	}
+
+	idx = virtio_guest_to_host_u16(queue->endian, queue->vring.used->idx);
 
 	/*
 	 * Use wmb to assure that used elem was updated with head and len.
@@ -66,12 +109,58 @@ void virt_queue__used_idx_advance(struct virt_queue *queue, u16 jump)
 	queue->vring.used->idx = virtio_host_to_guest_u16(queue->endian, idx);
 }
 
+/*
+ * Write a used descriptor for buffer @head after the ones already pending. The
+ * flags of the first pending descriptor are only written when the batch is
+ * published, since they hand the whole batch over to the driver.
+ */
+static void virt_queue__set_used_elem_packed(struct virt_queue *queue,
+					     u32 head, u32 len)
+{
+	struct virt_queue_packed *packed = &queue->packed;
+	struct vring_packed_desc *desc;
+	bool wrap = packed->used_wrap;
+	u16 idx, flags = 0;
+
+	idx = packed->used_idx + packed->used_pending;
+	if (idx >= queue->vring.num) {
+		idx -= queue->vring.num;
+		wrap = !wrap;
+	}
+
+	if (wrap)
+		flags = 1 << VRING_PACKED_DESC_F_AVAIL |
+			1 << VRING_PACKED_DESC_F_USED;
+
+	desc		= &packed->desc[idx];
+	desc->id	= virtio_host_to_guest_u16(queue->endian, head);
+	desc->len	= virtio_host_to_guest_u32(queue->endian, len);
+
+	if (packed->used_pending)
+		desc->flags = virtio_host_to_guest_u16(queue->endian, flags);
+	else
+		packed->used_flags = flags;
+
+	packed->used_pending += packed->bufs[head].ndescs;
+}
+
 struct vring_used_elem *
 virt_queue__set_used_elem_no_update(struct virt_queue *queue, u32 head,
 				    u32 len, u16 offset)
 {
 	struct vring_used_elem *used_elem;
-	u16 idx = virtio_guest_to_host_u16(queue->endian, queue->vring.used->idx);
+	u16 idx;
+
+	virt_queue__stat_add(queue, used, 1);
+	virt_queue__stat_add(queue, bytes_in, len);
+
+	/* Packed used descriptors are always appended in order */
+	if (queue->use_packed) {
+		virt_queue__set_used_elem_packed(queue, head, len);
+		return NULL;
+	}
+
+	idx = virtio_guest_to_host_u16(queue->endian, queue->vring.used->idx);
 
 	idx += offset;
 	used_elem	= &queue->vring.used->ring[idx % queue->vring.num];
@@ -85,12 +174,38 @@ struct vring_used_elem *virt_queue__set_used_elem(struct virt_queue *queue, u32
 {
 	struct vring_used_elem *used_elem;
 
-	used_elem = virt_queue__set_used_elem_no_update(queue, head, len, 0);
-	virt_queue__used_idx_advance(queue, 1);
+	/* Publishes any staged element along with this one */
+	used_elem = virt_queue__set_used_elem_no_update(queue, head, len,
+							queue->used_staged);
+	virt_queue__used_idx_advance(queue, queue->used_staged + 1);
+	queue->used_staged = 0;
 
 	return used_elem;
 }
 
+/*
+ * Batched completion: stage any number of used elements, then hand them all
+ * over to the guest with a single barrier and index update. The caller
+ * serializes these against other used ring updates of the queue, and decides
+ * once per batch whether to signal the guest.
+ */
+void virt_queue__stage_used_elem(struct virt_queue *queue, u32 head, u32 len)
+{
+	virt_queue__set_used_elem_no_update(queue, head, len, queue->used_staged++);
+}
+
+/* Returns true if there was anything to publish */
+bool virt_queue__publish_used(struct virt_queue *queue)
+{
+	if (!queue->used_staged)
+		return false;
+
+	virt_queue__used_idx_advance(queue, queue->used_staged);
+	queue->used_staged = 0;
+
+	return true;
+}
+
 static inline bool virt_desc__test_flag(struct virt_queue *vq,
 					struct vring_desc *desc, u16 flag)
 {
@@ -117,7 +232,146 @@ static unsigned next_desc(struct virt_queue *vq, struct vring_desc *desc,
 	return min(next, max);
 }
 
-u16 virt_queue__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 *out, u16 *in, u16 head, struct kvm *kvm)
+static inline bool virt_packed_desc__test_flag(struct virt_queue *vq,
+					       struct vring_packed_desc *desc,
+					       u16 flag)
+{
+	return !!(virtio_guest_to_host_u16(vq->endian, desc->flags) & flag);
+}
+
+u16 virt_queue__pop_packed(struct virt_queue *queue)
+{
+	struct virt_queue_packed *packed = &queue->packed;
+	struct vring_packed_desc *desc;
+	u16 pos, id, ndescs = 0;
+	bool wrap;
+
+	/*
+	 * The driver makes the first descriptor of a chain available after
+	 * writing the rest of it. Ensure that we read the updated chain once
+	 * virt_queue__available() observes the new flags.
+	 */
+	rmb();
+
+	pos = queue->last_avail_idx;
+	wrap = packed->avail_wrap;
+	do {
+		desc = &packed->desc[pos];
+		ndescs++;
+		if (++pos == queue->vring.num) {
+			pos = 0;
+			wrap = !wrap;
+		}
+	} while (virt_packed_desc__test_flag(queue, desc, VRING_DESC_F_NEXT) &&
+		 ndescs < queue->vring.num);
+
+	/* The buffer ID is only valid in the last descriptor of a chain */
+	id = virtio_guest_to_host_u16(queue->endian, desc->id);
+	/* Ensure it's not leading us off end of the buffer table. */
+	id = min_t(u16, id, queue->vring.num - 1);
+
+	packed->bufs[id] = (struct virt_queue_packed_buf) {
+		.pos	= queue->last_avail_idx,
+		.ndescs	= ndescs,
+	};
+
+	queue->last_avail_idx = pos;
+	packed->avail_wrap = wrap;
+
+	if (queue->state != VIRT_QUEUE_BUSY)
+		virt_queue__set_state(queue, VIRT_QUEUE_BUSY);
+
+	return id;
+}
+
+static void virt_packed_desc__add_iov(struct virt_queue *vq,
+				      struct vring_packed_desc *desc,
+				      struct iovec in_iov[],
+				      struct iovec out_iov[],
+				      u16 *in, u16 *out, struct kvm *kvm)
+{
+	bool write = virt_packed_desc__test_flag(vq, desc, VRING_DESC_F_WRITE);
+	struct iovec *iov;
+
+	/* Without in_iov, descriptors are stored in chain order in out_iov */
+	if (!in_iov)
+		iov = &out_iov[*out + *in];
+	else
+		iov = write ? &in_iov[*in] : &out_iov[*out];
+
+	iov->iov_len = virtio_guest_to_host_u32(vq->endian, desc->len);
+	iov->iov_base = guest_flat_to_host(kvm,
+					   virtio_guest_to_host_u64(vq->endian, desc->addr));
+	if (write) {
+		(*in)++;
+	} else {
+		(*out)++;
+		virt_queue__stat_add(vq, bytes_out, iov->iov_len);
+	}
+}
+
+static void virt_queue__get_packed_iov(struct virt_queue *vq, u16 head,
+				       struct iovec in_iov[],
+				       struct iovec out_iov[],
+				       u16 *in, u16 *out, struct kvm *kvm)
+{
+	struct virt_queue_packed_buf *buf = &vq->packed.bufs[head];
+	struct vring_packed_desc *desc, *table;
+	u16 i, j, idx, max;
+
+	*out = *in = 0;
+	idx = buf->pos;
+
+	for (i = 0; i < buf->ndescs; i++) {
+		desc = &vq->packed.desc[idx];
+
+		if (virt_packed_desc__test_flag(vq, desc, VRING_DESC_F_INDIRECT)) {
+			max = virtio_guest_to_host_u32(vq->endian, desc->len) / sizeof(*table);
+			table = guest_flat_to_host(kvm, virtio_guest_to_host_u64(vq->endian, desc->addr));
+			for (j = 0; j < max; j++)
+				virt_packed_desc__add_iov(vq, &table[j], in_iov,
+							  out_iov, in, out, kvm);
+		} else {
+			virt_packed_desc__add_iov(vq, desc, in_iov, out_iov,
+						  in, out, kvm);
+		}
+
+		if (++idx == vq->vring.num)
+			idx = 0;
+	}
+
+	virt_queue__stat_add(vq, descs, *in + *out);
+}
+
+/* Number of buffers of a packed chain, including those of indirect tables */
+static u32 virt_queue__packed_count(struct virt_queue *vq, u16 head)
+{
+	struct virt_queue_packed_buf *buf = &vq->packed.bufs[head];
+	struct vring_packed_desc *desc;
+	u32 nr = 0;
+	u16 i, idx;
+
+	idx = buf->pos;
+	for (i = 0; i < buf->ndescs; i++) {
+		desc = &vq->packed.desc[idx];
+
+		if (virt_packed_desc__test_flag(vq, desc, VRING_DESC_F_INDIRECT))
+			nr += (u16)(virtio_guest_to_host_u32(vq->endian, desc->len) /
+				    sizeof(*desc));
+		else
+			nr++;
+
+		if (++idx == vq->vring.num)
+			idx = 0;
+	}
+
+	return nr;
+}
+
+/* Stores at most max_iov buffers, returns false when the chain is longer */
+static bool virt_queue__get_split_iov(struct virt_queue *vq, struct iovec iov[],
+				      u32 max_iov, u16 *out, u16 *in, u16 head,
+				      struct kvm *kvm)
 {
 	struct vring_desc *desc;
 	u16 idx;
@@ -135,20 +389,136 @@ u16 virt_queue__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 *out
 	}
 
 	do {
+		if (*out + *in == max_iov)
+			return false;
+
 		/* Grab the first descriptor, and check it's OK. */
 		iov[*out + *in].iov_len = virtio_guest_to_host_u32(vq->endian, desc[idx].len);
 		iov[*out + *in].iov_base = guest_flat_to_host(kvm,
 							      virtio_guest_to_host_u64(vq->endian, desc[idx].addr));
 		/* If this is an input descriptor, increment that count. */
-		if (virt_desc__test_flag(vq, &desc[idx], VRING_DESC_F_WRITE))
+		if (virt_desc__test_flag(vq, &desc[idx], VRING_DESC_F_WRITE)) {
 			(*in)++;
-		else
+		} else {
 			(*out)++;
+			virt_queue__stat_add(vq, bytes_out,
+					     iov[*out + *in - 1].iov_len);
+		}
 	} while ((idx = next_desc(vq, desc, idx, max)) != max);
 
+	virt_queue__stat_add(vq, descs, *out + *in);
+
+	return true;
+}
+
+u16 virt_queue__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 *out, u16 *in, u16 head, struct kvm *kvm)
+{
+	if (vq->use_packed)
+		virt_queue__get_packed_iov(vq, head, NULL, iov, in, out, kvm);
+	else
+		virt_queue__get_split_iov(vq, iov, UINT_MAX, out, in, head, kvm);
+
 	return head;
 }
 
+/*
+ * Like virt_queue__get_head_iov(), for devices that advertise a maximum
+ * number of buffers per request. Returns -E2BIG, without storing more than
+ * max_iov buffers, when the chain of head is longer.
+ */
+int virt_queue__get_head_iov_max(struct virt_queue *vq, struct iovec iov[],
+				 u16 max_iov, u16 *out, u16 *in, u16 head,
+				 struct kvm *kvm)
+{
+	*out = *in = 0;
+
+	if (vq->use_packed) {
+		if (virt_queue__packed_count(vq, head) > max_iov)
+			return -E2BIG;
+
+		virt_queue__get_packed_iov(vq, head, NULL, iov, in, out, kvm);
+		return 0;
+	}
+
+	if (!virt_queue__get_split_iov(vq, iov, max_iov, out, in, head, kvm))
+		return -E2BIG;
+
+	return 0;
+}
+
+/* The last byte of a packed chain the device can write, or NULL */
+static void *virt_queue__packed_last_in(struct virt_queue *vq, u16 head,
+					struct kvm *kvm)
+{
+	struct virt_queue_packed_buf *buf = &vq->packed.bufs[head];
+	struct vring_packed_desc *desc, *table, *last = NULL;
+	u16 i, j, idx, max;
+
+	idx = buf->pos;
+	for (i = 0; i < buf->ndescs; i++) {
+		desc = &vq->packed.desc[idx];
+
+		if (virt_packed_desc__test_flag(vq, desc, VRING_DESC_F_INDIRECT)) {
+			max = virtio_guest_to_host_u32(vq->endian, desc->len) / sizeof(*table);
+			table = guest_flat_to_host(kvm, virtio_guest_to_host_u64(vq->endian, desc->addr));
+			for (j = 0; j < max; j++) {
+				if (virt_packed_desc__test_flag(vq, &table[j], VRING_DESC_F_WRITE) &&
+				    table[j].len)
+					last = &table[j];
+			}
+		} else if (virt_packed_desc__test_flag(vq, desc, VRING_DESC_F_WRITE) &&
+			   desc->len) {
+			last = desc;
+		}
+
+		if (++idx == vq->vring.num)
+			idx = 0;
+	}
+
+	if (!last)
+		return NULL;
+
+	return guest_flat_to_host(kvm, virtio_guest_to_host_u64(vq->endian, last->addr)) +
+	       virtio_guest_to_host_u32(vq->endian, last->len) - 1;
+}
+
+/*
+ * The last byte of the chain of head that the device can write, or NULL if
+ * there is none. Lets devices report the failure of requests whose buffers
+ * they couldn't get, such as chains longer than they advertise.
+ */
+void *virt_queue__get_last_in(struct virt_queue *vq, u16 head, struct kvm *kvm)
+{
+	struct vring_desc *desc, *last = NULL;
+	u16 idx, max, n = 0;
+
+	if (vq->use_packed)
+		return virt_queue__packed_last_in(vq, head, kvm);
+
+	idx = head;
+	max = vq->vring.num;
+	desc = vq->vring.desc;
+
+	if (virt_desc__test_flag(vq, &desc[idx], VRING_DESC_F_INDIRECT)) {
+		max = virtio_guest_to_host_u32(vq->endian, desc[idx].len) / sizeof(struct vring_desc);
+		desc = guest_flat_to_host(kvm, virtio_guest_to_host_u64(vq->endian, desc[idx].addr));
+		idx = 0;
+	}
+
+	/* A chain can't be longer than its table, unless it loops */
+	do {
+		if (virt_desc__test_flag(vq, &desc[idx], VRING_DESC_F_WRITE) &&
+		    desc[idx].len)
+			last = &desc[idx];
+	} while (++n < max && (idx = next_desc(vq, desc, idx, max)) != max);
+
+	if (!last)
+		return NULL;
+
+	return guest_flat_to_host(kvm, virtio_guest_to_host_u64(vq->endian, last->addr)) +
+	       virtio_guest_to_host_u32(vq->endian, last->len) - 1;
+}
+
 u16 virt_queue__get_iov(struct virt_queue *vq, struct iovec iov[], u16 *out, u16 *in, struct kvm *kvm)
 {
 	u16 head;
@@ -167,6 +537,13 @@ u16 virt_queue__get_inout_iov(struct kvm *kvm, struct virt_queue *queue,
 	u16 head, idx;
 
 	idx = head = virt_queue__pop(queue);
+
+	if (queue->use_packed) {
+		virt_queue__get_packed_iov(queue, head, in_iov, out_iov, in,
+					   out, kvm);
+		return head;
+	}
+
 	*out = *in = 0;
 	do {
 		u64 addr;
@@ -179,6 +556,7 @@ u16 virt_queue__get_inout_iov(struct kvm *kvm, struct virt_queue *queue,
 		} else {
 			out_iov[*out].iov_base = guest_flat_to_host(kvm, addr);
 			out_iov[*out].iov_len = virtio_guest_to_host_u32(queue->endian, desc->len);
+			virt_queue__stat_add(queue, bytes_out, out_iov[*out].iov_len);
 			(*out)++;
 		}
 		if (virt_desc__test_flag(queue, desc, VRING_DESC_F_NEXT))
@@ -187,6 +565,8 @@ u16 virt_queue__get_inout_iov(struct kvm *kvm, struct virt_queue *queue,
 			break;
 	} while (1);
 
+	virt_queue__stat_add(queue, descs, *out + *in);
+
 	return head;
 }
 
@@ -197,10 +577,47 @@ void virtio_init_device_vq(struct kvm *kvm, struct virtio_device *vdev,
 
 	vq->endian		= vdev->endian;
 	vq->use_event_idx	= (vdev->features & (1UL << VIRTIO_RING_F_EVENT_IDX));
+	vq->use_packed		= (vdev->features & (1ULL << VIRTIO_F_RING_PACKED));
 	vq->enabled		= true;
 	vq->vdev		= vdev;
 
-	if (addr->legacy) {
+	virt_queue__init_coalesce(vq);
+
+	if (vq->use_packed) {
+		u64 desc = (u64)addr->desc_hi << 32 | addr->desc_lo;
+		u64 driver = (u64)addr->avail_hi << 32 | addr->avail_lo;
+		u64 device = (u64)addr->used_hi << 32 | addr->used_lo;
+		u16 flags = vq->use_event_idx ? VRING_PACKED_EVENT_FLAG_DESC :
+						VRING_PACKED_EVENT_FLAG_ENABLE;
+		u16 off_wrap;
+
+		free(vq->packed.bufs);
+		vq->packed = (struct virt_queue_packed) {
+			.desc		= guest_flat_to_host(kvm, desc),
+			.driver		= guest_flat_to_host(kvm, driver),
+			.device		= guest_flat_to_host(kvm, device),
+			.bufs		= calloc(nr_descs, sizeof(*vq->packed.bufs)),
+			.avail_wrap	= true,
+			.used_wrap	= true,
+		};
+		if (!vq->packed.bufs)
+			die("Failed allocating packed virtqueue state");
+
+		vq->vring.num = nr_descs;
+
+		/*
+		 * With EVENT_IDX the driver kicks when it makes this descriptor
+		 * available, so it must be valid before the first kick.
+		 */
+		off_wrap = vq->last_avail_idx |
+			   vq->packed.avail_wrap << VRING_PACKED_EVENT_F_WRAP_CTR;
+		vq->packed.device->off_wrap = virtio_host_to_guest_u16(vq->endian,
+								       off_wrap);
+		/* The event offset must be visible before the flags */
+		wmb();
+		vq->packed.device->flags = virtio_host_to_guest_u16(vq->endian,
+								    flags);
+	} else if (addr->legacy) {
 		unsigned long base = (u64)addr->pfn * addr->pgsize;
 		void *p = guest_flat_to_host(kvm, base);
 
@@ -226,7 +643,33 @@ void virtio_exit_vq(struct kvm *kvm, struct virtio_device *vdev,
 
 	if (vq->enabled && vdev->ops->exit_vq)
 		vdev->ops->exit_vq(kvm, dev, num);
-	memset(vq, 0, sizeof(*vq));
+	virt_queue__exit_coalesce(vq);
+	free(vq->packed.bufs);
+	memset(vq, 0, offsetof(struct virt_queue, coalesce));
+}
+
+void virtio_notify_vq(struct kvm *kvm, struct virtio_device *vdev, u32 vq)
+{
+	struct virt_queue *queue;
+
+	if (vq < vdev->ops->get_vq_count(kvm, vdev->dev)) {
+		queue = vdev->ops->get_vq(kvm, vdev->dev, vq);
+		virt_queue__stat_add_atomic(queue, kicks, 1);
+	}
+
+	vdev->ops->notify_vq(kvm, vdev->dev, vq);
+}
+
+/*
+ * Whether the kick eventfd of @vq is consumed by the device itself. Vhost
+ * queues are consumed by the kernel, and the others by the ioeventfd worker.
+ */
+bool virtio_owns_vq_eventfd(struct kvm *kvm, struct virtio_device *vdev, u32 vq)
+{
+	if (vdev->use_vhost || !vdev->ops->owns_vq_eventfd)
+		return false;
+
+	return vdev->ops->owns_vq_eventfd(kvm, vdev->dev, vq);
 }
 
 int virtio__get_dev_specific_field(int offset, bool msix, u32 *config_off)
@@ -243,17 +686,39 @@ int virtio__get_dev_specific_field(int offset, bool msix, u32 *config_off)
 	return VIRTIO_PCI_O_CONFIG;
 }
 
-bool virtio_queue__should_signal(struct virt_queue *vq)
+static bool virtio_queue__should_signal_packed(struct virt_queue *vq)
 {
-	u16 old_idx, new_idx, event_idx;
+	struct virt_queue_packed *packed = &vq->packed;
+	u16 old_idx, new_idx, flags, off_wrap;
+	bool valid;
+	int off;
 
-	/*
-	 * Use mb to assure used idx has been increased before we signal the
-	 * guest, and we don't read a stale value for used_event. Without a mb
-	 * here we might not send a notification that we need to send, or the
-	 * guest may ignore the queue since it won't see an updated idx.
-	 */
-	mb();
+	old_idx		= vq->last_used_signalled;
+	new_idx		= packed->used_idx;
+	valid		= packed->signalled_valid;
+
+	vq->last_used_signalled	= new_idx;
+	packed->signalled_valid	= true;
+
+	flags = virtio_guest_to_host_u16(vq->endian, packed->driver->flags);
+	if (flags != VRING_PACKED_EVENT_FLAG_DESC)
+		return flags == VRING_PACKED_EVENT_FLAG_ENABLE;
+
+	if (!valid)
+		return true;
+
+	/* The event offset may still refer to the previous lap of the ring */
+	off_wrap = virtio_guest_to_host_u16(vq->endian, packed->driver->off_wrap);
+	off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+	if (packed->used_wrap != (off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR))
+		off -= vq->vring.num;
+
+	return vring_need_event(off, new_idx, old_idx);
+}
+
+static bool virtio_queue__should_signal_split(struct virt_queue *vq)
+{
+	u16 old_idx, new_idx, event_idx;
 
 	if (!vq->use_event_idx) {
 		/*
@@ -276,6 +741,185 @@ bool virtio_queue__should_signal(struct virt_queue *vq)
 	return false;
 }
 
+bool virtio_queue__should_signal(struct virt_queue *vq)
+{
+	bool signal;
+
+	/*
+	 * Use mb to assure used idx has been increased before we signal the
+	 * guest, and we don't read a stale value for used_event. Without a mb
+	 * here we might not send a notification that we need to send, or the
+	 * guest may ignore the queue since it won't see an updated idx.
+	 */
+	mb();
+
+	if (vq->use_packed)
+		signal = virtio_queue__should_signal_packed(vq);
+	else
+		signal = virtio_queue__should_signal_split(vq);
+
+	if (signal)
+		return true;
+
+	/*
+	 * While coalescing holds back an interrupt, keep signalling so that
+	 * the transport sees every batch and can count frames.
+	 */
+	if (vq->coalesce.pending)
+		return true;
+
+	virt_queue__stat_add(vq, irqs_suppressed, 1);
+	return false;
+}
+
+/*
+ * The driver may pick a smaller queue than the device offers. Split queues must
+ * be a power of two, packed queues can have any size.
+ */
+u16 virt_queue__set_size(struct virtio_device *vdev, struct virt_queue *vq,
+			 u32 size, u16 max)
+{
+	bool packed = vdev->features & (1ULL << VIRTIO_F_RING_PACKED);
+
+	if (!size || size > max || (!packed && (size & (size - 1)))) {
+		pr_warning("invalid queue size %u, using %u", size, max);
+		size = max;
+	}
+
+	vq->size = size;
+
+	return size;
+}
+
+u16 virtio_parse_queue_size(const char *arg)
+{
+	unsigned long size = strtoul(arg, NULL, 0);
+
+	if (!size || size > VIRTIO_QUEUE_SIZE_MAX || (size & (size - 1)))
+		die("Invalid queue size %s, must be a power of two up to %u",
+		    arg, VIRTIO_QUEUE_SIZE_MAX);
+
+	return size;
+}
+
+void virt_queue__set_state(struct virt_queue *vq, enum virt_queue_state state)
+{
+	u64 now = monotonic_ns();
+
+	/* The state before the first transition is unknown */
+	if (vq->state_ns && vq->state == VIRT_QUEUE_EMPTY)
+		virt_queue__stat_add(vq, empty_ns, now - vq->state_ns);
+	else if (vq->state_ns && vq->state == VIRT_QUEUE_FULL)
+		virt_queue__stat_add(vq, full_ns, now - vq->state_ns);
+
+	vq->state = state;
+	vq->state_ns = now;
+}
+
+/*
+ * Ask the driver not to notify us about new buffers, for example while a worker
+ * is already processing the queue.
+ */
+void virt_queue__disable_notify(struct virt_queue *vq)
+{
+	u16 flags;
+
+	if (vq->notify_disabled)
+		return;
+
+	vq->notify_disabled = true;
+
+	if (vq->use_packed) {
+		vq->packed.device->flags = virtio_host_to_guest_u16(vq->endian,
+					VRING_PACKED_EVENT_FLAG_DISABLE);
+		return;
+	}
+
+	/* With event index, virt_queue__available() stops moving it instead */
+	flags = virtio_guest_to_host_u16(vq->endian, vq->vring.used->flags);
+	vq->vring.used->flags = virtio_host_to_guest_u16(vq->endian,
+					flags | VRING_USED_F_NO_NOTIFY);
+}
+
+/*
+ * Re-enable driver notifications. Returns true if buffers were made available
+ * while they were disabled, in which case the caller must process them rather
+ * than wait for a notification that won't come.
+ */
+bool virt_queue__enable_notify(struct virt_queue *vq)
+{
+	u16 flags;
+
+	if (!vq->notify_disabled)
+		return virt_queue__available(vq);
+
+	vq->notify_disabled = false;
+	virt_queue__stat_add(vq, drains, 1);
+
+	if (vq->use_packed) {
+		flags = vq->use_event_idx ? VRING_PACKED_EVENT_FLAG_DESC :
+					    VRING_PACKED_EVENT_FLAG_ENABLE;
+		vq->packed.device->flags = virtio_host_to_guest_u16(vq->endian,
+								    flags);
+	} else {
+		flags = virtio_guest_to_host_u16(vq->endian, vq->vring.used->flags);
+		vq->vring.used->flags = virtio_host_to_guest_u16(vq->endian,
+					flags & ~VRING_USED_F_NO_NOTIFY);
+	}
+
+	/*
+	 * The driver writes new buffers then reads the flags or event index.
+	 * Ensure that we read its buffers after publishing our flags, or else
+	 * we'll miss the notification. virt_queue__available() updates the
+	 * event index.
+	 */
+	mb();
+
+	return virt_queue__available(vq);
+}
+
+/* Smallest budget, so that polling can recover once the load comes back */
+#define VIRT_QUEUE_POLL_MIN_NS		1000ULL
+
+void virt_queue__poll_init(struct virt_queue_poll *poll, u32 max_us)
+{
+	poll->max_ns = USECS_TO_NSECS(max_us);
+	poll->budget_ns = poll->max_ns;
+}
+
+/*
+ * Busy-wait for new buffers with guest notifications disabled, instead of
+ * paying for a kick and a wakeup. The budget doubles every time polling finds
+ * work and halves every time it runs out, so it follows how often spinning
+ * pays off.
+ *
+ * Returns true if buffers are available. Otherwise, notifications are enabled
+ * again and the caller can go to sleep. When returning true, notifications
+ * stay disabled until the next unsuccessful poll.
+ */
+bool virt_queue__poll(struct virt_queue *vq, struct virt_queue_poll *poll)
+{
+	u64 start;
+
+	if (!poll->max_ns)
+		return false;
+
+	virt_queue__disable_notify(vq);
+
+	start = monotonic_ns();
+	do {
+		if (virt_queue__available(vq)) {
+			poll->budget_ns = min(poll->budget_ns * 2, poll->max_ns);
+			return true;
+		}
+	} while (monotonic_ns() - start < poll->budget_ns);
+
+	poll->budget_ns = max(poll->budget_ns / 2,
+			      min(VIRT_QUEUE_POLL_MIN_NS, poll->max_ns));
+
+	return virt_queue__enable_notify(vq);
+}
+
 void virtio_set_guest_features(struct kvm *kvm, struct virtio_device *vdev,
 			       void *dev, u64 features)
 {
@@ -315,6 +959,16 @@ void virtio_notify_status(struct kvm *kvm, struct virtio_device *vdev,
 		vdev->ops->notify_status(kvm, dev, ext_status);
 }
 
+/*
+ * The device can't go on until the driver resets it. Transports report the
+ * flag along with the status last written by the driver.
+ */
+void virtio_set_needs_reset(struct kvm *kvm, struct virtio_device *vdev)
+{
+	vdev->status |= VIRTIO_CONFIG_S_NEEDS_RESET;
+	vdev->ops->signal_config(kvm, vdev);
+}
+
 u64 virtio_dev_get_host_features(struct virtio_device *vdev, struct kvm *kvm, void *dev)
 {
 	u64 features = kvm__arch_get_virtio_host_features(kvm);
@@ -368,6 +1022,10 @@ int virtio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 	void *virtio;
 	int r;
 
+	INIT_LIST_HEAD(&vdev->list);
+	vdev->dev = dev;
+	vdev->id = subsys_id;
+
 	switch (trans) {
 	case VIRTIO_PCI_LEGACY:
 		vdev->legacy			= true;
@@ -405,14 +1063,130 @@ int virtio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 		r = -1;
 	};
 
+	if (r >= 0) {
+		mutex_lock(&virtio_devices_lock);
+		list_add_tail(&vdev->list, &virtio_devices);
+		mutex_unlock(&virtio_devices_lock);
+	}
+
 	return r;
 }
 
 void virtio_exit(struct kvm *kvm, struct virtio_device *vdev)
 {
-	if (vdev->ops && vdev->ops->exit)
+	if (vdev->ops && vdev->ops->exit) {
+		mutex_lock(&virtio_devices_lock);
+		list_del_init(&vdev->list);
+		mutex_unlock(&virtio_devices_lock);
+
 		vdev->ops->exit(kvm, vdev);
+	}
+}
+
+static const char *virtio_dev_name(u32 id)
+{
+	switch (id) {
+	case VIRTIO_ID_NET:
+		return "net";
+	case VIRTIO_ID_BLOCK:
+		return "blk";
+	case VIRTIO_ID_CONSOLE:
+		return "console";
+	case VIRTIO_ID_RNG:
+		return "rng";
+	case VIRTIO_ID_BALLOON:
+		return "balloon";
+	case VIRTIO_ID_SCSI:
+		return "scsi";
+	case VIRTIO_ID_9P:
+		return "9p";
+	case VIRTIO_ID_VSOCK:
+		return "vsock";
+	default:
+		return "virtio";
+	}
+}
+
+static u32 virtio_stat__fill(struct kvm *kvm, struct virtio_device *vdev,
+			     u32 instance, struct virtio_stat_entry *entry)
+{
+	u32 i, nr_vqs, nr = 0;
+	struct virt_queue *vq;
+	u64 now = monotonic_ns();
+
+	nr_vqs = vdev->ops->get_vq_count(kvm, vdev->dev);
+	for (i = 0; i < nr_vqs; i++) {
+		vq = vdev->ops->get_vq(kvm, vdev->dev, i);
+		if (!vq->enabled)
+			continue;
+
+		entry->vq = i;
+		entry->size = vq->vring.num;
+		snprintf(entry->device, sizeof(entry->device), "%s%u",
+			 virtio_dev_name(vdev->id), instance);
+		memcpy(&entry->stats, &vq->stats, sizeof(entry->stats));
+
+		/* Include the time spent in the current state */
+		if (vq->state_ns && vq->state == VIRT_QUEUE_EMPTY)
+			entry->stats.empty_ns += now - vq->state_ns;
+		else if (vq->state_ns && vq->state == VIRT_QUEUE_FULL)
+			entry->stats.full_ns += now - vq->state_ns;
+
+		entry++;
+		nr++;
+	}
+
+	return nr;
+}
+
+static void virtio_stat__handle(struct kvm *kvm, int fd, u32 type, u32 len,
+				u8 *msg)
+{
+	struct virtio_stat_entry *entries = NULL;
+	struct virtio_device *vdev, *prev;
+	u32 max = 0, nr = 0, instance;
+
+	if (WARN_ON(type != KVM_IPC_VIRTIO_STAT || len))
+		return;
+
+	mutex_lock(&virtio_devices_lock);
+
+	list_for_each_entry(vdev, &virtio_devices, list)
+		max += vdev->ops->get_vq_count(kvm, vdev->dev);
+
+	if (max)
+		entries = calloc(max, sizeof(*entries));
+
+	list_for_each_entry(vdev, &virtio_devices, list) {
+		if (!entries)
+			break;
+
+		instance = 0;
+		list_for_each_entry(prev, &virtio_devices, list) {
+			if (prev == vdev)
+				break;
+			if (prev->id == vdev->id)
+				instance++;
+		}
+
+		nr += virtio_stat__fill(kvm, vdev, instance, entries + nr);
+	}
+
+	mutex_unlock(&virtio_devices_lock);
+
+	if (write_in_full(fd, &nr, sizeof(nr)) < 0 ||
+	    write_in_full(fd, entries, nr * sizeof(*entries)) < 0)
+		pr_warning("Failed sending virtio stats");
+
+	free(entries);
+}
+
+static int virtio_stat__init(struct kvm *kvm)
+{
+	return kvm_ipc__register_handler(KVM_IPC_VIRTIO_STAT,
+					 virtio_stat__handle);
 }
+dev_base_init(virtio_stat__init);
 
 int virtio_compat_add_message(const char *device, const char *config)
 {
@@ -118,7 +118,7 @@ static void virtio_mmio_config_out(struct kvm_cpu *vcpu,
 				val, vq_count);
 			break;
 		}
-		vdev->ops->notify_vq(vmmio->kvm, vmmio->dev, val);
+		virtio_notify_vq(vmmio->kvm, vdev, val);
 		break;
 	case VIRTIO_MMIO_INTERRUPT_ACK:
 		val = ioport__read32(data);
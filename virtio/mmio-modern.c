@@ -14,15 +14,22 @@ static void virtio_mmio_config_in(struct kvm_cpu *vcpu,
 	u64 features = 1ULL << VIRTIO_F_VERSION_1;
 	u32 val = 0;
 
+	/* vhost backends only understand the split ring layout */
+	if (!vdev->use_vhost)
+		features |= 1ULL << VIRTIO_F_RING_PACKED;
+
 	switch (addr) {
 	case VIRTIO_MMIO_MAGIC_VALUE:
 	case VIRTIO_MMIO_VERSION:
 	case VIRTIO_MMIO_DEVICE_ID:
 	case VIRTIO_MMIO_VENDOR_ID:
-	case VIRTIO_MMIO_STATUS:
 	case VIRTIO_MMIO_INTERRUPT_STATUS:
 		val = *(u32 *)(((void *)&vmmio->hdr) + addr);
 		break;
+	case VIRTIO_MMIO_STATUS:
+		val = vmmio->hdr.status |
+		      (vdev->status & VIRTIO_CONFIG_S_NEEDS_RESET);
+		break;
 	case VIRTIO_MMIO_DEVICE_FEATURES:
 		if (vmmio->hdr.host_features_sel > 1)
 			break;
@@ -108,7 +115,7 @@ static void virtio_mmio_config_out(struct kvm_cpu *vcpu,
 			virtio_mmio_exit_vq(kvm, vdev, vmmio->hdr.queue_sel);
 		break;
 	case VIRTIO_MMIO_QUEUE_NOTIFY:
-		vdev->ops->notify_vq(vmmio->kvm, vmmio->dev, val);
+		virtio_notify_vq(vmmio->kvm, vdev, val);
 		break;
 	case VIRTIO_MMIO_INTERRUPT_ACK:
 		vmmio->hdr.interrupt_state &= ~val;
@@ -22,9 +22,8 @@ static u32 virtio_mmio_get_io_space_block(u32 size)
 static void virtio_mmio_ioevent_callback(struct kvm *kvm, void *param)
 {
 	struct virtio_mmio_ioevent_param *ioeventfd = param;
-	struct virtio_mmio *vmmio = ioeventfd->vdev->virtio;
 
-	ioeventfd->vdev->ops->notify_vq(kvm, vmmio->dev, ioeventfd->vq);
+	virtio_notify_vq(kvm, ioeventfd->vdev, ioeventfd->vq);
 }
 
 int virtio_mmio_init_ioeventfd(struct kvm *kvm, struct virtio_device *vdev,
@@ -49,10 +48,11 @@ int virtio_mmio_init_ioeventfd(struct kvm *kvm, struct virtio_device *vdev,
 		.fd		= eventfd(0, 0),
 	};
 
-	if (vdev->use_vhost)
+	if (vdev->use_vhost || virtio_owns_vq_eventfd(kvm, vdev, vq))
 		/*
-		 * Vhost will poll the eventfd in host kernel side,
-		 * no need to poll in userspace.
+		 * Vhost will poll the eventfd in host kernel side, and some
+		 * devices poll it from their own thread. No need to poll it
+		 * in the ioeventfd worker.
 		 */
 		err = ioeventfd__add_event(&ioevent, 0);
 	else
@@ -67,9 +67,13 @@ int virtio_mmio_init_ioeventfd(struct kvm *kvm, struct virtio_device *vdev,
 	return 0;
 }
 
-int virtio_mmio_signal_vq(struct kvm *kvm, struct virtio_device *vdev, u32 vq)
+static int virtio_mmio_inject_vq(struct kvm *kvm, struct virtio_device *vdev,
+				 u32 vq)
 {
 	struct virtio_mmio *vmmio = vdev->virtio;
+	struct virt_queue *queue = vdev->ops->get_vq(kvm, vmmio->dev, vq);
+
+	virt_queue__stat_add_atomic(queue, irqs, 1);
 
 	vmmio->hdr.interrupt_state |= VIRTIO_MMIO_INT_VRING;
 	kvm__irq_trigger(vmmio->kvm, vmmio->irq);
@@ -77,6 +81,17 @@ int virtio_mmio_signal_vq(struct kvm *kvm, struct virtio_device *vdev, u32 vq)
 	return 0;
 }
 
+int virtio_mmio_signal_vq(struct kvm *kvm, struct virtio_device *vdev, u32 vq)
+{
+	struct virtio_mmio *vmmio = vdev->virtio;
+	struct virt_queue *queue = vdev->ops->get_vq(kvm, vmmio->dev, vq);
+
+	if (!virt_queue__coalesce_irq(queue, vq, virtio_mmio_inject_vq))
+		return 0;
+
+	return virtio_mmio_inject_vq(kvm, vdev, vq);
+}
+
 int virtio_mmio_init_vq(struct kvm *kvm, struct virtio_device *vdev, int vq)
 {
 	int ret;
@@ -94,8 +109,9 @@ void virtio_mmio_exit_vq(struct kvm *kvm, struct virtio_device *vdev, int vq)
 {
 	struct virtio_mmio *vmmio = vdev->virtio;
 
-	ioeventfd__del_event(vmmio->addr + VIRTIO_MMIO_QUEUE_NOTIFY, vq);
+	/* Stop the device before closing an eventfd it may be waiting on */
 	virtio_exit_vq(kvm, vdev, vmmio->dev, vq);
+	ioeventfd__del_event(vmmio->addr + VIRTIO_MMIO_QUEUE_NOTIFY, vq);
 }
 
 int virtio_mmio_signal_config(struct kvm *kvm, struct virtio_device *vdev)
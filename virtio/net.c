@@ -26,6 +26,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 
+/* Default maximum queue size, overridden with -n queue_size=<n> */
 #define VIRTIO_NET_QUEUE_SIZE		256
 #define VIRTIO_NET_NUM_QUEUES		8
 
@@ -43,6 +44,11 @@ struct net_dev_queue {
 	pthread_t			thread;
 	struct mutex			lock;
 	pthread_cond_t			cond;
+	struct virt_queue_poll		poll;
+	/* ndev->queue_size entries, used by the queue thread */
+	struct iovec			*iov;
+	/* Kick eventfd, read by the queue thread directly */
+	int				kick_fd;
 };
 
 struct net_dev {
@@ -53,6 +59,11 @@ struct net_dev {
 	struct net_dev_queue		queues[VIRTIO_NET_NUM_QUEUES * 2 + 1];
 	struct virtio_net_config	config;
 	u32				queue_pairs;
+	/* Largest queue offered to the driver */
+	u16				queue_size;
+	/* Interrupt coalescing for new RX (0) and TX (1) queues */
+	u32				coal_frames[2];
+	u32				coal_usecs[2];
 
 	int				vhost_fd;
 	int				tap_fd;
@@ -75,7 +86,7 @@ static int compat_id = -1;
 
 static bool has_virtio_feature(struct net_dev *ndev, u32 feature)
 {
-	return ndev->vdev.features & (1 << feature);
+	return ndev->vdev.features & (1ULL << feature);
 }
 
 static int virtio_net_hdr_len(struct net_dev *ndev)
@@ -87,10 +98,33 @@ static int virtio_net_hdr_len(struct net_dev *ndev)
 	return sizeof(struct virtio_net_hdr);
 }
 
+/*
+ * Re-enable notifications and wait for the guest to kick us if the queue is
+ * still empty. The recheck happens before reading the eventfd, or under the
+ * lock taken by the notifier, so the wakeup can't be lost.
+ */
+static void virtio_net_wait_kick(struct net_dev_queue *queue)
+{
+	struct virt_queue *vq = &queue->vq;
+	u64 kicks;
+
+	if (queue->kick_fd > 0) {
+		if (!virt_queue__enable_notify(vq) &&
+		    read(queue->kick_fd, &kicks, sizeof(kicks)) > 0)
+			virt_queue__stat_add(vq, kicks, kicks);
+		return;
+	}
+
+	mutex_lock(&queue->lock);
+	if (!virt_queue__enable_notify(vq))
+		pthread_cond_wait(&queue->cond, &queue->lock.mutex);
+	mutex_unlock(&queue->lock);
+}
+
 static void *virtio_net_rx_thread(void *p)
 {
-	struct iovec iov[VIRTIO_NET_QUEUE_SIZE];
 	struct net_dev_queue *queue = p;
+	struct iovec *iov = queue->iov;
 	struct virt_queue *vq = &queue->vq;
 	struct net_dev *ndev = queue->ndev;
 	struct kvm *kvm;
@@ -102,10 +136,9 @@ static void *virtio_net_rx_thread(void *p)
 
 	kvm = ndev->kvm;
 	while (1) {
-		mutex_lock(&queue->lock);
-		if (!virt_queue__available(vq))
-			pthread_cond_wait(&queue->cond, &queue->lock.mutex);
-		mutex_unlock(&queue->lock);
+		/* Only ask for a kick once we run out of buffers */
+		virtio_net_wait_kick(queue);
+		virt_queue__disable_notify(vq);
 
 		while (virt_queue__available(vq)) {
 			unsigned char buffer[MAX_PACKET_SIZE + sizeof(struct virtio_net_hdr_mrg_rxbuf)];
@@ -164,8 +197,8 @@ out_err:
 
 static void *virtio_net_tx_thread(void *p)
 {
-	struct iovec iov[VIRTIO_NET_QUEUE_SIZE];
 	struct net_dev_queue *queue = p;
+	struct iovec *iov = queue->iov;
 	struct virt_queue *vq = &queue->vq;
 	struct net_dev *ndev = queue->ndev;
 	struct kvm *kvm;
@@ -178,25 +211,27 @@ static void *virtio_net_tx_thread(void *p)
 	kvm = ndev->kvm;
 
 	while (1) {
-		mutex_lock(&queue->lock);
-		if (!virt_queue__available(vq))
-			pthread_cond_wait(&queue->cond, &queue->lock.mutex);
-		mutex_unlock(&queue->lock);
+		virtio_net_wait_kick(queue);
 
-		while (virt_queue__available(vq)) {
-			head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
-			len = ndev->ops->tx(iov, out, ndev);
-			if (len < 0) {
-				pr_warning("%s: tx on vq %u failed (%d)\n",
-						__func__, queue->id, errno);
-				goto out_err;
-			}
+		do {
+			virt_queue__disable_notify(vq);
 
-			virt_queue__set_used_elem(vq, head, len);
-		}
+			while (virt_queue__available(vq)) {
+				head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
+				len = ndev->ops->tx(iov, out, ndev);
+				if (len < 0) {
+					pr_warning("%s: tx on vq %u failed (%d)\n",
+							__func__, queue->id, errno);
+					goto out_err;
+				}
+
+				virt_queue__stage_used_elem(vq, head, len);
+			}
 
-		if (virtio_queue__should_signal(vq))
-			ndev->vdev.ops->signal_vq(kvm, &ndev->vdev, queue->id);
+			if (virt_queue__publish_used(vq) &&
+			    virtio_queue__should_signal(vq))
+				ndev->vdev.ops->signal_vq(kvm, &ndev->vdev, queue->id);
+		} while (virt_queue__poll(vq, &queue->poll));
 	}
 
 out_err:
@@ -210,10 +245,108 @@ static virtio_net_ctrl_ack virtio_net_handle_mq(struct kvm* kvm, struct net_dev
 	return VIRTIO_NET_OK;
 }
 
+static bool is_ctrl_vq(struct net_dev *ndev, u32 vq)
+{
+	return vq == (u32)(ndev->queue_pairs * 2);
+}
+
+/* The guest's settings don't survive a reset */
+static void virtio_net_default_coal(struct net_dev *ndev)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		ndev->coal_frames[i] = max(ndev->params->coalesce_frames, 0);
+		ndev->coal_usecs[i] = max(ndev->params->coalesce_usecs, 0);
+	}
+}
+
+static int virtio_net_set_coal(struct net_dev *ndev, u32 vq, u32 frames,
+			       u32 usecs)
+{
+	struct virt_queue *queue = &ndev->queues[vq].vq;
+
+	if (!queue->enabled)
+		return 0;
+
+	return virt_queue__set_coalesce(queue, frames, usecs);
+}
+
+static virtio_net_ctrl_ack virtio_net_handle_coal(struct kvm *kvm,
+						  struct net_dev *ndev,
+						  struct virtio_net_ctrl_hdr *ctrl,
+						  struct iovec *iov, u16 out,
+						  u16 in)
+{
+	struct virtio_net_ctrl_coal_vq coal_vq;
+	struct virtio_net_ctrl_coal coal;
+	struct virt_queue *queue;
+	u16 endian = ndev->vdev.endian;
+	u32 vq, frames, usecs;
+
+	switch (ctrl->cmd) {
+	case VIRTIO_NET_CTRL_NOTF_COAL_TX_SET:
+	case VIRTIO_NET_CTRL_NOTF_COAL_RX_SET:
+		/* The tx and rx structures have the same layout */
+		if (!has_virtio_feature(ndev, VIRTIO_NET_F_NOTF_COAL) ||
+		    iov_size(iov, out) < sizeof(coal))
+			return VIRTIO_NET_ERR;
+		memcpy_fromiovec((void *)&coal, iov, sizeof(coal));
+		frames = virtio_guest_to_host_u32(endian, coal.max_packets);
+		usecs = virtio_guest_to_host_u32(endian, coal.max_usecs);
+
+		/* Applies to all queues of that direction, and to new ones */
+		vq = ctrl->cmd == VIRTIO_NET_CTRL_NOTF_COAL_TX_SET;
+		ndev->coal_frames[vq] = frames;
+		ndev->coal_usecs[vq] = usecs;
+		for (; vq < ndev->queue_pairs * 2; vq += 2) {
+			if (virtio_net_set_coal(ndev, vq, frames, usecs))
+				return VIRTIO_NET_ERR;
+		}
+		return VIRTIO_NET_OK;
+	case VIRTIO_NET_CTRL_NOTF_COAL_VQ_SET:
+	case VIRTIO_NET_CTRL_NOTF_COAL_VQ_GET:
+		if (!has_virtio_feature(ndev, VIRTIO_NET_F_VQ_NOTF_COAL) ||
+		    iov_size(iov, out) < sizeof(coal_vq))
+			return VIRTIO_NET_ERR;
+		memcpy_fromiovec((void *)&coal_vq, iov, sizeof(coal_vq));
+
+		vq = virtio_guest_to_host_u16(endian, coal_vq.vqn);
+		if (vq >= ndev->queue_pairs * 2)
+			return VIRTIO_NET_ERR;
+
+		if (ctrl->cmd == VIRTIO_NET_CTRL_NOTF_COAL_VQ_SET) {
+			frames = virtio_guest_to_host_u32(endian,
+							  coal_vq.coal.max_packets);
+			usecs = virtio_guest_to_host_u32(endian,
+							 coal_vq.coal.max_usecs);
+			if (virtio_net_set_coal(ndev, vq, frames, usecs))
+				return VIRTIO_NET_ERR;
+			return VIRTIO_NET_OK;
+		}
+
+		/* The result precedes the ack in the device-writable part */
+		if (iov_size(iov + out, in) < sizeof(coal) + sizeof(virtio_net_ctrl_ack))
+			return VIRTIO_NET_ERR;
+
+		queue = &ndev->queues[vq].vq;
+		coal = (struct virtio_net_ctrl_coal) {
+			.max_packets	= virtio_host_to_guest_u32(endian,
+						queue->coalesce.max_frames),
+			.max_usecs	= virtio_host_to_guest_u32(endian,
+						queue->coalesce.max_usecs),
+		};
+		memcpy_toiovec(iov + out, (void *)&coal, sizeof(coal));
+		return VIRTIO_NET_OK;
+	default:
+		return VIRTIO_NET_ERR;
+	}
+}
+
 static void *virtio_net_ctrl_thread(void *p)
 {
-	struct iovec iov[VIRTIO_NET_QUEUE_SIZE];
 	struct net_dev_queue *queue = p;
+	struct iovec *iov = queue->iov;
 	struct virt_queue *vq = &queue->vq;
 	struct net_dev *ndev = queue->ndev;
 	u16 out, in, head;
@@ -225,26 +358,32 @@ static void *virtio_net_ctrl_thread(void *p)
 	kvm__set_thread_name("virtio-net-ctrl");
 
 	while (1) {
-		mutex_lock(&queue->lock);
-		if (!virt_queue__available(vq))
-			pthread_cond_wait(&queue->cond, &queue->lock.mutex);
-		mutex_unlock(&queue->lock);
+		virtio_net_wait_kick(queue);
+		virt_queue__disable_notify(vq);
 
 		while (virt_queue__available(vq)) {
 			head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
-			len = min(iov_size(iov, in), sizeof(ctrl));
-			memcpy_fromiovec((void *)&ctrl, iov, len);
+			/* The ack follows the driver-readable header and data */
+			len = iov_size(iov + out, in);
+			memset(&ctrl, 0, sizeof(ctrl));
+			memcpy_fromiovec((void *)&ctrl, iov,
+					 min(iov_size(iov, out), sizeof(ctrl)));
 
 			switch (ctrl.class) {
 			case VIRTIO_NET_CTRL_MQ:
 				ack = virtio_net_handle_mq(kvm, ndev, &ctrl);
 				break;
+			case VIRTIO_NET_CTRL_NOTF_COAL:
+				ack = virtio_net_handle_coal(kvm, ndev, &ctrl,
+							     iov, out, in);
+				break;
 			default:
 				ack = VIRTIO_NET_ERR;
 				break;
 			}
-			memcpy_toiovec(iov + in, &ack, sizeof(ack));
-			virt_queue__set_used_elem(vq, head, sizeof(ack));
+			memcpy_toiovec(iov + out, &ack, sizeof(ack));
+			len -= iov_size(iov + out, in);
+			virt_queue__set_used_elem(vq, head, len);
 		}
 
 		if (virtio_queue__should_signal(vq))
@@ -259,12 +398,19 @@ static void *virtio_net_ctrl_thread(void *p)
 static void virtio_net_handle_callback(struct kvm *kvm, struct net_dev *ndev, int queue)
 {
 	struct net_dev_queue *net_queue = &ndev->queues[queue];
+	u64 data = 1;
 
 	if ((u32)queue >= (ndev->queue_pairs * 2 + 1)) {
 		pr_warning("Unknown queue index %u", queue);
 		return;
 	}
 
+	if (net_queue->kick_fd > 0) {
+		if (write(net_queue->kick_fd, &data, sizeof(data)) < 0)
+			pr_warning("Failed to kick queue %u", queue);
+		return;
+	}
+
 	mutex_lock(&net_queue->lock);
 	pthread_cond_signal(&net_queue->cond);
 	mutex_unlock(&net_queue->lock);
@@ -495,7 +641,9 @@ static u64 get_host_features(struct kvm *kvm, void *dev)
 		| 1UL << VIRTIO_NET_F_CTRL_VQ
 		| 1UL << VIRTIO_NET_F_MRG_RXBUF
 		| 1UL << (ndev->queue_pairs > 1 ? VIRTIO_NET_F_MQ : 0)
-		| 1UL << VIRTIO_F_ANY_LAYOUT;
+		| 1UL << VIRTIO_F_ANY_LAYOUT
+		| 1ULL << VIRTIO_NET_F_NOTF_COAL
+		| 1ULL << VIRTIO_NET_F_VQ_NOTF_COAL;
 
 	/*
 	 * The UFO feature for host and guest only can be enabled when the
@@ -512,6 +660,10 @@ static u64 get_host_features(struct kvm *kvm, void *dev)
 			die_perror("VHOST_GET_FEATURES failed");
 
 		features &= vhost_features;
+
+		/* Interrupts are injected by vhost, not by our transport */
+		features &= ~(1ULL << VIRTIO_NET_F_NOTF_COAL |
+			      1ULL << VIRTIO_NET_F_VQ_NOTF_COAL);
 	}
 
 	return features;
@@ -586,11 +738,6 @@ static void notify_status(struct kvm *kvm, void *dev, u32 status)
 		virtio_net_stop(dev);
 }
 
-static bool is_ctrl_vq(struct net_dev *ndev, u32 vq)
-{
-	return vq == (u32)(ndev->queue_pairs * 2);
-}
-
 static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct vhost_vring_file file = { .index = vq };
@@ -605,16 +752,34 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 	net_queue->id	= vq;
 	net_queue->ndev	= ndev;
 	queue		= &net_queue->vq;
-	virtio_init_device_vq(kvm, &ndev->vdev, queue, VIRTIO_NET_QUEUE_SIZE);
+	virtio_init_device_vq(kvm, &ndev->vdev, queue,
+			      virt_queue__get_size(queue, ndev->queue_size));
 
 	mutex_init(&net_queue->lock);
 	pthread_cond_init(&net_queue->cond, NULL);
+	/*
+	 * Only TX threads poll their queue. RX threads wait for packets from
+	 * the backend rather than for guest buffers.
+	 */
+	virt_queue__poll_init(&net_queue->poll,
+			      (vq & 1) ? max(ndev->params->poll, 0) : 0);
+	if (is_ctrl_vq(ndev, vq) || ndev->vhost_fd == 0) {
+		net_queue->iov = calloc(ndev->queue_size, sizeof(struct iovec));
+		if (!net_queue->iov)
+			return -ENOMEM;
+	}
+
 	if (is_ctrl_vq(ndev, vq)) {
 		pthread_create(&net_queue->thread, NULL, virtio_net_ctrl_thread,
 			       net_queue);
 
 		return 0;
 	} else if (ndev->vhost_fd == 0 ) {
+		r = virtio_net_set_coal(ndev, vq, ndev->coal_frames[vq & 1],
+					ndev->coal_usecs[vq & 1]);
+		if (r < 0)
+			return r;
+
 		if (vq & 1)
 			pthread_create(&net_queue->thread, NULL,
 				       virtio_net_tx_thread, net_queue);
@@ -658,6 +823,13 @@ static void exit_vq(struct kvm *kvm, void *dev, u32 vq)
 	 */
 	pthread_cancel(queue->thread);
 	pthread_join(queue->thread, NULL);
+
+	if (is_ctrl_vq(ndev, vq))
+		virtio_net_default_coal(ndev);
+
+	free(queue->iov);
+	queue->iov = NULL;
+	queue->kick_fd = 0;
 }
 
 static void notify_vq_gsi(struct kvm *kvm, void *dev, u32 vq, u32 gsi)
@@ -675,12 +847,25 @@ static void notify_vq_eventfd(struct kvm *kvm, void *dev, u32 vq, u32 efd)
 {
 	struct net_dev *ndev = dev;
 
-	if (ndev->vhost_fd == 0 || is_ctrl_vq(ndev, vq))
+	if (ndev->vhost_fd == 0) {
+		ndev->queues[vq].kick_fd = efd;
+		return;
+	}
+
+	if (is_ctrl_vq(ndev, vq))
 		return;
 
 	virtio_vhost_set_vring_kick(kvm, ndev->vhost_fd, vq, efd);
 }
 
+static bool owns_vq_eventfd(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct net_dev *ndev = dev;
+
+	/* Queue threads wait on their kick eventfd rather than a condition */
+	return ndev->vhost_fd == 0;
+}
+
 static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct net_dev *ndev = dev;
@@ -699,14 +884,17 @@ static struct virt_queue *get_vq(struct kvm *kvm, void *dev, u32 vq)
 
 static int get_size_vq(struct kvm *kvm, void *dev, u32 vq)
 {
-	/* FIXME: dynamic */
-	return VIRTIO_NET_QUEUE_SIZE;
+	struct net_dev *ndev = dev;
+
+	return virt_queue__get_size(&ndev->queues[vq].vq, ndev->queue_size);
 }
 
 static int set_size_vq(struct kvm *kvm, void *dev, u32 vq, int size)
 {
-	/* FIXME: dynamic */
-	return size;
+	struct net_dev *ndev = dev;
+
+	return virt_queue__set_size(&ndev->vdev, &ndev->queues[vq].vq, size,
+				    ndev->queue_size);
 }
 
 static unsigned int get_vq_count(struct kvm *kvm, void *dev)
@@ -729,6 +917,7 @@ static struct virtio_ops net_dev_virtio_ops = {
 	.notify_vq		= notify_vq,
 	.notify_vq_gsi		= notify_vq_gsi,
 	.notify_vq_eventfd	= notify_vq_eventfd,
+	.owns_vq_eventfd	= owns_vq_eventfd,
 	.notify_status		= notify_status,
 };
 
@@ -791,6 +980,14 @@ static int set_net_param(struct kvm *kvm, struct virtio_net_params *p,
 		p->fd = atoi(val);
 	} else if (strcmp(param, "mq") == 0) {
 		p->mq = atoi(val);
+	} else if (strcmp(param, "poll") == 0) {
+		p->poll = atoi(val);
+	} else if (strcmp(param, "queue_size") == 0) {
+		p->queue_size = virtio_parse_queue_size(val);
+	} else if (strcmp(param, "coalesce_frames") == 0) {
+		p->coalesce_frames = atoi(val);
+	} else if (strcmp(param, "coalesce_usecs") == 0) {
+		p->coalesce_usecs = atoi(val);
 	} else
 		die("Unknown network parameter %s", param);
 
@@ -869,6 +1066,9 @@ static int virtio_net__init_one(struct virtio_net_params *params)
 
 	mutex_init(&ndev->mutex);
 	ndev->queue_pairs = max(1, min(VIRTIO_NET_NUM_QUEUES, params->mq));
+	ndev->queue_size = params->queue_size ? params->queue_size :
+			   VIRTIO_NET_QUEUE_SIZE;
+	virtio_net_default_coal(ndev);
 
 	for (i = 0 ; i < 6 ; i++) {
 		ndev->config.mac[i]		= params->guest_mac[i];
@@ -98,7 +98,7 @@ static bool virtio_pci__specific_data_out(struct kvm *kvm, struct virtio_device
 			if (gsi < 0)
 				break;
 
-			vpci->gsis[vpci->queue_selector] = gsi;
+			virtio_pci__set_vq_gsi(vdev, vpci->queue_selector, gsi);
 			if (vdev->ops->notify_vq_gsi)
 				vdev->ops->notify_vq_gsi(kvm, vpci->dev,
 							 vpci->queue_selector,
@@ -166,7 +166,7 @@ static bool virtio_pci__data_out(struct kvm_cpu *vcpu, struct virtio_device *vde
 				val, vq_count);
 			return false;
 		}
-		vdev->ops->notify_vq(kvm, vpci->dev, val);
+		virtio_notify_vq(kvm, vdev, val);
 		break;
 	case VIRTIO_PCI_STATUS:
 		vpci->status = ioport__read8(data);
@@ -87,7 +87,7 @@ static bool virtio_pci__common_write(struct virtio_device *vdev,
 		if (gsi < 0)
 			break;
 
-		vpci->gsis[vpci->queue_selector] = gsi;
+		virtio_pci__set_vq_gsi(vdev, vpci->queue_selector, gsi);
 		if (vdev->ops->notify_vq_gsi)
 			vdev->ops->notify_vq_gsi(vpci->kvm, vpci->dev,
 						 vpci->queue_selector, gsi);
@@ -128,7 +128,7 @@ static bool virtio_pci__notify_write(struct virtio_device *vdev,
 	u16 vq = ioport__read16(data);
 	struct virtio_pci *vpci = vdev->virtio;
 
-	vdev->ops->notify_vq(vpci->kvm, vpci->dev, vq);
+	virtio_notify_vq(vpci->kvm, vdev, vq);
 
 	return true;
 }
@@ -153,6 +153,10 @@ static bool virtio_pci__common_read(struct virtio_device *vdev,
 	if (vpci->kvm->cfg.pkvm)
 		features |= 1ULL << VIRTIO_F_ACCESS_PLATFORM;
 
+	/* vhost backends only understand the split ring layout */
+	if (!vdev->use_vhost)
+		features |= 1ULL << VIRTIO_F_RING_PACKED;
+
 	switch (offset - VPCI_CFG_COMMON_START) {
 	case VIRTIO_PCI_COMMON_DFSELECT:
 		val = vpci->device_features_sel;
@@ -178,7 +182,8 @@ static bool virtio_pci__common_read(struct virtio_device *vdev,
 		ioport__write32(data, val);
 		break;
 	case VIRTIO_PCI_COMMON_STATUS:
-		ioport__write8(data, vpci->status);
+		ioport__write8(data, vpci->status |
+			       (vdev->status & VIRTIO_CONFIG_S_NEEDS_RESET));
 		break;
 	case VIRTIO_PCI_COMMON_CFGGENERATION:
 		/*
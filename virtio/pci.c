@@ -47,12 +47,60 @@ static void virtio_pci__del_msix_route(struct virtio_pci *vpci, u32 gsi)
 	irq__update_msix_route(vpci->kvm, gsi, &msg);
 }
 
+static void virtio_pci__del_vq_irqfd(struct virtio_pci *vpci, u32 vq)
+{
+	int fd = vpci->irqfds[vq];
+
+	if (fd < 0)
+		return;
+
+	irq__del_irqfd(vpci->kvm, vpci->gsis[vq], fd);
+	close(fd);
+	vpci->irqfds[vq] = -1;
+}
+
+/*
+ * Bind an eventfd to the MSI route of the queue, so that signalling it is a
+ * write rather than a KVM_SIGNAL_MSI ioctl, and so that KVM can post the
+ * interrupt directly. Route changes made by update_msix_map() apply to the
+ * irqfd as well. If it cannot be set up we fall back to the ioctl.
+ */
+static void virtio_pci__add_vq_irqfd(struct virtio_pci *vpci, u32 vq, u32 gsi)
+{
+	int fd;
+
+	virtio_pci__del_vq_irqfd(vpci, vq);
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) {
+		pr_warning("Failed to create irqfd for vq %u: %d", vq, errno);
+		return;
+	}
+
+	if (irq__add_irqfd(vpci->kvm, gsi, fd, -1) < 0) {
+		pr_warning("Failed to add irqfd for vq %u: %d", vq, errno);
+		close(fd);
+		return;
+	}
+
+	vpci->irqfds[vq] = fd;
+}
+
+void virtio_pci__set_vq_gsi(struct virtio_device *vdev, u32 vq, u32 gsi)
+{
+	struct virtio_pci *vpci = vdev->virtio;
+
+	/* Vhost binds its own irqfd to the gsi, with notify_vq_gsi() */
+	if (!vdev->use_vhost)
+		virtio_pci__add_vq_irqfd(vpci, vq, gsi);
+	vpci->gsis[vq] = gsi;
+}
+
 static void virtio_pci__ioevent_callback(struct kvm *kvm, void *param)
 {
 	struct virtio_pci_ioevent_param *ioeventfd = param;
-	struct virtio_pci *vpci = ioeventfd->vdev->virtio;
 
-	ioeventfd->vdev->ops->notify_vq(kvm, vpci->dev, ioeventfd->vq);
+	virtio_notify_vq(kvm, ioeventfd->vdev, ioeventfd->vq);
 }
 
 int virtio_pci__init_ioeventfd(struct kvm *kvm, struct virtio_device *vdev,
@@ -63,7 +111,7 @@ int virtio_pci__init_ioeventfd(struct kvm *kvm, struct virtio_device *vdev,
 	u32 mmio_addr = virtio_pci__mmio_addr(vpci);
 	u16 port_addr = virtio_pci__port_addr(vpci);
 	off_t offset = vpci->doorbell_offset;
-	int r, flags = 0;
+	int r, flags = 0, pio_flags, mmio_flags;
 	int pio_fd, mmio_fd;
 
 	vpci->ioeventfds[vq] = (struct virtio_pci_ioevent_param) {
@@ -85,11 +133,23 @@ int virtio_pci__init_ioeventfd(struct kvm *kvm, struct virtio_device *vdev,
 	if (!vdev->use_vhost)
 		flags |= IOEVENTFD_FLAG_USER_POLL;
 
+	/*
+	 * A device that owns its eventfd only gets the one matching the
+	 * transport. The other is still polled, in case the driver uses it.
+	 */
+	pio_flags = mmio_flags = flags;
+	if (virtio_owns_vq_eventfd(kvm, vdev, vq)) {
+		if (vdev->legacy)
+			pio_flags &= ~IOEVENTFD_FLAG_USER_POLL;
+		else
+			mmio_flags &= ~IOEVENTFD_FLAG_USER_POLL;
+	}
+
 	/* ioport */
 	ioevent.io_addr	= port_addr + offset;
 	ioevent.io_len	= sizeof(u16);
 	ioevent.fd	= pio_fd = eventfd(0, 0);
-	r = ioeventfd__add_event(&ioevent, flags | IOEVENTFD_FLAG_PIO);
+	r = ioeventfd__add_event(&ioevent, pio_flags | IOEVENTFD_FLAG_PIO);
 	if (r)
 		return r;
 
@@ -97,7 +157,7 @@ int virtio_pci__init_ioeventfd(struct kvm *kvm, struct virtio_device *vdev,
 	ioevent.io_addr	= mmio_addr + offset;
 	ioevent.io_len	= sizeof(u16);
 	ioevent.fd	= mmio_fd = eventfd(0, 0);
-	r = ioeventfd__add_event(&ioevent, flags);
+	r = ioeventfd__add_event(&ioevent, mmio_flags);
 	if (r)
 		goto free_ioport_evt;
 
@@ -131,12 +191,14 @@ void virtio_pci_exit_vq(struct kvm *kvm, struct virtio_device *vdev, int vq)
 	u16 port_addr = virtio_pci__port_addr(vpci);
 	off_t offset = vpci->doorbell_offset;
 
+	virtio_pci__del_vq_irqfd(vpci, vq);
 	virtio_pci__del_msix_route(vpci, vpci->gsis[vq]);
 	vpci->gsis[vq] = 0;
 	vpci->vq_vector[vq] = VIRTIO_MSI_NO_VECTOR;
+	/* Stop the device before closing eventfds it may be waiting on */
+	virtio_exit_vq(kvm, vdev, vpci->dev, vq);
 	ioeventfd__del_event(mmio_addr + offset, vq);
 	ioeventfd__del_event(port_addr + offset, vq);
-	virtio_exit_vq(kvm, vdev, vpci->dev, vq);
 }
 
 static void update_msix_map(struct virtio_pci *vpci,
@@ -224,7 +286,20 @@ static void virtio_pci__signal_msi(struct kvm *kvm, struct virtio_pci *vpci,
 	irq__signal_msi(kvm, &msi);
 }
 
-int virtio_pci__signal_vq(struct kvm *kvm, struct virtio_device *vdev, u32 vq)
+static void virtio_pci__signal_irqfd(int fd)
+{
+	u64 val = 1;
+
+	/*
+	 * Writes that land before KVM consumes the eventfd are merged into a
+	 * single interrupt.
+	 */
+	if (write(fd, &val, sizeof(val)) < 0)
+		pr_warning("Failed to signal irqfd: %d", errno);
+}
+
+static int virtio_pci__inject_vq(struct kvm *kvm, struct virtio_device *vdev,
+				 u32 vq)
 {
 	struct virtio_pci *vpci = vdev->virtio;
 	int tbl = vpci->vq_vector[vq];
@@ -237,17 +312,36 @@ int virtio_pci__signal_vq(struct kvm *kvm, struct virtio_device *vdev, u32 vq)
 			return 0;
 		}
 
-		if (vpci->signal_msi)
+		virt_queue__stat_add_atomic(vdev->ops->get_vq(kvm, vpci->dev, vq),
+					    irqs, 1);
+
+		if (vpci->irqfds[vq] >= 0)
+			virtio_pci__signal_irqfd(vpci->irqfds[vq]);
+		else if (vpci->signal_msi)
 			virtio_pci__signal_msi(kvm, vpci, vpci->vq_vector[vq]);
 		else
 			kvm__irq_trigger(kvm, vpci->gsis[vq]);
 	} else {
+		virt_queue__stat_add_atomic(vdev->ops->get_vq(kvm, vpci->dev, vq),
+					    irqs, 1);
+
 		vpci->isr |= VIRTIO_PCI_ISR_QUEUE;
 		kvm__irq_line(kvm, vpci->legacy_irq_line, VIRTIO_IRQ_HIGH);
 	}
 	return 0;
 }
 
+int virtio_pci__signal_vq(struct kvm *kvm, struct virtio_device *vdev, u32 vq)
+{
+	struct virtio_pci *vpci = vdev->virtio;
+	struct virt_queue *queue = vdev->ops->get_vq(kvm, vpci->dev, vq);
+
+	if (!virt_queue__coalesce_irq(queue, vq, virtio_pci__inject_vq))
+		return 0;
+
+	return virtio_pci__inject_vq(kvm, vdev, vq);
+}
+
 int virtio_pci__signal_config(struct kvm *kvm, struct virtio_device *vdev)
 {
 	struct virtio_pci *vpci = vdev->virtio;
@@ -410,6 +504,7 @@ int virtio_pci__init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 	vpci->config_vector = VIRTIO_MSI_NO_VECTOR;
 	/* Initialize all vq vectors to NO_VECTOR */
 	memset(vpci->vq_vector, 0xff, sizeof(vpci->vq_vector));
+	memset(vpci->irqfds, 0xff, sizeof(vpci->irqfds));
 
 	if (irq__can_signal_msi(kvm))
 		vpci->signal_msi = true;
@@ -92,8 +92,12 @@ static void virtio_rng_do_io(struct kvm *kvm, void *param)
 	struct virt_queue *vq	= job->vq;
 	struct rng_dev *rdev	= job->rdev;
 
-	while (virt_queue__available(vq))
-		virtio_rng_do_io_request(kvm, rdev, vq);
+	do {
+		virt_queue__disable_notify(vq);
+
+		while (virt_queue__available(vq))
+			virtio_rng_do_io_request(kvm, rdev, vq);
+	} while (virt_queue__enable_notify(vq));
 
 	rdev->vdev.ops->signal_vq(kvm, &rdev->vdev, vq - rdev->vqs);
 }